@@ -1,18 +1,28 @@
 # Build file for KUtrace postprocessing programs
 # dsites 2022.08.17
 
-c++ -O2 checktrace.cc -o checktrace
+c++ -O2 checktrace.cc -o checktrace -pthread
 c++ -O2 eventtospan3.cc -o eventtospan3
+c++ -O2 -DKUPOSTPROC fuzz_rawblock.cc rawtoevent.cc from_base40.cc -o fuzz_rawblock
 c++ -O2 kuod.cc -o kuod
-c++ -O2 makeself.cc -o makeself
+c++ -O2 -DKUPOSTPROC kupostproc.cc rawtoevent.cc eventtospan3.cc spantotrim.cc samptoname_k.cc samptoname_u.cc spantolod.cc makeself.cc from_base40.cc -pthread -lz -o kupostproc
+c++ -O2 makeself.cc -lz -o makeself
+c++ -O2 mergehosts.cc -o mergehosts
 c++ -O2 rawtoevent.cc from_base40.cc kutrace_lib.cc -o rawtoevent
 c++ -O2 rawtoevent.cc from_base40.cc -o rawtoevent
 c++ -O2 samptoname_k.cc -o samptoname_k
 c++ -O2 samptoname_u.cc -o samptoname_u
-c++ -O2 spantoprof.cc -o spantoprof
+c++ -O2 spanquery.cc -o spanquery -pthread
+c++ -O2 spantolatency.cc -o spantolatency
+c++ -O2 spantolock.cc -o spantolock
+c++ -O2 spantolod.cc -o spantolod
+c++ -O2 spantoprof.cc -o spantoprof -pthread
+c++ -O2 spantoslowrpc.cc -o spantoslowrpc
 c++ -O2 spantospan.cc -o spantospan
 c++ -O2 spantotrim.cc from_base40.cc -o spantotrim
+c++ -O2 spantowakeup.cc -o spantowakeup
 c++ -O2 time_getpid.cc kutrace_lib.cc -o time_getpid
-c++ -O2 unmakeself.cc -o unmakeself
+c++ -O2 tracesize.cc -o tracesize
+c++ -O2 unmakeself.cc -lz -o unmakeself
 
 
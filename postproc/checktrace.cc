@@ -5,18 +5,25 @@
 // Input has filename like 
 //   kutrace_control_20170821_095154_dclab-1_2056.trace
 //
-// compile with g++ -O2 checktrace.cc -o checktrace
+// compile with g++ -O2 checktrace.cc -o checktrace -pthread
 //
 // To see raw trace in hex, use kuod or
 //   od -Ax -tx8z -w32 foo.trace
 //
 // dsites 2022.08.17 Initial version
+// 2026.10.17 Read blocks and step over entries with rawblock.h, shared with rawtoevent
+// 2026.10.17 -t <threads> checks block bodies in parallel over the mapped file,
+//            then does the header, cross-block, and peak checks in block order
+// 2026.10.17 -series <file> writes events per CPU per second by event class as CSV;
+//            trace buffer MB/sec summary, and fill time with -tracemb <MB>
 //
 
 
 #include <map>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>     // exit
@@ -29,25 +36,17 @@
 
 #include "basetypes.h"
 #include "kutrace_lib.h"
-
-#define IPC_Flag     0x80
-#define WRAP_Flag    0x40
-#define Unused2_Flag 0x20
-#define Unused1_Flag 0x10
-#define VERSION_MASK 0x0F
+#include "rawblock.h"
 
 using std::map;
 using std::string;
+using std::vector;
 
 typedef map<uint64, string> U64Name;	// Name for each syscall/PID/etc.
 
 //VERYTEMP
 bool tracenames = false;
 
-
-static const int kTraceBufSize = 8192;	// uint64 count
-static const int kIpcBufSize = 1024;	// uint64 count
-
 // 2+ years in multiple of 10nsec
 static const uint64 kMaxTimeCounter = 0x001FFFFFFFFFFFFFL;
 
@@ -218,6 +217,10 @@ bool verbose_save = false;
 bool hex = false;		// If set, print each entry in hex (debug)
 bool quiet = false;		// If set, only give pass/fail line
 bool nopf = false;		// Allow trace with no page faults to pass
+int thread_count = 1;		// For checking block bodies
+static const int kMaxThreads = 64;	// When the core count is unknown
+const char* series_fname = NULL;	// -series CSV output, or NULL
+uint64 tracemb = 0;		// -tracemb, for buffer fill time; 0 for none
 size_t offset = 0;		// Byte offset of block start within file
 int block_num = 0;		// Current Block number 0..n or -1 for no block
 uint64 flags;			// Flags byte from first block of trace
@@ -258,6 +261,41 @@ uint64 prior_10second;
 
 uint64 total_events_per_cpu[256];	// Events per CPU across the entire trace
 
+// Event classes for the time series, by the high hex digit of the event number.
+// Calls and returns go together
+enum EvClass {
+  EC_NAME,
+  EC_POINT,
+  EC_WAIT,
+  EC_TRAP,
+  EC_IRQ,
+  EC_SYS64,
+  EC_SYS32,
+  NUM_EC	// Must be last
+};
+
+const char* ec_text[NUM_EC] = {
+  "names", "point", "wait", "trap", "irq", "sys64", "sys32",
+};
+
+const int ec_of_group[16] = {
+  EC_NAME, EC_NAME, EC_POINT, EC_WAIT, EC_TRAP, EC_IRQ, EC_TRAP, EC_IRQ,
+  EC_SYS64, EC_SYS64, EC_SYS64, EC_SYS64, EC_SYS32, EC_SYS32, EC_SYS32, EC_SYS32,
+};
+
+// One CPU for one second. Each block is spread evenly over the time it
+// covers, from its start time of day to its last entry, so counts are fractional
+typedef struct {
+  double blocks;
+  double events;
+  double class_events[NUM_EC];
+} SeriesRow;
+
+typedef map<uint64, SeriesRow> SeriesMap;	// Key is (second << 8) | cpu
+
+SeriesMap series;
+uint64 min_block_time_of_day;	// Earliest block kept, for wraparound traces
+
 U64Name names;
 
 static const int kMaxDateTimeBuffer = 32;
@@ -269,11 +307,15 @@ static char gTempPrintBuffer2[kMaxPrintBuffer];
 
 
 void Usage() {
-  fprintf(stderr, "Usage: checktrace <filename> [-v] [-q] [-h] [-nopf]\n\n");
+  fprintf(stderr, "Usage: checktrace <filename> [-v] [-q] [-h] [-nopf] [-t <threads>]\n");
+  fprintf(stderr, "                  [-series <file.csv>] [-tracemb <MB>]\n\n");
   fprintf(stderr, "       -v verbose, show hex at problem, more than two of each message\n");
   fprintf(stderr, "       -q quiet, just one line of PASS/FAIL output\n");
   fprintf(stderr, "       -h show hex for each event (debug)\n");
   fprintf(stderr, "       -nopf no page_fault checking, some files are OK without them\n");
+  fprintf(stderr, "       -t check block bodies with this many threads, at most one per core, same output\n");
+  fprintf(stderr, "       -series write events per CPU per second by event class to CSV file\n");
+  fprintf(stderr, "       -tracemb estimate how soon a trace buffer of this many MB fills\n");
   exit(0);
 }
 
@@ -339,43 +381,6 @@ const char* FormatUint64x2(uint64 n) {
   return gTempPrintBuffer2;
 }
 
-uint8 GetFlags(uint64* traceblock) {
-  return (uint8)((traceblock[1] >> 56) & 0xFF);
-}
-
-bool HasIPC(uint8 flags) {
-  return (flags & IPC_Flag);
-}
-bool HasWrap(uint8 flags) {
-  return (flags & WRAP_Flag);
-}
-
-bool IsVarLen(uint64 event) {
-  // Skip the Historical mistakes
-  if (event == KUTRACE_PC_TEMP) {return false;}
-  if (event == KUTRACE_PC_U) {return false;}
-  if (event == KUTRACE_PC_K) {return false;}
-  // Variable-length names
-  if ((KUTRACE_VARLENLO <= event) && (event <= KUTRACE_VARLENHI)) {
-    return true;
-  } 
-  return false;
-}
-
-// Most events are 1 word; a few are longer
-int GetEventLen(uint64 event) {
-  // Historical mistakes
-  if (event == KUTRACE_PC_TEMP) {return 2;}
-  if (event == KUTRACE_PC_U) {return 2;}
-  if (event == KUTRACE_PC_K) {return 2;}
-  // Variable-length names
-  if ((KUTRACE_VARLENLO <= event) && (event <= KUTRACE_VARLENHI)) {
-    int possible_len = (event >> 4) & 0x00F;
-    return possible_len ? possible_len : 1;	// Never return zero length
-  } 
-  return 1;
-}
-
 // Remove the length bits from an event number
 inline uint64 NoLen(uint64 e) {return e & 0xF0F;}
 
@@ -455,7 +460,7 @@ void CleanupAscii(char* str, int len) {
 //  event_no_len = event &0xF0F (middle four bits are entry length)
 //  key of (event_no_len << 16) | arg0 
 // where event says what kind of name, and arg0 says which item is named
-void SaveName(uint64 event, uint64 arg0, int event_len, uint64* traceblock_i) {
+void SaveName(uint64 event, uint64 arg0, int event_len, uint64* traceblock_i, U64Name* names) {
   char nametemp[64];
   int namelen = (event_len - 1) * 8;	// Eight bytes per name word
   if (namelen <= 0) {return;}		// Avoid core dump on bogus length
@@ -466,7 +471,7 @@ void SaveName(uint64 event, uint64 arg0, int event_len, uint64* traceblock_i) {
   nametemp[namelen] = '\0';
   CleanupAscii(nametemp, namelen);
   uint64 key = MakeKey(event, arg0);
-  names[key] = string(nametemp);
+  (*names)[key] = string(nametemp);
 if (tracenames) fprintf(stdout, "%016llx insert names[%07llx] %s\n", *traceblock_i, key, nametemp);
 }
 
@@ -661,13 +666,13 @@ bool CheckFirstTraceBlock(uint64* traceblock) {
   }
 
   // Trace-format version number is only in the first block's flags
-  flags = GetFlags(traceblock);
-  if ((flags & VERSION_MASK) != 3) {
-    subpar |= Note(WARN, TR1_VERSION, traceblock, 1*8, FormatUint64(flags & VERSION_MASK));
+  flags = traceblock[1] >> 56;
+  if (RawVersion(flags) != 3) {
+    subpar |= Note(WARN, TR1_VERSION, traceblock, 1*8, FormatUint64(RawVersion(flags)));
   }
 
   // Fail fast on zero version -- trace file is too old
-  if ((flags & VERSION_MASK) < 3) {
+  if (RawVersion(flags) < 3) {
     fprintf(stdout, "FAILFAST %s %s\n\n", "Too-old trace version", fname);
     exit(0);
   }
@@ -823,26 +828,46 @@ bool TsBefore() {
       // +-------------------+-----------+---------------+-------+-------+
       //          20              12         8       8           16 
 
-// Return true if subpar -- fail or warn
-bool CheckBlockBody(uint64* traceblock, int next_entry, int* block_events) {
-  bool subpar = false;
+// What the sequential checks need from one block body
+typedef struct {
+  int events;
+  int cross;		// Word number of an entry that runs past the block, or -1
+  uint64 last_cycles;	// Latest full timestamp of any entry, at least the block base
+  uint64 class_events[NUM_EC];
+} BlockBody;
+
+// Count events into event_counts and hasret_counts and save names into
+// blocknames. Any block-crossing entry is left in body for the caller to note.
+// Touches no other globals, so blocks can be done in parallel
+void CheckBlockBody(const RawBlock& block, uint64* event_counts, uint64* hasret_counts,
+                    U64Name* blocknames, BlockBody* body) {
   uint64 block_event_count = 0;
-
-  for (int i = next_entry; i < kTraceBufSize; ++i) {
+  uint64* traceblock = block.words;
+  body->cross = -1;
+  body->last_cycles = block.base_cycle;
+  memset(body->class_events, 0, NUM_EC * sizeof(uint64));
+
+  RawEntryIter iter;
+  InitRawEntryIter(&block, &iter);
+  RawEntry entry;
+  while (NextRawEntry(&iter, &entry)) {
+    int i = entry.index;
     if (hex) {fprintf(stdout, "[%4d] %016llx\n", i, traceblock[i]);}
-    uint64 ts = (traceblock[i] >> 44) & 0xFFFFF;
-    uint64 event = (traceblock[i] >> 32) & 0xFFF;
-    uint64 delta_t = (traceblock[i] >> 24) & 0xFF;
-    uint64 retval = (traceblock[i] >> 16) & 0xFF;
-    uint64 arg0 = (traceblock[i] >> 0) & 0xFFFF;
-    int event_len = GetEventLen(event);
+    uint64 event = entry.event;
+    uint64 delta_t = entry.delta_t;
+    uint64 arg0 = entry.arg;
+    int event_len = entry.len;
+    if (body->last_cycles < entry.cycles) {body->last_cycles = entry.cycles;}
 
     // Count all events, and also any optimized returns
-    ++event_count[event];
+    uint64* class_events = &body->class_events[ec_of_group[event >> 8]];
+    ++event_counts[event];
     ++block_event_count;
+    ++*class_events;
     if (IsCallRet(event, delta_t)) {
-      ++hasret_count[event];
+      ++hasret_counts[event];
       ++block_event_count;
+      ++*class_events;
     }
 
 
@@ -854,27 +879,32 @@ bool CheckBlockBody(uint64* traceblock, int next_entry, int* block_events) {
     //}
 
     // If variable-length entry (name), remember it 
-    if (IsVarLen(event)) {
-      SaveName(event, arg0, event_len, &traceblock[i]);
+    if (RawIsVarLen(event)) {
+      SaveName(event, arg0, event_len, &traceblock[i], blocknames);
     }
 
-    // Extra advance over multi-word events
-    if (1 < event_len) {
-      i += (event_len - 1);
-      // Check for block overflow
-      if (kTraceBufSize <= i) {
-        subpar |= Note(FAIL, BL_CROSS, traceblock, i*8, "");
-      }
+    // Check for multi-word events overflowing the block. event_len is already
+    // cut to the words left, so SaveName above stays inside the block
+    if (entry.truncated) {
+      body->cross = i;
     }
-
-    // Keep track of the event counts per CPU and per second
-    *block_events = block_event_count;
   }
 
-  return subpar;
+  // Keep track of the event counts per CPU and per second
+  body->events = block_event_count;
 }
 
-void TrackBlockEvents(uint64* traceblock, int block_events) {
+// Cycle counts per usec from the trace start and stop time pairs, or 0 if they
+// are unusable, such as the 32-bit RPi4 counter
+double CountsPerUsec() {
+  if (skip_tc_checks) {return 0.0;}
+  if (stop_time_counter <= start_time_counter) {return 0.0;}
+  if (stop_time_of_day <= start_time_of_day) {return 0.0;}
+  return (double)(stop_time_counter - start_time_counter) / (stop_time_of_day - start_time_of_day);
+}
+
+void TrackBlockEvents(uint64* traceblock, const BlockBody* body) {
+  int block_events = body->events;
   uint64 cpu = traceblock[0] >> 56;
   uint64 time_of_day = traceblock[1] & 0x00FFFFFFFFFFFFFFL;
   uint64 current_100msec =  time_of_day / 100000;
@@ -915,6 +945,98 @@ void TrackBlockEvents(uint64* traceblock, int block_events) {
 
   // Per-CPU events across entire trace
   total_events_per_cpu[cpu] += block_events;
+
+  // Time series, and buffer use per second. The block ends at its last entry,
+  // converted to time of day through the block's own cycle counter and time
+  // of day pair. Its share of each second it covers goes to that second
+  if (time_of_day < min_block_time_of_day) {min_block_time_of_day = time_of_day;}
+  uint64 base_cycle = traceblock[0] & 0x00FFFFFFFFFFFFFFL;
+  double counts_per_usec = CountsPerUsec();
+  uint64 end_time_of_day = time_of_day;
+  if (0.0 < counts_per_usec) {
+    end_time_of_day += (uint64)((body->last_cycles - base_cycle) / counts_per_usec);
+  }
+  if (stop_time_of_day < end_time_of_day) {end_time_of_day = stop_time_of_day;}
+  if (end_time_of_day < time_of_day) {end_time_of_day = time_of_day;}
+  uint64 usec = time_of_day;
+  do {
+    uint64 second = usec / 1000000;
+    uint64 next_usec = (second + 1) * 1000000;
+    double share = 1.0;
+    if (time_of_day < end_time_of_day) {
+      uint64 hi = (end_time_of_day < next_usec) ? end_time_of_day : next_usec;
+      share = (double)(hi - usec) / (end_time_of_day - time_of_day);
+    }
+    SeriesRow* row = &series[(second << 8) | (cpu & 0xFF)];
+    row->blocks += share;
+    row->events += share * block_events;
+    for (int k = 0; k < NUM_EC; ++k) {row->class_events[k] += share * body->class_events[k];}
+    usec = next_usec;
+  } while (usec < end_time_of_day);
+}
+
+// Trace buffer bytes per block, including any IPC bytes
+uint64 BlockBytes() {
+  return (kTraceBufSize * 8) + (RawHasIpc(flags) ? kIpcBufSize : 0);
+}
+
+// One line per CPU per second that has any part of a block
+void WriteSeries(const char* fname) {
+  FILE* f = fopen(fname, "w");
+  if (f == NULL) {
+    fprintf(stderr, "%s did not open\n", fname);
+    exit(0);
+  }
+  fprintf(f, "second,cpu,blocks,kb,events");
+  for (int k = 0; k < NUM_EC; ++k) {fprintf(f, ",%s", ec_text[k]);}
+  fprintf(f, "\n");
+  for (SeriesMap::const_iterator it = series.begin(); it != series.end(); ++it) {
+    const SeriesRow& row = it->second;
+    fprintf(f, "%llu,%llu,%.2f,%.0f,%.0f", it->first >> 8, it->first & 0xFF, 
+            row.blocks, (row.blocks * BlockBytes()) / 1024.0, row.events);
+    for (int k = 0; k < NUM_EC; ++k) {fprintf(f, ",%.0f", row.class_events[k]);}
+    fprintf(f, "\n");
+  }
+  fclose(f);
+}
+
+// How fast the workload fills trace buffer, on average from the earliest block
+// to the trace stop time, and in the busiest second. Optionally how long a
+// buffer of tracemb MB would last
+void PrintBufferRate() {
+  if (stop_time_of_day <= min_block_time_of_day) {return;}
+  double elapsed = (stop_time_of_day - min_block_time_of_day) / 1000000.0;
+  double mb_per_sec = ((total_block_count * BlockBytes()) / 1048576.0) / elapsed;
+
+  map<uint64, double> blocks_per_second;
+  for (SeriesMap::const_iterator it = series.begin(); it != series.end(); ++it) {
+    blocks_per_second[it->first >> 8] += it->second.blocks;
+  }
+  // A second's rate is over just the part of it inside the trace. Seconds
+  // with less than a quarter inside are too noisy to count
+  double peak_mb_per_sec = mb_per_sec;
+  uint64 peak_blocks_second = min_block_time_of_day / 1000000;
+  bool any_peak = false;
+  for (map<uint64, double>::const_iterator it = blocks_per_second.begin(); 
+       it != blocks_per_second.end(); ++it) {
+    uint64 lo = it->first * 1000000;
+    uint64 hi = lo + 1000000;
+    if (lo < min_block_time_of_day) {lo = min_block_time_of_day;}
+    if (stop_time_of_day < hi) {hi = stop_time_of_day;}
+    if (hi < lo + 250000) {continue;}
+    double rate = ((it->second * BlockBytes()) / 1048576.0) / ((hi - lo) / 1000000.0);
+    if (!any_peak || (peak_mb_per_sec < rate)) {
+      peak_mb_per_sec = rate;
+      peak_blocks_second = it->first;
+      any_peak = true;
+    }
+  }
+  fprintf(stdout, "     Trace buffer use %5.2f MB/sec over %1.1f seconds, peak %5.2f MB/sec at %s\n",
+    mb_per_sec, elapsed, peak_mb_per_sec, FormatSecondsDateTime(peak_blocks_second));
+  if ((0 < tracemb) && (0 < mb_per_sec)) {
+    fprintf(stdout, "     At tracemb=%llu the buffer fills in ~%1.1f seconds, ~%1.1f at peak rate\n",
+      tracemb, tracemb / mb_per_sec, tracemb / peak_mb_per_sec);
+  }
 }
 
 // Called after all blocks, to handle peaks at end of trace
@@ -939,28 +1061,33 @@ void FinishBlockEvents() {
 }
 
 // Return true if subpar -- fail or warn
-bool CheckTraceBlock(size_t n, uint64* traceblock) {
+// body is from an earlier parallel pass, or NULL to check the body here
+bool CheckTraceBlock(const RawBlock& block, const BlockBody* body) {
   bool subpar = false;
-  int block_events;
+  uint64* traceblock = block.words;
   // Must be 64KB
-  if ((n & 0xFFFF) != 0) {
+  if ((block.trace_bytes & 0xFFFF) != 0) {
     subpar |= Note(FAIL, TR_TRUNC, traceblock, 0, "");
     subpar = true;
   }
 
   // First block extra checks
   // Sets global time range, so must be before calling CheckBlockHeader 
-  int next_entry = 2;
   if (block_num == 0) {
     subpar |= CheckFirstTraceBlock(traceblock);
-    next_entry = 8;
   }
 
-  subpar |= CheckBlockHeader(traceblock, next_entry);
-  next_entry += 4;					// Over the PID #,name
-  subpar |= CheckBlockBody(traceblock, next_entry, &block_events);
+  subpar |= CheckBlockHeader(traceblock, block.header_words);
+  BlockBody temp;
+  if (body == NULL) {
+    CheckBlockBody(block, event_count, hasret_count, &names, &temp);	// After the PID #,name
+    body = &temp;
+  }
+  if (0 <= body->cross) {
+    subpar |= Note(FAIL, BL_CROSS, traceblock, body->cross*8, "");
+  }
 
-  TrackBlockEvents(traceblock, block_events);
+  TrackBlockEvents(traceblock, body);
 
   // Give overall blessing for positive feedback
   if (!subpar) {Note(GOOD, BL_GOOD, NULL, 0, "");}
@@ -968,17 +1095,49 @@ bool CheckTraceBlock(size_t n, uint64* traceblock) {
 }
 
 // Return true if subpar -- fail or warn
-bool CheckIpcBlock(size_t n, uint64* ipcblock) {
+bool CheckIpcBlock(size_t n, const uint8* ipcblock) {
   bool subpar = false;
   // Must be 8KB
   if ((n & 0xFFF) != 0) {
-    subpar |= Note(FAIL, TR_TRUNC, ipcblock, 0, "");
+    subpar |= Note(FAIL, TR_TRUNC, (uint64*)ipcblock, 0, "");
   }
   // Only other test I can think of is to see if density of 1-bits is about 
   // the same in both 32-bit halves. Left density is higher in trace blocks.
   return subpar;
 }
 
+// One thread's share of the block bodies, blocks [begin, limit)
+typedef struct {
+  const RawBlock* blocks;
+  BlockBody* bodies;
+  int begin;
+  int limit;
+  uint64 event_count[4096];
+  uint64 hasret_count[4096];
+  U64Name names;
+} Shard;
+
+void CheckShard(Shard* shard) {
+  memset(shard->event_count, 0, 4096 * sizeof(uint64));
+  memset(shard->hasret_count, 0, 4096 * sizeof(uint64));
+  for (int b = shard->begin; b < shard->limit; ++b) {
+    CheckBlockBody(shard->blocks[b], shard->event_count, shard->hasret_count,
+                   &shard->names, &shard->bodies[b]);
+  }
+}
+
+// Shards are merged in block order, so a later name replaces an earlier one
+// just as in a serial pass
+void MergeShard(const Shard& shard) {
+  for (int i = 0; i < 4096; ++i) {
+    event_count[i] += shard.event_count[i];
+    hasret_count[i] += shard.hasret_count[i];
+  }
+  for (U64Name::const_iterator it = shard.names.begin(); it != shard.names.end(); ++it) {
+    names[it->first] = it->second;
+  }
+}
+
 // Get a name for event number 000 .. FFF
 const char* GetEventName(int event) {
   const char* retval;
@@ -1058,7 +1217,6 @@ bool CheckEventCounts() {
     // Ignore small counts
     if (10 <= calls) {
       int callper = (calls * 100) / sum;
-      int retper = 100 - callper;
       // Ignore nearly 50:50 ratio
       if (55 < callper) {	// Complain over 55:45 or worse
         char temp[128];
@@ -1148,10 +1306,22 @@ int main (int argc, const char** argv) {
       hex = true;
     } else if (strcmp(argv[i], "-nopf") == 0) {
       nopf = true;
+    } else if ((strcmp(argv[i], "-t") == 0) && (i < (argc - 1))) {
+      thread_count = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "-series") == 0) && (i < (argc - 1))) {
+      series_fname = argv[++i];
+    } else if ((strcmp(argv[i], "-tracemb") == 0) && (i < (argc - 1))) {
+      tracemb = atoll(argv[++i]);
     } else {
       Usage();
     }
   }
+  if (thread_count < 1) {Usage();}
+  // No more threads than cores; std::thread throws when it cannot make one
+  int max_threads = std::thread::hardware_concurrency();
+  if (max_threads < 1) {max_threads = kMaxThreads;}
+  if (max_threads < thread_count) {thread_count = max_threads;}
+  if (hex || tracenames) {thread_count = 1;}	// Keep the per-entry output in order
 
   // Initialize
   memset(event_count, 0, 4096 * sizeof(uint64));
@@ -1174,34 +1344,67 @@ int main (int argc, const char** argv) {
   prior_10second = 0;
 
   memset(total_events_per_cpu, 0, 256 * sizeof(uint64));
+  min_block_time_of_day = ~0LLU;
 
 
   // Exits if any problem with file -- fail_fast
   FILE* f = CheckStat(fname);
 
-  // Loop reading and testing trace blocks
-  uint64 traceblock[kTraceBufSize];	// 8 bytes per trace entry
-  uint64 ipcblock[kIpcBufSize];		// One byte per trace entry
+  // Loop reading and testing trace blocks, each followed by its 8KB IPC block
+  // if the first block has IPC_Flag set
+  RawReader reader;
+  RawBlock block;
+  InitRawReader(f, &reader);
+
+  // With threads, first check all the block bodies in place in the mapped
+  // file, then do everything else below in block order
+  vector<RawBlock> blocks;
+  vector<BlockBody> bodies;
+  if ((1 < thread_count) && (reader.map_base != NULL)) {
+    while (NextRawBlock(&reader, &block)) {blocks.push_back(block);}
+    bodies.resize(blocks.size());
+    vector<Shard*> shards;
+    vector<std::thread*> threads;
+    for (int i = 0; i < thread_count; ++i) {
+      Shard* shard = new Shard;
+      shard->blocks = blocks.data();
+      shard->bodies = bodies.data();
+      shard->begin = (blocks.size() * i) / thread_count;
+      shard->limit = (blocks.size() * (i + 1)) / thread_count;
+      shards.push_back(shard);
+      threads.push_back(new std::thread(CheckShard, shard));
+    }
+    for (int i = 0; i < thread_count; ++i) {
+      threads[i]->join();
+      MergeShard(*shards[i]);
+      delete threads[i];
+      delete shards[i];
+    }
+  }
 
   offset = 0;
   block_num = 0;
-  size_t n;
-  while ((n = fread(traceblock, 1, sizeof(traceblock), f)) != 0) {
+  while (bodies.empty() ? NextRawBlock(&reader, &block) : (block_num < (int)blocks.size())) {
     bool subpar_block = false; 
-    subpar_block |= CheckTraceBlock(n, traceblock);	// Sets flags at first block
-    offset += n;
-
-    if (HasIPC(flags)) {
-      // Extract 8KB IPC block
-      n = fread(ipcblock, 1, sizeof(ipcblock), f);
-      subpar_block |= CheckIpcBlock(n, ipcblock);
-      offset += n;
+    const BlockBody* body = NULL;
+    if (!bodies.empty()) {
+      block = blocks[block_num];
+      body = &bodies[block_num];
+    }
+    offset = block.offset;
+    subpar_block |= CheckTraceBlock(block, body);	// Sets flags at first block
+
+    if (block.ipc != NULL) {
+      offset = block.offset + block.trace_bytes;
+      subpar_block |= CheckIpcBlock(block.ipc_bytes, block.ipc);
     }
     ++total_block_count;
     if (subpar_block) {++total_bad_block_count;}
 
     ++block_num;
   }
+  uint64* traceblock = NULL;	// Further messages are not about one block
+  CloseRawReader(&reader);
   fclose(f);
   FinishBlockEvents();
 
@@ -1226,8 +1429,8 @@ int main (int argc, const char** argv) {
   // Print trace summary
   snprintf(gTempPrintBuffer, kMaxPrintBuffer, "%d CPUs%s%s", 
     max_cpu + 1, 
-    HasIPC(flags) ? ", IPC" : "", 
-    HasWrap(flags) ? ", WRAP" : "");
+    RawHasIpc(flags) ? ", IPC" : "", 
+    RawHasWrap(flags) ? ", WRAP" : "");
   Note(INFO, TR_INFO, traceblock, 0*8, gTempPrintBuffer); 
  
   // Print peaks
@@ -1249,8 +1452,11 @@ int main (int argc, const char** argv) {
     ((peak_10second_events/10) >> 10) / (max_cpu+1));
   // TODO: most active CPU
 #endif
+  PrintBufferRate();
   }
 
+  if (series_fname != NULL) {WriteSeries(series_fname);}
+
   fprintf(stdout, "%s %s\n\n", trace_fail ? "FAIL" : "PASS", fname);
 
   return 0;
@@ -0,0 +1,310 @@
+// elfsym.h
+//
+// Minimal in-process ELF64 function-symbol reader, so samptoname_u can turn
+// user-mode PC samples into routine names without running addr2line per sample.
+//
+// Each binary is read once: its PT_LOAD program headers, to turn a file offset
+// from /proc/pid/maps into a link-time virtual address, its allocated section
+// address ranges, and its code symbols sorted by address. Symbols come from
+// .symtab; if the binary is stripped, from the .symtab of a separate debug file
+// /usr/lib/debug/.build-id/xx/yyyy.debug if there is one, else from .dynsym.
+//
+// Lookup picks the same symbol that addr2line -f picks when there is no line
+// information: the nearest one at or below the address within the same section.
+// There is no check against symbol size, so an address in a static routine of a
+// stripped library gets the name of the exported routine just before it.
+//
+// Only little-endian ELF64 is handled; callers fall back to addr2line otherwise.
+//
+
+#ifndef __ELFSYM_H__
+#define __ELFSYM_H__
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <cxxabi.h>     // abi::__cxa_demangle
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>     // free
+#include <string.h>
+
+#include "basetypes.h"
+
+typedef struct {
+  uint64 addr;
+  uint64 size;          // st_size, but at least 1
+  int section;          // st_shndx
+  bool is_func;         // STT_FUNC or STT_GNU_IFUNC, vs. STT_NOTYPE
+  std::string name;     // As in the symbol table, not demangled
+} ElfSym;
+
+typedef struct {
+  uint64 addr;          // sh_addr
+  uint64 size;          // sh_size
+  int section;
+} ElfSection;
+
+typedef struct {
+  uint64 offset;        // p_offset
+  uint64 vaddr;         // p_vaddr
+  uint64 filesz;        // p_filesz
+} ElfLoad;
+
+typedef struct {
+  bool found;           // False if the file did not open
+  bool ok;              // False if not readable little-endian ELF64
+  std::vector<ElfLoad> loads;
+  std::vector<ElfSection> sections;     // Allocated ones only
+  std::vector<ElfSym> syms;     // Sorted by addr, else in symbol table order
+} ElfSymtab;
+
+inline bool ElfSymLess(const ElfSym& a, const ElfSym& b) {
+  return a.addr < b.addr;
+}
+
+// Read len bytes at offset in f into buf. Return false on any failure
+inline bool ElfReadAt(FILE* f, uint64 offset, uint64 len, void* buf) {
+  if (fseek(f, offset, SEEK_SET) != 0) {return false;}
+  return fread(buf, 1, len, f) == len;
+}
+
+// Read one whole section into buf
+inline bool ElfReadSection(FILE* f, const Elf64_Shdr& shdr, std::vector<char>* buf) {
+  buf->resize(shdr.sh_size + 1);
+  (*buf)[shdr.sh_size] = '\0';          // So a string table always ends in NUL
+  if (shdr.sh_size == 0) {return true;}
+  return ElfReadAt(f, shdr.sh_offset, shdr.sh_size, &(*buf)[0]);
+}
+
+// Read the file and section headers of an open ELF64 file
+inline bool ElfReadHeaders(FILE* f, Elf64_Ehdr* ehdr, std::vector<Elf64_Shdr>* shdrs) {
+  if (!ElfReadAt(f, 0, sizeof(Elf64_Ehdr), ehdr)) {return false;}
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0) {return false;}
+  if (ehdr->e_ident[EI_CLASS] != ELFCLASS64) {return false;}
+  if (ehdr->e_ident[EI_DATA] != ELFDATA2LSB) {return false;}
+  if (ehdr->e_shentsize != sizeof(Elf64_Shdr)) {return false;}
+  shdrs->resize(ehdr->e_shnum);
+  if (ehdr->e_shnum == 0) {return true;}
+  return ElfReadAt(f, ehdr->e_shoff, ehdr->e_shnum * sizeof(Elf64_Shdr), &(*shdrs)[0]);
+}
+
+// Add the code symbols of one symbol table section (SHT_SYMTAB or SHT_DYNSYM)
+// Data, thread-local, section, and file symbols never name a PC
+inline void ElfAddSyms(FILE* f, const std::vector<Elf64_Shdr>& shdrs, int symsec,
+                       ElfSymtab* symtab) {
+  const Elf64_Shdr& shdr = shdrs[symsec];
+  if ((shdr.sh_entsize != sizeof(Elf64_Sym)) || (shdrs.size() <= shdr.sh_link)) {return;}
+  std::vector<char> symbuf;
+  std::vector<char> strbuf;
+  if (!ElfReadSection(f, shdr, &symbuf)) {return;}
+  if (!ElfReadSection(f, shdrs[shdr.sh_link], &strbuf)) {return;}
+
+  int count = shdr.sh_size / sizeof(Elf64_Sym);
+  const Elf64_Sym* sym = reinterpret_cast<const Elf64_Sym*>(&symbuf[0]);
+  for (int i = 0; i < count; ++i) {
+    int type = ELF64_ST_TYPE(sym[i].st_info);
+    int bind = ELF64_ST_BIND(sym[i].st_info);
+    if ((type != STT_FUNC) && (type != STT_GNU_IFUNC) && (type != STT_NOTYPE)) {continue;}
+    if ((sym[i].st_shndx == SHN_UNDEF) || (SHN_LORESERVE <= sym[i].st_shndx)) {continue;}
+    // Skip compiler-plugin notes: hidden, local, untyped, zero size
+    if ((type == STT_NOTYPE) && (bind == STB_LOCAL) && (sym[i].st_size == 0) &&
+        (ELF64_ST_VISIBILITY(sym[i].st_other) == STV_HIDDEN)) {continue;}
+    if (strbuf.size() <= sym[i].st_name) {continue;}
+    const char* name = &strbuf[sym[i].st_name];
+    // Skip unnamed symbols and arm/riscv $x/$d mapping symbols
+    if ((name[0] == '\0') || (name[0] == '$')) {continue;}
+
+    ElfSym temp;
+    temp.addr = sym[i].st_value;
+    temp.size = (sym[i].st_size == 0) ? 1 : sym[i].st_size;
+    temp.section = sym[i].st_shndx;
+    temp.is_func = (type != STT_NOTYPE);
+    temp.name = name;
+    symtab->syms.push_back(temp);
+  }
+}
+
+// Return the GNU build-id as hex digits, or empty string if none
+inline std::string ElfBuildId(FILE* f, const std::vector<Elf64_Shdr>& shdrs) {
+  for (int i = 0; i < (int)shdrs.size(); ++i) {
+    if (shdrs[i].sh_type != SHT_NOTE) {continue;}
+    std::vector<char> notebuf;
+    if (!ElfReadSection(f, shdrs[i], &notebuf)) {continue;}
+    if (notebuf.size() < sizeof(Elf64_Nhdr) + 4) {continue;}
+    const Elf64_Nhdr* nhdr = reinterpret_cast<const Elf64_Nhdr*>(&notebuf[0]);
+    if (nhdr->n_type != NT_GNU_BUILD_ID) {continue;}
+    if ((nhdr->n_namesz != 4) || (memcmp(&notebuf[sizeof(Elf64_Nhdr)], "GNU", 4) != 0)) {continue;}
+    const uint8* id = reinterpret_cast<const uint8*>(&notebuf[sizeof(Elf64_Nhdr) + 4]);
+    if ((nhdr->n_descsz < 2) ||
+        (notebuf.size() < sizeof(Elf64_Nhdr) + 4 + nhdr->n_descsz)) {continue;}
+    std::string buildid;
+    char hex[4];
+    for (int k = 0; k < (int)nhdr->n_descsz; ++k) {
+      sprintf(hex, "%02x", id[k]);
+      buildid += hex;
+    }
+    return buildid;
+  }
+  return std::string();
+}
+
+// Return the build-id debug file name for a stripped binary, or empty string
+inline std::string ElfDebugFileName(FILE* f, const std::vector<Elf64_Shdr>& shdrs) {
+  std::string buildid = ElfBuildId(f, shdrs);
+  if (buildid.empty()) {return buildid;}
+  return "/usr/lib/debug/.build-id/" + buildid.substr(0, 2) + "/" + buildid.substr(2) + ".debug";
+}
+
+// Return the build-id of a binary without reading its symbols, or empty string
+inline std::string ReadElfBuildId(const char* pathname) {
+  FILE* f = fopen(pathname, "rb");
+  if (f == NULL) {return std::string();}
+  Elf64_Ehdr ehdr;
+  std::vector<Elf64_Shdr> shdrs;
+  std::string buildid;
+  if (ElfReadHeaders(f, &ehdr, &shdrs)) {buildid = ElfBuildId(f, shdrs);}
+  fclose(f);
+  return buildid;
+}
+
+// Read the load segments and code symbols of one binary
+inline void ReadElfSymtab(const char* pathname, ElfSymtab* symtab) {
+  symtab->found = false;
+  symtab->ok = false;
+  symtab->loads.clear();
+  symtab->sections.clear();
+  symtab->syms.clear();
+  FILE* f = fopen(pathname, "rb");
+  if (f == NULL) {return;}
+  symtab->found = true;
+
+  Elf64_Ehdr ehdr;
+  std::vector<Elf64_Shdr> shdrs;
+  if (!ElfReadHeaders(f, &ehdr, &shdrs) || (ehdr.e_phentsize != sizeof(Elf64_Phdr))) {
+    fclose(f);
+    return;
+  }
+
+  std::vector<Elf64_Phdr> phdrs(ehdr.e_phnum);
+  if ((ehdr.e_phnum != 0) &&
+      !ElfReadAt(f, ehdr.e_phoff, ehdr.e_phnum * sizeof(Elf64_Phdr), &phdrs[0])) {
+    fclose(f);
+    return;
+  }
+  for (int i = 0; i < (int)phdrs.size(); ++i) {
+    if (phdrs[i].p_type != PT_LOAD) {continue;}
+    ElfLoad temp;
+    temp.offset = phdrs[i].p_offset;
+    temp.vaddr = phdrs[i].p_vaddr;
+    temp.filesz = phdrs[i].p_filesz;
+    symtab->loads.push_back(temp);
+  }
+
+  for (int i = 0; i < (int)shdrs.size(); ++i) {
+    if ((shdrs[i].sh_flags & SHF_ALLOC) == 0) {continue;}
+    ElfSection temp;
+    temp.addr = shdrs[i].sh_addr;
+    temp.size = shdrs[i].sh_size;
+    temp.section = i;
+    symtab->sections.push_back(temp);
+  }
+
+  for (int i = 0; i < (int)shdrs.size(); ++i) {
+    if (shdrs[i].sh_type == SHT_SYMTAB) {ElfAddSyms(f, shdrs, i, symtab);}
+  }
+
+  // Stripped binary: pick up the full symbol table from a separate debug file
+  if (symtab->syms.empty()) {
+    std::string debugname = ElfDebugFileName(f, shdrs);
+    FILE* g = debugname.empty() ? NULL : fopen(debugname.c_str(), "rb");
+    if (g != NULL) {
+      Elf64_Ehdr debug_ehdr;
+      std::vector<Elf64_Shdr> debug_shdrs;
+      if (ElfReadHeaders(g, &debug_ehdr, &debug_shdrs)) {
+        for (int i = 0; i < (int)debug_shdrs.size(); ++i) {
+          if (debug_shdrs[i].sh_type == SHT_SYMTAB) {ElfAddSyms(g, debug_shdrs, i, symtab);}
+        }
+      }
+      fclose(g);
+    }
+  }
+
+  // Else make do with the exported symbols
+  if (symtab->syms.empty()) {
+    for (int i = 0; i < (int)shdrs.size(); ++i) {
+      if (shdrs[i].sh_type == SHT_DYNSYM) {ElfAddSyms(f, shdrs, i, symtab);}
+    }
+  }
+  fclose(f);
+
+  std::stable_sort(symtab->syms.begin(), symtab->syms.end(), ElfSymLess);
+  symtab->ok = true;
+}
+
+// Turn a file offset into the link-time virtual address used by the symbols
+// Returns the offset itself if it is in no load segment
+inline uint64 ElfFileOffsetToVaddr(const ElfSymtab& symtab, uint64 offset) {
+  for (int i = 0; i < (int)symtab.loads.size(); ++i) {
+    const ElfLoad& load = symtab.loads[i];
+    if ((load.offset <= offset) && (offset < load.offset + load.filesz)) {
+      return offset - load.offset + load.vaddr;
+    }
+  }
+  return offset;
+}
+
+// Return the nearest symbol at or below vaddr in the same section, or NULL if none
+inline const ElfSym* ElfLookup(const ElfSymtab& symtab, uint64 vaddr) {
+  const ElfSection* section = NULL;
+  for (int i = 0; i < (int)symtab.sections.size(); ++i) {
+    const ElfSection& sec = symtab.sections[i];
+    if ((sec.addr <= vaddr) && (vaddr < sec.addr + sec.size)) {section = &sec; break;}
+  }
+  if (section == NULL) {return NULL;}
+
+  ElfSym key;
+  key.addr = vaddr;
+  std::vector<ElfSym>::const_iterator it =
+    std::upper_bound(symtab.syms.begin(), symtab.syms.end(), key, ElfSymLess);
+
+  // Walk down to the highest symbol address in this section
+  std::vector<ElfSym>::const_iterator top = symtab.syms.end();
+  while (it != symtab.syms.begin()) {
+    --it;
+    if (it->addr < section->addr) {break;}
+    if ((top != symtab.syms.end()) && (it->addr != top->addr)) {break;}
+    if (it->section == section->section) {top = it;}
+  }
+  if (top == symtab.syms.end()) {return NULL;}
+
+  // Choose among the aliases at that address in symbol table order, as addr2line
+  // does: if the best so far does not reach vaddr, take a larger one; else
+  // prefer functions over labels, then a smaller one
+  const ElfSym* best = &(*top);
+  for (++top; (top != symtab.syms.end()) && (top->addr == best->addr); ++top) {
+    if (top->section != section->section) {continue;}
+    const ElfSym* sym = &(*top);
+    if (best->addr + best->size <= vaddr) {
+      if (best->size < sym->size) {best = sym;}
+    } else if (sym->is_func != best->is_func) {
+      if (sym->is_func) {best = sym;}
+    } else if (sym->size < best->size) {
+      best = sym;
+    }
+  }
+  return best;
+}
+
+// Demangle a C++ name as addr2line -C does; plain C names come back unchanged
+inline std::string ElfDemangle(const std::string& name) {
+  int status = 0;
+  char* demangled = abi::__cxa_demangle(name.c_str(), NULL, NULL, &status);
+  if (demangled == NULL) {return name;}
+  std::string retval = demangled;
+  free(demangled);
+  return retval;
+}
+
+#endif	// __ELFSYM_H__
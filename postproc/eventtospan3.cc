@@ -64,6 +64,7 @@
 // 2021.10.22 dsites Change mwait to wfi for Raspberry Pi
 // 2022.06.05 dsites Allow mwait(0) for C1 state, add mwait exit event
 // 2022.06.05 dsites Get pid (later: rpc names to track over time if they change
+// 2026.10.16 Add -ticks for integer 10ns-tick JSON output, see json_ticks.h
 
 // Compile with  g++ -O2 eventtospan3.cc -o eventtospan3
 
@@ -88,6 +89,15 @@
 ////#include "kutrace_control_names.h"
 #include "kutrace_lib.h"
 
+#include "kupostproc.h"
+#include "json_ticks.h"
+
+namespace eventtospan3 {
+
+// Input and output streams. stdin/stdout except when run inside kupostproc
+static FILE* infile = NULL;
+static FILE* outfile = NULL;
+
 // Event numbers or related masks
 #define call_mask        0xc00
 #define call_ret_mask    0xe00
@@ -481,6 +491,7 @@ static const HashCorr inithashcorr = {0, 0};
 bool verbose = false;
 bool trace = false;
 bool rel0 = false;
+int64 ticks_per_sec = 0;	// Nonzero for -ticks integer JSON times
 bool is_rpi = false;		// True for Raspberry Pi
 bool is_low_res_ts = false;	// True for Riscv u74
 
@@ -1166,7 +1177,7 @@ void CexitBackToIdle(OneSpan* span) {
   if (span->eventnum != event_c_exit) {return;}
   span->eventnum = event_idle;
   span->name = string(kIdleName);
-//fprintf(stdout, "CexitBackToIdle at %llu\n", span->start_ts);
+//fprintf(outfile, "CexitBackToIdle at %llu\n", span->start_ts);
 }
 
 // Make sure bugs about renaming the idle pid are gone. DEFUNCT
@@ -1181,9 +1192,19 @@ void CheckSpan(const char* label, const CPUState* thiscpu) {
   }
   if (fail) {
     fprintf(stderr, "\nCheckSpan failed ==================================\n");
-    fprintf(stdout, "\nCheckSpan failed ==================================\n");
-    DumpSpan(stdout, label, span);
-    DumpStack(stdout, label, &thiscpu->cpu_stack);
+    fprintf(outfile, "\nCheckSpan failed ==================================\n");
+    DumpSpan(outfile, label, span);
+    DumpStack(outfile, label, &thiscpu->cpu_stack);
+  }
+}
+
+// Write the start time and duration of a span, 10ns ticks in, json out
+// Seconds by default, else unchanged integer ticks with -ticks
+void WriteJsonTimes(FILE* f, int64 start_ts, int64 duration) {
+  if (ticks_per_sec == 0) {
+    PrintSpanTimes(f, 0, start_ts / 100000000.0, duration / 100000000.0);
+  } else {
+    PrintSpanTimes(f, ticks_per_sec, start_ts, duration);
   }
 }
 
@@ -1198,12 +1219,12 @@ void WriteSpanJson2(FILE* f, const OneSpan* span) {
   // Output
   // time dur cpu pid rpcid event arg retval ipc name
   // Change time from multiples of 10 nsec to seconds and fraction
-  double ts_sec = span->start_ts / 100000000.0;
   double dur_sec = span->duration / 100000000.0;
 //CHECK("f", *span);
   //                   ts dur cpu  pid rpc event  arg ret ipc  name
-  fprintf(f, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s\"],",
-          ts_sec, dur_sec, span->cpu,
+  WriteJsonTimes(f, span->start_ts, span->duration);
+  fprintf(f, "%d, %d, %d, %d, %d, %d, %d, \"%s\"],",
+          span->cpu,
           span->pid, span->rpcid, span->eventnum,
           span->arg, span->retval, span->ipc, span->name.c_str());
   ++span_count;
@@ -1228,12 +1249,11 @@ void WriteSpanJson(FILE* f, const CPUState* thiscpu) {
 // Write a point event, so they aren't lost
 // Change time from multiples of 10 nsec to seconds and fraction
 void WriteEventJson(FILE* f, const OneSpan* event) {
-  double ts_sec = event->start_ts / 100000000.0;
-  double dur_sec = event->duration / 100000000.0;
 //CHECK("g", *event);
   //                   ts dur cpu  pid rpc event  arg ret ipc  name
-  fprintf(f, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n",
-          ts_sec, dur_sec, event->cpu,
+  WriteJsonTimes(f, event->start_ts, event->duration);
+  fprintf(f, "%d, %d, %d, %d, %d, %d, %d, \"%s\"],\n",
+          event->cpu,
           event->pid, event->rpcid, event->eventnum,
           event->arg, event->retval, event->ipc, event->name.c_str());
   ++span_count;
@@ -1247,7 +1267,11 @@ void InitialJson(FILE* f, const char* label, const char* basetime) {
 
   // Leading spaces are to keep this all in front and in order after text sort
   fprintf(f, "  {\n");
-  fprintf(f, " \"Comment\" : \"V2 with IPC field\",\n");
+  if (ticks_per_sec == 0) {
+    fprintf(f, " \"Comment\" : \"V2 with IPC field\",\n");
+  } else {
+    fprintf(f, " \"Comment\" : \"V3 with IPC field, integer ticks\",\n");
+  }
   fprintf(f, " \"axisLabelX\" : \"Time (sec)\",\n");
   fprintf(f, " \"axisLabelY\" : \"CPU Number\",\n");
   fprintf(f, " \"flags\" : %d,\n", incoming_flags);
@@ -1255,6 +1279,9 @@ void InitialJson(FILE* f, const char* label, const char* basetime) {
   fprintf(f, " \"shortUnitsX\" : \"s\",\n");
   fprintf(f, " \"shortMulX\" : 1,\n");
   fprintf(f, " \"thousandsX\" : 1000,\n");
+  if (ticks_per_sec != 0) {
+    fprintf(f, "%s%lld,\n", kTicksPerSecField, ticks_per_sec);
+  }
   fprintf(f, " \"title\" : \"%s\",\n", label);
   fprintf(f, " \"tracebase\" : \"%s\",\n", basetime);
   fprintf(f, " \"version\" : %d,\n", incoming_version);
@@ -1276,8 +1303,7 @@ void InitialJson(FILE* f, const char* label, const char* basetime) {
 
 // Add dummy entry that sorts last, then close the events array and top-level json
 void FinalJson(FILE* f) {
-  fprintf(f, "[999.0, 0.0, 0, 0, 0, 0, 0, 0, 0, \"\"]\n");	// no comma
-  fprintf(f, "]}\n");
+  PrintFinalJson(f, ticks_per_sec);
 }
 
 // Design for push/pop of nested kernel routines
@@ -1339,10 +1365,10 @@ int NestLevel(int eventnum) {
 void AdjustStackForPush(const OneSpan& event, CPUState* thiscpu) {
   while (NestLevel(event.eventnum) <=
          NestLevel(thiscpu->cpu_stack.eventnum[thiscpu->cpu_stack.top])) {
-fprintf(stdout,"AdjustStackForPush FAIL\n");
+fprintf(outfile,"AdjustStackForPush FAIL\n");
     // Insert dummy returns, i.e. pop, until the call is legal or we are at user-mode level
     if (thiscpu->cpu_stack.top == 0) {break;}
-if (verbose) fprintf(stdout, "-%d  dummy return from %s\n",
+if (verbose) fprintf(outfile, "-%d  dummy return from %s\n",
 event.cpu, thiscpu->cpu_stack.name[thiscpu->cpu_stack.top].c_str());
     --thiscpu->cpu_stack.top;
   }
@@ -1351,9 +1377,9 @@ event.cpu, thiscpu->cpu_stack.name[thiscpu->cpu_stack.top].c_str());
 // This deals with unbalanced return
 void AdjustStackForPop(const OneSpan& event, CPUState* thiscpu) {
   if (thiscpu->cpu_stack.top == 0) {
-fprintf(stdout,"AdjustStackForPop FAIL\n");
+fprintf(outfile,"AdjustStackForPop FAIL\n");
     // Trying to return above user mode. Push a dummy syscall
-if (verbose) fprintf(stdout, "+%d dummy call to %s\n", event.cpu, event.name.c_str());
+if (verbose) fprintf(outfile, "+%d dummy call to %s\n", event.cpu, event.name.c_str());
     ++thiscpu->cpu_stack.top;
     thiscpu->cpu_stack.eventnum[thiscpu->cpu_stack.top] = dummy_syscall;
     thiscpu->cpu_stack.name[thiscpu->cpu_stack.top] = string("-dummy-");
@@ -1363,10 +1389,10 @@ if (verbose) fprintf(stdout, "+%d dummy call to %s\n", event.cpu, event.name.c_s
   int matching_call = event.eventnum & ~ret_mask;		// Turn off the return bit
   while (NestLevel(matching_call) <
          NestLevel(thiscpu->cpu_stack.eventnum[thiscpu->cpu_stack.top])) {
-fprintf(stdout,"AdjustStackForPop FAIL\n");
+fprintf(outfile,"AdjustStackForPop FAIL\n");
     // Insert dummy returns, i.e. pop, until the call is legal or we are at user-mode level
     if (thiscpu->cpu_stack.top == 1) {break;}
-if (verbose) fprintf(stdout, "-%d  dummy return from %s\n",
+if (verbose) fprintf(outfile, "-%d  dummy return from %s\n",
 event.cpu, thiscpu->cpu_stack.name[thiscpu->cpu_stack.top].c_str());
     --thiscpu->cpu_stack.top;
   }
@@ -1475,7 +1501,7 @@ void WaitBeforeWakeup(const OneSpan& event, CPUState* cpustate, PerPidState* per
 
     // Don't clutter if the waiting is short (say < 10 usec)
     if (thiscpu->cur_span.duration >= kMIN_WAIT_DURATION) {
-      WriteSpanJson(stdout, thiscpu);	// Standalone wait_cpu span
+      WriteSpanJson(outfile, thiscpu);	// Standalone wait_cpu span
     }
     thiscpu->cur_span = temp_span;		// Restore
   }
@@ -1504,8 +1530,8 @@ void SwapStacks(int oldpid, int newpid, const string& name, CPUState* thiscpu, P
     (*perpidstate)[oldpid] = thiscpu->cpu_stack;
   }
 if (verbose) {
-fprintf(stdout, "SwapStacks old %d: ", oldpid);
-DumpStackShort(stdout, &thiscpu->cpu_stack);
+fprintf(outfile, "SwapStacks old %d: ", oldpid);
+DumpStackShort(outfile, &thiscpu->cpu_stack);
 }
   if (perpidstate->find(newpid) == perpidstate->end()) {
     // Switching to a thread we haven't seen before. Should only happen at trace start.
@@ -1516,9 +1542,9 @@ DumpStackShort(stdout, &thiscpu->cpu_stack);
   thiscpu->cpu_stack = (*perpidstate)[newpid];
 
 if (verbose) {
- fprintf(stdout, "new %d: ", newpid);
- DumpStackShort(stdout, &thiscpu->cpu_stack);
- fprintf(stdout, "\n");
+ fprintf(outfile, "new %d: ", newpid);
+ DumpStackShort(outfile, &thiscpu->cpu_stack);
+ fprintf(outfile, "\n");
  }
 }
 
@@ -1532,13 +1558,13 @@ void FixupAmbiguousSpan(const OneSpan& event,
   if (thiscpu->cpu_stack.ambiguous < thiscpu->cpu_stack.top) {return;}
 
 if (verbose) {
-DumpStackShort(stdout, &thiscpu->cpu_stack);
-fprintf(stdout, " ===ambiguous at %s :\n", event.name.c_str());
+DumpStackShort(outfile, &thiscpu->cpu_stack);
+fprintf(outfile, " ===ambiguous at %s :\n", event.name.c_str());
 }
   if (OnlyInKernelMode(event)) {
     thiscpu->cpu_stack.ambiguous = 0;
     // Span was set to top of stack, so we are all done
-if (verbose) fprintf(stdout, "=== resolved kernel\n");
+if (verbose) fprintf(outfile, "=== resolved kernel\n");
     return;
   }
   if (OnlyInUserMode(event)) {
@@ -1547,11 +1573,11 @@ if (verbose) fprintf(stdout, "=== resolved kernel\n");
     thiscpu->cpu_stack.top = 0;
     thiscpu->cur_span.eventnum = thiscpu->cpu_stack.eventnum[0];
     thiscpu->cur_span.name = thiscpu->cpu_stack.name[0];
-if (verbose) fprintf(stdout, "=== resolved user\n");
+if (verbose) fprintf(outfile, "=== resolved user\n");
     return;
   }
   // If neither, leave ambiguous. Span shows top of stack
-if (verbose) fprintf(stdout, "=== unresolved\n");
+if (verbose) fprintf(outfile, "=== unresolved\n");
 }
 
 uint64 PackLock(int lockhash, int pid) {
@@ -1572,7 +1598,7 @@ void WriteFreqSpan(uint64 start_ts, uint64 end_ts, uint64 cpu, uint64 freq) {
   event.retval = 0;
   event.ipc = 0;
   event.name = string("-freq-");
-  WriteEventJson(stdout, &event);
+  WriteEventJson(outfile, &event);
 }
 
 
@@ -1590,24 +1616,24 @@ void ProcessEvent(const OneSpan& event,
   CPUState* thiscpu = &cpustate[event.cpu];
 
   if (verbose) {
-    fprintf(stdout, "zz[%d] %llu %llu %03x(%d)=%d %s ",
+    fprintf(outfile, "zz[%d] %llu %llu %03x(%d)=%d %s ",
           event.cpu, event.start_ts, event.duration,
           event.eventnum, event.arg, event.retval, event.name.c_str());
-    DumpEvent(stdout, "", event);
-    DumpShort(stdout, &cpustate[event.cpu]);
+    DumpEvent(outfile, "", event);
+    DumpShort(outfile, &cpustate[event.cpu]);
   }
 
   // Remember last instance of each PID
   // We want to do this for the events that finish execution spans
   if ((event.pid > 0) && (event.cpu >= 0)) {
     priorPidEvent[event.pid] = event;
-//fprintf(stdout, "~~ ~~ priorPidEvent[%d] = %llu\n", event.pid, event.start_ts);
+//fprintf(outfile, "~~ ~~ priorPidEvent[%d] = %llu\n", event.pid, event.start_ts);
   }
 
   // Remember that there is no pending context switch
   if (IsSchedCallEvent(event) || IsSchedReturnEvent(event)) {
     thiscpu->ctx_switch_ts = 0;
-//fprintf(stdout, "~~ ~~ ctx_switch_ts[%d] = 0\n", event.cpu);
+//fprintf(outfile, "~~ ~~ ctx_switch_ts[%d] = 0\n", event.cpu);
   }
 
   // Keep track of which PIDs are currently running
@@ -1619,7 +1645,7 @@ void ProcessEvent(const OneSpan& event,
     if (thiscpu->cpu_stack.rpcid != 0) {
       OneSpan temp_span;
       MakeRpcidMidSpan(event.start_ts, event.cpu, event.pid, thiscpu->cpu_stack.rpcid, &temp_span);
-      WriteSpanJson2(stdout, &temp_span);
+      WriteSpanJson2(outfile, &temp_span);
     }
   }
 
@@ -1638,9 +1664,9 @@ void ProcessEvent(const OneSpan& event,
     if (thiscpu->valid_span) {
       // Prior span stops here 					--------^^^^^^^^
       FinishSpan(event, &thiscpu->cur_span);
-      WriteSpanJson(stdout, thiscpu);	// Previous span
+      WriteSpanJson(outfile, thiscpu);	// Previous span
     }
-    WriteEventJson(stdout, &event);	// Standalone mark
+    WriteEventJson(outfile, &event);	// Standalone mark
 
 // This is looking just like IsAMark
 // Just update the still-open span start
@@ -1664,16 +1690,16 @@ void ProcessEvent(const OneSpan& event,
 
     // Remember this pending context switch time, in case /sched is missing
     thiscpu->ctx_switch_ts = event.start_ts;
-//fprintf(stdout, "~~ ~~ ctx_switch_ts[%d] = %llu\n", event.cpu, event.start_ts);
+//fprintf(outfile, "~~ ~~ ctx_switch_ts[%d] = %llu\n", event.cpu, event.start_ts);
 
     // Mark the old stack ambiguous if inside kernel code
     thiscpu->cpu_stack.ambiguous = 0;
-if (verbose) DumpStackShort(stdout, &thiscpu->cpu_stack);
+if (verbose) DumpStackShort(outfile, &thiscpu->cpu_stack);
     if (2 <= thiscpu->cpu_stack.top) {
       // Scheduler entered from within a kernel routine
       // stack such as: 2{mystery25.3950 read -sched- }0
       // Record the subscript of the ambiguous stack entry just before -sched-
-if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %s\n", event.name.c_str());
+if (verbose) fprintf(outfile, " ===marking old stack ambiguous at ctx_switch to %s\n", event.name.c_str());
       thiscpu->cpu_stack.ambiguous = thiscpu->cpu_stack.top - 1;
     }
 
@@ -1714,7 +1740,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
       OneSpan event1 = event;
       event1.start_ts = thiscpu->prior_pc_samp_ts;
       event1.duration = event.start_ts - event1.start_ts;
-      WriteEventJson(stdout, &event1);
+      WriteEventJson(outfile, &event1);
     }
     thiscpu->prior_pc_samp_ts = event.start_ts;
     return;
@@ -1769,9 +1795,9 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     if (thiscpu->valid_span) {
       // Prior span stops here 					--------^^^^^^^^
       FinishSpan(event, &thiscpu->cur_span);
-      WriteSpanJson(stdout, thiscpu);	// Previous span
+      WriteSpanJson(outfile, thiscpu);	// Previous span
     }
-    WriteEventJson(stdout, &event);	// Standalone mark/mwait/etc.
+    WriteEventJson(outfile, &event);	// Standalone mark/mwait/etc.
     // Continue what we were doing, with new start_ts
     thiscpu->cur_span.start_ts = event.start_ts + event.duration;
 
@@ -1796,7 +1822,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
   
   } else if (IsAPointEvent(event)) {	// Marks do not end up here due to test just above
  
-    WriteEventJson(stdout, &event);	// Standalone point event
+    WriteEventJson(outfile, &event);	// Standalone point event
 
 // Things that can happen in the trace
 // 1) CPU A releases lock, spinning CPU B acquires it immediately, produces ACQ trace entry, then A produces REL entry 10-20ns later
@@ -1839,7 +1865,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
           OneSpan temp_span;
           MakeLockSpan(dots, start_ts, end_ts, event.pid,
                        lockhash, lockname, &temp_span);
-          WriteSpanJson2(stdout, &temp_span);
+          WriteSpanJson2(outfile, &temp_span);
         }
       }
       // Remember that this PID now holds this lock
@@ -1866,7 +1892,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
           OneSpan temp_span;
           MakeLockSpan(dots, start_ts, end_ts, event.pid,
                        lockhash, lockname, &temp_span);
-          WriteSpanJson2(stdout, &temp_span);
+          WriteSpanJson2(outfile, &temp_span);
         }
       }
       // This PID is no longer interested in the lock
@@ -1897,7 +1923,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     // Suppress idle spans of length zero or exactly 10ns
     bool suppress = ((thiscpu->cur_span.duration <= 1) && 
                      IsAnIdlenum(thiscpu->cur_span.eventnum));
-    if (!suppress) {WriteSpanJson(stdout, thiscpu);}	// Previous span
+    if (!suppress) {WriteSpanJson(outfile, thiscpu);}	// Previous span
   }
 
   // Connect wakeup event to new span if the PID matches
@@ -1906,7 +1932,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     // Make a wakeup arc
     OneSpan temp_span = thiscpu->cur_span;	// Save
     MakeArcSpan(pendingWakeup[event.pid], event, &thiscpu->cur_span);
-    WriteSpanJson(stdout, thiscpu);	// Standalone arc span
+    WriteSpanJson(outfile, thiscpu);	// Standalone arc span
     // Consume the pending wakeup
     pendingWakeup.erase(event.pid);
     thiscpu->cur_span = temp_span;		// Restore
@@ -1923,7 +1949,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     priorPidEnd[event.pid] = event.start_ts + event.duration;
     // Don't clutter if the waiting is short (say < 10 usec)
     if (thiscpu->cur_span.duration >= kMIN_WAIT_DURATION) {
-      WriteSpanJson(stdout, thiscpu);	// Standalone wait_cpu span
+      WriteSpanJson(outfile, thiscpu);	// Standalone wait_cpu span
     }
     thiscpu->cur_span = temp_span;		// Restore
   }
@@ -1944,7 +1970,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
       thiscpu->cur_span.duration = event.duration;
       // Note: Optimized call/ret, prior span ipc in ipc<3:0>, current span in ipc<7:4>
       thiscpu->cur_span.ipc = (event.ipc >> 4) & ipc_mask;
-      WriteSpanJson(stdout, thiscpu);	// Standalone call-return span
+      WriteSpanJson(outfile, thiscpu);	// Standalone call-return span
       // Continue what we were doing, with new start_ts
       thiscpu->cur_span = oldspan;
       thiscpu->cur_span.start_ts = event.start_ts + event.duration;
@@ -1977,7 +2003,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
   } else {
     // c-exit and other synthesized items
     // Make it a standalone span and go back to what was running
-    WriteEventJson(stdout, &event);
+    WriteEventJson(outfile, &event);
     // Continue what we were doing, with new start_ts
     StartSpan(event, &thiscpu->cur_span);  // New start 	--------vvvvvvvv
     thiscpu->valid_span = true;
@@ -1992,7 +2018,7 @@ void InsertEvent(const OneSpan& event,
                  CPUState* cpustate,
                  PerPidState* perpidstate) {
   if (verbose) {
-    DumpEvent(stdout, "insert:", event);
+    DumpEvent(outfile, "insert:", event);
   }
   ProcessEvent(event, cpustate, perpidstate);
 }
@@ -2099,7 +2125,7 @@ bool FixupReturn(uint64 new_start_ts,
     // Insert dummy returns at now until TOS = X (we don't know the retval)
     while (thiscpu_stack->eventnum[thiscpu_stack->top] != matching_callnum) {
       // Return now from TOS
-if(verbose){fprintf(stdout, "InsertReturnAt 1\n");}
+if(verbose){fprintf(outfile, "InsertReturnAt 1\n");}
       InsertReturnAt(event.start_ts, event, cpustate, perpidstate);
     }
     return true;
@@ -2110,7 +2136,7 @@ if(verbose){fprintf(stdout, "InsertReturnAt 1\n");}
   // Insert dummy returns at new_start_ts until nesting X is OK (we don't know the retval)
   while (NestLevel(matching_callnum) <= NestLevel(thiscpu_stack->eventnum[thiscpu_stack->top])) {
     // Return at span_start_ts from TOS
-if(verbose){fprintf(stdout, "InsertReturnAt 2\n");}
+if(verbose){fprintf(outfile, "InsertReturnAt 2\n");}
     InsertReturnAt(new_start_ts, event, cpustate, perpidstate);
   }
 
@@ -2130,7 +2156,7 @@ bool FixupCall(uint64 new_start_ts,
   // Insert dummy returns at new_start_ts until nesting X is OK (we don't know the retval)
   while (NestLevel(matching_callnum) <= NestLevel(thiscpu_stack->eventnum[thiscpu_stack->top])) {
     // Return at span_start_ts from TOS
-if(verbose){fprintf(stdout, "InsertReturnAt 3: %d %d\n", matching_callnum, thiscpu_stack->eventnum[thiscpu_stack->top]);}
+if(verbose){fprintf(outfile, "InsertReturnAt 3: %d %d\n", matching_callnum, thiscpu_stack->eventnum[thiscpu_stack->top]);}
     InsertReturnAt(new_start_ts, event, cpustate, perpidstate);
   }
   return true;
@@ -2159,7 +2185,7 @@ bool FixupSched(uint64 new_start_ts,
   int matching_callnum = RetToCall(event.eventnum);
 
   // Return at new_start_ts from TOS
-if(verbose){fprintf(stdout, "InsertReturnAt 4\n");}
+if(verbose){fprintf(outfile, "InsertReturnAt 4\n");}
   InsertReturnAt(new_start_ts, event, cpustate, perpidstate);
   ////--thiscpu_stack->top;
   return true;
@@ -2200,7 +2226,7 @@ bool FixupCexit(uint64 new_start_ts,
 
   // Inserting the c-exit will shorten the pending idle
   ////thiscpu->cur_span.duration -= exit_latency;
-////fprintf(stdout, "~~duration[%d] -= %llu = %llu\n", 
+////fprintf(outfile, "~~duration[%d] -= %llu = %llu\n", 
 //// event.cpu, exit_latency, thiscpu->cur_span.duration);
 
   // Insert c-exit call/ret
@@ -2361,7 +2387,7 @@ void PreProcessEvent(const OneSpan& event,
     // We are at X
     keep &= FixupCexit(event.start_ts, event, cpustate, perpidstate);
     cpustate[event.cpu].mwait_pending = -1;		// None pending
-//fprintf(stdout, "~~mwait_pending[%d] = %d\n", event.cpu, 0);
+//fprintf(outfile, "~~mwait_pending[%d] = %d\n", event.cpu, 0);
   }
 
   //   - Insert any missing names
@@ -2375,32 +2401,32 @@ void PreProcessEvent(const OneSpan& event,
   // We want to do this for the events that finish execution spans
   if ((event.pid > 0) && (event.cpu >= 0)) {
     priorPidEvent[event.pid] = event;
-//fprintf(stdout, "~~priorPidEvent[%d] = %llu\n", event.pid, event.start_ts);
+//fprintf(outfile, "~~priorPidEvent[%d] = %llu\n", event.pid, event.start_ts);
   }
 
   // Remember that there is no pending context switch, for FixupSched
   if (IsSchedCallEvent(event) || IsSchedReturnEvent(event)) {
     thiscpu->ctx_switch_ts = 0;
-//fprintf(stdout, "~~ctx_switch_ts[%d] = 0\n", event.cpu);
+//fprintf(outfile, "~~ctx_switch_ts[%d] = 0\n", event.cpu);
   }
 
   if (IsAContextSwitch(event)) {		// for FixupSched
     // Remember this pending context switch time, in case /sched is missing
     thiscpu->ctx_switch_ts = event.start_ts;
-//fprintf(stdout, "~~ctx_switch_ts[%d] = %llu\n", event.cpu, event.start_ts);
+//fprintf(outfile, "~~ctx_switch_ts[%d] = %llu\n", event.cpu, event.start_ts);
   }
 
   // Remember any mwait by cpu, for drawing c-state exit sine wave
   if (IsAnMwait(event)) {			// For FixupCexit
     thiscpu->mwait_pending = event.arg;
-//fprintf(stdout, "~~mwait_pending[%d] = %d\n", event.cpu, event.arg);
+//fprintf(outfile, "~~mwait_pending[%d] = %d\n", event.cpu, event.arg);
   }
 
   // Remember any failed lock acquire event, for wait_lock
   if (event.eventnum == KUTRACE_LOCKNOACQUIRE) {
     pendingLock[event.arg] = event;
     priorPidLock[event.pid] = event.arg;
-//fprintf(stdout, "~~priorPidLock[%d] = %d\n", event.pid, event.arg);
+//fprintf(outfile, "~~priorPidLock[%d] = %d\n", event.pid, event.arg);
   }
 
   // Enqueue/dequeue processing: make a queue span per RPC
@@ -2435,7 +2461,7 @@ void PreProcessEvent(const OneSpan& event,
       thiscpu->cpu_stack.dequeue_num_pending = -1;
       // Don't clutter if the queued waiting is short (say < 10 usec)
       if (temp_span.duration >= kMIN_WAIT_DURATION) {
-        WriteSpanJson2(stdout, &temp_span);	// Standalone queued span
+        WriteSpanJson2(outfile, &temp_span);	// Standalone queued span
       }
     }
   }
@@ -2612,13 +2638,13 @@ void RecordPidName(int64 temp_ts, int temp_arg,
   if (pidnames.find(temp_arg) == pidnames.end()) {
     // No name for this PID seen before
     pidnames[temp_arg] = temp_name_str;
-//fprintf(stdout, "%lld NAME1[%d %d] = %s\n", temp_ts, temp_arg, temp_arg & 0xFFFF, pidnames[temp_arg].c_str());
+//fprintf(outfile, "%lld NAME1[%d %d] = %s\n", temp_ts, temp_arg, temp_arg & 0xFFFF, pidnames[temp_arg].c_str());
     return;
   }
 
   // A different name for this PID was seen before
   if (pidnames[temp_arg] != temp_name_str) {
-//fprintf(stdout, "%lld NAME2[%d %d] %s => %s\n", 
+//fprintf(outfile, "%lld NAME2[%d %d] %s => %s\n", 
 //temp_ts, temp_arg, temp_arg & 0xFFFF, pidnames[temp_arg].c_str(), temp_name_str.c_str());
        pidnames[temp_arg] = temp_name_str;
   }
@@ -2631,7 +2657,7 @@ void FixPidName(OneSpan* eventp) {
   // Force in the current name from pidnames[pid]
   int pid = EventnumToPid(eventp->eventnum);
   if (pidnames.find(pid) != pidnames.end()) {
-//fprintf(stdout, "    %s => %s\n", eventp->name.c_str(), NameAppendPid(pidnames[pid], pid).c_str());
+//fprintf(outfile, "    %s => %s\n", eventp->name.c_str(), NameAppendPid(pidnames[pid], pid).c_str());
     eventp->name = NameAppendPid(pidnames[pid], pid);
     // Also update the stacked name for this pid
     // also update the span name for this pid
@@ -2673,6 +2699,409 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
   return true;
 }
 
+//
+// Checkpoint and resume
+//
+// For a growing trace, we can process just the newly-appended events instead
+// of starting over. Run the first chunk of sorted events with
+//   eventtospan3 "title" -checkpoint foo.ckpt
+// and each later chunk with
+//   eventtospan3 "title" -resume foo.ckpt -checkpoint foo.ckpt
+// leaving off -checkpoint for the final chunk. Each later chunk's events must
+// all be at or after the last timestamp of the prior chunk, and every chunk
+// must be run with -ticks or every chunk without it.
+//
+// The checkpoint has the complete reconstruction state: per-CPU and per-PID
+// stacks, names, pending wakeup/lock/RPC correlation state, and the main-loop
+// timestamps. A run that writes a checkpoint omits the end-of-trace JSON
+// (final frequency spans, mbit_sec, row names, end marker), and a resumed run
+// omits the initial JSON header, so that
+//   cat chunk1.json chunk2.json ... |sort
+// is identical to sorting the output of one run over all the events.
+//
+// The file is Ascii: whitespace-separated numbers, with strings as len:bytes
+// and doubles in %a hex so they round-trip exactly.
+//
+
+static const char* kCheckpointVersion = "eventtospan3_checkpoint_2";
+
+void CkFail(const char* what) {
+  fprintf(stderr, "eventtospan3: bad checkpoint file at %s\n", what);
+  exit(0);
+}
+
+void CkPutTag(FILE* f, const char* tag) {fprintf(f, "\n%s ", tag);}
+void CkPutU64(FILE* f, uint64 x) {fprintf(f, "%llu ", x);}
+void CkPutInt(FILE* f, int x) {fprintf(f, "%d ", x);}
+void CkPutDouble(FILE* f, double x) {fprintf(f, "%a ", x);}
+void CkPutString(FILE* f, const string& s) {
+  fprintf(f, "%d:", (int)s.size());
+  fwrite(s.data(), 1, s.size(), f);
+  fprintf(f, " ");
+}
+
+void CkGetTag(FILE* f, const char* tag) {
+  char temp[64];
+  if ((fscanf(f, "%63s", temp) != 1) || (strcmp(temp, tag) != 0)) {CkFail(tag);}
+}
+uint64 CkGetU64(FILE* f) {
+  uint64 x;
+  if (fscanf(f, "%llu", &x) != 1) {CkFail("u64");}
+  return x;
+}
+int CkGetInt(FILE* f) {
+  int x;
+  if (fscanf(f, "%d", &x) != 1) {CkFail("int");}
+  return x;
+}
+double CkGetDouble(FILE* f) {
+  double x;
+  if (fscanf(f, "%la", &x) != 1) {CkFail("double");}
+  return x;
+}
+string CkGetString(FILE* f) {
+  int len;
+  if ((fscanf(f, " %d:", &len) != 1) || (len < 0)) {CkFail("string");}
+  string s(len, ' ');
+  if ((len > 0) && (fread(&s[0], 1, len, f) != len)) {CkFail("string");}
+  return s;
+}
+
+void CkPutSpan(FILE* f, const OneSpan& s) {
+  CkPutU64(f, s.start_ts);
+  CkPutU64(f, s.duration);
+  CkPutInt(f, s.cpu);
+  CkPutInt(f, s.pid);
+  CkPutInt(f, s.rpcid);
+  CkPutInt(f, s.eventnum);
+  CkPutInt(f, s.arg);
+  CkPutInt(f, s.retval);
+  CkPutInt(f, s.ipc);
+  CkPutString(f, s.name);
+}
+
+void CkGetSpan(FILE* f, OneSpan* s) {
+  s->start_ts = CkGetU64(f);
+  s->duration = CkGetU64(f);
+  s->cpu = CkGetInt(f);
+  s->pid = CkGetInt(f);
+  s->rpcid = CkGetInt(f);
+  s->eventnum = CkGetInt(f);
+  s->arg = CkGetInt(f);
+  s->retval = CkGetInt(f);
+  s->ipc = CkGetInt(f);
+  s->name = CkGetString(f);
+}
+
+void CkPutPidState(FILE* f, const PidState& t) {
+  CkPutInt(f, t.ambiguous);
+  CkPutInt(f, t.rpcid);
+  CkPutInt(f, t.enqueue_num_pending);
+  CkPutInt(f, t.dequeue_num_pending);
+  CkPutInt(f, t.top);
+  for (int i = 0; i < 5; ++i) {
+    CkPutInt(f, t.eventnum[i]);
+    CkPutString(f, t.name[i]);
+  }
+}
+
+void CkGetPidState(FILE* f, PidState* t) {
+  t->ambiguous = CkGetInt(f);
+  t->rpcid = CkGetInt(f);
+  t->enqueue_num_pending = CkGetInt(f);
+  t->dequeue_num_pending = CkGetInt(f);
+  t->top = CkGetInt(f);
+  for (int i = 0; i < 5; ++i) {
+    t->eventnum[i] = CkGetInt(f);
+    t->name[i] = CkGetString(f);
+  }
+}
+
+void CkPutIntName(FILE* f, const char* tag, const IntName& m) {
+  CkPutTag(f, tag);
+  CkPutInt(f, m.size());
+  for (IntName::const_iterator it = m.begin(); it != m.end(); ++it) {
+    CkPutInt(f, it->first);
+    CkPutString(f, it->second);
+  }
+}
+
+void CkGetIntName(FILE* f, const char* tag, IntName* m) {
+  CkGetTag(f, tag);
+  m->clear();
+  int n = CkGetInt(f);
+  for (int i = 0; i < n; ++i) {
+    int key = CkGetInt(f);
+    (*m)[key] = CkGetString(f);
+  }
+}
+
+void CkPutPidWakeup(FILE* f, const char* tag, const PidWakeup& m) {
+  CkPutTag(f, tag);
+  CkPutInt(f, m.size());
+  for (PidWakeup::const_iterator it = m.begin(); it != m.end(); ++it) {
+    CkPutInt(f, it->first);
+    CkPutSpan(f, it->second);
+  }
+}
+
+void CkGetPidWakeup(FILE* f, const char* tag, PidWakeup* m) {
+  CkGetTag(f, tag);
+  m->clear();
+  int n = CkGetInt(f);
+  for (int i = 0; i < n; ++i) {
+    int key = CkGetInt(f);
+    CkGetSpan(f, &(*m)[key]);
+  }
+}
+
+// Works for any map of integer to integer
+template <typename T> void CkPutIntMap(FILE* f, const char* tag, const T& m) {
+  CkPutTag(f, tag);
+  CkPutInt(f, m.size());
+  for (typename T::const_iterator it = m.begin(); it != m.end(); ++it) {
+    CkPutU64(f, it->first);
+    CkPutU64(f, it->second);
+  }
+}
+
+template <typename T> void CkGetIntMap(FILE* f, const char* tag, T* m) {
+  CkGetTag(f, tag);
+  m->clear();
+  int n = CkGetInt(f);
+  for (int i = 0; i < n; ++i) {
+    uint64 key = CkGetU64(f);
+    (*m)[key] = CkGetU64(f);
+  }
+}
+
+void CkPutHashToCorr(FILE* f, const char* tag, const HashToCorr& m) {
+  CkPutTag(f, tag);
+  CkPutInt(f, m.size());
+  for (HashToCorr::const_iterator it = m.begin(); it != m.end(); ++it) {
+    CkPutU64(f, it->first);
+    CkPutU64(f, it->second.k_timestamp);
+    CkPutU64(f, it->second.pid);
+  }
+}
+
+void CkGetHashToCorr(FILE* f, const char* tag, HashToCorr* m) {
+  CkGetTag(f, tag);
+  m->clear();
+  int n = CkGetInt(f);
+  for (int i = 0; i < n; ++i) {
+    uint32 key = CkGetU64(f);
+    HashCorr* h = &(*m)[key];
+    h->k_timestamp = CkGetU64(f);
+    h->pid = CkGetU64(f);
+  }
+}
+
+// Write everything needed to continue later exactly where we left off
+void WriteCheckpoint(const char* fname, const CPUState* cpustate, const PerPidState& perpidstate,
+                     const string& trace_label, const string& trace_timeofday,
+                     uint64 lowest_ts, uint64 prior_ts, int linenum, const OneSpan& event) {
+  FILE* f = fopen(fname, "w");
+  if (f == NULL) {
+    fprintf(stderr, "eventtospan3: %s did not open\n", fname);
+    exit(0);
+  }
+  fprintf(f, "%s", kCheckpointVersion);
+
+  CkPutTag(f, "loop");
+  CkPutString(f, trace_label);
+  CkPutString(f, trace_timeofday);
+  CkPutU64(f, lowest_ts);
+  CkPutU64(f, prior_ts);
+  CkPutInt(f, linenum);
+  CkPutSpan(f, event);
+
+  CkPutTag(f, "globals");
+  CkPutU64(f, ticks_per_sec);
+  CkPutInt(f, is_rpi);
+  CkPutInt(f, is_low_res_ts);
+  CkPutString(f, kernel_version);
+  CkPutString(f, cpu_model_name);
+  CkPutString(f, host_name);
+  CkPutInt(f, mbit_sec);
+  CkPutInt(f, max_cpu_seen);
+  CkPutU64(f, span_count);
+  CkPutInt(f, incoming_version);
+  CkPutInt(f, incoming_flags);
+  CkPutDouble(f, total_usermode);
+  CkPutDouble(f, total_idle);
+  CkPutDouble(f, total_kernelmode);
+  CkPutDouble(f, total_other);
+
+  CkPutTag(f, "cpustate");
+  CkPutInt(f, kMAX_CPUS);
+  for (int i = 0; i < kMAX_CPUS; ++i) {
+    const CPUState* c = &cpustate[i];
+    fprintf(f, "\n");
+    CkPutPidState(f, c->cpu_stack);
+    CkPutSpan(f, c->cur_span);
+    CkPutU64(f, c->prior_pstate_ts);
+    CkPutU64(f, c->prior_pstate_freq);
+    CkPutU64(f, c->prior_pc_samp_ts);
+    CkPutU64(f, c->ctx_switch_ts);
+    CkPutInt(f, c->mwait_pending);
+    CkPutInt(f, c->oldpid);
+    CkPutInt(f, c->newpid);
+    CkPutInt(f, c->valid_span);
+  }
+
+  CkPutTag(f, "perpidstate");
+  CkPutInt(f, perpidstate.size());
+  for (PerPidState::const_iterator it = perpidstate.begin(); it != perpidstate.end(); ++it) {
+    fprintf(f, "\n");
+    CkPutInt(f, it->first);
+    CkPutPidState(f, it->second);
+  }
+
+  CkPutIntName(f, "queuenames", queuenames);
+  CkPutIntMap(f, "enqueuetime", enqueuetime);
+  CkPutIntName(f, "methodnames", methodnames);
+  CkPutTag(f, "pidtocorr");
+  CkPutInt(f, pidtocorr.size());
+  for (PidToCorr::const_iterator it = pidtocorr.begin(); it != pidtocorr.end(); ++it) {
+    CkPutU64(f, it->first);
+    CkPutU64(f, it->second.k_timestamp);
+    CkPutU64(f, it->second.rpcid);
+    CkPutU64(f, it->second.lglen8);
+    CkPutInt(f, it->second.rx);
+  }
+  CkPutHashToCorr(f, "rx_hashtocorr", rx_hashtocorr);
+  CkPutHashToCorr(f, "tx_hashtocorr", tx_hashtocorr);
+  CkPutIntName(f, "pidnames", pidnames);
+  CkPutIntName(f, "pidrownames", pidrownames);
+  CkPutPidWakeup(f, "pendingWakeup", pendingWakeup);
+  CkPutPidWakeup(f, "priorPidEvent", priorPidEvent);
+  CkPutIntMap(f, "priorPidEnd", priorPidEnd);
+  CkPutIntMap(f, "priorPidLock", priorPidLock);
+  CkPutIntName(f, "locknames", locknames);
+  CkPutTag(f, "lockpending");
+  CkPutInt(f, lockpending.size());
+  for (LockPending::const_iterator it = lockpending.begin(); it != lockpending.end(); ++it) {
+    CkPutU64(f, it->first);
+    CkPutU64(f, it->second.start_ts);
+    CkPutInt(f, it->second.pid);
+    CkPutInt(f, it->second.eventnum);
+  }
+  CkPutPidWakeup(f, "pendingLock", pendingLock);
+  CkPutIntMap(f, "pendingKernelRx", pendingKernelRx);
+  CkPutIntMap(f, "pidRunning", pidRunning);
+  CkPutTag(f, "end");
+  fprintf(f, "\n");
+  fclose(f);
+}
+
+// Restore everything written by WriteCheckpoint
+void ReadCheckpoint(const char* fname, CPUState* cpustate, PerPidState* perpidstate,
+                    string* trace_label, string* trace_timeofday,
+                    uint64* lowest_ts, uint64* prior_ts, int* linenum, OneSpan* event) {
+  FILE* f = fopen(fname, "r");
+  if (f == NULL) {
+    fprintf(stderr, "eventtospan3: %s did not open\n", fname);
+    exit(0);
+  }
+  CkGetTag(f, kCheckpointVersion);
+
+  CkGetTag(f, "loop");
+  *trace_label = CkGetString(f);
+  *trace_timeofday = CkGetString(f);
+  *lowest_ts = CkGetU64(f);
+  *prior_ts = CkGetU64(f);
+  *linenum = CkGetInt(f);
+  CkGetSpan(f, event);
+
+  CkGetTag(f, "globals");
+  // Every chunk must use the same time units, or the output mixes them
+  int64 checkpoint_ticks_per_sec = CkGetU64(f);
+  if (checkpoint_ticks_per_sec != ticks_per_sec) {
+    fprintf(stderr, "eventtospan3: %s was written %s -ticks; resume %s it\n", fname,
+            (checkpoint_ticks_per_sec == 0) ? "without" : "with",
+            (checkpoint_ticks_per_sec == 0) ? "without" : "with");
+    exit(0);
+  }
+  is_rpi = CkGetInt(f);
+  is_low_res_ts = CkGetInt(f);
+  kernel_version = CkGetString(f);
+  cpu_model_name = CkGetString(f);
+  host_name = CkGetString(f);
+  mbit_sec = CkGetInt(f);
+  max_cpu_seen = CkGetInt(f);
+  span_count = CkGetU64(f);
+  incoming_version = CkGetInt(f);
+  incoming_flags = CkGetInt(f);
+  total_usermode = CkGetDouble(f);
+  total_idle = CkGetDouble(f);
+  total_kernelmode = CkGetDouble(f);
+  total_other = CkGetDouble(f);
+
+  CkGetTag(f, "cpustate");
+  if (CkGetInt(f) != kMAX_CPUS) {CkFail("kMAX_CPUS");}
+  for (int i = 0; i < kMAX_CPUS; ++i) {
+    CPUState* c = &cpustate[i];
+    CkGetPidState(f, &c->cpu_stack);
+    CkGetSpan(f, &c->cur_span);
+    c->prior_pstate_ts = CkGetU64(f);
+    c->prior_pstate_freq = CkGetU64(f);
+    c->prior_pc_samp_ts = CkGetU64(f);
+    c->ctx_switch_ts = CkGetU64(f);
+    c->mwait_pending = CkGetInt(f);
+    c->oldpid = CkGetInt(f);
+    c->newpid = CkGetInt(f);
+    c->valid_span = CkGetInt(f);
+  }
+
+  CkGetTag(f, "perpidstate");
+  perpidstate->clear();
+  int n = CkGetInt(f);
+  for (int i = 0; i < n; ++i) {
+    int pid = CkGetInt(f);
+    CkGetPidState(f, &(*perpidstate)[pid]);
+  }
+
+  CkGetIntName(f, "queuenames", &queuenames);
+  CkGetIntMap(f, "enqueuetime", &enqueuetime);
+  CkGetIntName(f, "methodnames", &methodnames);
+  CkGetTag(f, "pidtocorr");
+  pidtocorr.clear();
+  n = CkGetInt(f);
+  for (int i = 0; i < n; ++i) {
+    uint32 pid = CkGetU64(f);
+    PidCorr* p = &pidtocorr[pid];
+    p->k_timestamp = CkGetU64(f);
+    p->rpcid = CkGetU64(f);
+    p->lglen8 = CkGetU64(f);
+    p->rx = CkGetInt(f);
+  }
+  CkGetHashToCorr(f, "rx_hashtocorr", &rx_hashtocorr);
+  CkGetHashToCorr(f, "tx_hashtocorr", &tx_hashtocorr);
+  CkGetIntName(f, "pidnames", &pidnames);
+  CkGetIntName(f, "pidrownames", &pidrownames);
+  CkGetPidWakeup(f, "pendingWakeup", &pendingWakeup);
+  CkGetPidWakeup(f, "priorPidEvent", &priorPidEvent);
+  CkGetIntMap(f, "priorPidEnd", &priorPidEnd);
+  CkGetIntMap(f, "priorPidLock", &priorPidLock);
+  CkGetIntName(f, "locknames", &locknames);
+  CkGetTag(f, "lockpending");
+  lockpending.clear();
+  n = CkGetInt(f);
+  for (int i = 0; i < n; ++i) {
+    uint64 key = CkGetU64(f);
+    LockContend* l = &lockpending[key];
+    l->start_ts = CkGetU64(f);
+    l->pid = CkGetInt(f);
+    l->eventnum = CkGetInt(f);
+  }
+  CkGetPidWakeup(f, "pendingLock", &pendingLock);
+  CkGetIntMap(f, "pendingKernelRx", &pendingKernelRx);
+  CkGetIntMap(f, "pidRunning", &pidRunning);
+  CkGetTag(f, "end");
+  fclose(f);
+}
+
 // We assign every nanosecond of each CPUs time to some time span.
 // Initially, all CPUs are assumed to be executing the idle job, pid=0
 // Any syscall/irq/trap pushes into that kernel code
@@ -2689,9 +3118,12 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
 // to make a correctly-nested set of time spans.
 
 //
-// Usage: eventtospan3 <event file name> [-v] [-t]
+// Usage: eventtospan3 <event file name> [-v] [-t] [-ticks] [-resume <file>] [-checkpoint <file>]
 //
-int main (int argc, const char** argv) {
+int EventToSpan3(int argc, const char** argv, FILE* in, FILE* out) {
+  infile = in;
+  outfile = out;
+
   CPUState cpustate[kMAX_CPUS];	// Running state for each CPU
   PerPidState perpidstate;	// Saved PID call stacks, for context switching
 
@@ -2705,6 +3137,8 @@ int main (int argc, const char** argv) {
   pidtocorr.clear();
   rx_hashtocorr.clear();
   tx_hashtocorr.clear();
+  const char* resume_fname = NULL;
+  const char* checkpoint_fname = NULL;
 
 
   if (argc >= 2) {
@@ -2717,6 +3151,9 @@ int main (int argc, const char** argv) {
     if (strcmp(argv[i], "-v") == 0) {verbose = true;}
     if (strcmp(argv[i], "-t") == 0) {trace = true;}
     if (strcmp(argv[i], "-rel0") == 0) {rel0 = true;}
+    if (strcmp(argv[i], "-ticks") == 0) {ticks_per_sec = kTicksPerSec;}
+    if ((strcmp(argv[i], "-resume") == 0) && (i < (argc - 1))) {resume_fname = argv[++i];}
+    if ((strcmp(argv[i], "-checkpoint") == 0) && (i < (argc - 1))) {checkpoint_fname = argv[++i];}
   }
 
   // Initialize CPU state
@@ -2751,8 +3188,15 @@ int main (int argc, const char** argv) {
   uint64 lowest_ts = 0;
   uint64 prior_ts = 0;
   int linenum = 0;
+
+  // Pick up where an earlier run on the preceding events left off
+  if (resume_fname != NULL) {
+    ReadCheckpoint(resume_fname, cpustate, &perpidstate, &trace_label, &trace_timeofday,
+                   &lowest_ts, &prior_ts, &linenum, &event);
+  }
+
   char buffer[kMaxBufferSize];
-  while (ReadLine(stdin, buffer, kMaxBufferSize)) {
+  while (ReadLine(infile, buffer, kMaxBufferSize)) {
     ++linenum;
     int len = strlen(buffer);
     if (buffer[0] == '\0') {continue;}
@@ -2771,7 +3215,7 @@ int main (int argc, const char** argv) {
           // since the timestamps are all relative to a minute boundary
           trace_timeofday = string(buffer, 6, 17) + "00";
           //fprintf(stderr, "eventtospan3: trace_timeofday '%s'\n", trace_timeofday.c_str());
-          InitialJson(stdout, trace_label.c_str(), trace_timeofday.c_str());
+          InitialJson(outfile, trace_label.c_str(), trace_timeofday.c_str());
       }
       // Pull version and flags out if present
       if (memcmp(buffer, "# ## VERSION: ", 14) == 0) {
@@ -2786,11 +3230,11 @@ int main (int argc, const char** argv) {
     }
 
     // Input created by:
-    //  fprintf(stdout, "%lld %lld %lld %lld  %lld %lld %lld %lld %d %s (%llx)\n",
+    //  fprintf(outfile, "%lld %lld %lld %lld  %lld %lld %lld %lld %d %s (%llx)\n",
     //          mhz, duration, event, current_cpu, current_pid[current_cpu], current_rpc[current_cpu],
     //          arg, retval, ipc, name.c_str(), event);
     // or if a name by
-    //    fprintf(stdout, "%lld %lld %lld %lld %s\n",
+    //    fprintf(outfile, "%lld %lld %lld %lld %s\n",
     //            mhz, duration, event, nameinsert, tempstring);
     //
 
@@ -2808,7 +3252,7 @@ int main (int argc, const char** argv) {
     char temp_name[64];
     sscanf(buffer, "%lld %llu %d %d %[ -~]", &temp_ts, &temp_dur, &temp_eventnum, &temp_arg, temp_name);
     if (IsNamedef(temp_eventnum)) {
-//fprintf(stdout, "====%%%s\n", buffer);
+//fprintf(outfile, "====%%%s\n", buffer);
       if (IsLockNameInt(temp_eventnum)) {		// Lock names
         locknames[temp_arg] = string(temp_name);
       } else if (IsKernelVerInt(temp_eventnum)) {
@@ -2873,10 +3317,10 @@ int main (int argc, const char** argv) {
     }
 
 if (verbose) {
-fprintf(stdout, "\n%% [%d] %llu %llu %03x(%d)=%d %s ",
+fprintf(outfile, "\n%% [%d] %llu %llu %03x(%d)=%d %s ",
         event.cpu, event.start_ts, event.duration,
         event.eventnum, event.arg, event.retval, event.name.c_str());
-DumpShort(stdout, &cpustate[event.cpu]);
+DumpShort(outfile, &cpustate[event.cpu]);
 }
 
     if ((lowest_ts == 0) && (0 < event.start_ts)) {
@@ -2934,6 +3378,15 @@ DumpShort(stdout, &cpustate[event.cpu]);
   // End main loop
   //
 
+  // If more events will follow, save state and leave the end-of-trace JSON to the last run
+  if (checkpoint_fname != NULL) {
+    WriteCheckpoint(checkpoint_fname, cpustate, perpidstate, trace_label, trace_timeofday,
+                    lowest_ts, prior_ts, linenum, event);
+    fprintf(stderr, "eventtospan3: %lld spans so far, checkpoint in %s\n",
+            span_count, checkpoint_fname);
+    return 0;
+  }
+
   // Flush the last frequency spans here
   for (int i = 0; i <= max_cpu_seen; ++i) {
     if (cpustate[i].prior_pstate_ts != 0) {
@@ -2944,20 +3397,20 @@ DumpShort(stdout, &cpustate[event.cpu]);
   }
 
   // Keep any hardware description. Leading space is required.
-  fprintf(stdout, " \"mbit_sec\" : %d,\n", mbit_sec);
+  fprintf(outfile, " \"mbit_sec\" : %d,\n", mbit_sec);
 
   // Put out any multi-named PID row names
   for (IntName::const_iterator it = pidrownames.begin(); it != pidrownames.end(); ++it) {
     int pid = it->first;
     string rowname = it->second;
-    double lowest_sec = lowest_ts / 100000000.0;
     if (rowname.find("+") != string::npos) {
-      fprintf(stdout, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s.%d\"],\n",
-          lowest_sec, 0.00000001, 0, pid, 0, KUTRACE_LEFTMARK, 0, 0, 0, rowname.c_str(), pid);
+      WriteJsonTimes(outfile, lowest_ts, 1);
+      fprintf(outfile, "%d, %d, %d, %d, %d, %d, %d, \"%s.%d\"],\n",
+          0, pid, 0, KUTRACE_LEFTMARK, 0, 0, 0, rowname.c_str(), pid);
     }
   }
 
-  FinalJson(stdout);
+  FinalJson(outfile);
 
   // Statistics for main timeline; no decorations, PCsamp, etc.
   double total_dur = total_usermode + total_idle + total_kernelmode;
@@ -2969,3 +3422,11 @@ DumpShort(stdout, &cpustate[event.cpu]);
 
   return 0;
 }
+
+}  // namespace eventtospan3
+
+#ifndef KUPOSTPROC
+int main (int argc, const char** argv) {
+  return eventtospan3::EventToSpan3(argc, argv, stdin, stdout);
+}
+#endif
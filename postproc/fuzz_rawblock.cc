@@ -0,0 +1,221 @@
+// Little program to feed random raw trace blocks through the rawblock.h decoder
+// and rawtoevent, looking for reads past the end of a block and for crashes
+//
+// Usage: fuzz_rawblock [-n <blocks>] [-seed <n>] [-o foo.trace]
+//   -n <blocks>  how many random blocks, default 1000
+//   -seed <n>    start of the pseudo-random sequence, default 1; the same
+//                seed always makes the same blocks
+//   -o foo.trace also keep the blocks as a raw trace, for checktrace -v
+//
+//   fuzz_rawblock -n 10000 -seed 7 -o fuzz.trace && checktrace -v fuzz.trace
+//
+// Each block is mostly plausible entries with increasing truncated times,
+// plus zero NOPs, names of every length nibble including bogus ones, PC
+// samples, TSDELTAs, mostly-FFFF and all-ones filler, and now and then
+// nothing but random words. Half the blocks end with a multi-word entry
+// that does not fit.
+//
+// Every block is walked in place at the very end of a buffer that is
+// followed by an inaccessible page, reading every word of every entry the
+// way rawtoevent and checktrace do, so a read past the block faults. The walk
+// checks that entries are contiguous and inside the block, and that the
+// up-front timestamp rebuild matches the entry-by-entry one. All the blocks
+// then go through rawtoevent, in this process, as one trace.
+//
+// Compile with g++ -O2 -DKUPOSTPROC fuzz_rawblock.cc rawtoevent.cc from_base40.cc -o fuzz_rawblock
+//
+
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "basetypes.h"
+#include "kupostproc.h"
+#include "kutrace_lib.h"
+#include "rawblock.h"
+
+static uint64 rng_state = 1;
+
+void Usage() {
+  fprintf(stderr, "Usage: fuzz_rawblock [-n <blocks>] [-seed <n>] [-o foo.trace]\n");
+  exit(0);
+}
+
+// xorshift64
+uint64 Rand() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+inline int RandBelow(int n) {return Rand() % n;}
+inline bool OneIn(int n) {return RandBelow(n) == 0;}
+
+inline uint64 MakeEntry(uint64 t, uint64 event, uint64 arg) {
+  return ((t & 0xfffff) << 44) | ((event & 0xfff) << 32) | (arg & 0xffffffff);
+}
+
+// Entry of one to eight nominal words at w[i], clipped to the block.
+// Returns the nominal length
+int RandomEntry(uint64 t, uint64* w, int i) {
+  uint64 event;
+  switch (RandBelow(8)) {
+  case 0:  w[i] = 0; return 1;
+  case 1:  event = KUTRACE_VARLENLO + RandBelow(KUTRACE_VARLENHI - KUTRACE_VARLENLO + 1); break;
+  case 2:  event = OneIn(2) ? KUTRACE_PC_U : (OneIn(2) ? KUTRACE_PC_K : KUTRACE_PC_TEMP); break;
+  case 3:  event = KUTRACE_TSDELTA; break;
+  case 4:  w[i] = 0xffffffff00000000LLU | (Rand() & 0xffffffff); return 1;	// Mostly-FFFF
+  default: event = RandBelow(0x1000); break;
+  }
+  w[i] = MakeEntry(t, event, Rand());
+  int len = (w[i] == 0) ? 1 : RawEventLen(event);
+  for (int k = 1; (k < len) && (i + k < kTraceBufSize); ++k) {w[i + k] = Rand();}
+  return len;
+}
+
+// Block headers are plausible, 50 counts per usec from a common start, so
+// that rawtoevent gets past the first block and decodes the rest
+void RandomBlock(int blocknum, uint64* w) {
+  uint64 base_cycle = 0x100000000LLU + blocknum * 50000LLU + RandBelow(50000);
+  w[0] = ((uint64)RandBelow(8) << 56) | base_cycle;
+  w[1] = (0x03LLU << 56) | (1600000000000000LLU + blocknum * 1000LLU);	// Version 3, no IPC
+  int header_words = (blocknum == 0) ? kFirstBlockHeader : kBlockHeader;
+  if (blocknum == 0) {
+    w[2] = base_cycle;
+    w[3] = w[1] & 0x00ffffffffffffffLLU;
+    w[4] = base_cycle + 50000000;
+    w[5] = w[3] + 1000000;
+    w[6] = w[7] = 0;
+  }
+  w[header_words] = Rand() & 0xffff;	// PID
+  w[header_words + 1] = 0;
+  memcpy(&w[header_words + 2], "fuzz_rawblock\0\0\0", 16);
+  int i = header_words + kPidHeader;
+
+  if (OneIn(8)) {
+    while (i < kTraceBufSize) {w[i++] = Rand();}
+    return;
+  }
+  uint64 t = base_cycle;
+  while (i < kTraceBufSize) {
+    if (OneIn(2000)) {
+      while (i < kTraceBufSize) {w[i++] = 0xffffffffffffffffLLU;}	// Filler to the end
+      break;
+    }
+    t += OneIn(500) ? Rand() : RandBelow(64);	// Now and then a wraparound or late store
+    i += RandomEntry(t, w, i);
+  }
+  if (OneIn(2)) {
+    // A name or PC sample in the last few words that does not fit
+    int last = kTraceBufSize - 1 - RandBelow(4);
+    uint64 event = OneIn(2) ? KUTRACE_PC_U : (0x080 | RandBelow(16));
+    w[last] = MakeEntry(t, event, Rand());
+    for (int k = last + 1; k < kTraceBufSize; ++k) {w[k] = Rand();}
+  }
+}
+
+// Walk the block the way the decoders do. Returns the number of problems
+int CheckBlock(const RawBlock& block, int64* entries, int64* truncated) {
+  int problems = 0;
+  static RawBlockTimes times;
+  RawEntryIter iter;
+  InitRawEntryIter(&block, &iter);
+  RawDecodeBlockTimes(&iter, &times);
+  problems += RawCheckBlockTimes(&block, &times);
+
+  InitRawEntryIter(&block, &iter);
+  RawEntry entry;
+  int expect = block.first_entry;
+  uint64 sum = 0;
+  while (NextRawEntry(&iter, &entry)) {
+    ++*entries;
+    if (entry.truncated) {++*truncated;}
+    if ((entry.index != expect) || (entry.len < 1) || (kTraceBufSize < entry.index + entry.len)) {
+      fprintf(stderr, "fuzz_rawblock: block %d bad entry at word %d, len %d\n",
+              block.blocknum, entry.index, entry.len);
+      ++problems;
+      break;
+    }
+    // Names and PC samples are read word by word; past the block faults
+    for (int k = 0; k < entry.len; ++k) {sum += block.words[entry.index + k];}
+    expect = entry.index + entry.len;
+  }
+  if (sum == 1) {fprintf(stderr, " ");}		// Keep the reads
+  return problems;
+}
+
+int main(int argc, const char** argv) {
+  int nblocks = 1000;
+  const char* fname = NULL;
+  for (int i = 1; i < argc; ++i) {
+    if ((strcmp(argv[i], "-n") == 0) && (i < (argc - 1))) {
+      nblocks = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "-seed") == 0) && (i < (argc - 1))) {
+      rng_state = strtoull(argv[++i], NULL, 0);
+      if (rng_state == 0) {rng_state = 1;}
+    } else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) {
+      fname = argv[++i];
+    } else {
+      Usage();
+    }
+  }
+  if (nblocks < 1) {Usage();}
+
+  // One block butted up against an inaccessible page
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  size_t block_bytes = kTraceBufSize * 8;
+  size_t span = ((block_bytes + pagesize - 1) / pagesize + 1) * pagesize;
+  uint8* base = (uint8*)mmap(NULL, span, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "fuzz_rawblock: mmap failed\n");
+    exit(0);
+  }
+  mprotect(base + span - pagesize, pagesize, PROT_NONE);
+  uint64* words = (uint64*)(base + span - pagesize - block_bytes);
+
+  FILE* trace = (fname == NULL) ? tmpfile() : fopen(fname, "wb+");
+  if (trace == NULL) {
+    fprintf(stderr, "fuzz_rawblock: %s did not open\n", (fname == NULL) ? "temp file" : fname);
+    exit(0);
+  }
+
+  int64 entries = 0;
+  int64 truncated = 0;
+  int problems = 0;
+  for (int n = 0; n < nblocks; ++n) {
+    RandomBlock(n, words);
+    fwrite(words, 8, kTraceBufSize, trace);
+
+    RawBlock block;
+    block.words = words;
+    block.ipc = NULL;
+    block.offset = (int64)n * block_bytes;
+    block.trace_bytes = block_bytes;
+    block.ipc_bytes = 0;
+    block.blocknum = n;
+    block.cpu = words[0] >> 56;
+    block.flags = words[1] >> 56;
+    block.base_cycle = words[0] & 0x00ffffffffffffffLLU;
+    block.gtod = words[1] & 0x00ffffffffffffffLLU;
+    block.header_words = (n == 0) ? kFirstBlockHeader : kBlockHeader;
+    block.first_entry = block.header_words + kPidHeader;
+    problems += CheckBlock(block, &entries, &truncated);
+  }
+  fflush(trace);
+  fprintf(stderr, "fuzz_rawblock: %d blocks, %lld entries, %lld truncated, %d problems\n",
+          nblocks, entries, truncated, problems);
+
+  // The same blocks as one trace through rawtoevent
+  FILE* devnull = fopen("/dev/null", "w");
+  const char* rawtoevent_argv[1] = {"rawtoevent"};
+  rewind(trace);
+  rawtoevent::RawToEvent(1, rawtoevent_argv, trace, devnull);	// Closes trace
+  fclose(devnull);
+  fprintf(stderr, "fuzz_rawblock: rawtoevent done\n");
+
+  return (problems == 0) ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+// json_ticks.h
+//
+// Integer-tick JSON span format (JSON v3)
+//
+// Normal span lines carry start time and duration as seconds,
+//   [ 12.34569799, 0.00000556, 0, 1000, 0, 66536, 0, 0, 0, "proc0.1000"],
+// With eventtospan3 -ticks they are instead integer multiples of 10ns since
+// tracebase, and the JSON header has a scale field giving ticks per second
+//   "ticksPerSec" : 100000000,
+//   [  1234569799, 556, 0, 1000, 0, 66536, 0, 0, 0, "proc0.1000"],
+//
+// The start time is right-justified in 12 columns, just like %12.8f seconds,
+// so that a plain text sort is still a time sort. The end marker 99999999999
+// (999.99999999 sec) still starts with "[999" and still sorts last.
+//
+// Programs that read spans pick up ticks_per_sec from the header line and
+// write spans back out in whichever form they read.
+//
+
+#ifndef __JSON_TICKS_H__
+#define __JSON_TICKS_H__
+
+#include <stdio.h>
+#include <stdlib.h>     // atoll
+#include <string.h>
+
+#include "basetypes.h"
+
+static const int64 kTicksPerSec = 100000000;	// 10ns ticks
+static const char* const kTicksPerSecField = " \"ticksPerSec\" : ";
+
+// Return ticks per second if this line is the ticksPerSec header field, else 0
+inline int64 ParseTicksPerSec(const char* buffer) {
+  int len = strlen(kTicksPerSecField);
+  if (memcmp(buffer, kTicksPerSecField, len) != 0) {return 0;}
+  return atoll(buffer + len);
+}
+
+// Incoming time value to seconds. ticks_per_sec of 0 means already seconds
+inline double SpanSec(double t, int64 ticks_per_sec) {
+  return (ticks_per_sec == 0) ? t : t / ticks_per_sec;
+}
+
+// Write the leading [start, dur, of a span line, in incoming units
+inline void PrintSpanTimes(FILE* f, int64 ticks_per_sec, double ts, double dur) {
+  if (ticks_per_sec == 0) {
+    fprintf(f, "[%12.8f, %10.8f, ", ts, dur);
+  } else {
+    fprintf(f, "[%12lld, %lld, ", (int64)(ts + 0.5), (int64)(dur + 0.5));
+  }
+}
+
+// Write the dummy entry that sorts last, with no comma or newline
+inline void PrintEndMarker(FILE* f, int64 ticks_per_sec) {
+  if (ticks_per_sec == 0) {
+    fprintf(f, "[999.0, 0.0, 0, 0, 0, 0, 0, 0, 0, \"\"]");
+  } else {
+    fprintf(f, "[99999999999, 0, 0, 0, 0, 0, 0, 0, 0, \"\"]");
+  }
+}
+
+// Add dummy entry that sorts last, then close the events array and top-level json
+inline void PrintFinalJson(FILE* f, int64 ticks_per_sec) {
+  PrintEndMarker(f, ticks_per_sec);
+  fprintf(f, "\n]}\n");
+}
+
+#endif	// __JSON_TICKS_H__
@@ -0,0 +1,444 @@
+// Little program to do all of postproc3.sh inside a single process
+//
+// postproc3.sh runs
+//   cat foo.trace |rawtoevent |sort -n |eventtospan3 "title" |sort >foo.json
+//   cat foo.json |spantotrim 0 |makeself show_cpu.html >foo.html
+// as seven processes with text pipes and two external sorts between them.
+//
+// Here each filter is a thread, running the very same code as the standalone
+// program (see kupostproc.h), and the sorts are done in memory. Stages are
+// connected by bounded in-memory queues of text chunks, so a fast producer
+// cannot run arbitrarily far ahead of its consumer. At the end we report for
+// each stage when it finished and how much CPU time it used.
+//
+// The optional -k and -u arguments add the samptoname_k and samptoname_u
+// filters just before the final sort, so the symbolized JSON gets sorted once.
+// The optional -symcache argument gives them a persistent symbol cache, see symcache.h
+// The optional -ticks argument writes integer-tick JSON, see json_ticks.h
+// The optional -z argument writes compressed JSON into the HTML, see makeself.cc
+// The optional -lod argument adds the spantolod filter just before makeself,
+// so the HTML has a level-of-detail pyramid for fast zoomed-out drawing
+//
+// Usage: kupostproc <trace file> "title" [label | start_sec [stop_sec]]
+//          [-k allsyms_file] [-u allmaps_file] [-symcache dir]
+//          [-html show_cpu.html] [-nohtml] [-ticks] [-z] [-lod]
+//
+// Writes foo.json and foo.html next to foo.trace, just like postproc3.sh.
+// Like the standalone makeself, expects d3.v4.min.js in the current directory.
+//
+// Compile with
+//   g++ -O2 -DKUPOSTPROC kupostproc.cc rawtoevent.cc eventtospan3.cc spantotrim.cc
+//     samptoname_k.cc samptoname_u.cc spantolod.cc makeself.cc from_base40.cc -pthread -lz
+//     -o kupostproc
+//
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>   // gettimeofday
+#include <sys/types.h>
+
+#include "basetypes.h"
+#include "kupostproc.h"
+
+using std::string;
+using std::vector;
+
+static const size_t kChunkSize = 64 * 1024;	// Stdio buffer size for queue streams
+static const size_t kMaxChunks = 64;		// Bound on chunks waiting in any one queue
+static const int kMaxStages = 12;
+
+// Bounded queue of text chunks from one stage to the next
+typedef struct {
+  std::mutex mu;
+  std::condition_variable changed;
+  std::deque<string> chunks;
+  bool closed;		// Producer is done
+  bool abandoned;	// Consumer is done; discard anything more
+  string current;	// Consumer-side chunk being read
+  size_t current_pos;
+} ChunkQueue;
+
+// Time spent in one stage
+typedef struct {
+  const char* name;
+  double done_sec;	// Since kupostproc start
+  double cpu_sec;
+} StageTime;
+
+static StageTime stagetimes[kMaxStages];
+static int numstages = 0;
+static double start_sec = 0.0;
+
+void Usage() {
+  fprintf(stderr, "Usage: kupostproc <trace file> \"title\" [label | start_sec [stop_sec]]\n");
+  fprintf(stderr, "         [-k allsyms_file] [-u allmaps_file] [-symcache dir]\n");
+  fprintf(stderr, "         [-html show_cpu.html] [-nohtml] [-ticks] [-z] [-lod]\n");
+  exit(0);
+}
+
+double NowSec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+double ThreadCpuSec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+//
+// Stdio glue so that the unchanged filter code can fprintf and fgets
+// through a ChunkQueue
+//
+
+ssize_t QueueWrite(void* cookie, const char* buf, size_t size) {
+  ChunkQueue* q = reinterpret_cast<ChunkQueue*>(cookie);
+  std::unique_lock<std::mutex> lock(q->mu);
+  while (!q->abandoned && (q->chunks.size() >= kMaxChunks)) {q->changed.wait(lock);}
+  if (!q->abandoned) {q->chunks.push_back(string(buf, size));}
+  q->changed.notify_all();
+  return size;
+}
+
+ssize_t QueueRead(void* cookie, char* buf, size_t size) {
+  ChunkQueue* q = reinterpret_cast<ChunkQueue*>(cookie);
+  if (q->current_pos >= q->current.size()) {
+    std::unique_lock<std::mutex> lock(q->mu);
+    while (!q->closed && q->chunks.empty()) {q->changed.wait(lock);}
+    if (q->chunks.empty()) {return 0;}	// EOF
+    q->current.swap(q->chunks.front());
+    q->chunks.pop_front();
+    q->current_pos = 0;
+    q->changed.notify_all();
+  }
+  size_t len = q->current.size() - q->current_pos;
+  if (len > size) {len = size;}
+  memcpy(buf, q->current.data() + q->current_pos, len);
+  q->current_pos += len;
+  return len;
+}
+
+int QueueCloseWriter(void* cookie) {
+  ChunkQueue* q = reinterpret_cast<ChunkQueue*>(cookie);
+  std::unique_lock<std::mutex> lock(q->mu);
+  q->closed = true;
+  q->changed.notify_all();
+  return 0;
+}
+
+// A consumer may stop reading early, e.g. at the 999.0 end marker
+int QueueCloseReader(void* cookie) {
+  ChunkQueue* q = reinterpret_cast<ChunkQueue*>(cookie);
+  std::unique_lock<std::mutex> lock(q->mu);
+  q->abandoned = true;
+  q->chunks.clear();
+  q->changed.notify_all();
+  return 0;
+}
+
+ChunkQueue* NewQueue() {
+  ChunkQueue* q = new ChunkQueue;
+  q->closed = false;
+  q->abandoned = false;
+  q->current_pos = 0;
+  return q;
+}
+
+FILE* QueueWriter(ChunkQueue* q) {
+  cookie_io_functions_t funcs = {NULL, QueueWrite, NULL, QueueCloseWriter};
+  FILE* f = fopencookie(q, "w", funcs);
+  setvbuf(f, NULL, _IOFBF, kChunkSize);
+  return f;
+}
+
+FILE* QueueReader(ChunkQueue* q) {
+  cookie_io_functions_t funcs = {QueueRead, NULL, NULL, QueueCloseReader};
+  FILE* f = fopencookie(q, "r", funcs);
+  setvbuf(f, NULL, _IOFBF, kChunkSize);
+  return f;
+}
+
+//
+// In-memory replacements for the two external sorts. Both match LC_ALL=C
+//
+
+typedef struct {
+  const char* text;
+  int len;
+  int64 key;		// Leading number, for sort -n
+} Line;
+
+// Leading integer of a line the way sort -n sees it; no number sorts as zero
+int64 LeadingNumber(const char* s) {
+  while ((*s == ' ') || (*s == '\t')) {++s;}
+  bool neg = (*s == '-');
+  if (neg) {++s;}
+  int64 value = 0;
+  while (('0' <= *s) && (*s <= '9')) {value = (value * 10) + (*s++ - '0');}
+  return neg ? -value : value;
+}
+
+// Byte-by-byte compare, as sort does with LC_ALL=C
+inline bool LineLess(const Line& a, const Line& b) {
+  int minlen = (a.len < b.len) ? a.len : b.len;
+  int cmp = memcmp(a.text, b.text, minlen);
+  if (cmp != 0) {return cmp < 0;}
+  return a.len < b.len;
+}
+
+// sort -n breaks ties on the leading number with a compare of the whole line
+inline bool LineLessNumeric(const Line& a, const Line& b) {
+  if (a.key != b.key) {return a.key < b.key;}
+  return LineLess(a, b);
+}
+
+// Read all of in, sort the lines, write them to out and also to tee if not NULL
+void SortLines(bool numeric, FILE* in, FILE* out, FILE* tee) {
+  string text;
+  char buffer[kChunkSize];
+  size_t n;
+  while ((n = fread(buffer, 1, kChunkSize, in)) > 0) {text.append(buffer, n);}
+
+  vector<Line> lines;
+  size_t start = 0;
+  while (start < text.size()) {
+    size_t end = text.find('\n', start);
+    if (end == string::npos) {end = text.size();}
+    Line line;
+    line.text = text.data() + start;
+    line.len = end - start;
+    line.key = numeric ? LeadingNumber(line.text) : 0;
+    lines.push_back(line);
+    start = end + 1;
+  }
+
+  if (numeric) {
+    std::sort(lines.begin(), lines.end(), LineLessNumeric);
+  } else {
+    std::sort(lines.begin(), lines.end(), LineLess);
+  }
+
+  for (int i = 0; i < (int)lines.size(); ++i) {
+    fwrite(lines[i].text, 1, lines[i].len, out);
+    fputc('\n', out);
+    if (tee != NULL) {
+      fwrite(lines[i].text, 1, lines[i].len, tee);
+      fputc('\n', tee);
+    }
+  }
+}
+
+//
+// Stage threads
+//
+
+typedef int (*FilterFunc)(int argc, const char** argv, FILE* in, FILE* out);
+
+// Run one filter on its own thread. The thread closes both ends when done,
+// which is what tells the next stage there is no more input.
+std::thread* StartFilter(const char* name, FilterFunc filter, const vector<const char*>& args,
+                         FILE* in, FILE* out) {
+  if (numstages >= kMaxStages) {fprintf(stderr, "kupostproc: too many stages\n"); exit(0);}
+  StageTime* st = &stagetimes[numstages++];
+  st->name = name;
+  return new std::thread([st, filter, args, in, out]() {
+    double start_cpu = ThreadCpuSec();
+    vector<const char*> argv(args);
+    argv.push_back(NULL);
+    filter(args.size(), &argv[0], in, out);
+    if (in != NULL) {fclose(in);}
+    fclose(out);
+    st->cpu_sec = ThreadCpuSec() - start_cpu;
+    st->done_sec = NowSec() - start_sec;
+  });
+}
+
+std::thread* StartSort(const char* name, bool numeric, FILE* in, FILE* out, FILE* tee) {
+  if (numstages >= kMaxStages) {fprintf(stderr, "kupostproc: too many stages\n"); exit(0);}
+  StageTime* st = &stagetimes[numstages++];
+  st->name = name;
+  return new std::thread([st, numeric, in, out, tee]() {
+    double start_cpu = ThreadCpuSec();
+    SortLines(numeric, in, out, tee);
+    fclose(in);
+    fclose(out);
+    if (tee != NULL) {fclose(tee);}
+    st->cpu_sec = ThreadCpuSec() - start_cpu;
+    st->done_sec = NowSec() - start_sec;
+  });
+}
+
+// Make a new queue and return its two ends
+void MakePipe(FILE** reader, FILE** writer) {
+  ChunkQueue* q = NewQueue();
+  *writer = QueueWriter(q);
+  *reader = QueueReader(q);
+}
+
+FILE* OpenOrDie(const string& fname, const char* mode) {
+  FILE* f = fopen(fname.c_str(), mode);
+  if (f == NULL) {
+    fprintf(stderr, "kupostproc: %s did not open\n", fname.c_str());
+    exit(0);
+  }
+  return f;
+}
+
+int main (int argc, const char** argv) {
+  if (argc < 3) {Usage();}
+
+  // Strip trailing .trace if it is there
+  string stem = string(argv[1]);
+  if ((stem.size() > 6) && (stem.substr(stem.size() - 6) == ".trace")) {
+    stem = stem.substr(0, stem.size() - 6);
+  }
+  const char* title = argv[2];
+  const char* allsyms_fname = NULL;
+  const char* allmaps_fname = NULL;
+  const char* symcache_dir = NULL;
+  const char* html_fname = "show_cpu.html";
+  bool do_html = true;
+  bool do_ticks = false;
+  bool do_z = false;
+  bool do_lod = false;
+  vector<const char*> trim_args;
+
+  for (int i = 3; i < argc; ++i) {
+    if ((strcmp(argv[i], "-k") == 0) && (i < (argc - 1))) {
+      allsyms_fname = argv[++i];
+    } else if ((strcmp(argv[i], "-u") == 0) && (i < (argc - 1))) {
+      allmaps_fname = argv[++i];
+    } else if ((strcmp(argv[i], "-symcache") == 0) && (i < (argc - 1))) {
+      symcache_dir = argv[++i];
+    } else if ((strcmp(argv[i], "-html") == 0) && (i < (argc - 1))) {
+      html_fname = argv[++i];
+    } else if (strcmp(argv[i], "-nohtml") == 0) {
+      do_html = false;
+    } else if (strcmp(argv[i], "-ticks") == 0) {
+      do_ticks = true;
+    } else if (strcmp(argv[i], "-z") == 0) {
+      do_z = true;
+    } else if (strcmp(argv[i], "-lod") == 0) {
+      do_lod = true;
+    } else if (argv[i][0] == '-') {
+      Usage();
+    } else {
+      trim_args.push_back(argv[i]);
+    }
+  }
+  if (trim_args.size() > 2) {Usage();}
+  if (trim_args.empty()) {trim_args.push_back("0");}
+
+  string trace_fname = stem + ".trace";
+  string json_fname = stem + ".json";
+  string html_out_fname = stem + ".html";
+
+  start_sec = NowSec();
+  vector<std::thread*> threads;
+  FILE* rd;
+  FILE* wr;
+  FILE* next_in;
+
+  // rawtoevent opens the trace file itself
+  MakePipe(&rd, &wr);
+  vector<const char*> args;
+  args.push_back("rawtoevent");
+  args.push_back(trace_fname.c_str());
+  threads.push_back(StartFilter("rawtoevent", rawtoevent::RawToEvent, args, NULL, wr));
+  next_in = rd;
+
+  MakePipe(&rd, &wr);
+  threads.push_back(StartSort("sort -n", true, next_in, wr, NULL));
+  next_in = rd;
+
+  MakePipe(&rd, &wr);
+  args.clear();
+  args.push_back("eventtospan3");
+  args.push_back(title);
+  if (do_ticks) {args.push_back("-ticks");}
+  threads.push_back(StartFilter("eventtospan3", eventtospan3::EventToSpan3, args, next_in, wr));
+  next_in = rd;
+
+  if (allsyms_fname != NULL) {
+    MakePipe(&rd, &wr);
+    args.clear();
+    args.push_back("samptoname_k");
+    args.push_back(allsyms_fname);
+    if (symcache_dir != NULL) {args.push_back("-cache"); args.push_back(symcache_dir);}
+    threads.push_back(StartFilter("samptoname_k", samptoname_k::SampToNameK, args, next_in, wr));
+    next_in = rd;
+  }
+
+  if (allmaps_fname != NULL) {
+    MakePipe(&rd, &wr);
+    args.clear();
+    args.push_back("samptoname_u");
+    args.push_back(allmaps_fname);
+    if (symcache_dir != NULL) {args.push_back("-cache"); args.push_back(symcache_dir);}
+    threads.push_back(StartFilter("samptoname_u", samptoname_u::SampToNameU, args, next_in, wr));
+    next_in = rd;
+  }
+
+  // The final sort also writes foo.json
+  FILE* fjson = OpenOrDie(json_fname, "w");
+  if (do_html) {
+    MakePipe(&rd, &wr);
+    threads.push_back(StartSort("sort", false, next_in, wr, fjson));
+    next_in = rd;
+
+    MakePipe(&rd, &wr);
+    args.clear();
+    args.push_back("spantotrim");
+    for (int i = 0; i < (int)trim_args.size(); ++i) {args.push_back(trim_args[i]);}
+    threads.push_back(StartFilter("spantotrim", spantotrim::SpanToTrim, args, next_in, wr));
+    next_in = rd;
+
+    if (do_lod) {
+      MakePipe(&rd, &wr);
+      args.clear();
+      args.push_back("spantolod");
+      threads.push_back(StartFilter("spantolod", spantolod::SpanToLod, args, next_in, wr));
+      next_in = rd;
+    }
+
+    FILE* fhtml = OpenOrDie(html_out_fname, "w");
+    args.clear();
+    args.push_back("makeself");
+    if (do_z) {args.push_back("-z");}
+    args.push_back(html_fname);
+    threads.push_back(StartFilter("makeself", makeself::MakeSelf, args, next_in, fhtml));
+  } else {
+    threads.push_back(StartSort("sort", false, next_in, fjson, NULL));
+  }
+
+  for (int i = 0; i < (int)threads.size(); ++i) {
+    threads[i]->join();
+    delete threads[i];
+  }
+  double total_sec = NowSec() - start_sec;
+
+  fprintf(stderr, "  %s written\n", json_fname.c_str());
+  if (do_html) {fprintf(stderr, "  %s written\n", html_out_fname.c_str());}
+
+  // Stages overlap, so CPU times can add up to more than the total
+  fprintf(stderr, "kupostproc: %5.3f elapsed seconds\n", total_sec);
+  fprintf(stderr, "  %-14s %9s %9s\n", "stage", "done_at", "cpu");
+  for (int i = 0; i < numstages; ++i) {
+    fprintf(stderr, "  %-14s %9.3f %9.3f\n",
+            stagetimes[i].name, stagetimes[i].done_sec, stagetimes[i].cpu_sec);
+  }
+
+  return 0;
+}
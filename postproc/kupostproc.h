@@ -0,0 +1,42 @@
+// kupostproc.h
+//
+// Entry points for the postprocessing filters that kupostproc runs as threads
+// inside a single process. Each standalone program's main() is just a call to
+// its entry point with stdin and stdout. Build kupostproc with -DKUPOSTPROC
+// so that those main() routines drop out.
+//
+
+#ifndef __KUPOSTPROC_H__
+#define __KUPOSTPROC_H__
+
+#include <stdio.h>
+
+namespace rawtoevent {
+int RawToEvent(int argc, const char** argv, FILE* in, FILE* out);
+}
+
+namespace eventtospan3 {
+int EventToSpan3(int argc, const char** argv, FILE* in, FILE* out);
+}
+
+namespace spantotrim {
+int SpanToTrim(int argc, const char** argv, FILE* in, FILE* out);
+}
+
+namespace samptoname_k {
+int SampToNameK(int argc, const char** argv, FILE* in, FILE* out);
+}
+
+namespace samptoname_u {
+int SampToNameU(int argc, const char** argv, FILE* in, FILE* out);
+}
+
+namespace spantolod {
+int SpanToLod(int argc, const char** argv, FILE* in, FILE* out);
+}
+
+namespace makeself {
+int MakeSelf(int argc, const char** argv, FILE* in, FILE* out);
+}
+
+#endif	// __KUPOSTPROC_H__
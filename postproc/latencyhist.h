@@ -0,0 +1,133 @@
+// latencyhist.h
+//
+// Log-linear latency histogram, shared by the span analysis programs.
+//
+// Values are nanoseconds. Values below 16 each get their own bucket; above
+// that, each power of two is split into 16 equal buckets, so a bucket is
+// within 1/16 of the values it holds. That covers 1ns to centuries in under
+// a thousand buckets with no configuration and no second pass.
+//
+// Alongside the counts, a histogram keeps the exact min and max and the
+// kMaxWorst largest values with the time and PID of each, so a report can
+// point at the worst instances in the trace.
+//
+
+#ifndef __LATENCYHIST_H__
+#define __LATENCYHIST_H__
+
+#include <math.h>	// ceil
+#include <string.h>
+
+#include "basetypes.h"
+
+static const int kSubBucketBits = 4;
+static const int kSubBuckets = 1 << kSubBucketBits;
+static const int kHistBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+static const int kMaxWorst = 8;
+
+// One instance, for the worst list
+typedef struct {
+  int64 value_ns;
+  int64 start_ns;	// When it started, ns since trace start
+  int pid;
+} LatInstance;
+
+typedef struct {
+  int64 count;
+  int64 sum_ns;
+  int64 min_ns;
+  int64 max_ns;
+  int worst_count;
+  LatInstance worst[kMaxWorst];	// Descending by value_ns
+  int64 bucket[kHistBuckets];
+} LatHist;
+
+inline void InitLatHist(LatHist* hist) {
+  memset(hist, 0, sizeof(LatHist));
+}
+
+// Floor of log base 2, for x > 0
+inline int LatFloorLg(uint64 x) {
+  int lg = 0;
+  while (x >>= 1) {++lg;}
+  return lg;
+}
+
+inline int LatBucket(int64 value_ns) {
+  if (value_ns < kSubBuckets) {return (value_ns < 0) ? 0 : (int)value_ns;}
+  int lg = LatFloorLg(value_ns);
+  int sub = (value_ns >> (lg - kSubBucketBits)) & (kSubBuckets - 1);
+  return (lg - kSubBucketBits + 1) * kSubBuckets + sub;
+}
+
+// Smallest value in bucket b
+inline int64 LatBucketLo(int b) {
+  if (b < kSubBuckets) {return b;}
+  int lg = (b / kSubBuckets) + kSubBucketBits - 1;
+  int sub = b % kSubBuckets;
+  return ((int64)(kSubBuckets + sub)) << (lg - kSubBucketBits);
+}
+
+// Largest value in bucket b
+inline int64 LatBucketHi(int b) {
+  return (b + 1 < kHistBuckets) ? LatBucketLo(b + 1) - 1 : 0x7FFFFFFFFFFFFFFFLL;
+}
+
+// Insert into the worst list; ties keep the earlier instance first
+inline void AddToLatWorst(int64 value_ns, int64 start_ns, int pid, LatHist* hist) {
+  if ((hist->worst_count == kMaxWorst) &&
+      (value_ns <= hist->worst[kMaxWorst - 1].value_ns)) {return;}
+  int i = (hist->worst_count < kMaxWorst) ? hist->worst_count++ : kMaxWorst - 1;
+  while ((0 < i) && (hist->worst[i - 1].value_ns < value_ns)) {
+    hist->worst[i] = hist->worst[i - 1];
+    --i;
+  }
+  hist->worst[i].value_ns = value_ns;
+  hist->worst[i].start_ns = start_ns;
+  hist->worst[i].pid = pid;
+}
+
+inline void AddToLatHist(int64 value_ns, int64 start_ns, int pid, LatHist* hist) {
+  if (value_ns < 0) {value_ns = 0;}
+  if ((hist->count == 0) || (value_ns < hist->min_ns)) {hist->min_ns = value_ns;}
+  if ((hist->count == 0) || (hist->max_ns < value_ns)) {hist->max_ns = value_ns;}
+  ++hist->count;
+  hist->sum_ns += value_ns;
+  ++hist->bucket[LatBucket(value_ns)];
+  AddToLatWorst(value_ns, start_ns, pid, hist);
+}
+
+// Add the histogram part, made from later values, into total
+inline void MergeLatHist(const LatHist& part, LatHist* total) {
+  if (part.count == 0) {return;}
+  if ((total->count == 0) || (part.min_ns < total->min_ns)) {total->min_ns = part.min_ns;}
+  if ((total->count == 0) || (total->max_ns < part.max_ns)) {total->max_ns = part.max_ns;}
+  total->count += part.count;
+  total->sum_ns += part.sum_ns;
+  for (int b = 0; b < kHistBuckets; ++b) {total->bucket[b] += part.bucket[b];}
+  for (int i = 0; i < part.worst_count; ++i) {
+    AddToLatWorst(part.worst[i].value_ns, part.worst[i].start_ns, part.worst[i].pid, total);
+  }
+}
+
+// Value at fraction q (0.5 for p50) of the way through the sorted values.
+// This is the top of the bucket holding it, clipped to the exact min and max,
+// so it is never below the true percentile and at most 1/16 above it
+inline int64 LatPercentile(const LatHist& hist, double q) {
+  if (hist.count == 0) {return 0;}
+  int64 rank = (int64)ceil((q * hist.count) - 0.000001);	// 1-based, despite rounding in q
+  if (rank < 1) {rank = 1;}
+  int64 seen = 0;
+  for (int b = 0; b < kHistBuckets; ++b) {
+    seen += hist.bucket[b];
+    if (rank <= seen) {
+      int64 value = LatBucketHi(b);
+      if (value < hist.min_ns) {value = hist.min_ns;}
+      if (hist.max_ns < value) {value = hist.max_ns;}
+      return value;
+    }
+  }
+  return hist.max_ns;
+}
+
+#endif	// __LATENCYHIST_H__
@@ -3,6 +3,8 @@
 // dick sites 2017.12.07 Allows pipe from stdin
 // dick sites 2020.06.05 Explicitly check for sorted input
 // dsites 20201.01.07 Only check for sorted until end of events[]. More unsorted may be added after that.
+// 2026.10.16 Add -z to embed the JSON deflate-compressed and base64-encoded
+// 2026.10.17 Embed spantolod coarse levels as separate strings, parsed lazily
 //
 // Inputs
 // (1) A base HTML file with everything except for a library and json data
@@ -14,17 +16,44 @@
 // Output
 //     A new self-contained HTML file written to arg[3]
 //
+// With -z, the JSON is embedded as var myStringZ, zlib-compressed and then
+// base64-encoded, instead of as the plain string myString. show_cpu.html
+// inflates it with the browser's DecompressionStream before JSON.parse.
+// This is typically four to six times smaller than the plain form.
+//
+// If the JSON has a level-of-detail pyramid from spantolod, the events array
+// of each coarse level is cut out of the main string and replaced by
+// "part" : n. The cut-out arrays are embedded in order as var myLod, an
+// array of strings, or with -z as var myLodZ, each compressed separately.
+// show_cpu.html then parses just the main string before its first paint,
+// and each coarse level only when a zoom first needs it.
+//
+// Compile with g++ -O2 makeself.cc -lz -o makeself
+//
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>		// exit
 #include <string.h>
+#include <zlib.h>
+
+#include "kupostproc.h"
+
+namespace makeself {
+
+// Input and output streams. stdin/stdout except when run inside kupostproc
+static FILE* infile = NULL;
+static FILE* outfile = NULL;
 
 static const char* const_text_1 = "<script>";
 static const char* const_text_2 = "</script>";
 
 static const char* const_text_3 = "var myString = '";
 static const char* const_text_4 = "';";
+static const char* const_text_3z = "var myStringZ = '";
+static const char* const_text_lod = "var myLod = [\n";
+static const char* const_text_lodz = "var myLodZ = [\n";
+static const char* const_text_lod_end = "];";
 
 //static const char* const_text_5 = "data = JSON.parse(myString); newdata2_resize(data);";
 // Now uses onload="initAll()"
@@ -33,11 +62,132 @@ static const char* const_text_6 = "";
 
 
 void usage() {
-  fprintf(stderr, "Usage: makeself <input html> <input json> <output html>\n");
+  fprintf(stderr, "Usage: makeself [-z] <input html> <input json> <output html>\n");
   exit(0);
 }
 
-int main (int argc, const char** argv) {
+static const char* kBase64 =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Encode len bytes of src as base64 into dst, which must hold 4 * ((len + 2) / 3)
+// bytes. Returns the number of bytes written
+int64_t Base64Encode(const unsigned char* src, int64_t len, char* dst) {
+  char* d = dst;
+  int64_t i = 0;
+  for (; i + 3 <= len; i += 3) {
+    uint32_t w = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+    *d++ = kBase64[(w >> 18) & 63];
+    *d++ = kBase64[(w >> 12) & 63];
+    *d++ = kBase64[(w >> 6) & 63];
+    *d++ = kBase64[w & 63];
+  }
+  if (i < len) {
+    // One or two bytes left over, padded with =
+    uint32_t w = src[i] << 16;
+    if (i + 1 < len) {w |= src[i + 1] << 8;}
+    *d++ = kBase64[(w >> 18) & 63];
+    *d++ = kBase64[(w >> 12) & 63];
+    *d++ = (i + 1 < len) ? kBase64[(w >> 6) & 63] : '=';
+    *d++ = '=';
+  }
+  return d - dst;
+}
+
+// One piece of the JSON text, in its own buffer
+typedef struct {
+  char* text;
+  int len;
+} Piece;
+
+static const int kMaxLodParts = 16;
+
+// Move the coarse-level events arrays from spantolod out of json, which runs
+// through json_len, into parts. A level looks like
+//   {"usec" : 100, ..., "events" : [
+//   [ 12.34567890, ...],
+//   ...
+//   [999.0, 0.0, 0, 0, 0, 0, 0, 0, 0, ""]]},
+// and becomes {"usec" : 100, ..., "part" : 0}. Only levels in the lod array,
+// after the main events array, are moved. The shortened json is compacted in
+// place. Returns the number of parts
+int SplitLodParts(char* json, int* json_len, Piece* parts) {
+  static const char* kEvents = ", \"events\" : [\n";
+  char* lod = strstr(json, "\n\"lod\" : [");
+  if (lod == NULL) {return 0;}
+  int nparts = 0;
+  char* end = json + *json_len;
+  char* src = lod;		// Next text to keep
+  char* dst = lod;		// Where it goes
+  for (;;) {
+    char* cut = strstr(src, kEvents);
+    if ((cut == NULL) || (end <= cut) || (kMaxLodParts <= nparts)) {break;}
+    // The array runs through the ]] that ends its 999 marker line
+    char* arr = cut + strlen(kEvents) - 2;
+    char* marker = strstr(arr, "\n[999");
+    char* close = (marker == NULL) ? NULL : strstr(marker, "]]");
+    if ((close == NULL) || (end <= close)) {break;}
+    close += 2;
+    // Copy the part out before compacting over it
+    parts[nparts].len = close - arr;
+    parts[nparts].text = new char[parts[nparts].len];
+    memcpy(parts[nparts].text, arr, parts[nparts].len);
+    // Keep everything before the cut, then say which part has the events.
+    // The replacement is shorter than what it replaces, so dst stays behind src
+    memmove(dst, src, cut - src);
+    dst += cut - src;
+    dst += sprintf(dst, ", \"part\" : %d", nparts);
+    ++nparts;
+    src = close;
+  }
+  memmove(dst, src, end - src);
+  dst += end - src;
+  *json_len = dst - json;
+  return nparts;
+}
+
+// Replace newline with space -- JSON string may not contain newline
+void NewlinesToSpaces(char* buf, int len) {
+  for (int i = 0; i < len; ++i) {
+    if (buf[i] == '\n') {buf[i] = ' ';}
+  }
+}
+
+// Write len bytes of text as the inside of a JS string literal, either plain
+// or zlib-compressed and base64-encoded. Returns the number of bytes written
+int64_t WriteStringText(FILE* f, char* text, int len, bool compress) {
+  int64_t out_len = len;
+  if (compress) {
+    uLongf z_len = compressBound(len);
+    unsigned char* z_buf = new unsigned char[z_len];
+    int status = compress2(z_buf, &z_len, (const Bytef*)text, len, Z_DEFAULT_COMPRESSION);
+    if (status != Z_OK) {fprintf(stderr, "makeself: compress2 failed, status %d\n", status); exit(0);}
+    char* b64_buf = new char[4 * ((z_len + 2) / 3)];
+    out_len = Base64Encode(z_buf, z_len, b64_buf);
+    fwrite(b64_buf, 1, out_len, f);
+    delete[] z_buf;
+    delete[] b64_buf;
+  } else {
+    NewlinesToSpaces(text, len);
+    fwrite(text, 1, len, f);
+  }
+  return out_len;
+}
+
+int MakeSelf(int argc, const char** argv, FILE* in, FILE* out) {
+  infile = in;
+  outfile = out;
+
+  // Pick off -z, leaving the positional arguments in place
+  bool compress = false;
+  const char* posargv[4];
+  int posargc = 0;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "-z") == 0) {compress = true; continue;}
+    if (posargc < 4) {posargv[posargc++] = argv[i];}
+  }
+  argc = posargc;
+  argv = posargv;
+
   if (argc < 2) {usage();}
 
   FILE* finlib = fopen("d3.v4.min.js", "rb");
@@ -56,14 +206,14 @@ int main (int argc, const char** argv) {
     if (fouthtml == NULL) {fprintf(stderr, "%s did not open.\n", argv[3]);}
   } else if (argc == 3) {
     // Pipe from stdin 
-    finjson = stdin;
+    finjson = infile;
 
     fouthtml = fopen(argv[2], "wb");
     if (fouthtml == NULL) {fprintf(stderr, "%s did not open.\n", argv[2]);}
   } else {
     // Pipe from stdin and to stdout 
-    finjson = stdin;
-    fouthtml = stdout;
+    finjson = infile;
+    fouthtml = outfile;
   }
 
   if (finhtml == NULL || finjson == NULL || finlib == NULL || fouthtml == NULL) {
@@ -80,8 +230,9 @@ int main (int argc, const char** argv) {
   int html_len = fread(inhtml_buf, 1, 1000000, finhtml);
   fclose(finhtml);
 
-  int json_len = fread(injson_buf, 1, 250000000, finjson);
-  if (finjson != stdin) {fclose(finjson);}
+  int json_len = fread(injson_buf, 1, 250000000 - 1, finjson);
+  if (finjson != infile) {fclose(finjson);}
+  injson_buf[json_len] = '\0';
 
   char* self0 = strstr(inhtml_buf, "<!-- selfcontained0 -->");
   char* self1 = strstr(inhtml_buf, "<!-- selfcontained1 -->");
@@ -120,6 +271,7 @@ int main (int argc, const char** argv) {
   //  plus constant text
   //  plus injson_buf with all <cr> turned into space
   //  plus constant text
+  //  plus any coarse levels cut out of injson_buf, likewise
   //
   //  plus inhtml_buf between self1 and self2 (len3)
   //  plus constant text to display json
@@ -144,7 +296,7 @@ int main (int argc, const char** argv) {
           fprintf(stderr, "  '%s...'\n", temp);
           exit(0);
         }
-        // Stop checking sorted at first line that has "[999.0," in column 1
+        // Stop checking sorted at first line that has "[999.0," or "[99999999999," in column 1
         if (strncmp(next_line, "[999", 4) == 0) {check_sorted = false;}
         // Stop checking sorted if line has " \"unsorted\"" in column 1
         // Note leading space.
@@ -154,13 +306,14 @@ int main (int argc, const char** argv) {
       }
 
       prior_line = next_line;
-      // Replace newline with space -- JSON string may not contain newline
-      injson_buf[i] = ' ';
       // Replace backslash with two of them
       // Replace quote with backslash quote
     } 
   }
 
+  Piece parts[kMaxLodParts];
+  int nparts = SplitLodParts(injson_buf, &json_len, parts);
+
   // Lengths of four inhtml pieces
   int len1 = self0_end - inhtml_buf;
   int len2 = self1_end - self0_cr2;	// Skips one line of d3.v4.min.js include
@@ -174,16 +327,35 @@ int main (int argc, const char** argv) {
 
   fwrite(self0_cr2, 1, len2, fouthtml);
 
-  fwrite(const_text_3, 1, strlen(const_text_3), fouthtml);
-  fwrite(injson_buf, 1, json_len, fouthtml);
+  // Compressed JSON is not a string literal, so it keeps its newlines
+  const char* text_3 = compress ? const_text_3z : const_text_3;
+  fwrite(text_3, 1, strlen(text_3), fouthtml);
+  int64_t out_len = WriteStringText(fouthtml, injson_buf, json_len, compress);
   fwrite(const_text_4, 1, strlen(const_text_4), fouthtml);
+  if (compress) {
+    fprintf(stderr, "makeself: JSON %d bytes, base64 of deflated %ld\n", json_len, (long)out_len);
+  }
+
+  if (0 < nparts) {
+    const char* text_lod = compress ? const_text_lodz : const_text_lod;
+    fwrite(text_lod, 1, strlen(text_lod), fouthtml);
+    for (int i = 0; i < nparts; ++i) {
+      fprintf(fouthtml, "'");
+      out_len = WriteStringText(fouthtml, parts[i].text, parts[i].len, compress);
+      fprintf(fouthtml, "',\n");
+      fprintf(stderr, "makeself: lod part %d, %d bytes, %ld embedded\n",
+              i, parts[i].len, (long)out_len);
+      delete[] parts[i].text;
+    }
+    fwrite(const_text_lod_end, 1, strlen(const_text_lod_end), fouthtml);
+  }
 
   fwrite(self1_end, 1, len3, fouthtml);
   fwrite(const_text_5, 1, strlen(const_text_5), fouthtml);
   fwrite(const_text_6, 1, strlen(const_text_6), fouthtml);
 
   fwrite(self2_end, 1, len4, fouthtml);
-  if (fouthtml != stdout) {fclose(fouthtml);}  
+  if (fouthtml != outfile) {fclose(fouthtml);}  
 
   free(inlib_buf);
   free(inhtml_buf);
@@ -191,3 +363,10 @@ int main (int argc, const char** argv) {
   return 0;
 }
 
+}  // namespace makeself
+
+#ifndef KUPOSTPROC
+int main (int argc, const char** argv) {
+  return makeself::MakeSelf(argc, argv, stdin, stdout);
+}
+#endif
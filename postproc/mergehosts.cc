@@ -0,0 +1,547 @@
+// Little program to merge JSON span files traced together on several hosts
+// onto one timeline, for viewing side by side
+//
+// Usage: mergehosts [-title "text"] [-v] foo_host0.json foo_host1.json ... >foo.json
+//
+// Each input file is made from one host's trace by the usual
+//   rawtoevent |sort -n |eventtospan3 |sort
+// pipeline.
+//
+// Each host's trace has its own cycle counter and gettimeofday time pair, so
+// its span times are only as close to the other hosts' as their clocks are.
+// The kernel KUTRACE_TX_PKT and KUTRACE_RX_PKT events carry a hash32 over the
+// first 32 payload bytes of each selected packet, so a packet sent by one
+// host and received by another shows up on both with the same hash. Each
+// such pair bounds the receiving host's clock offset: the packet must be
+// received after it was sent. Packets one way give an upper bound and
+// packets the other way a lower bound; as in NTP, the tightest bounds come
+// from the fastest packets, and the offset is taken midway between them,
+// assuming the minimum delay is the same both ways.
+//
+// The matched pairs are split into kNumWindows time windows. Each window
+// with packets both ways gives one offset estimate, and a least-squares line
+// through those gives the offset and drift of the host clock. That line is
+// then moved just enough that no matched packet arrives before it was sent,
+// if possible.
+//
+// The first file is the reference host. Every other host is aligned to
+// whichever already-aligned host it exchanged the most packets with, so a
+// chain client -> server -> storage works too. Hosts with no matched packets
+// keep their gettimeofday alignment.
+//
+// Output is one JSON file on the timeline of the earliest tracebase, with
+// CPU numbers prefixed by host number: CPU 3 of the second file (host 1)
+// is shown as CPU 103, or 1003 if some host has 100 or more CPUs. PID and
+// RPC rows are not renamed, so the same PID on two hosts shares a row.
+// The header is that of the first file, with the new title and tracebase.
+// Alignment results go to stderr.
+//
+// Compile with g++ -O2 mergehosts.cc -o mergehosts
+//
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <math.h>	// llround
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+#include <time.h>	// timegm
+
+#include "basetypes.h"
+#include "json_ticks.h"
+#include "kutrace_lib.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+static const int kMaxHosts = 16;
+static const int kNumWindows = 8;
+static const int64 kMatchWindowNs = 1000000000LL;	// gettimeofday clocks this close
+
+typedef struct {
+  int64 start_ns;	// Since the common tracebase, once aligned
+  int64 duration_ns;
+  int cpu;
+  int pid;
+  int rpcid;
+  int eventnum;
+  int arg;
+  int retval;
+  int ipc;
+  int host;
+  string rest;		// Name and closing bracket, as read
+} OneSpan;
+
+// One packet event on one host
+typedef struct {
+  int64 ns;
+  uint32 hash32;
+} OnePkt;
+
+// One packet sent on one host and received on another, each time on its own
+// host's clock. Inbound, delta is receive minus send time; outbound, it is
+// send minus receive time
+typedef struct {
+  int64 ns;		// Time on the host being aligned
+  int64 delta;		// Time on the host being aligned minus time on the reference
+  bool inbound;		// Sent by the reference, received by the host being aligned
+} PktPair;
+
+// Host clock to reference clock: t_ref = t - (offset_ns + drift * (t - mid_ns))
+typedef struct {
+  int64 offset_ns;
+  double drift;
+  int64 mid_ns;
+} ClockFit;
+
+typedef struct {
+  string fname;
+  string hostname;
+  string tracebase;
+  int64 ticks_per_sec;
+  int64 base_ns;		// tracebase minus the earliest tracebase
+  vector<string> header;	// Lines before the first span
+  vector<OneSpan> spans;
+  vector<OnePkt> tx;
+  vector<OnePkt> rx;
+  int max_cpu;
+  bool aligned;
+  int ref;			// Host this one was aligned to
+  ClockFit fit;
+} Host;
+
+static bool verbose = false;
+
+static const int kMaxBufferSize = 256;
+
+// Read next line, stripping any crlf. Return false if no more.
+bool ReadLine(FILE* f, char* buffer, int maxsize) {
+  char* s = fgets(buffer, maxsize, f);
+  if (s == NULL) {return false;}
+  int len = strlen(s);
+  // Strip any crlf or cr or lf
+  if (s[len - 1] == '\n') {s[--len] = '\0';}
+  if (s[len - 1] == '\r') {s[--len] = '\0';}
+  return true;
+}
+
+void Usage() {
+  fprintf(stderr, "Usage: mergehosts [-title \"text\"] [-v] foo_host0.json foo_host1.json ...\n");
+  exit(0);
+}
+
+// Value of a "name" : "value", header line, or empty
+string HeaderString(const char* buffer, const char* name) {
+  const char* p = strstr(buffer, name);
+  if (p == NULL) {return string("");}
+  p = strchr(p + strlen(name), '"');		// Opening quote of the value
+  if (p == NULL) {return string("");}
+  const char* q = strchr(p + 1, '"');
+  if (q == NULL) {return string("");}
+  return string(p + 1, q - p - 1);
+}
+
+// yyyy-mm-dd_hh:mm:ss to seconds. Only differences matter
+int64 TracebaseSec(const string& tracebase) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(tracebase.c_str(), "%d-%d-%d_%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+             &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {return 0;}
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  return timegm(&tm);
+}
+
+// File name without directory or .json, for a host with no hostName
+string FileStem(const char* fname) {
+  const char* slash = strrchr(fname, '/');
+  string stem = string((slash == NULL) ? fname : slash + 1);
+  size_t dot = stem.rfind(".json");
+  if (dot != string::npos) {stem.erase(dot);}
+  return stem;
+}
+
+bool PktLess(const OnePkt& a, const OnePkt& b) {return a.ns < b.ns;}
+bool SpanLess(const OneSpan& a, const OneSpan& b) {return a.start_ns < b.start_ns;}
+bool PairLess(const PktPair& a, const PktPair& b) {return a.ns < b.ns;}
+
+void ReadHost(const char* fname, int hostnum, Host* host) {
+  FILE* f = fopen(fname, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "%s did not open\n", fname);
+    exit(0);
+  }
+  host->fname = string(fname);
+  host->ticks_per_sec = 0;
+  host->max_cpu = 0;
+  host->aligned = false;
+  host->ref = -1;
+  host->fit.offset_ns = 0;
+  host->fit.drift = 0.0;
+  host->fit.mid_ns = 0;
+
+  // expecting:
+  //    ts           dur        cpu pid  rpc event arg retval  ipc name
+  //  [ 22.39359781, 0.00000283, 0, 1910, 0, 2048, 3, 256, 3, "read"],
+  bool in_header = true;
+  char buffer[kMaxBufferSize];
+  while (ReadLine(f, buffer, kMaxBufferSize)) {
+    double start_ts, duration;
+    OneSpan onespan;
+    int name_pos = 0;
+    int n = sscanf(buffer, "[%lf, %lf, %d, %d, %d, %d, %d, %d, %d, %n",
+                   &start_ts, &duration,
+                   &onespan.cpu, &onespan.pid, &onespan.rpcid,
+                   &onespan.eventnum, &onespan.arg, &onespan.retval, &onespan.ipc, &name_pos);
+    if (n < 9) {
+      if (!in_header) {continue;}	// Closing ]}
+      if (ParseTicksPerSec(buffer) != 0) {host->ticks_per_sec = ParseTicksPerSec(buffer);}
+      string value = HeaderString(buffer, "\"tracebase\"");
+      if (!value.empty()) {host->tracebase = value;}
+      value = HeaderString(buffer, "\"hostName\"");
+      if (!value.empty()) {host->hostname = value;}
+      host->header.push_back(string(buffer));
+      continue;
+    }
+    in_header = false;
+    if (SpanSec(start_ts, host->ticks_per_sec) >= 999.0) {break;}	// End marker
+
+    double ns_per_unit = (host->ticks_per_sec == 0) ?
+                         1000000000.0 : 1000000000.0 / host->ticks_per_sec;
+    onespan.start_ns = llround(start_ts * ns_per_unit);
+    onespan.duration_ns = llround(duration * ns_per_unit);
+    onespan.host = hostnum;
+    onespan.rest = string(buffer + name_pos);
+    if (host->max_cpu < onespan.cpu) {host->max_cpu = onespan.cpu;}
+
+    if ((onespan.eventnum == KUTRACE_TX_PKT) || (onespan.eventnum == KUTRACE_RX_PKT)) {
+      OnePkt pkt;
+      pkt.ns = onespan.start_ns;
+      pkt.hash32 = (uint32)onespan.arg;
+      if (onespan.eventnum == KUTRACE_TX_PKT) {
+        host->tx.push_back(pkt);
+      } else {
+        host->rx.push_back(pkt);
+      }
+    }
+    host->spans.push_back(onespan);
+  }
+  fclose(f);
+
+  if (host->tracebase.empty()) {
+    fprintf(stderr, "mergehosts: %s has no tracebase\n", fname);
+    exit(0);
+  }
+  if (host->hostname.empty()) {host->hostname = FileStem(fname);}
+}
+
+// Shift every span and packet of a host by delta_ns
+void ShiftHost(int64 delta_ns, Host* host) {
+  for (int i = 0; i < (int)host->spans.size(); ++i) {host->spans[i].start_ns += delta_ns;}
+  for (int i = 0; i < (int)host->tx.size(); ++i) {host->tx[i].ns += delta_ns;}
+  for (int i = 0; i < (int)host->rx.size(); ++i) {host->rx[i].ns += delta_ns;}
+}
+
+// Packets sent on from and received on to, by hash32, that are close in time.
+// Each receive is matched with the send of the same hash nearest in time
+void MatchPackets(const Host& from, const Host& to, bool inbound, vector<PktPair>* pairs) {
+  map<uint32, vector<int64> > sent;
+  for (int i = 0; i < (int)from.tx.size(); ++i) {
+    sent[from.tx[i].hash32].push_back(from.tx[i].ns);	// Already in time order
+  }
+  for (int i = 0; i < (int)to.rx.size(); ++i) {
+    map<uint32, vector<int64> >::const_iterator it = sent.find(to.rx[i].hash32);
+    if (it == sent.end()) {continue;}
+    const vector<int64>& times = it->second;
+    int64 rx_ns = to.rx[i].ns;
+    int k = std::lower_bound(times.begin(), times.end(), rx_ns) - times.begin();
+    int64 best = -1;
+    if (k < (int)times.size()) {best = times[k];}
+    if ((0 < k) && ((best < 0) || (rx_ns - times[k - 1] < best - rx_ns))) {best = times[k - 1];}
+    if ((best < 0) || (kMatchWindowNs < llabs(rx_ns - best))) {continue;}
+
+    PktPair pair;
+    if (inbound) {
+      pair.ns = rx_ns;			// to is the host being aligned
+      pair.delta = rx_ns - best;
+    } else {
+      pair.ns = best;			// from is the host being aligned
+      pair.delta = best - rx_ns;
+    }
+    pair.inbound = inbound;
+    pairs->push_back(pair);
+  }
+}
+
+int64 FitOffset(const ClockFit& fit, int64 ns) {
+  return fit.offset_ns + llround(fit.drift * (ns - fit.mid_ns));
+}
+
+// Fit the host clock offset from matched packets, sorted by time.
+// An inbound pair's delta is an upper bound on the offset, an outbound
+// pair's delta a lower bound. Returns the number of pairs the fit still violates
+int FitClock(const vector<PktPair>& pairs, ClockFit* fit, int64* min_rtt) {
+  int64 lo_ns = pairs.front().ns;
+  int64 hi_ns = pairs.back().ns + 1;
+  int64 upper[kNumWindows];	// Min inbound delta per window
+  int64 lower[kNumWindows];	// Max outbound delta per window
+  int64 upper_ns[kNumWindows];
+  int64 lower_ns[kNumWindows];
+  bool has_upper[kNumWindows];
+  bool has_lower[kNumWindows];
+  for (int w = 0; w < kNumWindows; ++w) {has_upper[w] = has_lower[w] = false;}
+  for (int i = 0; i < (int)pairs.size(); ++i) {
+    int w = ((pairs[i].ns - lo_ns) * kNumWindows) / (hi_ns - lo_ns);
+    if (pairs[i].inbound) {
+      if (!has_upper[w] || (pairs[i].delta < upper[w])) {
+        upper[w] = pairs[i].delta;
+        upper_ns[w] = pairs[i].ns;
+        has_upper[w] = true;
+      }
+    } else {
+      if (!has_lower[w] || (lower[w] < pairs[i].delta)) {
+        lower[w] = pairs[i].delta;
+        lower_ns[w] = pairs[i].ns;
+        has_lower[w] = true;
+      }
+    }
+  }
+
+  // One estimate per window: midway if both ways, else the one bound we have
+  bool both_ways = false;
+  for (int w = 0; w < kNumWindows; ++w) {both_ways |= has_upper[w] && has_lower[w];}
+  vector<double> xs, ys;
+  *min_rtt = -1;
+  for (int w = 0; w < kNumWindows; ++w) {
+    if (has_upper[w] && has_lower[w]) {
+      xs.push_back((upper_ns[w] + lower_ns[w]) / 2.0);
+      ys.push_back((upper[w] + lower[w]) / 2.0);
+      int64 rtt = upper[w] - lower[w];
+      if ((*min_rtt < 0) || (rtt < *min_rtt)) {*min_rtt = rtt;}
+    } else if (!both_ways && has_upper[w]) {
+      xs.push_back(upper_ns[w]);
+      ys.push_back(upper[w]);
+    } else if (!both_ways && has_lower[w]) {
+      xs.push_back(lower_ns[w]);
+      ys.push_back(lower[w]);
+    }
+  }
+
+  // Least squares line, or constant if all in one window
+  int n = xs.size();
+  double mean_x = 0.0;
+  double mean_y = 0.0;
+  for (int i = 0; i < n; ++i) {mean_x += xs[i]; mean_y += ys[i];}
+  mean_x /= n;
+  mean_y /= n;
+  double sxx = 0.0;
+  double sxy = 0.0;
+  for (int i = 0; i < n; ++i) {
+    sxx += (xs[i] - mean_x) * (xs[i] - mean_x);
+    sxy += (xs[i] - mean_x) * (ys[i] - mean_y);
+  }
+  fit->mid_ns = llround(mean_x);
+  fit->offset_ns = llround(mean_y);
+  fit->drift = (sxx > 0.0) ? sxy / sxx : 0.0;
+
+  // Move the line so no packet arrives before it was sent, if possible
+  int64 over = 0;	// Most the line is above an upper bound
+  int64 under = 0;	// Most the line is below a lower bound
+  for (int i = 0; i < (int)pairs.size(); ++i) {
+    int64 diff = FitOffset(*fit, pairs[i].ns) - pairs[i].delta;
+    if (pairs[i].inbound && (over < diff)) {over = diff;}
+    if (!pairs[i].inbound && (under < -diff)) {under = -diff;}
+  }
+  if ((0 < over) && (under == 0)) {
+    fit->offset_ns -= over;
+  } else if ((over == 0) && (0 < under)) {
+    fit->offset_ns += under;
+  } else if ((0 < over) && (0 < under)) {
+    fit->offset_ns += (under - over) / 2;
+  }
+
+  int violations = 0;
+  for (int i = 0; i < (int)pairs.size(); ++i) {
+    int64 diff = FitOffset(*fit, pairs[i].ns) - pairs[i].delta;
+    if (pairs[i].inbound && (0 < diff)) {++violations;}
+    if (!pairs[i].inbound && (diff < 0)) {++violations;}
+  }
+  return violations;
+}
+
+// Align host h to aligned host ref, then move its times onto ref's clock
+void AlignHost(int h, int ref, const vector<PktPair>& pairs, Host* hosts) {
+  Host* host = &hosts[h];
+  int64 min_rtt;
+  int violations = FitClock(pairs, &host->fit, &min_rtt);
+  host->aligned = true;
+  host->ref = ref;
+
+  int inbound = 0;
+  for (int i = 0; i < (int)pairs.size(); ++i) {if (pairs[i].inbound) {++inbound;}}
+  fprintf(stderr, "mergehosts: host %d %s to host %d %s: %d packets (%d in, %d out), "
+          "offset %.3f us, drift %.3f ppm",
+          h, host->hostname.c_str(), ref, hosts[ref].hostname.c_str(),
+          (int)pairs.size(), inbound, (int)pairs.size() - inbound,
+          host->fit.offset_ns / 1000.0, host->fit.drift * 1000000.0);
+  if (0 <= min_rtt) {fprintf(stderr, ", min RTT %.3f us", min_rtt / 1000.0);}
+  fprintf(stderr, "\n");
+  if ((inbound == 0) || (inbound == (int)pairs.size())) {
+    fprintf(stderr, "mergehosts:   packets one way only; offset is just a bound\n");
+  }
+  if (0 < violations) {
+    fprintf(stderr, "mergehosts:   %d packets still arrive before they were sent\n", violations);
+  }
+
+  for (int i = 0; i < (int)host->spans.size(); ++i) {
+    host->spans[i].start_ns -= FitOffset(host->fit, host->spans[i].start_ns);
+  }
+  for (int i = 0; i < (int)host->tx.size(); ++i) {
+    host->tx[i].ns -= FitOffset(host->fit, host->tx[i].ns);
+  }
+  for (int i = 0; i < (int)host->rx.size(); ++i) {
+    host->rx[i].ns -= FitOffset(host->fit, host->rx[i].ns);
+  }
+
+  if (verbose) {
+    for (int i = 0; i < (int)pairs.size(); ++i) {
+      fprintf(stderr, "  %s %12.8f  delta %10.3f us  slack %10.3f us\n",
+              pairs[i].inbound ? "in " : "out", pairs[i].ns / 1000000000.0,
+              pairs[i].delta / 1000.0,
+              (pairs[i].delta - FitOffset(host->fit, pairs[i].ns)) / 1000.0);
+    }
+  }
+}
+
+int main(int argc, const char** argv) {
+  const char* title = NULL;
+  vector<const char*> fnames;
+  for (int i = 1; i < argc; ++i) {
+    if ((strcmp(argv[i], "-title") == 0) && (i < (argc - 1))) {
+      title = argv[++i];
+    } else if (strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else if (argv[i][0] != '-') {
+      fnames.push_back(argv[i]);
+    } else {
+      Usage();
+    }
+  }
+  int nhosts = fnames.size();
+  if (nhosts < 2) {Usage();}
+  if (kMaxHosts < nhosts) {
+    fprintf(stderr, "mergehosts: at most %d hosts\n", kMaxHosts);
+    exit(0);
+  }
+
+  Host* hosts = new Host[nhosts];
+  for (int h = 0; h < nhosts; ++h) {ReadHost(fnames[h], h, &hosts[h]);}
+
+  // Put every host on the earliest tracebase, using gettimeofday alone
+  int64 earliest_sec = TracebaseSec(hosts[0].tracebase);
+  int earliest = 0;
+  for (int h = 1; h < nhosts; ++h) {
+    if (TracebaseSec(hosts[h].tracebase) < earliest_sec) {
+      earliest_sec = TracebaseSec(hosts[h].tracebase);
+      earliest = h;
+    }
+  }
+  for (int h = 0; h < nhosts; ++h) {
+    hosts[h].base_ns = (TracebaseSec(hosts[h].tracebase) - earliest_sec) * 1000000000LL;
+    ShiftHost(hosts[h].base_ns, &hosts[h]);
+    std::sort(hosts[h].tx.begin(), hosts[h].tx.end(), PktLess);
+    std::sort(hosts[h].rx.begin(), hosts[h].rx.end(), PktLess);
+  }
+
+  // Grow the aligned set one host at a time, by most matched packets
+  hosts[0].aligned = true;
+  for (;;) {
+    int best_h = -1;
+    int best_ref = -1;
+    vector<PktPair> best_pairs;
+    for (int h = 0; h < nhosts; ++h) {
+      if (hosts[h].aligned) {continue;}
+      for (int ref = 0; ref < nhosts; ++ref) {
+        if (!hosts[ref].aligned) {continue;}
+        vector<PktPair> pairs;
+        MatchPackets(hosts[ref], hosts[h], true, &pairs);
+        MatchPackets(hosts[h], hosts[ref], false, &pairs);
+        if (best_pairs.size() < pairs.size()) {
+          best_h = h;
+          best_ref = ref;
+          best_pairs.swap(pairs);
+        }
+      }
+    }
+    if (best_h < 0) {break;}
+    std::sort(best_pairs.begin(), best_pairs.end(), PairLess);
+    AlignHost(best_h, best_ref, best_pairs, hosts);
+  }
+  for (int h = 1; h < nhosts; ++h) {
+    if (!hosts[h].aligned) {
+      fprintf(stderr, "mergehosts: host %d %s has no packets matching the other hosts; "
+              "gettimeofday alignment only\n", h, hosts[h].hostname.c_str());
+    }
+  }
+
+  // Host-prefixed CPU numbers
+  int cpu_stride = 100;
+  for (int h = 0; h < nhosts; ++h) {
+    if (100 <= hosts[h].max_cpu) {cpu_stride = 1000;}
+  }
+  string merged_title;
+  for (int h = 0; h < nhosts; ++h) {
+    fprintf(stderr, "mergehosts: host %d %s is CPUs %d..%d\n",
+            h, hosts[h].hostname.c_str(), h * cpu_stride, h * cpu_stride + hosts[h].max_cpu);
+    if (0 < h) {merged_title += " + ";}
+    merged_title += hosts[h].hostname;
+  }
+  if (title != NULL) {merged_title = string(title);}
+
+  // All spans on one timeline
+  vector<OneSpan> spans;
+  for (int h = 0; h < nhosts; ++h) {
+    for (int i = 0; i < (int)hosts[h].spans.size(); ++i) {
+      OneSpan onespan = hosts[h].spans[i];
+      if (0 <= onespan.cpu) {onespan.cpu += h * cpu_stride;}
+      spans.push_back(onespan);
+    }
+    hosts[h].spans.clear();
+  }
+  std::stable_sort(spans.begin(), spans.end(), SpanLess);
+
+  // Header of the first file, in its units
+  int64 ticks_per_sec = hosts[0].ticks_per_sec;
+  for (int i = 0; i < (int)hosts[0].header.size(); ++i) {
+    const char* line = hosts[0].header[i].c_str();
+    if (strstr(line, "\"title\"") != NULL) {
+      fprintf(stdout, " \"title\" : \"%s\",\n", merged_title.c_str());
+    } else if (strstr(line, "\"tracebase\"") != NULL) {
+      fprintf(stdout, " \"tracebase\" : \"%s\",\n", hosts[earliest].tracebase.c_str());
+    } else if (strstr(line, "\"hostName\"") != NULL) {
+      // Dropped; each host's name is in the title
+    } else {
+      fprintf(stdout, "%s\n", line);
+    }
+  }
+
+  double units_per_ns = (ticks_per_sec == 0) ? 1.0 / 1000000000.0 : ticks_per_sec / 1000000000.0;
+  for (int i = 0; i < (int)spans.size(); ++i) {
+    const OneSpan& onespan = spans[i];
+    if (onespan.start_ns < 0) {continue;}	// Aligned to before the tracebase
+    PrintSpanTimes(stdout, ticks_per_sec,
+                   onespan.start_ns * units_per_ns, onespan.duration_ns * units_per_ns);
+    fprintf(stdout, "%d, %d, %d, %d, %d, %d, %d, %s\n",
+            onespan.cpu, onespan.pid, onespan.rpcid, onespan.eventnum,
+            onespan.arg, onespan.retval, onespan.ipc, onespan.rest.c_str());
+  }
+  PrintFinalJson(stdout, ticks_per_sec);
+  fprintf(stderr, "mergehosts: %d hosts, %d spans\n", nhosts, (int)spans.size());
+
+  delete[] hosts;
+  return 0;
+}
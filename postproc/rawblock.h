@@ -0,0 +1,477 @@
+// rawblock.h
+//
+// Decode raw KUtrace files: one reader for rawtoevent, checktrace, and kuod.
+//
+// A raw trace is a sequence of 64KB trace blocks. If the IPC flag is set in
+// the first block, each trace block is followed by an 8KB block holding one
+// IPC byte per trace word. Every trace block starts with the CPU number and
+// cycle counter, then flags and gettimeofday. The very first block has six
+// more words for the start and stop time pairs. In trace version 3 and later,
+// each block then has a four-word PID header for the thread running when the
+// block was started. Entries follow, one to eight words each.
+//
+// The reader maps the whole file if it can, so blocks are decoded in place;
+// otherwise, such as from a pipe, it reads one block at a time into its own
+// buffers. Nothing is allocated per block or per entry.
+//
+// The entry iterator also rebuilds full cycle-counter timestamps from the
+// 20-bit truncated ones in each entry, including wraparound, late stores, and
+// TSDELTA entries. This must match the late-store compare in kutrace_mod.c.
+//
+// Most entries are one word, with no TSDELTA. Runs of those can have their
+// timestamps rebuilt four at a time as a running sum of wraparound carries,
+// with AVX2 where the CPU has it. Everything else goes entry by entry.
+//
+
+#ifndef __RAWBLOCK_H__
+#define __RAWBLOCK_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define RAWBLOCK_AVX2 1
+#endif
+
+#include "basetypes.h"
+#include "kutrace_lib.h"
+
+// Flags in the top byte of block word [1]. Version 3 all values are pre-shifted
+#define IPC_Flag     0x80
+#define WRAP_Flag    0x40
+#define Unused2_Flag 0x20
+#define Unused1_Flag 0x10
+#define VERSION_MASK 0x0F
+
+static const int kTraceBufSize = 8192;	// uint64 count, 64KB per trace block
+static const int kIpcBufSize = 8192;	// uint8 count, one IPC byte per trace word
+static const int kFirstBlockHeader = 8;	// Words before the PID header, very first block
+static const int kBlockHeader = 2;	// Words before the PID header, other blocks
+static const int kPidHeader = 4;	// Version 3 and later
+
+// Large ts difference means slightly backward time
+static const uint64 kLargeTsdelta = 2000000000;
+
+// For deciding that large timestamp advance is really a late store with backward time.
+static const uint64 kLateStoreThresh = 0x0000000000020000LLU;
+
+inline int RawVersion(uint8 flags) {return flags & VERSION_MASK;}
+inline bool RawHasIpc(uint8 flags) {return (flags & IPC_Flag) != 0;}
+inline bool RawHasWrap(uint8 flags) {return (flags & WRAP_Flag) != 0;}
+
+// Variable-length entries are names; the middle hex digit is the word count
+inline bool RawIsVarLen(uint64 event) {
+  if (event == KUTRACE_PC_TEMP) {return false;}
+  return (KUTRACE_VARLENLO <= event) && (event <= KUTRACE_VARLENHI);
+}
+
+// Most events are 1 word; a few are longer. A name with a length outside
+// 1..8 is bogus and is taken as one word
+inline int RawEventLen(uint64 event) {
+  // Historical mistakes
+  if (event == KUTRACE_PC_TEMP) {return 2;}
+  if (event == KUTRACE_PC_U) {return 2;}
+  if (event == KUTRACE_PC_K) {return 2;}
+  if (RawIsVarLen(event)) {
+    int len = (event >> 4) & 0x00F;
+    return ((1 <= len) && (len <= 8)) ? len : 1;
+  }
+  return 1;
+}
+
+// We wrapped if prior > now, except that we allow a modest amount of going backwards
+// because an interrupt entry can get recorded in the midst of recording say a
+// syscallentry, in which case the stored irq entry's timestamp may be later than
+// the subsequently-written syscall entry's timestamp. We allow 4K counts backward
+// (about 80 usec at nominal 20 ns/count). Count increment should be kept between
+// 10 nsec and 40 nsec.
+inline bool RawWrapped(uint64 prior, uint64 now) {
+  if (prior <= now) {return false;}	// Common case
+  return (prior > (now + 4096));	// Wrapped if prior is larger
+}
+
+inline bool RawLateStore(uint64 prior, uint64 now) {
+  if (prior <= now) {return false;}		// Common case
+  return (prior <= (now + kLateStoreThresh));	// Late store
+}
+
+//   +-------+-----------------------+-------------------------------+
+//   | cpu#  |                  cycle counter                        | 0 module
+//   +-------+-----------------------+-------------------------------+
+//   | flags |                  gettimeofday                         | 1 DoDump
+//   ~  very first block only: start/stop time pairs, two unused     ~ 2..7
+//   +-------------------------------+-------------------------------+
+//   |           (freq)              |            PID                | 2 or 8  module
+//   +-------------------------------+-------------------------------+
+//   |                          u n u s e d                          | 3 or 9  module
+//   +-------------------------------+-------------------------------+
+//   |                                                               | 4 or 10 module
+//   +                            pidname                            +
+//   |                                                               | 5 or 11 module
+//   +-------------------------------+-------------------------------+
+typedef struct {
+  uint64* words;	// kTraceBufSize words. Scratch; changes do not reach the file
+  const uint8* ipc;	// kIpcBufSize bytes, or NULL if the trace has no IPC
+  int64 offset;		// Byte offset of the block in the file
+  int trace_bytes;	// Bytes present; short only if the file is truncated
+  int ipc_bytes;
+  int blocknum;
+  int cpu;
+  uint8 flags;
+  uint64 base_cycle;
+  uint64 gtod;		// gettimeofday usec
+  int header_words;	// kFirstBlockHeader or kBlockHeader
+  int first_entry;	// After any PID header
+} RawBlock;
+
+inline uint64 RawBlockPid(const RawBlock& block) {
+  return block.words[block.header_words] & 0x00000000ffffffffLLU;
+}
+
+inline uint64 RawBlockFreq(const RawBlock& block) {
+  return block.words[block.header_words] >> 32;
+}
+
+// pidname must hold 17 bytes
+inline void RawBlockPidName(const RawBlock& block, char* pidname) {
+  memcpy(pidname, reinterpret_cast<const char*>(&block.words[block.header_words + 2]), 16);
+  pidname[16] = '\0';
+}
+
+typedef struct {
+  FILE* f;
+  uint8* map_base;	// Whole file mapped, or NULL to fread
+  size_t map_size;
+  size_t pos;		// Next byte in the mapping
+  int64 offset;		// Next byte in the file
+  int blocknum;
+  bool has_ipc;		// From the first block
+  int version;		// From the first block
+  uint64 tracebuf[kTraceBufSize];
+  uint8 ipcbuf[kIpcBufSize];
+} RawReader;
+
+// Start reading at the current position of f. The caller still owns f
+inline void InitRawReader(FILE* f, RawReader* reader) {
+  reader->f = f;
+  reader->map_base = NULL;
+  reader->map_size = 0;
+  reader->pos = 0;
+  reader->offset = 0;
+  reader->blocknum = 0;
+  reader->has_ipc = false;
+  reader->version = 0;
+
+  struct stat st;
+  int fd = fileno(f);
+  long start = ftell(f);	// Not lseek, which misses anything f has buffered
+  if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (start < 0) ||
+      (st.st_size <= start)) {return;}
+  void* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) {return;}
+  reader->map_base = (uint8*)base;
+  reader->map_size = st.st_size;
+  reader->pos = start;
+}
+
+inline void CloseRawReader(RawReader* reader) {
+  if (reader->map_base != NULL) {munmap(reader->map_base, reader->map_size);}
+  reader->map_base = NULL;
+}
+
+// Up to want bytes, in place if mapped and all there, else in buf zero-filled
+inline uint8* RawRead(RawReader* reader, int want, uint8* buf, int* got) {
+  if (reader->map_base == NULL) {
+    *got = fread(buf, 1, want, reader->f);
+    if (*got < want) {memset(buf + *got, 0, want - *got);}
+    reader->offset += *got;
+    return buf;
+  }
+  size_t avail = reader->map_size - reader->pos;
+  *got = (avail < (size_t)want) ? avail : want;
+  uint8* ptr = reader->map_base + reader->pos;
+  if (*got < want) {
+    memcpy(buf, ptr, *got);
+    memset(buf + *got, 0, want - *got);
+    ptr = buf;
+  }
+  reader->pos += *got;
+  reader->offset += *got;
+  return ptr;
+}
+
+// Next trace block and its IPC bytes. Return false at end of file
+inline bool NextRawBlock(RawReader* reader, RawBlock* block) {
+  // At the end of a mapped file, leave the buffers alone so that a short last
+  // block copied there stays valid
+  if ((reader->map_base != NULL) && (reader->map_size <= reader->pos)) {return false;}
+  block->offset = reader->offset;
+  block->words = (uint64*)RawRead(reader, kTraceBufSize * 8, (uint8*)reader->tracebuf,
+                                  &block->trace_bytes);
+  if (block->trace_bytes == 0) {return false;}
+
+  block->flags = block->words[1] >> 56;
+  if (reader->blocknum == 0) {
+    reader->has_ipc = RawHasIpc(block->flags);
+    reader->version = RawVersion(block->flags);
+  }
+  block->ipc = NULL;
+  block->ipc_bytes = 0;
+  if (reader->has_ipc) {
+    block->ipc = RawRead(reader, kIpcBufSize, reader->ipcbuf, &block->ipc_bytes);
+  }
+
+  block->blocknum = reader->blocknum++;
+  block->cpu = block->words[0] >> 56;
+  block->base_cycle = block->words[0] & 0x00ffffffffffffffLLU;
+  block->gtod = block->words[1] & 0x00ffffffffffffffLLU;
+  block->header_words = (block->blocknum == 0) ? kFirstBlockHeader : kBlockHeader;
+  block->first_entry = block->header_words + ((reader->version >= 3) ? kPidHeader : 0);
+  return true;
+}
+
+// +-------------------+-----------+---------------+-------+-------+
+// | timestamp         | event     | delta | retval|      arg0     |
+// +-------------------+-----------+---------------+-------+-------+
+//          20              12         8       8           16
+typedef struct {
+  int index;		// Word number in the block
+  int len;		// Words, including any name or PC sample words, within the block
+  bool truncated;	// Entry runs past the end of the block; len is cut short
+  uint64 word;
+  uint64 t;		// Truncated timestamp
+  uint64 event;
+  uint64 arg;		// Low 16 bits
+  uint64 argall;	// Low 32 bits
+  uint64 arg_hi;	// Bits <31:16>
+  uint64 delta_t;	// Optimized call return time
+  uint64 retval;	// Optimized call return value, not sign extended
+  uint8 ipc;
+  uint64 cycles;	// Full timestamp rebuilt from t
+} RawEntry;
+
+// Full timestamps for a whole block, filled in by RawDecodeBlockTimes
+typedef struct {
+  int end;		// Entries before this word number have cycles
+  uint64 cycles[kTraceBufSize];
+} RawBlockTimes;
+
+typedef struct {
+  const RawBlock* block;
+  int next;		// Word number of the next entry
+  uint64 prepend;	// High bits of the full timestamp
+  uint64 prior_t;
+  const RawBlockTimes* times;	// Precomputed, or NULL
+} RawEntryIter;
+
+inline void InitRawEntryIter(const RawBlock* block, RawEntryIter* iter) {
+  iter->block = block;
+  iter->next = block->first_entry;
+  iter->times = NULL;
+  iter->prepend = block->base_cycle & ~0xfffffLLU;
+  // The base cycle count for this block may well be a bit later than the truncated time
+  // in the first real entry, and may have wrapped in its low 20 bits. If so, the high bits
+  // we want to prepend should be one smaller.
+  iter->prior_t = block->words[block->header_words] >> 44;
+  if (RawWrapped(iter->prior_t, block->base_cycle)) {iter->prepend -= 0x100000;}
+}
+
+/*
+ * In recording a trace event, it is possible for an interrupt to happen after
+ * KUtrace code takes the event timestamp and before it claims the storage location.
+ * In this case, the interupt handling will recursively record several events
+ * before returning to the original KUtrace path, which then claims a location
+ * and stores the original event with its earlier timestamp. This is called a
+ * "late store." When that happens, the reconstruciton needs to
+ * decide whether time went forward by almost the entire 20-bit wraparound
+ * period, or went backward by some amount.
+ *
+ * To resolve this ambiguity, we declare that a time gap of 7/8 of the wraparound
+ * period is forward time and the high 1/8 is backward time associated with an
+ * otherwise undetectable backward time.
+ *
+ * To mark forward time in that 1/8 (and above), we add a TSDELTA entry to the
+ * trace. The exact compare for late store must be identical in kutrace_mod.c
+ * and here.
+ */
+inline void RawAdvanceTime(RawEntryIter* iter, RawEntry* entry) {
+  // All-zero NOP entries and mostly-FFFF entries carry no time
+  if ((entry->word == 0) || ((entry->t == 0xFFFFF) && (entry->event == 0xFFF))) {
+    entry->cycles = iter->prepend | iter->prior_t;
+    return;
+  }
+
+  // TSDELTA arg has the time difference between this entry and previous one,
+  // in units of timestamp ticks (10-20nsec). If time goes backward a little,
+  // difference will be large, otherwise it will be a small number of millions.
+  if (entry->event == KUTRACE_TSDELTA) {
+    uint64 oldfull = iter->prepend | iter->prior_t;
+    uint64 newfull;
+    if (entry->argall < kLargeTsdelta) {
+      newfull = oldfull + entry->argall;	// Increment time by delta
+    } else {
+      newfull = oldfull + (0xFFFFFFFF00000000LLU | entry->argall);	// Sign extend arg
+    }
+    iter->prepend = newfull & ~0xfffffLLU;
+    iter->prior_t = newfull & 0xfffffLLU;
+    entry->cycles = newfull;
+    return;
+  }
+
+  // Increment the prepend if truncated time rolls over and not caused by a late store
+  if (RawWrapped(iter->prior_t, entry->t) && !RawLateStore(iter->prior_t, entry->t)) {
+    iter->prepend += 0x100000;
+  }
+  iter->prior_t = entry->t;
+  entry->cycles = iter->prepend | entry->t;
+}
+
+// Next entry in the block, stepping over the extra words of longer entries.
+// Every word position is visited, including all-zero NOPs and the all-ones
+// end-of-block filler; the caller decides what to skip.
+// A multi-word entry that would run past the end of the block, which only a
+// damaged trace has, comes back truncated with len cut to the words left, so
+// callers never read beyond the block; it is the last entry of the block.
+// Return false at end of block
+inline bool NextRawEntry(RawEntryIter* iter, RawEntry* entry) {
+  if (kTraceBufSize <= iter->next) {return false;}
+  const RawBlock* block = iter->block;
+  int i = iter->next;
+  uint64 word = block->words[i];
+  entry->index = i;
+  entry->word = word;
+  entry->t = word >> 44;
+  entry->event = (word >> 32) & 0xfff;
+  entry->arg = word & 0x0000ffff;
+  entry->argall = word & 0xffffffff;
+  entry->arg_hi = (word >> 16) & 0xffff;
+  entry->delta_t = (word >> 24) & 0xff;
+  entry->retval = (word >> 16) & 0xff;
+  entry->ipc = (block->ipc == NULL) ? 0 : block->ipc[i];
+  entry->len = (word == 0) ? 1 : RawEventLen(entry->event);
+  entry->truncated = (kTraceBufSize < i + entry->len);
+  if (entry->truncated) {entry->len = kTraceBufSize - i;}
+  if ((iter->times != NULL) && (i < iter->times->end)) {
+    entry->cycles = iter->times->cycles[i];
+  } else {
+    RawAdvanceTime(iter, entry);
+  }
+  iter->next = i + entry->len;
+  return true;
+}
+
+// Decode the entry at word i the long way, advancing iter. Return its length
+inline int RawStepTime(RawEntryIter* iter, int i, RawBlockTimes* times) {
+  RawEntry entry;
+  entry.word = iter->block->words[i];
+  entry.t = entry.word >> 44;
+  entry.event = (entry.word >> 32) & 0xfff;
+  entry.argall = entry.word & 0xffffffff;
+  RawAdvanceTime(iter, &entry);
+  times->cycles[i] = entry.cycles;
+  return (entry.word == 0) ? 1 : RawEventLen(entry.event);
+}
+
+inline void RawDecodeTimesScalar(RawEntryIter* iter, RawBlockTimes* times) {
+  const uint64* words = iter->block->words;
+  int i = iter->next;
+  while ((i < kTraceBufSize) && (words[i] != 0xffffffffffffffffLLU)) {
+    i += RawStepTime(iter, i, times);
+  }
+  times->end = i;
+}
+
+#ifdef RAWBLOCK_AVX2
+// Four entries at a time wherever four one-word entries in a row qualify,
+// else one entry the long way. For one-word entries, RawWrapped && !RawLateStore
+// reduces to prior_t > t + kLateStoreThresh, so the carry into each entry is
+// a compare with the entry before it. A prefix sum of the carries across the
+// four lanes, plus the running prepend, gives the high bits
+__attribute__((target("avx2")))
+inline void RawDecodeTimesAvx2(RawEntryIter* iter, RawBlockTimes* times) {
+  const uint64* words = iter->block->words;
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones32 = _mm256_set1_epi64x(0xffffffffLL);
+  const __m256i evmask = _mm256_set1_epi64x(0xfff);
+  const __m256i varlenlo = _mm256_set1_epi64x(KUTRACE_VARLENLO - 1);
+  const __m256i varlenhi = _mm256_set1_epi64x(KUTRACE_VARLENHI + 1);
+  const __m256i pc_u = _mm256_set1_epi64x(KUTRACE_PC_U);
+  const __m256i pc_k = _mm256_set1_epi64x(KUTRACE_PC_K);
+  const __m256i tsdelta = _mm256_set1_epi64x(KUTRACE_TSDELTA);
+  const __m256i thresh = _mm256_set1_epi64x(kLateStoreThresh);
+  int i = iter->next;
+  while ((i < kTraceBufSize) && (words[i] != 0xffffffffffffffffLLU)) {
+    if (kTraceBufSize < i + 4) {
+      i += RawStepTime(iter, i, times);
+      continue;
+    }
+    __m256i w = _mm256_loadu_si256((const __m256i*)&words[i]);
+    __m256i hi = _mm256_srli_epi64(w, 32);
+    __m256i ev = _mm256_and_si256(hi, evmask);
+    __m256i bad = _mm256_or_si256(_mm256_cmpeq_epi64(w, zero), _mm256_cmpeq_epi64(hi, ones32));
+    bad = _mm256_or_si256(bad, _mm256_and_si256(_mm256_cmpgt_epi64(ev, varlenlo),
+                                                _mm256_cmpgt_epi64(varlenhi, ev)));
+    bad = _mm256_or_si256(bad, _mm256_cmpeq_epi64(ev, pc_u));
+    bad = _mm256_or_si256(bad, _mm256_cmpeq_epi64(ev, pc_k));
+    bad = _mm256_or_si256(bad, _mm256_cmpeq_epi64(ev, tsdelta));
+    if (!_mm256_testz_si256(bad, bad)) {
+      i += RawStepTime(iter, i, times);
+      continue;
+    }
+
+    // prior = [prior_t, t0, t1, t2]
+    __m256i t = _mm256_srli_epi64(w, 44);
+    __m256i prior = _mm256_blend_epi32(_mm256_permute4x64_epi64(t, 0x90),
+                                       _mm256_set1_epi64x(iter->prior_t), 0x03);
+    // 1 where prior > t + thresh, else 0
+    __m256i carry = _mm256_sub_epi64(zero,
+                      _mm256_cmpgt_epi64(prior, _mm256_add_epi64(t, thresh)));
+    // [c0, c0+c1, c0+c1+c2, c0+c1+c2+c3]
+    carry = _mm256_add_epi64(carry,
+              _mm256_blend_epi32(_mm256_permute4x64_epi64(carry, 0x90), zero, 0x03));
+    carry = _mm256_add_epi64(carry,
+              _mm256_blend_epi32(_mm256_permute4x64_epi64(carry, 0x40), zero, 0x0F));
+    __m256i high = _mm256_add_epi64(_mm256_set1_epi64x(iter->prepend),
+                                    _mm256_slli_epi64(carry, 20));
+    _mm256_storeu_si256((__m256i*)&times->cycles[i], _mm256_or_si256(high, t));
+    iter->prepend = _mm256_extract_epi64(high, 3);
+    iter->prior_t = _mm256_extract_epi64(t, 3);
+    i += 4;
+  }
+  times->end = i;
+}
+#endif
+
+// Rebuild the timestamps for the whole block up front, up to any all-ones
+// filler, and have iter use them. Call right after InitRawEntryIter
+inline void RawDecodeBlockTimes(RawEntryIter* iter, RawBlockTimes* times) {
+#ifdef RAWBLOCK_AVX2
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if (has_avx2) {
+    RawDecodeTimesAvx2(iter, times);
+  } else {
+    RawDecodeTimesScalar(iter, times);
+  }
+#else
+  RawDecodeTimesScalar(iter, times);
+#endif
+  iter->times = times;
+}
+
+// Number of entries whose precomputed cycles differ from the entry-by-entry
+// rebuild, for checking RawDecodeBlockTimes
+inline int RawCheckBlockTimes(const RawBlock* block, const RawBlockTimes* times) {
+  int mismatches = 0;
+  RawEntryIter iter;
+  InitRawEntryIter(block, &iter);
+  RawEntry entry;
+  while (NextRawEntry(&iter, &entry) && (entry.index < times->end)) {
+    if (entry.cycles != times->cycles[entry.index]) {++mismatches;}
+  }
+  return mismatches;
+}
+
+#endif	// __RAWBLOCK_H__
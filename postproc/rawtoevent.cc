@@ -15,6 +15,10 @@
 // dsites 2022.08.19 Add RPi tweaks
 // dsites 2023.04.30 Update TSDELTA processing to go backward
 // dsites 2023.05.03 Update timestamp processing to go backward in top 7/8 of wrap period
+// 2026.10.17 Block reading and timestamp reconstruction moved to rawblock.h,
+//            shared with checktrace and kuod. Reads in place from a mapped file
+// 2026.10.17 Whole-block timestamp decode, four one-word entries at a time with AVX2
+//            if available. -check compares it against the entry-by-entry decode
 //
 
 
@@ -35,6 +39,15 @@
 ////#include "kutrace_control_names.h"
 #include "kutrace_lib.h"
 
+#include "kupostproc.h"
+#include "rawblock.h"
+
+namespace rawtoevent {
+
+// Input and output streams. stdin/stdout except when run inside kupostproc
+static FILE* infile = NULL;
+static FILE* outfile = NULL;
+
 // To come from names in trace
 static int gTIMER_IRQ_EVENT = 0x05ec;	// local_timer
 static int gSCHED_EVENT = 0x0dff;	// -sched-
@@ -52,6 +65,7 @@ static int gSCHED_EVENT = 0x0dff;	// -sched-
 // Global for debugging
 bool verbose = false;
 bool hexevent = false;
+bool docheck = false;
 
 //VERYTEMP
 bool keep_idle = false;
@@ -69,24 +83,9 @@ static const int kDefaultLowResNsec10 = 35;	// Low-res riscv: 0 dur => 350 nsec
 // For sanity checks
 static const uint64 usec_per_100_years = 1000000LL * 86400 * 365 * 100;  // Thru ~2070
 
-// Large ts difference means slightly backward time
-static const uint64 kLargeTsdelta = 2000000000;	
-
 // For dealing with riscv poor-resolution sifive u74-mc clock (1MHz)
 bool is_low_res_ts = false;		// True for Riscv u74 1 MHz timestamp
 
-
-// For deciding that large timestamp advance is really a late store with backward time.
-static const uint64 kLateStoreThresh = 0x0000000000020000LLU;
-
-// Version 3 all values are pre-shifted
-
-#define IPC_Flag     0x80
-#define WRAP_Flag    0x40
-#define Unused2_Flag 0x20
-#define Unused1_Flag 0x10
-#define VERSION_MASK 0x0F
-
 #define RDTSC_SHIFT 0 
 #define OLD_RDTSC_SHIFT 6
 
@@ -185,8 +184,6 @@ using std::string;
 
 static double kDefaultSlope = 0.000285714;  // 1/3500, dclab-3 at 3.5 GHz
 
-// Number of uint64 values per trace block
-static const int kTraceBufSize = 8192;
 // Number trace blocks per MB
 static const double kTraceBlocksPerMB = 16.0;
 
@@ -231,11 +228,11 @@ void SetParams(int64 start_cycles, int64 start_usec,
   params->m_slope = (stop_usec - start_usec) * 1.0 / (stop_cycles - start_cycles);
   params->m_slope_nsec10 = params->m_slope * 100.0;
   if (verbose) {
-    fprintf(stdout, "SetParams maps %18lldcy ==> %18lldus\n", start_cycles, start_usec);
-    fprintf(stdout, "SetParams maps %18lldcy ==> %18lldus\n", stop_cycles, stop_usec);
-    fprintf(stdout, "          diff %18lldcy ==> %18lldus\n", stop_cycles - start_cycles, stop_usec - start_usec);
+    fprintf(outfile, "SetParams maps %18lldcy ==> %18lldus\n", start_cycles, start_usec);
+    fprintf(outfile, "SetParams maps %18lldcy ==> %18lldus\n", stop_cycles, stop_usec);
+    fprintf(outfile, "          diff %18lldcy ==> %18lldus\n", stop_cycles - start_cycles, stop_usec - start_usec);
     // Assume that cy increments every 64 CPU cycles
-    fprintf(stdout, "SetParams slope %f us/cy (%f MHz)\n", params->m_slope, 64.0/params->m_slope);
+    fprintf(outfile, "SetParams slope %f us/cy (%f MHz)\n", params->m_slope, 64.0/params->m_slope);
   }
 }
 
@@ -243,7 +240,7 @@ void SetParams10(int64 start_cycles10, int64 start_nsec10, CyclesToUsecParams* p
   params->base_cycles10 = start_cycles10;
   params->base_nsec10 = start_nsec10;
   if (verbose) {
-    fprintf(stdout, "SetParams10 maps %16lldcy ==> %lldns10\n", start_cycles10, start_nsec10);
+    fprintf(outfile, "SetParams10 maps %16lldcy ==> %lldns10\n", start_cycles10, start_nsec10);
   }
 }
 
@@ -286,23 +283,6 @@ const char* FormatUsecDateTime(int64 us) {
   return gTempPrintBuffer;
 }
 
-// We wrapped if prior > now, except that we allow a modest amount of going backwards
-// because an interrupt entry can get recorded in the midst of recording say a
-// syscallentry, in which case the stored irq entry's timestamp may be later than
-// the subsequently-written syscall entry's timestamp. We allow 4K counts backward
-// (about 80 usec at nominal 20 ns/count). Count increment should be kept between
-// 10 nsec and 40 nsec.
-
-inline bool Wrapped(uint64 prior, uint64 now) {
-  if (prior <= now) {return false;}	// Common case 
-  return (prior > (now + 4096));	// Wrapped if prior is larger
-}
-
-inline bool LateStore(uint64 prior, uint64 now) {
-  if (prior <= now) {return false;}		// Common case 
-  return (prior <= (now + kLateStoreThresh));	// Late store 
-}
- 
 // A user-mode-execution event is the pid number plus 64K
 uint64 PidToEvent(uint64 pid) {return (pid & 0xFFFF) | 0x10000;}
 uint64 EventToPid(uint64 event) {return event & 0xFFFF;}
@@ -414,26 +394,12 @@ inline bool is_bottom_half(uint64 event) {
 }
 
 
-
-int TracefileVersion(uint8 flags) {
-  return flags & VERSION_MASK;
-}
-
-int HasIPC(uint8 flags) {
-  return (flags & IPC_Flag) != 0;
-}
-
-int HasWraparound(uint8 flags) {
-  return (flags & WRAP_Flag) != 0;
-}
-
-
 // Change any spaces and non-Ascii to underscore
 // time dur event pid name(event)
 void OutputName(FILE* f, uint64 nsec10, uint64 event, uint32 argall, const char* name) {
   // Avoid crazy big times
   if (nsec10 >= 99900000000LL) {
-    if (verbose) {fprintf(stdout, "BUG ts=%lld\n", nsec10);}
+    if (verbose) {fprintf(outfile, "BUG ts=%lld\n", nsec10);}
     return;
   }
 
@@ -458,7 +424,7 @@ void OutputEvent(FILE* f,
   if (duration >= 99900000000LL) {fail = true;}
   if (nsec10 + duration >= 99900000000LL) {fail = true;}
   if (fail) {
-    if (verbose) {fprintf(stdout, "BUG %lld %lld\n", nsec10, duration);}
+    if (verbose) {fprintf(outfile, "BUG %lld %lld\n", nsec10, duration);}
     return;
   }
 
@@ -642,21 +608,21 @@ bool handle_very_first_block (uint64* traceblock, uint64* base_usec_timestamp, C
       
       // Record where we stand 
       //fprintf(stderr, "# counts per second %3.1f MHz\n", counts_per_usec);
-      //fprintf(stdout, "# counts per second %3.1f MHz\n", counts_per_usec);
+      //fprintf(outfile, "# counts per second %3.1f MHz\n", counts_per_usec);
       if (counts_per_usec < 10.0) {
         fprintf(stderr, "rawtoevent: ... Low-resolution timestamps ...\n");
       }
       
       if (verbose || hexevent) {
-        fprintf(stdout, "%% %016llx = %lldcy %lldus (%lld mod 1min)\n", 
+        fprintf(outfile, "%% %016llx = %lldcy %lldus (%lld mod 1min)\n", 
           traceblock[2], start_counts, start_usec, start_usec % 60000000l);
-        fprintf(stdout, "%% %016llx\n", traceblock[3]);
-        fprintf(stdout, "%% %016llx = %lldcy %lldus (%lld mod 1min)\n", 
+        fprintf(outfile, "%% %016llx\n", traceblock[3]);
+        fprintf(outfile, "%% %016llx = %lldcy %lldus (%lld mod 1min)\n", 
           traceblock[4], stop_counts, stop_usec, stop_usec % 60000000l);
-        fprintf(stdout, "%% %016llx\n", traceblock[5]);
-        fprintf(stdout, "%% %016llx unused\n", traceblock[6]);
-        fprintf(stdout, "%% %016llx unused\n", traceblock[7]);
-        fprintf(stdout, "\n");
+        fprintf(outfile, "%% %016llx\n", traceblock[5]);
+        fprintf(outfile, "%% %016llx unused\n", traceblock[6]);
+        fprintf(outfile, "%% %016llx unused\n", traceblock[7]);
+        fprintf(outfile, "\n");
       }
 
       // Now do some error checking 
@@ -709,9 +675,12 @@ bool handle_very_first_block (uint64* traceblock, uint64* base_usec_timestamp, C
 }
 
 //
-// Usage: rawtoevent <trace file name> [-v] [-h] [-maxblock n]
+// Usage: rawtoevent <trace file name> [-v] [-h] [-maxblock n] [-check]
 //
-int main (int argc, const char** argv) {
+int RawToEvent(int argc, const char** argv, FILE* in, FILE* out) {
+  infile = in;
+  outfile = out;
+
   // Some statistics
   uint64 base_usec_timestamp;
   uint64 event_count = 0;
@@ -727,8 +696,9 @@ int main (int argc, const char** argv) {
 
   int maxblock = 999999999;
   uint64 current_cpu = 0;
-  uint64 traceblock[kTraceBufSize];	// 8 bytes per trace entry
-  uint8 ipcblock[kTraceBufSize];	// One byte per trace entry
+  RawReader reader;			// Trace blocks, in place if the file maps
+  RawBlockTimes block_times;		// Whole-block timestamps, if the block allows
+  int check_mismatches = 0;		// For -check
 
   uint64 current_pid[kMAX_CPUS];	// Keep track of current PID on each of 16+ cores
   uint64 current_rpc[kMAX_CPUS]; 	// Keep track of current rpcid on each of 1+6 cores
@@ -752,6 +722,7 @@ int main (int argc, const char** argv) {
   for (int i = 1; i < argc; ++i) {
     if (strcmp(argv[i], "-v") == 0) {verbose = true;}
     if (strcmp(argv[i], "-h") == 0) {hexevent = true;}
+    if (strcmp(argv[i], "-check") == 0) {docheck = true;}
     if ((strcmp(argv[i], "-maxblock") == 0) && (i < (argc - 1))) {
       ++i;
       maxblock = atoi(argv[i]);
@@ -768,7 +739,7 @@ int main (int argc, const char** argv) {
   // For converting cycle counts to multiples of 100ns
   double m = kDefaultSlope;
 
-  FILE* f = stdin;
+  FILE* f = infile;
   if (argc >= 2) {
     f = fopen(argv[1], "rb");
     if (f == NULL) {
@@ -777,11 +748,13 @@ int main (int argc, const char** argv) {
     }
   }
 
+  InitRawReader(f, &reader);
+
   int blocknumber = 0;
   uint64 base_minute_usec, base_minute_cycle, base_minute_shift;
 
   // Need this to sort in front of allthe timestamps
-  fprintf(stdout, "# ## VERSION: %d\n", kRawVersionNumber);
+  fprintf(outfile, "# ## VERSION: %d\n", kRawVersionNumber);
   uint8 all_flags = 0;	// They should all be the same
   uint8 first_flags;	// Just first block has tracefile version number
 
@@ -789,28 +762,30 @@ int main (int argc, const char** argv) {
   //--------------------------------------------------------------------------//
   // Outer loop over blocks                                                   //
   //--------------------------------------------------------------------------//
-  while (fread(traceblock, 1, sizeof(traceblock), f) != 0) {
+  RawBlock block;
+  while (NextRawBlock(&reader, &block)) {
     if (blocknumber >= maxblock) {break;}
+    uint64* traceblock = block.words;
 
     // Need first [1] line to get basetime in later steps
     // TODO: Move this to a stylized BASETIME comment
-    ////fprintf(stdout, "# blocknumber %d\n", blocknumber);
+    ////fprintf(outfile, "# blocknumber %d\n", blocknumber);
     // These are stylized comments that eventtospan depends on for initial time
-    fprintf(stdout, "# [0] %016llx cpu %02llx block %d\n", 
+    fprintf(outfile, "# [0] %016llx cpu %02llx block %d\n", 
             traceblock[0],
             traceblock[0] >> 56,
             blocknumber);
-    fprintf(stdout, "# [1] %s cpu %02llx flags %02llx block %d\n",
+    fprintf(outfile, "# [1] %s cpu %02llx flags %02llx block %d\n",
             FormatUsecDateTime(traceblock[1] & 0x00fffffffffffffful),
             traceblock[0] >> 56, 
             traceblock[1] >> 56,
             blocknumber);
-    fprintf(stdout, 
+    fprintf(outfile, 
             "# TS      DUR EVENT CPU PID RPC ARG0 RETVAL IPC NAME (t and dur multiples of 10ns)\n");
 
     if (verbose || hexevent) {
-       fprintf(stdout, "%% %02llx %014llx\n", traceblock[0] >> 56, traceblock[0] & 0x00fffffffffffffful);
-       fprintf(stdout, "%% %02llx %014llx\n", traceblock[1] >> 56, traceblock[1] & 0x00fffffffffffffful);
+       fprintf(outfile, "%% %02llx %014llx\n", traceblock[0] >> 56, traceblock[0] & 0x00fffffffffffffful);
+       fprintf(outfile, "%% %02llx %014llx\n", traceblock[1] >> 56, traceblock[1] & 0x00fffffffffffffful);
     }
 //   +-------+-----------------------+-------------------------------+
 //   | cpu#  |                  cycle counter                        | 0 module
@@ -819,12 +794,12 @@ int main (int argc, const char** argv) {
 //   +-------+-----------------------+-------------------------------+
 
     // Pick out CPU number for this traceblock
-    current_cpu = traceblock[0] >> 56;
-    uint64 base_cycle = traceblock[0] & 0x00fffffffffffffful;
+    current_cpu = block.cpu;
+    uint64 base_cycle = block.base_cycle;
 
     // traceblock[1] has flags in top byte. 
-    uint8 flags = traceblock[1] >> 56;
-    uint64 gtod = traceblock[1] & 0x00fffffffffffffful;
+    uint8 flags = block.flags;
+    uint64 gtod = block.gtod;
 
     bool fail = false;
     if (kMAX_CPUS <= current_cpu) {
@@ -840,15 +815,8 @@ int main (int argc, const char** argv) {
   
 
     all_flags |= flags;
-    bool this_block_has_ipc = (HasIPC(flags));
-
-    // For each 64KB traceblock that has IPC_Flag set, also read the IPC bytes
-    if (this_block_has_ipc) {
-      // Extract 8KB IPC block
-      int n = fread(ipcblock, 1, sizeof(ipcblock), f);
-    } else {
-      memset(ipcblock, 0, sizeof(ipcblock));	// Default if no IPC data
-    }
+    // The reader has already picked up the 8KB of IPC bytes after each
+    // 64KB traceblock if the first block has IPC_Flag set
 
 // WRAPAROUND PROBLEM:
 // We pick base_minute_usec here in block 0, but it can be
@@ -861,10 +829,9 @@ int main (int argc, const char** argv) {
 //
 
     // If very first block, pick out time conversion parameters
-    int first_real_entry = 2;
+    int first_real_entry = block.header_words;
     bool very_first_block = (blocknumber == 0);
     if (very_first_block) {
-      first_real_entry = 8;
       first_flags = flags;
       fail |= handle_very_first_block(traceblock, &base_usec_timestamp, &params);
     }
@@ -877,22 +844,11 @@ int main (int argc, const char** argv) {
       continue;
     }
 
-    // Pick out CPU number for this traceblock
-    current_cpu = traceblock[0] >> 56;
     unique_cpus.insert(current_cpu);	// stats
 
-    // Pick out times for converting to 100Mhz
-    uint64 prepend = base_cycle & ~0xfffff;
-
-    // The base cycle count for this block may well be a bit later than the truncated time
-    // in the first real entry, and may have wrapped in its low 20 bits. If so, the high bits 
-    // we want to prepend should be one smaller.
-    uint64 first_timestamp = traceblock[first_real_entry] >> 44;
-    uint64 prior_t = first_timestamp;
-
     // If wraparound trace and in very_first_block, suppress everything except name entries
     // and hardware description
-    bool keep_just_names = HasWraparound(first_flags) && very_first_block;
+    bool keep_just_names = RawHasWrap(first_flags) && very_first_block;
 
 // Every block has PID and pidname at the front                          created by
 //   +-------+-----------------------+-------------------------------+
@@ -910,16 +866,14 @@ int main (int argc, const char** argv) {
 //   |                                                               | 5 or 11 module
 //   +-------------------------------+-------------------------------+
 
-    if (TracefileVersion(first_flags) >= 3) {
+    if (RawVersion(first_flags) >= 3) {
       /* Every block has PID and pidname at the front */
       /* CPU frequency may be in the first block per CPU, in the high half of pid */
-      uint64 pid = traceblock[first_real_entry + 0] & 0x00000000ffffffffLLU;
-      uint64 freq_mhz = traceblock[first_real_entry + 0] >> 32;
-      uint64 unused = traceblock[first_real_entry + 1];
+      uint64 pid = RawBlockPid(block);
+      uint64 freq_mhz = RawBlockFreq(block);
       char pidname[24];
       pid = RemapHighPid(pid);
-      memcpy(pidname, reinterpret_cast<char*>(&traceblock[first_real_entry + 2]), 16);
-      pidname[16] = '\0';
+      RawBlockPidName(block, pidname);
       
       // FreeBSD has multiple idle threads named idle:xxx, with different PID numbers
       // Map all of these to pid 0 name -idle-, remembering them
@@ -930,11 +884,11 @@ int main (int argc, const char** argv) {
           fprintf(stderr, "rawtoevent block[%d] cpu %lld pid %lld freq %lld %s\n", 
                   blocknumber, current_cpu, pid, freq_mhz, pidname);
         }
-        fprintf(stdout, "%% %016llx pid %lld\n", traceblock[first_real_entry + 0], pid);
-        fprintf(stdout, "%% %016llx unused\n",  traceblock[first_real_entry + 1]);
-        fprintf(stdout, "%% %016llx name %s\n", traceblock[first_real_entry + 2], pidname);
-        fprintf(stdout, "%% %016llx name\n",    traceblock[first_real_entry + 3]);
-        fprintf(stdout, "\n");
+        fprintf(outfile, "%% %016llx pid %lld\n", traceblock[first_real_entry + 0], pid);
+        fprintf(outfile, "%% %016llx unused\n",  traceblock[first_real_entry + 1]);
+        fprintf(outfile, "%% %016llx name %s\n", traceblock[first_real_entry + 2], pidname);
+        fprintf(outfile, "%% %016llx name\n",    traceblock[first_real_entry + 3]);
+        fprintf(outfile, "\n");
       }
 
       // Remember the name for this pid
@@ -944,14 +898,13 @@ int main (int argc, const char** argv) {
       
       // To allow updates of the reconstruction stack in eventtospan
       uint64 nsec10 = CyclesToNsec10(base_cycle, params);
-      OutputName(stdout, nsec10, KUTRACE_PIDNAME, pid, name.c_str());
+      OutputName(outfile, nsec10, KUTRACE_PIDNAME, pid, name.c_str());
 
       // New user-mode process id, pid
       unique_pids.insert(pid);	// stats
       if (current_pid[current_cpu] != pid) {++ctx_switches;}	// stats
       current_pid[current_cpu] = pid;
 
-      uint64 event = KUTRACE_USERPID;	// Context switch
       uint64 duration = 1;
       if (!keep_just_names) {
         name = AppendNum(name, pid);	// foo.12345
@@ -967,7 +920,7 @@ int main (int argc, const char** argv) {
         // A possible alternate design is to back up the timestamp here to just before the 
         // first real entry.
         //
-        /////OutputEvent(stdout, nsec10, duration, event, current_cpu, 
+        /////OutputEvent(outfile, nsec10, duration, event, current_cpu, 
         ////            pid, 0,  0, 0, 0, name.c_str());
 
         // Statistics: don't count as a context switch -- almost surely same
@@ -977,61 +930,64 @@ int main (int argc, const char** argv) {
         // dsites 2021.10.20 Output initial CPU frequency if nonzero
         if (at_first_cpu_block[current_cpu]) {
           at_first_cpu_block[current_cpu] = false;
-          OutputEvent(stdout, nsec10, duration, KUTRACE_USERPID, current_cpu, 
+          OutputEvent(outfile, nsec10, duration, KUTRACE_USERPID, current_cpu, 
                       pid, 0,  0, 0, 0, name.c_str());
           if (0 < freq_mhz) {
-            OutputEvent(stdout, nsec10, duration, KUTRACE_PSTATE, current_cpu, 
+            OutputEvent(outfile, nsec10, duration, KUTRACE_PSTATE, current_cpu, 
                         pid, 0,  freq_mhz, 0, 0, "-freq-");
            }
         }
       }
-
-      first_real_entry += 4;
     }	// End of each block preprocessing
 
-
-    // We wrapped if high bit of first_timestamp is 1 and high bit of base is 0
-    if (Wrapped(first_timestamp, base_cycle)) {
-      prepend -= 0x100000; 
-      if (TRACEWRAP) {fprintf(stdout, "  Wrap0 %05llx %05llx\n", first_timestamp, base_cycle);}
-    }
-
     //------------------------------------------------------------------------//
     // Inner loop over eight-byte entries                                     //
     //------------------------------------------------------------------------//
-    for (int i = first_real_entry; i < kTraceBufSize; ++i) {
-      int entry_i = i;		// Always the first word, even if i subsequently incremented
+    // The iterator steps over the extra words of names and PC samples and
+    // rebuilds the full timestamp tfull of each entry
+    RawEntryIter iter;
+    InitRawEntryIter(&block, &iter);
+    RawDecodeBlockTimes(&iter, &block_times);
+    if (docheck) {check_mismatches += RawCheckBlockTimes(&block, &block_times);}
+    RawEntry entry;
+    while (NextRawEntry(&iter, &entry)) {
+      int i = entry.index;
+      int entry_i = i;		// Always the first word
       bool has_arg = false;	// Set true if low 32 bits are used
       bool extra_word = false;	// Set true if entry is at least two words
       bool deferred_rpcid0 = false;
-      uint8 ipc = ipcblock[i];
+      uint8 ipc = entry.ipc;
 
       // Completely skip any all-zero NOP entries
-      if (traceblock[i] == 0LLU) {continue;}
+      if (entry.word == 0LLU) {continue;}
 
       // Skip the entire rest of the block if all-ones entry found
-      if (traceblock[i] == 0xffffffffffffffffLLU) {break;}
+      if (entry.word == 0xffffffffffffffffLLU) {break;}
 
       // +-------------------+-----------+---------------+-------+-------+
       // | timestamp         | event     | delta | retval|      arg0     |
       // +-------------------+-----------+---------------+-------+-------+
       //          20              12         8       8           16 
       
-      uint64 t = traceblock[i] >> 44;			// Timestamp
-      uint64 n = (traceblock[i] >> 32) & 0xfff;		// event number
-      uint64 arg    = traceblock[i] & 0x0000ffff;	// syscall/ret arg/retval
-      uint64 argall = traceblock[i] & 0xffffffff;	// mark_a/b/c/d, etc.
-      uint64 arg_hi = (traceblock[i] >> 16) & 0xffff;	// rx_pkt tx_pkt lglen8
-      uint64 delta_t = (traceblock[i] >> 24) & 0xff;	// Opt syscall return timestamp
-      uint64 retval = (traceblock[i] >> 16) & 0xff;	// Opt syscall retval
+      uint64 t = entry.t;		// Timestamp
+      uint64 n = entry.event;		// event number
+      uint64 arg    = entry.arg;	// syscall/ret arg/retval
+      uint64 argall = entry.argall;	// mark_a/b/c/d, etc.
+      uint64 arg_hi = entry.arg_hi;	// rx_pkt tx_pkt lglen8
+      uint64 delta_t = entry.delta_t;	// Opt syscall return timestamp
+      uint64 retval = entry.retval;	// Opt syscall retval
 
       // Completely skip any mostly-FFFF entries, but keep FFF return of 32-bit -sched-
       if ((t == 0xFFFFF) && (n == 0xFFF)) {continue;}
 
+      // A name or PC sample cut off by the end of the block is damage; drop it
+      // rather than read its missing words from past the block
+      if (entry.truncated) {break;}
+
       // Sign extend optimized retval [-128..127] from 8 bits to 16
       retval = (uint64)(((int64)(retval << 56)) >> 56) & 0xffff;
       if (verbose) {
-        fprintf(stdout, 
+        fprintf(outfile, 
                 "%% [%d,%d] %05llx %03llx %04llx %04llx = %lld %lld %lld, %lld %lld %02x\n", 
                 blocknumber, i,
                 (traceblock[i] >> 44) & 0xFFFFF, 
@@ -1061,73 +1017,12 @@ int main (int argc, const char** argv) {
       event = n;
 
  
-      // Module does
-      // delta_cycles = now - tb->prior_cycles;
-      // but records just the low 20 bits of now	
-      // We have to figure out here how to account for the low 20 bits wrapping:
-      // prior = ppp.f8938 now = nnn.d6f66 delta = 001.de62e
-      // prior + delta_lo = ppq.d6ff6 but (ppq.d6ff6 - ppp.f8938 fits in 20 bits, so would not have generated a tsdelta
-      // prior + delta = ppr.d6ff6
- 
+      // Skip everything else about the TSDELTA event. The iterator has already
+      // applied it, along with any wraparound of the truncated timestamp t
+      if (n == KUTRACE_TSDELTA) {continue;}
 
-/*
- * In recording a trace event, it is possible for an interrupt to happen after 
- * KUtrace code takes the event timestamp and before it claims the storage location.
- * In this case, the interupt handling will recursively record several events 
- * before returning to the original KUtrace path, which then claims a location
- * and stores the original event with its earlier timestamp. This is called a
- * "late store." When that happens, the reconstruciton in rawtoevent needs to
- * decide whether time went forward by almost the entire 20-bit wraparound
- * period, or went backward by some amount.
- * 
- * To resolve this ambiguity, we declare that a time gap of 7/8 of the wraparound
- * period is forward time and the high 1/8 is backward time associated with an
- * otherwise undetectable backward time.
- * 
- * To mark forward time in that 1/8 (and above), we add a TSDELTA entry to the
- * trace. The exact compare for late store must be identical in kutrace_mod.c 
- * and in rawtoevent.cc.
- * 
- */
-
-      // If TSDELTA entry, increment the prepend value.
-      // argall has the time difference between this entry and previous one,
-      // in units of timestamp ticks (10-20nsec).
-      // If time goes backward a little, difference will be large,  otherwise it will 
-      // be a small number of millions.
-      // A threshold of 2,000,000,000 is good for separating large, which we ignore
-      if (n == KUTRACE_TSDELTA) {
-        if (argall < kLargeTsdelta) {
-          // Increment time by delta
-          uint64 oldfull = (prepend | prior_t);	// Old prepend old t
-          uint64 newfull = oldfull + argall;
-
-          prepend = newfull & ~0xfffffLLU;
-          t =       newfull &  0xfffffLLU;
-          prior_t = t;
-        } else {
-          // Negative TSDELTA. Do unsigned subtraction.
-          uint64 oldfull = (prepend | prior_t);	// Old prepend old t
-          uint64 newfull = oldfull + (0xFFFFFFFF00000000LLU | argall); // sign extend arg
-
-          // Use newfull, but do not update prepend. Doing so would ... 
-          prepend = newfull & ~0xfffffLLU;
-          t =       newfull &  0xfffffLLU;
-          prior_t = t;
-        }
-        continue;	// Skip everything else about the TSDELTA event
-
-      } else {
-        // Increment the prepend if truncated time rolls over and not caused by a late store
-        if (Wrapped(prior_t, t) && !LateStore(prior_t, t)) {
-          prepend += 0x100000;
-        }
-      }
-
-      
       // tfull is increments of cycles from the base minute for this trace
-      uint64 tfull = prepend | t;
-      prior_t = t;
+      uint64 tfull = entry.cycles;
 
       // nsec10 is increments of 10ns from the base minute.
       // For a trace starting at 50 seconds into a minute and spanning 99 seconds, 
@@ -1198,8 +1093,8 @@ int main (int argc, const char** argv) {
           name = MakeSafeAscii(name);
           if (!name.empty()) {
             names[nameinsert] = name;
-            ////OutputName(stdout, nsec10, nameinsert, argall, name.c_str());
-            OutputName(stdout, nsec10, n, argall, name.c_str());
+            ////OutputName(outfile, nsec10, nameinsert, argall, name.c_str());
+            OutputName(outfile, nsec10, n, argall, name.c_str());
           }
           // Remember which event number is local_timer (or local_timer_vector) and which is -sched-
           // (these vary in different historical traces)
@@ -1212,13 +1107,12 @@ int main (int argc, const char** argv) {
 //fprintf(stderr, "-sched- syscall = %03x %d\n", gSCHED_EVENT, gSCHED_EVENT);
           }
         }
-        i += (len - 1);	// Skip over the rest of the name event
         extra_word = true;
         continue;
       }
       
       if (is_cpu_description(n)) {	// Just pass it on to eventtospan
-        OutputEvent(stdout, nsec10, 1, event, current_cpu, 
+        OutputEvent(outfile, nsec10, 1, event, current_cpu, 
                     0, 0, argall, 0, 0, "");
       }
 
@@ -1308,7 +1202,7 @@ int main (int argc, const char** argv) {
         has_arg = true;
         extra_word = true;
         uint64 freq_mhz = arg;
-        uint64 pc_sample = traceblock[++i];	// Consume second word, the PC sample
+        uint64 pc_sample = traceblock[i + 1];	// Second word, the PC sample
         // Change PC_TEMP to either kernel or user sample address
         event = n = (pc_sample & 0x8000000000000000LLU) ? KUTRACE_PC_K : KUTRACE_PC_U;
 
@@ -1329,7 +1223,7 @@ int main (int argc, const char** argv) {
 
         // Output the frequency event first if nonzero
         if (0 < freq_mhz) { 
-          OutputEvent(stdout, nsec10, 1, KUTRACE_PSTATE, current_cpu, 
+          OutputEvent(outfile, nsec10, 1, KUTRACE_PSTATE, current_cpu, 
                       current_pid[current_cpu], current_rpc[current_cpu], 
                       freq_mhz, 0, 0, "-freq-");
           ++event_count;	// stats
@@ -1400,15 +1294,15 @@ int main (int argc, const char** argv) {
 
       // Debug output. Raw 64-bit event in hex
       if (hexevent) {
-        fprintf(stdout, "%05llx.%03llx ", 
+        fprintf(outfile, "%05llx.%03llx ", 
           (traceblock[entry_i] >> 44) & 0xFFFFF, 
           (traceblock[entry_i] >> 32) & 0xFFF);
         if (has_arg) {
-          fprintf(stdout, " %04llx%04llx ", 
+          fprintf(outfile, " %04llx%04llx ", 
             (traceblock[entry_i] >> 16) & 0xFFFF, 
             (traceblock[entry_i] >> 0) & 0xFFFF);
         } else {
-          fprintf(stdout, "          "); 
+          fprintf(outfile, "          "); 
         }
       }
 
@@ -1430,14 +1324,14 @@ int main (int argc, const char** argv) {
       // Output the trace event
       // Output format:
       // time dur event cpu  pid rpc  arg retval IPC name(event)
-      OutputEvent(stdout, nsec10, duration, event, current_cpu, 
+      OutputEvent(outfile, nsec10, duration, event, current_cpu, 
                   current_pid[current_cpu], current_rpc[current_cpu], 
                   arg, retval, ipc, name.c_str());
       // Update some statistics
       ++event_count;	// stats
 
       if (hexevent && extra_word) {
-        fprintf(stdout, "   %16llx\n", traceblock[entry_i + 1]); 
+        fprintf(outfile, "   %16llx\n", traceblock[entry_i + 1]); 
       }
 
       // Do deferred switch to rpcid = 0
@@ -1450,16 +1344,17 @@ int main (int argc, const char** argv) {
 
     ++blocknumber;
 
-  }	// while (fread...
+  }	// while (NextRawBlock...
   //--------------------------------------------------------------------------//
   // End outer loop over blocks                                               //
   //--------------------------------------------------------------------------//
 
 
+  CloseRawReader(&reader);
   fclose(f);
 
   // Pass along the OR of all incoming raw traceblock flags, in particular IPC_Flag 
-  fprintf(stdout, "# ## FLAGS: %d\n", all_flags);
+  fprintf(outfile, "# ## FLAGS: %d\n", all_flags);
 
 
   // Reduce timestamps to start at no more than 60 seconds after the base minute.
@@ -1481,7 +1376,7 @@ if (hi_seconds > 999.0) {fprintf(stderr,"BUG: hi_seconds > 999.0 %12.8f\n", hi_s
     total_seconds = 1.0;	// avoid zdiv
   }
   // Pass along the time bounds 
-  fprintf(stdout, "# ## TIMES: %10.8f %10.8f\n", lo_seconds, hi_seconds);
+  fprintf(outfile, "# ## TIMES: %10.8f %10.8f\n", lo_seconds, hi_seconds);
 
 
   uint64 total_cpus = unique_cpus.size();
@@ -1508,6 +1403,18 @@ if (hi_seconds > 999.0) {fprintf(stderr,"BUG: hi_seconds > 999.0 %12.8f\n", hi_s
   fprintf(stderr, 
           "  %5.3f elapsed seconds: %5.3f to %5.3f\n", 
           total_seconds, lo_seconds, hi_seconds); 
+  if (docheck) {
+    fprintf(stderr, "rawtoevent: -check %d blocks, %d timestamp mismatches\n",
+            blocknumber, check_mismatches);
+  }
 
+  return 0;
 }
 
+}  // namespace rawtoevent
+
+#ifndef KUPOSTPROC
+int main (int argc, const char** argv) {
+  return rawtoevent::RawToEvent(argc, argv, stdin, stdout);
+}
+#endif
@@ -0,0 +1,139 @@
+// rpctrack.h
+//
+// Follow individual RPCs through a time-sorted JSON span file, for the span
+// analysis programs.
+//
+// The dclab RPC library marks the start of work on an RPC with a
+// KUTRACE_RPCIDREQ or KUTRACE_RPCIDRESP point event whose arg is the rpcid,
+// and the end of that work with the same event and arg 0. eventtospan3 adds
+// KUTRACE_RPCIDMID when a thread resumes a preempted RPC. Several threads may
+// work on one RPC, one after another or at once.
+//
+// An RPC instance starts at its first RPCIDREQ. It is done when the last
+// thread working on it stops, after some thread has sent its RPCIDRESP. That
+// covers a server request from receipt to the end of sending the response,
+// including hand-offs between threads, and a client request from sending it
+// to the end of processing the response. RPCIDs are only 16 bits and are
+// reused, so a finished instance frees its rpcid for the next request.
+//
+// A response for an rpcid with no open request began before the trace and
+// is ignored. Instances still open at the end never saw a response.
+//
+
+#ifndef __RPCTRACK_H__
+#define __RPCTRACK_H__
+
+#include <map>
+#include <string>
+
+#include "basetypes.h"
+#include "kutrace_lib.h"
+
+typedef struct {
+  int64 start_ns;
+  int64 end_ns;		// Filled in when done
+  int serial;		// 0, 1, 2, ... in order of starting
+  int rpcid;
+  int start_pid;
+  int workers;		// Threads currently working on it
+  bool responded;
+  std::string method;
+} RpcInstance;
+
+// Called once for each RPC instance as it finishes
+typedef void (*RpcDoneFunc)(const RpcInstance& rpc, void* done_arg);
+
+typedef struct {
+  std::map<int, RpcInstance> open;	// By rpcid
+  std::map<int, int> pidrpc;		// PID => rpcid it is working on, 0 for none
+  int next_serial;
+  int unanswered;			// Still open at the end
+  RpcDoneFunc done;
+  void* done_arg;
+} RpcTracker;
+
+inline void InitRpcTracker(RpcDoneFunc done, void* done_arg, RpcTracker* tracker) {
+  tracker->open.clear();
+  tracker->pidrpc.clear();
+  tracker->next_serial = 0;
+  tracker->unanswered = 0;
+  tracker->done = done;
+  tracker->done_arg = done_arg;
+}
+
+inline bool IsRpcWorkEvent(int eventnum) {
+  return (eventnum == KUTRACE_RPCIDREQ) || (eventnum == KUTRACE_RPCIDRESP) ||
+         (eventnum == KUTRACE_RPCIDMID);
+}
+
+// Strip the .rpcid from the span name method.rpcid
+inline std::string RpcMethodName(const char* name) {
+  std::string method = std::string(name);
+  size_t dot = method.rfind('.');
+  if ((dot != std::string::npos) && (0 < dot) &&
+      (method.find_first_not_of("0123456789", dot + 1) == std::string::npos)) {
+    method.resize(dot);
+  }
+  return method;
+}
+
+// Open instance for rpcid, or NULL
+inline const RpcInstance* OpenRpc(int rpcid, const RpcTracker& tracker) {
+  std::map<int, RpcInstance>::const_iterator it = tracker.open.find(rpcid);
+  return (it == tracker.open.end()) ? NULL : &it->second;
+}
+
+// The rpcid pid is working on, 0 for none
+inline int PidRpc(int pid, const RpcTracker& tracker) {
+  std::map<int, int>::const_iterator it = tracker.pidrpc.find(pid);
+  return (it == tracker.pidrpc.end()) ? 0 : it->second;
+}
+
+// A thread stops working on rpcid at ts_ns
+inline void LeaveRpc(int rpcid, int64 ts_ns, RpcTracker* tracker) {
+  std::map<int, RpcInstance>::iterator it = tracker->open.find(rpcid);
+  if (it == tracker->open.end()) {return;}
+  RpcInstance* rpc = &it->second;
+  if (0 < rpc->workers) {--rpc->workers;}
+  if (rpc->responded && (rpc->workers == 0)) {
+    rpc->end_ns = ts_ns;
+    tracker->done(*rpc, tracker->done_arg);
+    tracker->open.erase(it);
+  }
+}
+
+// One RPCIDREQ/RESP/MID span. arg is the rpcid now being worked on, 0 for none
+inline void RpcWorkEvent(int pid, int eventnum, int arg, int64 ts_ns, const char* name,
+                         RpcTracker* tracker) {
+  int rpcid = arg;
+  int old_rpcid = PidRpc(pid, *tracker);
+  if ((old_rpcid != 0) && (old_rpcid != rpcid)) {LeaveRpc(old_rpcid, ts_ns, tracker);}
+  tracker->pidrpc[pid] = rpcid;
+  if (rpcid == 0) {return;}
+
+  std::map<int, RpcInstance>::iterator it = tracker->open.find(rpcid);
+  if (it == tracker->open.end()) {
+    if (eventnum != KUTRACE_RPCIDREQ) {return;}	// Began before the trace
+    RpcInstance temp;
+    temp.start_ns = ts_ns;
+    temp.end_ns = ts_ns;
+    temp.serial = tracker->next_serial++;
+    temp.rpcid = rpcid;
+    temp.start_pid = pid;
+    temp.workers = 0;
+    temp.responded = false;
+    temp.method = RpcMethodName(name);
+    it = tracker->open.insert(std::map<int, RpcInstance>::value_type(rpcid, temp)).first;
+  }
+  RpcInstance* rpc = &it->second;
+  if (old_rpcid != rpcid) {++rpc->workers;}
+  if (eventnum == KUTRACE_RPCIDRESP) {rpc->responded = true;}
+}
+
+// End of input
+inline void FinishRpcTracker(RpcTracker* tracker) {
+  tracker->unanswered += tracker->open.size();
+  tracker->open.clear();
+}
+
+#endif	// __RPCTRACK_H__
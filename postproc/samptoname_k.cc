@@ -2,9 +2,17 @@
 // 
 // Filter from stdin to stdout
 // One command-line parameter -- allsyms file name 
+// Optional -cache <dir> keeps names across runs in a symcache.h directory
 //   $ cat foo.json |./samptoname_k >foo_with_k_pc.json
 //
+// Or, to prebuild a binary index of an allsyms file, which can then be given
+// in place of the allsyms file and is mmapped instead of parsed
+//   $ ./samptoname_k -makeindex allsyms.txt allsyms.idx
+//
 // dick sites 2020.03.06
+//  2026.10.16 Optional persistent symbol cache across runs (symcache.h)
+//  2026.10.16 Packed sorted symbol array instead of map<uint64, string>,
+//             prebuilt index files, and module names on module symbols
 //
 // Compile with g++ -O2 samptoname_k.cc -o samptoname_k
 //
@@ -22,6 +30,9 @@
 //  ffffffffb43bd2e0 T clear_page_erms
 //  ffffffffb43bd2f0 T cmdline_find_option_bool
 //  ffffffffb43bd410 T cmdline_find_option
+//  ffffffffc0a01000 t e1000_probe	[e1000]
+//
+// Symbols in modules get the module name appended, as e1000_probe[e1000]
 //
 // Output to stdout is the input json with names substituted and the
 // hash code in arg updated
@@ -29,18 +40,35 @@
 //
 
 
-#include <map>
+#include <algorithm>
 #include <string>
+#include <utility>      // pair
+#include <vector>
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>     // exit
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "basetypes.h"
+#include "json_ticks.h"
 #include "kutrace_lib.h"
+#include "symcache.h"
+
+#include "kupostproc.h"
+
+namespace samptoname_k {
+
+// Input and output streams. stdin/stdout except when run inside kupostproc
+static FILE* infile = NULL;
+static FILE* outfile = NULL;
 
 using std::string;
-using std::map;
+using std::pair;
+using std::vector;
 
 typedef struct {
   double start_ts;	// Seconds
@@ -57,12 +85,37 @@ typedef struct {
   string name;
 } OneSpan;
 
-typedef map<uint64, string> SymMap;
+// All the kernel symbols, packed for binary search: sorted addresses, and for
+// each one an offset into a single block of NUL-terminated names. Built by
+// parsing an allsyms text file, or mmapped from a prebuilt index file:
+//   char magic[8]                "KUKSYM1\n"
+//   uint64 count
+//   uint64 addrs[count]
+//   uint32 name_offsets[count]
+//   char names[]
+typedef struct {
+  uint64 count;
+  const uint64* addrs;
+  const uint32* name_offsets;
+  const char* names;
+  // Storage when parsed from text
+  vector<uint64> addr_store;
+  vector<uint32> offset_store;
+  string name_store;
+  // Mapping when read from an index file
+  const char* base;
+  size_t len;
+} SymIndex;
+
+static const char kSymIndexMagic[8] = {'K', 'U', 'K', 'S', 'Y', 'M', '1', '\n'};
+
+static int64 ticks_per_sec = 0;   // Incoming ticksPerSec, if any. 0 means times in seconds
+static int symcache_hits = 0;
+static int symcache_adds = 0;
 
 // Add dummy entry that sorts last, then close the events array and top-level json
 void FinalJson(FILE* f) {
-  fprintf(f, "[999.0, 0.0, 0, 0, 0, 0, 0, 0, 0, \"\"]\n");	// no comma
-  fprintf(f, "]}\n");
+  PrintFinalJson(f, ticks_per_sec);
 }
 
 static const int kMaxBufferSize = 256;
@@ -79,7 +132,24 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
 }
 
 
-void ReadAllsyms(FILE* f, SymMap* allsyms) {
+// (address, name offset) in file order
+typedef pair<uint64, uint32> AddrName;
+
+bool AddrLess(const AddrName& a, const AddrName& b) {
+  return a.first < b.first;
+}
+
+// Append one name to the names block, returning its offset
+uint32 AddName(const char* name, string* names) {
+  uint32 offset = names->size();
+  names->append(name, strlen(name) + 1);
+  return offset;
+}
+
+void ReadAllsyms(FILE* f, SymIndex* allsyms) {
+  vector<AddrName> addrnames;
+  string* names = &allsyms->name_store;
+  names->clear();
   uint64 addr = 0LL;
   char buffer[kMaxBufferSize];
   while (ReadLine(f, buffer, kMaxBufferSize)) {
@@ -93,34 +163,168 @@ void ReadAllsyms(FILE* f, SymMap* allsyms) {
     buffer[space2] = '\0';
 
     size_t space3 = space2 + 1 + strcspn(buffer + space2 + 1, " \t");
-    // Space3 is optional
+    // Space3 is optional. If present, it may be followed by [module]
+    char* module = NULL;
+    if (space3 < len) {
+      module = buffer + space3 + 1 + strspn(buffer + space3 + 1, " \t");
+      if ((module[0] != '[') || (strchr(module, ']') == NULL)) {module = NULL;}
+    }
     buffer[space3] = '\0';
 
-    int n = sscanf(buffer, "%llx", &addr);
-    if (n != 1) {continue;}
-    string name = string(buffer + space2 + 1);
-    (*allsyms)[addr] = name;
-//fprintf(stdout, "allsyms[%llx] = %s\n", addr, name.c_str());
+    char* endptr = NULL;
+    uint64 newaddr = strtoull(buffer, &endptr, 16);
+    if (endptr == buffer) {continue;}
+    addr = newaddr;
+    uint32 offset = names->size();
+    names->append(buffer + space2 + 1);
+    if (module != NULL) {
+      // Module name without the space, so name stays one JSON token downstream
+      names->append(module, strchr(module, ']') - module + 1);
+    }
+    names->push_back('\0');
+    addrnames.push_back(AddrName(addr, offset));
   }
   // We don't know how far the last item extends.
   // Arbitrarily assume that it is 4KB and add a dummy entry at that end
   if (addr < 0xffffffffffffffffL - 4096L) {
-    (*allsyms)[addr + 4096] = string("-dummy-");
+    addrnames.push_back(AddrName(addr + 4096, AddName("-dummy-", names)));
+  }
+
+  // Sort by address; for duplicate addresses the last one in the file wins
+  if (!std::is_sorted(addrnames.begin(), addrnames.end(), AddrLess)) {
+    std::stable_sort(addrnames.begin(), addrnames.end(), AddrLess);
+  }
+  allsyms->addr_store.clear();
+  allsyms->offset_store.clear();
+  for (int i = 0; i < (int)addrnames.size(); ++i) {
+    if ((i + 1 < (int)addrnames.size()) && (addrnames[i + 1].first == addrnames[i].first)) {
+      continue;
+    }
+    allsyms->addr_store.push_back(addrnames[i].first);
+    allsyms->offset_store.push_back(addrnames[i].second);
   }
+  allsyms->count = allsyms->addr_store.size();
+  allsyms->addrs = allsyms->addr_store.empty() ? NULL : &allsyms->addr_store[0];
+  allsyms->name_offsets = allsyms->offset_store.empty() ? NULL : &allsyms->offset_store[0];
+  allsyms->names = names->data();
+  allsyms->base = NULL;
+  allsyms->len = 0;
 }
 
-string Lookup(const string& s, const SymMap& allsyms) {
+// Map a prebuilt index file. Return false if it is not one
+bool MapIndex(const char* fname, SymIndex* allsyms) {
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) {return false;}
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || (st.st_size < 16)) {close(fd); return false;}
+  void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {return false;}
+
+  const char* base = reinterpret_cast<const char*>(p);
+  size_t len = st.st_size;
+  uint64 count = 0;
+  memcpy(&count, base + 8, sizeof(uint64));
+  bool ok = (memcmp(base, kSymIndexMagic, 8) == 0);
+  if (ok && ((len - 16) / (sizeof(uint64) + sizeof(uint32)) < count)) {ok = false;}
+  if (ok && (0 < count) && (base[len - 1] != '\0')) {ok = false;}
+  if (!ok) {
+    munmap(p, len);
+    return false;
+  }
+  allsyms->count = count;
+  allsyms->addrs = reinterpret_cast<const uint64*>(base + 16);
+  allsyms->name_offsets = reinterpret_cast<const uint32*>(base + 16 + count * sizeof(uint64));
+  allsyms->names = base + 16 + count * (sizeof(uint64) + sizeof(uint32));
+  allsyms->base = base;
+  allsyms->len = len;
+  return true;
+}
+
+// Read the allsyms file or prebuilt index file named fname
+void ReadAllsymsFile(const char* fname, SymIndex* allsyms) {
+  FILE* f = fopen(fname, "r");
+  if (f == NULL) {
+    fprintf(stderr, "%s did not open\n", fname);
+    exit(0);
+  }
+  char magic[8];
+  if ((fread(magic, 1, 8, f) == 8) && (memcmp(magic, kSymIndexMagic, 8) == 0)) {
+    fclose(f);
+    if (!MapIndex(fname, allsyms)) {
+      fprintf(stderr, "%s is not a valid index file\n", fname);
+      exit(0);
+    }
+    return;
+  }
+  rewind(f);
+  ReadAllsyms(f, allsyms);
+  fclose(f);
+}
+
+// Write allsyms as a prebuilt index file
+void WriteIndex(const char* fname, const SymIndex& allsyms) {
+  FILE* f = fopen(fname, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "%s did not open\n", fname);
+    exit(0);
+  }
+  fwrite(kSymIndexMagic, 1, 8, f);
+  fwrite(&allsyms.count, sizeof(uint64), 1, f);
+  fwrite(allsyms.addrs, sizeof(uint64), allsyms.count, f);
+  fwrite(allsyms.name_offsets, sizeof(uint32), allsyms.count, f);
+  fwrite(allsyms.names, 1, allsyms.name_store.size(), f);
+  bool ok = (ferror(f) == 0);
+  ok &= (fclose(f) == 0);
+  if (!ok) {
+    fprintf(stderr, "%s write failed\n", fname);
+    exit(0);
+  }
+  fprintf(stderr, "spantopcnamek: %lld symbols written to %s\n", allsyms.count, fname);
+}
+
+// Get the address from a "PC=hex"], name. Return false if not valid hex
+bool GetPC(const string& name, uint64* addr) {
+  string s = name.substr(4);	// Skip over "PC=
+  size_t quote2 = s.find("\"");
+  if (quote2 != string::npos) {s = s.substr(0, quote2);}
   if (s.find_first_not_of("0123456789abcdef") != string::npos) {
     // Not valid hex. Leave unchanged.
-//fprintf(stdout, "Lookup(%s) unchanged\n", s.c_str());
-    return string("");
-  }
-  uint64 addr = 0;
-  sscanf(s.c_str(), "%llx", &addr);
-  SymMap::const_iterator it = allsyms.upper_bound(addr);  // Just above addr
-  it = prev(it);	// At or just below addr
-//fprintf(stdout, "Lookup(%s %llx) = %s\n", s.c_str(), addr, it->second.c_str());
-  return it->second;
+    return false;
+  }
+  *addr = 0;
+  sscanf(s.c_str(), "%llx", addr);
+  return true;
+}
+
+// Find the symbol at or just below each of a batch of addresses, as an index
+// into allsyms, or -1 if below the first symbol.
+// Rather than a cold binary search over all of allsyms per address, we sort the
+// batch and make one sweep upward: each search gallops forward from the
+// previous answer, so it touches only nearby, mostly cached, entries.
+void ResolveBatch(const vector<uint64>& addrs, const SymIndex& allsyms, vector<int64>* symnum) {
+  vector<pair<uint64, int> > sorted;
+  for (int i = 0; i < (int)addrs.size(); ++i) {sorted.push_back(pair<uint64, int>(addrs[i], i));}
+  std::sort(sorted.begin(), sorted.end());
+
+  symnum->resize(addrs.size());
+  const uint64* start = allsyms.addrs;
+  const uint64* end = allsyms.addrs + allsyms.count;
+  const uint64* lo = start;	// All before lo are <= the current addr
+  for (int i = 0; i < (int)sorted.size(); ++i) {
+    uint64 addr = sorted[i].first;
+    // Gallop until hi is above addr, then binary search between
+    const uint64* hi = lo;
+    int64 step = 1;
+    while ((hi < end) && (*hi <= addr)) {
+      lo = hi;
+      hi = ((end - hi) <= step) ? end : hi + step;
+      step *= 2;
+    }
+    const uint64* it = std::upper_bound(lo, hi, addr);  // Just above addr
+    (*symnum)[sorted[i].second] = (it == start) ? -1 : (it - 1 - start);
+    lo = (it == start) ? start : it - 1;
+  }
 }
 
 // Cheap 16-bit hash so we can mostly distinguish different routine names
@@ -138,31 +342,116 @@ int NameHash(const string& s) {
 
 
 
+static const int kBatchSize = 4096;
+
+// Name the PC samples in a batch of spans, then write the batch out
+// Look in the symbol cache first, if any. The allsyms file is then only read
+// on the first miss
+void FlushBatch(vector<OneSpan>* batch, const char* fname, SymIndex* allsyms,
+                SymCache* symcache, int* output_events) {
+  vector<string> newnames(batch->size());
+  vector<int> misses;		// Batch index of each PC still to look up
+  vector<uint64> addrs;		// and its address
+  for (int i = 0; i < (int)batch->size(); ++i) {
+    const OneSpan& onespan = (*batch)[i];
+    uint64 addr;
+    if (onespan.eventnum != KUTRACE_PC_K) {continue;}
+    if (!GetPC(onespan.name, &addr)) {continue;}
+    if ((symcache != NULL) && SymCacheLookup(*symcache, addr, &newnames[i])) {
+      ++symcache_hits;
+      continue;
+    }
+    misses.push_back(i);
+    addrs.push_back(addr);
+  }
+
+  if (!addrs.empty()) {
+    if (allsyms->count == 0) {ReadAllsymsFile(fname, allsyms);}
+    vector<int64> symnum;
+    ResolveBatch(addrs, *allsyms, &symnum);
+    for (int k = 0; k < (int)misses.size(); ++k) {
+      if (symnum[k] < 0) {continue;}	// Below the first symbol. Leave unchanged.
+      newnames[misses[k]] = allsyms->names + allsyms->name_offsets[symnum[k]];
+      if (symcache != NULL) {
+        SymCacheAdd(symcache, addrs[k], newnames[misses[k]]);
+        ++symcache_adds;
+      }
+    }
+  }
+
+  for (int i = 0; i < (int)batch->size(); ++i) {
+    OneSpan& onespan = (*batch)[i];
+    if (!newnames[i].empty()) {
+      onespan.name = "\"PC=" + newnames[i] + "\"],";
+      onespan.arg = NameHash(newnames[i]);
+    }
+    // Name has trailing punctuation, including ],
+    PrintSpanTimes(outfile, ticks_per_sec, onespan.start_ts, onespan.duration);
+    fprintf(outfile, "%d, %d, %d, %d, %d, %d, %d, %s\n",
+            onespan.cpu, onespan.pid, onespan.rpcid, onespan.eventnum, 
+            onespan.arg, onespan.retval, onespan.ipc, onespan.name.c_str());
+    ++(*output_events);
+  }
+  batch->clear();
+}
+
 // Input is a json file of spans
-// start time and duration for each span are in seconds
+// start time and duration for each span are in seconds, or integer ticks
 // Output is a smaller json file of fewer spans with lower-resolution times
 void Usage() {
-  fprintf(stderr, "Usage: spantopcnamek <allsyms fname>\n");
+  fprintf(stderr, "Usage: spantopcnamek <allsyms or index fname> [-cache <dir>]\n");
+  fprintf(stderr, "       spantopcnamek -makeindex <allsyms fname> <index fname>\n");
   exit(0);
 }
 
 //
 // Filter from stdin to stdout
 //
-int main (int argc, const char** argv) {
+int SampToNameK(int argc, const char** argv, FILE* in, FILE* out) {
+  infile = in;
+  outfile = out;
+
   if (argc < 2) {Usage();}
 
   // Input allsyms file
-  SymMap allsyms;
+  SymIndex allsyms;
+  allsyms.count = 0;
+
+  if (strcmp(argv[1], "-makeindex") == 0) {
+    if (argc != 4) {Usage();}
+    ReadAllsymsFile(argv[2], &allsyms);
+    if (allsyms.base != NULL) {
+      fprintf(stderr, "%s is already an index file\n", argv[2]);
+      exit(0);
+    }
+    WriteIndex(argv[3], allsyms);
+    return 0;
+  }
+
+  const char* cache_dir = NULL;
+  for (int i = 2; i < argc; ++i) {
+    if ((strcmp(argv[i], "-cache") == 0) && (i < (argc - 1))) {
+      cache_dir = argv[++i];
+    } else {
+      Usage();
+    }
+  }
+  if ((cache_dir != NULL) && !MakeSymCacheDir(cache_dir)) {cache_dir = NULL;}
 
   const char* fname = argv[1];
-  FILE* f = fopen(fname, "r");
-  if (f == NULL) {
-    fprintf(stderr, "%s did not open\n", fname);
-    exit(0);
+  SymCache* symcache = NULL;
+  if (cache_dir == NULL) {
+    ReadAllsymsFile(fname, &allsyms);
+  } else {
+    // The cache file is named by the allsyms contents
+    string hash = SymCacheHashFile(fname);
+    if (hash.empty()) {
+      fprintf(stderr, "%s did not open\n", fname);
+      exit(0);
+    }
+    symcache = new SymCache;
+    OpenSymCache(cache_dir, "k" + hash, symcache);
   }
-  ReadAllsyms(f, &allsyms);
-  fclose(f);
   
   
   // expecting:
@@ -170,8 +459,9 @@ int main (int argc, const char** argv) {
   //  [  0.00000000, 0.00400049, -1, -1, 33588, 641, 61259, 0, 0, "PC=ffffffffb43bd2e7"],
 
   int output_events = 0;
+  vector<OneSpan> batch;
   char buffer[kMaxBufferSize];
-  while (ReadLine(stdin, buffer, kMaxBufferSize)) {
+  while (ReadLine(infile, buffer, kMaxBufferSize)) {
     char buffer2[256];
     buffer2[0] = '\0';
     OneSpan onespan;
@@ -183,36 +473,39 @@ int main (int argc, const char** argv) {
     // fprintf(stderr, "%d: %s\n", n, buffer);
     
     if (n < 10) {
-      // Copy unchanged anything not a span
-      fprintf(stdout, "%s\n", buffer);
+      // Copy unchanged anything not a span, in order
+      FlushBatch(&batch, fname, &allsyms, symcache, &output_events);
+      fprintf(outfile, "%s\n", buffer);
+      if (ParseTicksPerSec(buffer) != 0) {ticks_per_sec = ParseTicksPerSec(buffer);}
       continue;
     }
-    if (onespan.start_ts >= 999.0) {break;}	// Always strip 999.0 end marker and stop
-
-    if (onespan.eventnum == KUTRACE_PC_K) {
-      string oldname = onespan.name.substr(4);	// Skip over "PC=
-      size_t quote2 = oldname.find("\"");
-      if (quote2 != string::npos) {oldname = oldname.substr(0, quote2);}
-      string newname = Lookup(oldname, allsyms);
-      if (!newname.empty()) {
-        onespan.name = "\"PC=" + newname + "\"],";
-        onespan.arg = NameHash(newname);
-      }
-    }
+    if (SpanSec(onespan.start_ts, ticks_per_sec) >= 999.0) {break;}	// Always strip 999.0 end marker and stop
 
-#if 1
-    // Name has trailing punctuation, including ],
-    fprintf(stdout, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, %s\n",
-            onespan.start_ts, onespan.duration,
-            onespan.cpu, onespan.pid, onespan.rpcid, onespan.eventnum, 
-            onespan.arg, onespan.retval, onespan.ipc, onespan.name.c_str());
-    ++output_events;
-#endif
+    // PC samples are named a batch at a time
+    batch.push_back(onespan);
+    if (kBatchSize <= (int)batch.size()) {
+      FlushBatch(&batch, fname, &allsyms, symcache, &output_events);
+    }
   }
+  FlushBatch(&batch, fname, &allsyms, symcache, &output_events);
 
   // Add marker and closing at the end
-  FinalJson(stdout);
+  FinalJson(outfile);
   fprintf(stderr, "spantopcnamek: %d events\n", output_events);
+  if (symcache != NULL) {
+    CloseSymCache(symcache);
+    delete symcache;
+    fprintf(stderr, "spantopcnamek: %d symbol cache hits, %d new, in %s\n",
+            symcache_hits, symcache_adds, cache_dir);
+  }
 
   return 0;
 }
+
+}  // namespace samptoname_k
+
+#ifndef KUPOSTPROC
+int main (int argc, const char** argv) {
+  return samptoname_k::SampToNameK(argc, argv, stdin, stdout);
+}
+#endif
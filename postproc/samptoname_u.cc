@@ -2,12 +2,17 @@
 // 
 // Filter from stdin to stdout
 // One command-line parameter -- pidmaps file name 
+// Optional -cache <dir> keeps names across runs in a symcache.h directory
 //
 // dick sites 2020.03.06
 //  2020.04.12 dsites fixup __nss_passwd_lookup ==> memcpy
-//
-// TODO: 
-//  cache lookup results to avoid excess command spawning
+//  2026.10.16 Read ELF symbols in-process (elfsym.h), once per binary, and cache
+//             names per (binary, offset) instead of running addr2line per sample.
+//             addr2line is still used for binaries elfsym.h cannot read
+//  2026.10.16 Optional persistent symbol cache across runs (symcache.h)
+//  2026.10.16 One sorted range list per distinct address space, binary searched.
+//             PIDs missing from the maps file use their clone/fork parent's
+//             address space, learned from the trace, before the nearby-PID guess
 //
 // Compile with g++ -O2 samptoname_u.cc -o samptoname_u
 //
@@ -20,6 +25,9 @@
 //
 // Second input from filename is from 
 //   sudo ls /proc/*/maps |xargs -I % sh -c 'echo "\n====" %; sudo cat %' >somefile.txt
+// or, to include every thread ID, which is the pid field in the trace,
+//   sudo ls /proc/*/task/*/maps |xargs -I % sh -c 'echo "\n====" %; sudo cat %' >somefile.txt
+// Threads of one process have identical maps and share one address space here.
 //
 //  ==== /proc/10000/maps
 //  5636c2def000-5636c2eac000 r-xp 00000000 08:02 5510282                    /usr/sbin/sshd
@@ -33,21 +41,41 @@
 //
 // Note that we only care about the executable regions in the above: in r-xp the "x"
 //
+// A process that was created during the trace and exited before the maps were
+// captured has no maps of its own. Until it execs, it has its parent's address
+// space, so we remember the parent of each clone/fork/vfork seen in the trace:
+//  [ 26.60012345, 0.00004567, 1, 10129, 0, 2104, 0, 10131, 0, "clone"],
+// says that PID 10129 created PID 10131 (low 16 bits only, see below).
+//
 // Output to stdout is the input json with names substituted and the
 // hash code in arg updated
 //  [  0.00000000, 0.00400049, -1, -1, 33588, 641, 12345, 0, 0, "PC=memcpy-ssse3.S:1198"]
 //
 
 
+#include <algorithm>
 #include <map>
 #include <string>
+#include <utility>      // pair
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>     // exit
 #include <string.h>
 
 #include "basetypes.h"
+#include "elfsym.h"
+#include "json_ticks.h"
 #include "kutrace_lib.h"
+#include "symcache.h"
+
+#include "kupostproc.h"
+
+namespace samptoname_u {
+
+// Input and output streams. stdin/stdout except when run inside kupostproc
+static FILE* infile = NULL;
+static FILE* outfile = NULL;
 
 #define BUFFSIZE 256
 #define CR 0x0d
@@ -55,8 +83,14 @@
 
 static const int kMaxBufferSize = 256;
 
+// Long demangled C++ names are cut so that span lines stay within the
+// kMaxBufferSize lines that the downstream programs read
+static const int kMaxNameLen = 160;
+
 using std::string;
 using std::map;
+using std::pair;
+using std::vector;
 
 typedef struct {
   double start_ts;	// Seconds
@@ -73,23 +107,61 @@ typedef struct {
   string name;
 } OneSpan;
 
-// We are going to pack a PID and the low address of a range into a single 64 bit key:
-// top 16 bits for PID, low 48 bits for address. This could be changed later 
-// to use a pair of uint64 or a single uint128 as key.
-
+// One executable range of an address space
 typedef struct {
   uint64 addr_lo;
   uint64 addr_hi;
-  uint64 pid;
+  uint64 file_offset;	// File offset mapped at addr_lo
   string pathname;
 } RangeToFile;
 
-typedef map<uint64, RangeToFile> MapsMap;
+// All the executable ranges of one address space, sorted by addr_lo
+typedef vector<RangeToFile> AddressSpace;
+
+// Each distinct address space in the maps file, and which one each PID has.
+// PIDs with identical maps, such as the threads of one process or forked
+// workers that have not exec'd, share a single AddressSpace
+typedef pair<uint64, int> PidSpace;	// (pid, subscript in spaces)
+typedef struct {
+  vector<AddressSpace> spaces;
+  vector<PidSpace> pidspace;		// Sorted by pid
+} AllMaps;
+
+// Parent PID of each child created by clone/fork/vfork in the trace.
+// The syscall return value in the trace is only the low 16 bits of the child
+// PID, so that is the key
+typedef map<int, int> ParentMap;
+
+// Follow at most this many generations of parents looking for maps
+static const int kMaxGenerations = 8;
+
+// Each binary's symbols are read once, and only if some name is not already
+// in its on-disk symbol cache
+typedef struct {
+  ElfSymtab* symtab;	// NULL until first needed
+  SymCache* symcache;	// NULL unless -cache
+} Binary;
+
+typedef map<string, Binary*> BinaryMap;
+
+// Routine name per (pathname, file offset within binary); empty if no name
+typedef map<pair<string, uint64>, string> NameCache;
+
+static const char* cache_dir = NULL;	// -cache directory, if any
+static BinaryMap binaries;
+static NameCache namecache;
+static ParentMap parents;
+static int sample_count = 0;
+static int addr2line_count = 0;
+static int symtab_count = 0;
+static int symcache_hits = 0;
+static int symcache_adds = 0;
+
+static int64 ticks_per_sec = 0;   // Incoming ticksPerSec, if any. 0 means times in seconds
 
 // Add dummy entry that sorts last, then close the events array and top-level json
 void FinalJson(FILE* f) {
-  fprintf(f, "[999.0, 0.0, 0, 0, 0, 0, 0, 0, 0, \"\"]\n");	// no comma
-  fprintf(f, "]}\n");
+  PrintFinalJson(f, ticks_per_sec);
 }
 
 // Read next line, stripping any crlf. Return false if no more.
@@ -104,20 +176,55 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
 }
 
 void DumpRangeToFile(FILE* f, const RangeToFile rtf) {
-  fprintf(f, "%lld %llx %llx %s\n", rtf.pid, rtf.addr_lo, rtf.addr_hi, rtf.pathname.c_str()); 
+  fprintf(f, "%llx %llx %llx %s\n", rtf.addr_lo, rtf.addr_hi, rtf.file_offset, rtf.pathname.c_str()); 
+}
+
+bool RangeLess(const RangeToFile& a, const RangeToFile& b) {
+  return a.addr_lo < b.addr_lo;
 }
 
+bool SameSpace(const AddressSpace& a, const AddressSpace& b) {
+  if (a.size() != b.size()) {return false;}
+  for (int i = 0; i < (int)a.size(); ++i) {
+    if (a[i].addr_lo != b[i].addr_lo) {return false;}
+    if (a[i].addr_hi != b[i].addr_hi) {return false;}
+    if (a[i].file_offset != b[i].file_offset) {return false;}
+    if (a[i].pathname != b[i].pathname) {return false;}
+  }
+  return true;
+}
+
+// FNV-1a over all the ranges, to find identical address spaces quickly
+uint64 SpaceHash(const AddressSpace& space) {
+  uint64 hash = kFnvOffset;
+  for (int i = 0; i < (int)space.size(); ++i) {
+    const RangeToFile& rtf = space[i];
+    hash = SymCacheHash(hash, reinterpret_cast<const char*>(&rtf.addr_lo), sizeof(uint64));
+    hash = SymCacheHash(hash, reinterpret_cast<const char*>(&rtf.addr_hi), sizeof(uint64));
+    hash = SymCacheHash(hash, reinterpret_cast<const char*>(&rtf.file_offset), sizeof(uint64));
+    hash = SymCacheHash(hash, rtf.pathname.c_str(), rtf.pathname.size() + 1);
+  }
+  return hash;
+}
+
+//  ==== /proc/10000/maps
+//  ==== /proc/10000/task/10003/maps
 //  5636c2def000-5636c2eac000 r-xp 00000000 08:02 5510282                    /usr/sbin/sshd
-void ReadAllmaps(FILE* f, MapsMap* allmaps) {
+void ReadAllmaps(FILE* f, AllMaps* allmaps) {
   uint64 addr_lo = 0L;
   uint64 addr_hi = 0L;
   uint64 current_pid = 0L;
+  map<uint64, AddressSpace> perpid;
   char buffer[kMaxBufferSize];
   while (ReadLine(f, buffer, kMaxBufferSize)) {
     size_t len = strlen(buffer);
     if (memcmp(buffer, "==== /proc/", 11) == 0) {
        current_pid = atoi(&buffer[11]);
-//fprintf(stdout, "pid %lld %s\n", current_pid, buffer);
+       // Per-thread maps are keyed by thread ID, which is what the trace has
+       const char* task = strstr(buffer, "/task/");
+       if (task != NULL) {current_pid = atoi(task + 6);}
+       perpid[current_pid];	// Known PID, even if nothing executable
+//fprintf(outfile, "pid %lld %s\n", current_pid, buffer);
        continue;
     }
 
@@ -134,6 +241,8 @@ void ReadAllmaps(FILE* f, MapsMap* allmaps) {
 
     int n = sscanf(buffer, "%llx-%llx", &addr_lo, &addr_hi);
     if (n != 2) {continue;}
+    uint64 file_offset = 0L;
+    sscanf(buffer + space2 + 1, "%llx", &file_offset);
 
     if (strchr(buffer + space1 + 1, 'x') ==NULL) {continue;}
 
@@ -142,13 +251,34 @@ void ReadAllmaps(FILE* f, MapsMap* allmaps) {
     RangeToFile temp;
     temp.addr_lo = addr_lo;
     temp.addr_hi = addr_hi;
-    temp.pid = current_pid;
+    temp.file_offset = file_offset;
     temp.pathname = pathname;
-    uint64 key = (current_pid << 48) | (addr_lo & 0x0000FFFFFFFFFFFFL);
 
-    (*allmaps)[key] = temp;
-//fprintf(stdout, "allmaps[%016lx] = ", key);
-//DumpRangeToFile(stdout, temp);
+    perpid[current_pid].push_back(temp);
+//fprintf(outfile, "allmaps[%lld] += ", current_pid);
+//DumpRangeToFile(outfile, temp);
+  }
+
+  // Keep one copy of each distinct address space. perpid iterates in PID
+  // order, so pidspace comes out sorted
+  map<uint64, vector<int> > byhash;
+  allmaps->spaces.clear();
+  allmaps->pidspace.clear();
+  for (map<uint64, AddressSpace>::iterator it = perpid.begin(); it != perpid.end(); ++it) {
+    AddressSpace* space = &it->second;
+    std::stable_sort(space->begin(), space->end(), RangeLess);
+    vector<int>* candidates = &byhash[SpaceHash(*space)];
+    int found = -1;
+    for (int i = 0; i < (int)candidates->size(); ++i) {
+      if (SameSpace(allmaps->spaces[(*candidates)[i]], *space)) {found = (*candidates)[i];}
+    }
+    if (found < 0) {
+      found = allmaps->spaces.size();
+      candidates->push_back(found);
+      allmaps->spaces.push_back(AddressSpace());
+      allmaps->spaces.back().swap(*space);
+    }
+    allmaps->pidspace.push_back(PidSpace(it->first, found));
   }
 }
 
@@ -168,48 +298,75 @@ uint64 GetFromHex(const string& s) {
   return addr;
 }
 
-const RangeToFile* Lookup(int pid, uint64 addr, const MapsMap& allmaps) {
-  bool fail = false;
-  if (pid < 0) {fail = true;}
-  if (fail) {return NULL;}
-
-  uint64 key = pid;
-  key = (key << 48) | (addr & 0x0000FFFFFFFFFFFFL);
-  MapsMap::const_iterator it = allmaps.upper_bound(key);  // Just above key
-  it = prev(it);	// At or just below key
-//fprintf(stdout, "Lookup(%d %llx %llx) = ", pid, addr, key);
-//DumpRangeToFile(stdout, it->second);
-
-  // If process P spawns processes Q R and S, most often they will have PIDs P+1 P+2 and P+3
-  // and of course the same shared memory map. In this case, the lookup above will hit on the
-  // entry just after the LAST entry for P before we call prev(). We can see that the PID for 
-  // Q does not match the lookup result that is at the end of P, but we can see that Q's PID
-  // of P+1 is "close". If that happens, we try looking up again using pID P in the key.
-
-  if ((it->second.pid != pid) && (IsClose(it->second.pid, pid))) {
-    // Second try with the lower PID
-    uint64 maybeparentpid = it->second.pid; 
-    key = (maybeparentpid << 48) | (addr & 0x0000FFFFFFFFFFFFL);
-    it = allmaps.upper_bound(key);  // Just above key
-    it = prev(it);	// At or just below key
-//fprintf(stdout, "Lookup2(%lld %llx %llx) = ", maybeparentpid, addr, key);
-//DumpRangeToFile(stdout, it->second);
-    if (it->second.pid != maybeparentpid) {fail = true;}
-    if (addr < it->second.addr_lo) {fail = true;}
-    if (it->second.addr_hi <= addr) {fail = true;}
-  } else {
-    // Double-check that we had a real hit
-    if (it->second.pid != pid) {fail = true;}
-    if (addr < it->second.addr_lo) {fail = true;}
-    if (it->second.addr_hi <= addr) {fail = true;}
-  }
+bool PidSpaceLess(const PidSpace& a, const PidSpace& b) {
+  return a.first < b.first;
+}
 
-  if (fail) {
-//fprintf(stdout, "  false hit\n");
-    return NULL;
+// Subscript in allmaps.spaces of pid's address space, or -1 if not in the maps file
+int SpaceOf(uint64 pid, const AllMaps& allmaps) {
+  vector<PidSpace>::const_iterator it = std::lower_bound(
+    allmaps.pidspace.begin(), allmaps.pidspace.end(), PidSpace(pid, 0), PidSpaceLess);
+  if ((it == allmaps.pidspace.end()) || (it->first != pid)) {return -1;}
+  return it->second;
+}
+
+// If process P spawns processes Q R and S, most often they will have PIDs P+1 P+2 and P+3
+// and of course the same shared memory map. If Q is not in the maps file and the
+// trace did not show who created it, we guess the closest lower PID that is in the
+// maps file, if it is "close".
+int NearbySpace(uint64 pid, const AllMaps& allmaps) {
+  vector<PidSpace>::const_iterator it = std::upper_bound(
+    allmaps.pidspace.begin(), allmaps.pidspace.end(), PidSpace(pid, 0), PidSpaceLess);
+  if (it == allmaps.pidspace.begin()) {return -1;}
+  it = prev(it);	// Largest PID at or below pid
+  if (!IsClose(it->first, pid)) {return -1;}
+  return it->second;
+}
+
+const RangeToFile* Lookup(int pid, uint64 addr, const AllMaps& allmaps) {
+  if (pid < 0) {return NULL;}
+
+  int space = SpaceOf(pid, allmaps);
+
+  // Not in the maps file, so probably created during the trace. Try its
+  // parent's address space, then the grandparent's, and so on
+  int ancestor = pid;
+  for (int gen = 0; (space < 0) && (gen < kMaxGenerations); ++gen) {
+    ParentMap::const_iterator it = parents.find(ancestor & 0xffff);
+    if (it == parents.end()) {break;}
+    ancestor = it->second;
+    space = SpaceOf(ancestor, allmaps);
   }
 
-  return &it->second;
+  if (space < 0) {space = NearbySpace(pid, allmaps);}
+  if (space < 0) {return NULL;}
+
+  // Last range starting at or below addr
+  const AddressSpace& ranges = allmaps.spaces[space];
+  RangeToFile temp;
+  temp.addr_lo = addr;
+  AddressSpace::const_iterator it = std::upper_bound(ranges.begin(), ranges.end(), temp, RangeLess);
+  if (it == ranges.begin()) {return NULL;}
+  it = prev(it);
+//fprintf(outfile, "Lookup(%d %llx) = ", pid, addr);
+//DumpRangeToFile(outfile, *it);
+  if (it->addr_hi <= addr) {return NULL;}
+
+  return &(*it);
+}
+
+// The clone, clone3, fork, and vfork syscalls return the new child's PID,
+// of which the trace keeps the low 16 bits. Error returns -4095..-1 appear
+// as 61441..65535 and are ignored, as, sadly, are child PIDs that look like them
+bool IsForkSpan(const OneSpan& onespan) {
+  int call = onespan.eventnum & 0xE00;
+  if ((call != KUTRACE_SYSCALL64) && (call != KUTRACE_SYSCALL32)) {return false;}
+  if ((onespan.retval <= 0) || (0xF000 < onespan.retval)) {return false;}
+  const string& name = onespan.name;	// Has trailing punctuation, "clone"],
+  return (name.compare(0, 8, "\"clone\"]") == 0) ||
+         (name.compare(0, 9, "\"clone3\"]") == 0) ||
+         (name.compare(0, 7, "\"fork\"]") == 0) ||
+         (name.compare(0, 8, "\"vfork\"]") == 0);
 }
 
 
@@ -219,6 +376,10 @@ char* NoArgs(char* procname) {
   return procname;
 }
 
+string NoArgs(const string& procname) {
+  return procname.substr(0, procname.find('('));
+}
+
 // Expecting two lines, the procedure name (from -f) and the file:line#
 // If file:line# is unknown (not enough debug info), then it is ??:?
 // The demangled (from -C) procedure name may have argument types.
@@ -260,9 +421,88 @@ return NoArgs(buffer);
 const char* DoAddr2line(const string& pathname, uint64 offset, char* buffer) {
   char cmd[256];
   sprintf(cmd, "addr2line -fsC -e %s %llx", pathname.c_str(), offset);
+  ++addr2line_count;
   return GetProcFileName(cmd, buffer);
 }
 
+// State for pathname, made on first use. With -cache, this opens the
+// binary's symbol cache file, named by build-id or else by file contents
+Binary* GetBinary(const string& pathname) {
+  BinaryMap::const_iterator it = binaries.find(pathname);
+  if (it != binaries.end()) {return it->second;}
+  Binary* binary = new Binary;
+  binary->symtab = NULL;
+  binary->symcache = NULL;
+  if (cache_dir != NULL) {
+    string id = ReadElfBuildId(pathname.c_str());
+    if (id.empty()) {id = SymCacheHashFile(pathname.c_str());}
+    if (!id.empty()) {
+      binary->symcache = new SymCache;
+      OpenSymCache(cache_dir, "u" + id, binary->symcache);
+    }
+  }
+  binaries[pathname] = binary;
+  return binary;
+}
+
+// Symbols for pathname, read on first use
+const ElfSymtab* GetSymtab(Binary* binary, const string& pathname) {
+  if (binary->symtab == NULL) {
+    binary->symtab = new ElfSymtab;
+    ReadElfSymtab(pathname.c_str(), binary->symtab);
+    ++symtab_count;
+  }
+  return binary->symtab;
+}
+
+// Look up the routine name containing addr. Return false if none
+// Same answer as addr2line -fC, up to any parenthesis, but done in-process
+// and remembered, so each distinct PC value costs one lookup
+bool LookupName(const RangeToFile* rtf, uint64 addr, string* name) {
+  uint64 offset = addr - rtf->addr_lo;
+  uint64 file_offset = offset + rtf->file_offset;
+  pair<string, uint64> key(rtf->pathname, file_offset);
+  NameCache::const_iterator it = namecache.find(key);
+  if (it != namecache.end()) {
+    *name = it->second;
+    return !name->empty();
+  }
+
+  Binary* binary = GetBinary(rtf->pathname);
+  if ((binary->symcache != NULL) && SymCacheLookup(*binary->symcache, file_offset, name)) {
+    ++symcache_hits;
+    namecache[key] = *name;
+    return !name->empty();
+  }
+
+  const ElfSymtab* symtab = GetSymtab(binary, rtf->pathname);
+  name->clear();
+  if (symtab->ok) {
+    const ElfSym* sym = ElfLookup(*symtab, ElfFileOffsetToVaddr(*symtab, file_offset));
+    // addr2line says ?? when no symbol is below the address
+    *name = (sym == NULL) ? string("??") : NoArgs(ElfDemangle(sym->name));
+    if (kMaxNameLen < name->size()) {name->resize(kMaxNameLen);}
+  } else if (symtab->found) {
+    // Not something elfsym.h can read; ask addr2line
+    char buffer[256];
+    const char* newname = DoAddr2line(rtf->pathname, offset, buffer);
+    *name = (newname == NULL) ? string() : string(newname);
+  }
+  namecache[key] = *name;
+  if ((binary->symcache != NULL) && symtab->found) {
+    SymCacheAdd(binary->symcache, file_offset, *name);
+    ++symcache_adds;
+  }
+  return !name->empty();
+}
+
+// Write back any new symbol cache entries
+void CloseAllSymCaches() {
+  for (BinaryMap::iterator it = binaries.begin(); it != binaries.end(); ++it) {
+    if (it->second->symcache != NULL) {CloseSymCache(it->second->symcache);}
+  }
+}
+
 
 // Cheap 16-bit hash so we can mostly distinguish different routine names
 int NameHash(const string& s) {
@@ -277,7 +517,7 @@ int NameHash(const string& s) {
   return retval;
 }
 
-void PossiblyReplaceName(OneSpan* onespan, const MapsMap& allmaps) {
+void PossiblyReplaceName(OneSpan* onespan, const AllMaps& allmaps) {
   string oldname = onespan->name.substr(4);	// Skip over "PC=
   size_t quote2 = oldname.find("\"");
   if (quote2 != string::npos) {oldname = oldname.substr(0, quote2);}	// Chop trailing "...
@@ -288,40 +528,49 @@ void PossiblyReplaceName(OneSpan* onespan, const MapsMap& allmaps) {
 
   // We now have the pathname of an executable image containing the address
   // WE ARE NOT DONE YET. This is just the exec file name
-  string pathname = rtf->pathname;	
-  uint64 offset = addr - rtf->addr_lo;
-
-  // Now execute command: addr2line -fsC -e /lib/x86_64-linux-gnu/libc-2.27.so 0x18eb1f
-  // and parse the result into filename:line# or procname 
-  char buffer[256];
-  const char* newname = DoAddr2line(pathname, offset, buffer);
-  if (newname != NULL) {
+  // Now look up the routine name in that file's symbol table
+  ++sample_count;
+  string newname;
+  if (LookupName(rtf, addr, &newname)) {
    // Fixup non-debug libc mapping memcpy into __nss_passwd_lookup
-    if (strcmp(newname, "__nss_passwd_lookup") == 0) {newname = "memcpy";}
+    if (newname == "__nss_passwd_lookup") {newname = "memcpy";}
     onespan->name = string("\"PC=") + newname + "\"],";
     onespan->arg = NameHash(newname);
-//fprintf(stdout, "%s => %s\n", oldname.c_str(), newname);
+//fprintf(outfile, "%s => %s\n", oldname.c_str(), newname.c_str());
   }
 }
 
 
 
 // Input is a json file of spans
-// start time and duration for each span are in seconds
+// start time and duration for each span are in seconds, or integer ticks
 // Output is a smaller json file of fewer spans with lower-resolution times
 void Usage() {
-  fprintf(stderr, "Usage: spantopcnameu <pidmaps fname>\n");
+  fprintf(stderr, "Usage: spantopcnameu <pidmaps fname> [-cache <dir>]\n");
   exit(0);
 }
 
 //
 // Filter from stdin to stdout
 //
-int main (int argc, const char** argv) {
+int SampToNameU(int argc, const char** argv, FILE* in, FILE* out) {
+  infile = in;
+  outfile = out;
+
   if (argc < 2) {Usage();}
+  cache_dir = NULL;
+  for (int i = 2; i < argc; ++i) {
+    if ((strcmp(argv[i], "-cache") == 0) && (i < (argc - 1))) {
+      cache_dir = argv[++i];
+    } else {
+      Usage();
+    }
+  }
+  if ((cache_dir != NULL) && !MakeSymCacheDir(cache_dir)) {cache_dir = NULL;}
 
   // Input allmaps file
-  MapsMap allmaps;
+  AllMaps allmaps;
+  parents.clear();
 
   const char* fname = argv[1];
   FILE* f = fopen(fname, "r");
@@ -339,7 +588,7 @@ int main (int argc, const char** argv) {
 
   int output_events = 0;
   char buffer[kMaxBufferSize];
-  while (ReadLine(stdin, buffer, kMaxBufferSize)) {
+  while (ReadLine(infile, buffer, kMaxBufferSize)) {
     char buffer2[256];
     buffer2[0] = '\0';
     OneSpan onespan;
@@ -352,19 +601,22 @@ int main (int argc, const char** argv) {
     
     if (n < 10) {
       // Copy unchanged anything not a span
-      fprintf(stdout, "%s\n", buffer);
+      fprintf(outfile, "%s\n", buffer);
+      if (ParseTicksPerSec(buffer) != 0) {ticks_per_sec = ParseTicksPerSec(buffer);}
       continue;
     }
-    if (onespan.start_ts >= 999.0) {break;}	// Always strip 999.0 end marker and stop
+    if (SpanSec(onespan.start_ts, ticks_per_sec) >= 999.0) {break;}	// Always strip 999.0 end marker and stop
 
     if (onespan.eventnum == KUTRACE_PC_U) {
       PossiblyReplaceName(&onespan, allmaps);
+    } else if (IsForkSpan(onespan)) {
+      parents[onespan.retval & 0xffff] = onespan.pid;
     }
 
 #if 1
     // Name has trailing punctuation, including ],
-    fprintf(stdout, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, %s\n",
-            onespan.start_ts, onespan.duration,
+    PrintSpanTimes(outfile, ticks_per_sec, onespan.start_ts, onespan.duration);
+    fprintf(outfile, "%d, %d, %d, %d, %d, %d, %d, %s\n",
             onespan.cpu, onespan.pid, onespan.rpcid, onespan.eventnum, 
             onespan.arg, onespan.retval, onespan.ipc, onespan.name.c_str());
     ++output_events;
@@ -372,8 +624,25 @@ int main (int argc, const char** argv) {
   }
 
   // Add marker and closing at the end
-  FinalJson(stdout);
+  FinalJson(outfile);
   fprintf(stderr, "spantopcnameu: %d events\n", output_events);
+  CloseAllSymCaches();
+  fprintf(stderr, "spantopcnameu: %d PC samples, %d distinct, %d binaries read, %d addr2line\n",
+          sample_count, (int)namecache.size(), symtab_count, addr2line_count);
+  fprintf(stderr, "spantopcnameu: %d PIDs, %d distinct address spaces, %d parents from trace\n",
+          (int)allmaps.pidspace.size(), (int)allmaps.spaces.size(), (int)parents.size());
+  if (cache_dir != NULL) {
+    fprintf(stderr, "spantopcnameu: %d symbol cache hits, %d new, in %s\n",
+            symcache_hits, symcache_adds, cache_dir);
+  }
 
   return 0;
 }
+
+}  // namespace samptoname_u
+
+#ifndef KUPOSTPROC
+int main (int argc, const char** argv) {
+  return samptoname_u::SampToNameU(argc, argv, stdin, stdout);
+}
+#endif
@@ -0,0 +1,249 @@
+// spanmerge.h
+//
+// Coarsening of per-CPU timespans to a given granularity, shared by
+// spantospan (one granularity) and spantolod (a pyramid of several).
+//
+// dsites 2022.07.07 Design, as originally in spantospan.cc
+//
+
+/***
+ Design notes:
+ We want the granular output to contain nearly the same total amount of time per
+ timeline as the originaly.
+ We want long timespans to land in nearly the same position as originally.
+ We drop a lot of decoration items but keep mark_a/b/c.
+ We accumulate spans by event number, releasing an output span whenever
+ the total exceeds the granularity.
+ Large spans land within +/- granularity of their original
+
+ Items that total less than granularity at the end are dropped. We compensate
+ by initializing each deferred span's duration to half the granularity.
+ Each combined span is represented by its first-arrived item.
+
+ Output spans come out per CPU in time order, but not in overall time order.
+ ***/
+
+#ifndef __SPANMERGE_H__
+#define __SPANMERGE_H__
+
+#include <map>
+
+#include <stdio.h>
+
+#include "basetypes.h"
+#include "json_ticks.h"
+
+typedef struct {
+  double start_ts;	// Seconds
+  double duration;	// Seconds
+  int64 start_ts_ns;
+  int64 duration_ns;
+  int cpu;
+  int pid;
+  int rpcid;
+  int event;
+  int arg;
+  int retval;
+  int ipc;
+  char name[64];
+} OneSpan;
+
+// Short spans accumulate by summing duration
+typedef std::map<int, OneSpan> SpanMap;
+
+typedef struct {
+  int64 next_ts_ns;
+  int64 total_deferred_ns;
+  SpanMap spanmap;
+} CPUstate;
+
+static const int kMaxCpus = 80;
+
+// Called for each combined output span
+typedef void (*EmitSpanFunc)(const OneSpan& onespan, void* emit_arg);
+
+// All the state for coarsening to one granularity
+typedef struct {
+  int64 granularity_ns;
+  CPUstate cpustate[kMaxCpus];
+  bool output_buffer_full[kMaxCpus];
+  OneSpan buffered_span[kMaxCpus];
+  EmitSpanFunc emit;
+  void* emit_arg;
+} SpanMerger;
+
+inline void InitSpanMerger(int64 granularity_ns, EmitSpanFunc emit, void* emit_arg,
+                           SpanMerger* merger) {
+  merger->granularity_ns = granularity_ns;
+  merger->emit = emit;
+  merger->emit_arg = emit_arg;
+  // Initialize each CPU deferral
+  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
+    merger->cpustate[cpu].next_ts_ns = -1;
+    merger->cpustate[cpu].total_deferred_ns = granularity_ns / 2;
+    merger->cpustate[cpu].spanmap.clear();
+    merger->output_buffer_full[cpu] = false;
+  }
+}
+
+// Keep a few things, such as mark_a marker, unmerged
+inline bool KeepIntact(const OneSpan& onespan) {
+  // Keep mark_a for landmarks
+  if (onespan.event == 0x020A) {return true;}
+  return false;
+}
+
+// Delete all but events that span actual CPU time
+inline bool DeleteMe(const OneSpan& onespan, int64 ticks_per_sec) {
+  if (onespan.cpu < 0) {return true;}
+  if (onespan.event < 0x400) {return true;}
+  if (SpanSec(onespan.duration, ticks_per_sec) < 0.000000011) {return true;}
+  return false;
+}
+
+// Accumulate a span in per-CPU state, incrementing the deferred not-yet-output times
+inline void AddSpan(const OneSpan& onespan, CPUstate* cpustate) {
+  int event = onespan.event;
+  SpanMap::iterator it = cpustate->spanmap.find(event);
+  if (it == cpustate->spanmap.end()) {
+    // Make a new event entry
+    OneSpan temp;
+    temp = onespan;					// Copy all the fields
+    temp.duration_ns = 0;				// Updated below
+    cpustate->spanmap[event] = temp;
+    it = cpustate->spanmap.find(event);
+  }
+  OneSpan* addedspan = &it->second;
+  if (addedspan->duration_ns == 0) {
+    *addedspan = onespan;				// Reinit pid, etc.
+  } else {
+    addedspan->duration_ns += onespan.duration_ns;	// Just add to existing duration
+  }
+  cpustate->total_deferred_ns += onespan.duration_ns;
+}
+
+inline OneSpan* FindLargestDeferred(SpanMap& spanmap) {
+  int max_deferred = 0;
+  OneSpan* retval = NULL;
+  for (SpanMap::iterator it = spanmap.begin(); it != spanmap.end(); ++it) {
+    if (max_deferred < it->second.duration_ns) {
+      max_deferred = it->second.duration_ns;
+      retval = &it->second;
+    }
+  }
+  return retval;
+}
+
+// Run a one-span buffer so we can combine identical-event spans
+// This can be called with newspan=NULL to flush the last buffered entry
+inline void OutputSpan(SpanMerger* merger, int cpu, int64 next_ts_ns, const OneSpan* newspan) {
+  // Possibly combine with previously buffered span per CPU
+  if ((newspan != NULL) &&
+      merger->output_buffer_full[cpu] &&
+      (newspan->event == merger->buffered_span[cpu].event)) {
+    merger->buffered_span[cpu].duration_ns += newspan->duration_ns;
+    return;
+  }
+  // Flush any buffered span
+  if (merger->output_buffer_full[cpu]) {
+    merger->emit(merger->buffered_span[cpu], merger->emit_arg);
+    merger->output_buffer_full[cpu] = false;
+  }
+  // Save as new buffered span
+  if (newspan != NULL) {
+    merger->buffered_span[cpu] = *newspan;		// Copy all the fields
+    merger->buffered_span[cpu].start_ts_ns = next_ts_ns;
+    merger->output_buffer_full[cpu] = true;
+  }
+}
+
+inline void DumpDeferred(FILE* f, CPUstate* cpustate) {
+  fprintf(f, "DumpDefered %5lld\n", cpustate->total_deferred_ns);
+  for (SpanMap::iterator it = cpustate->spanmap.begin(); it != cpustate->spanmap.end(); ++it) {
+    if (0 < it->second.duration_ns) {
+      fprintf(f, "  %5lld %s\n", it->second.duration_ns, it->second.name);
+    }
+  }
+}
+
+inline OneSpan* GetCurrent(int event,  CPUstate* cpustate) {
+  SpanMap::iterator it = cpustate->spanmap.find(event);
+  if (it == cpustate->spanmap.end()) {
+    // No such event
+    return NULL;
+  }
+  return &it->second;
+}
+
+// Flush the deferred event that matches onespan.event
+inline void FlushCurrent(SpanMerger* merger, const OneSpan& onespan, CPUstate* cpustate) {
+  OneSpan* curspan = GetCurrent(onespan.event, cpustate);
+  if (curspan == NULL) {return;}
+  int64 duration_ns = curspan->duration_ns;
+  if (duration_ns == 0) {return;}
+  int cpu = curspan->cpu;
+  OutputSpan(merger, cpu, cpustate->next_ts_ns, curspan);
+  curspan->duration_ns = 0;
+  cpustate->next_ts_ns += duration_ns;
+  cpustate->total_deferred_ns -= duration_ns;
+}
+
+// Output deferred spans by decreasing size
+inline void FlushDeferred(SpanMerger* merger, CPUstate* cpustate) {
+    while (cpustate->total_deferred_ns >= merger->granularity_ns) {
+      OneSpan* deferspan = FindLargestDeferred(cpustate->spanmap);
+      if (deferspan == NULL) {break;}
+      int64 duration_ns = deferspan->duration_ns;
+      OutputSpan(merger, deferspan->cpu, cpustate->next_ts_ns, deferspan);
+      deferspan->duration_ns = 0;
+      cpustate->next_ts_ns += duration_ns;
+      cpustate->total_deferred_ns -= duration_ns;
+    }
+}
+
+// Defer this span by adding its duration to accumulated time by event number,
+// and also to total deferred time per CPU number.
+// If total deferred for this CPU then exceeds granularity, flush the largest
+// deferred spans.
+inline void ProcessSpan(SpanMerger* merger, const OneSpan& onespan) {
+  CPUstate* cpustate = merger->cpustate;
+  int cpu = onespan.cpu;
+  // Initialize start timestamp at first entry per CPU
+  if (cpustate[cpu].next_ts_ns < 0) {
+    cpustate[cpu].next_ts_ns = onespan.start_ts_ns;
+  }
+
+  // If this is a big span,  catch up deferred spans until we are within
+  // granularity of the new span's original start_ts, and then output this span.
+  // If  not big, defer this span and return.
+  // Big means that this span's duration plus any same-event deferred
+  // duration is >= granularity.
+  OneSpan* curspan = GetCurrent(onespan.event, &cpustate[cpu]);
+  int64 dur_ns = onespan.duration_ns;
+  if (curspan != NULL) {
+    dur_ns += curspan->duration_ns;
+  }
+  bool bigspan = (dur_ns >= merger->granularity_ns);
+  if (bigspan) {
+    FlushDeferred(merger, &cpustate[cpu]);
+    AddSpan(onespan, &cpustate[cpu]);
+    FlushCurrent(merger, onespan, &cpustate[cpu]);
+    return;
+  }
+
+  // Else just accumulate this span in deferred per-CPU state, possibly merging
+  // with previous small instances
+  AddSpan(onespan, &cpustate[cpu]);
+}
+
+// Flush any remaining deferred spans per CPU, at end of input
+inline void FlushAllSpans(SpanMerger* merger) {
+  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
+    // Possibly many deferred events
+    FlushDeferred(merger, &merger->cpustate[cpu]);
+    // And push out last buffered item
+    OutputSpan(merger, cpu, merger->cpustate[cpu].next_ts_ns, NULL);
+  }
+}
+
+#endif	// __SPANMERGE_H__
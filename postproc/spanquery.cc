@@ -0,0 +1,482 @@
+// Little program to query a JSON span file: pick spans by time range and by
+// cpu/pid/rpc/event/name/duration/ipc, then count them, total them, or list them
+//
+// Usage: spanquery [filters] [-by <key>] [-sort <metric>] [-top <n>] [-list]
+//                  [-t <threads>] [-noskip] [foo.json]
+//   Reads foo.json, or stdin if none
+//
+// Filters, all of which must match; lists are comma-separated numbers or
+// lo:hi ranges, inclusive, decimal or 0x hex
+//   -start <sec>     span starts at or after sec
+//   -stop <sec>      span starts before sec
+//   -cpu <list>  -pid <list>  -rpc <list>  -event <list>  -ipc <list>
+//   -name <pattern>  name matches a shell-style pattern, such as "read*"
+//   -mindur <usec>   duration at least usec
+//   -maxdur <usec>   duration at most usec
+//
+// Aggregates
+//   -by <key>        group by cpu, pid, rpc, event, name, or base (name up to
+//                    the last period, so all threads of a program together);
+//                    default is one group of everything that matches
+//   -sort <metric>   order groups by sum (default), count, max, p50, p90, or p99
+//                    of span durations
+//   -top <n>         show this many groups, default 20; 0 for all
+//   -list            instead, write the matching spans as a JSON span file,
+//                    header and all, which can go on to makeself
+//
+//   spanquery foo.json -event 0x800:0x9ff -by name -sort p99 -top 10
+//   spanquery foo.json -start 12.5 -stop 12.6 -pid 1910 -list |./makeself show_cpu.html >x.html
+//
+// The input is mapped if it is a file. Span files from the usual pipeline
+// are sorted by start time, so -start and -stop binary-search for the part
+// of the file to scan and nothing outside it is read; -noskip scans
+// everything instead, for unsorted input. That part is split at line
+// boundaries across -t threads, each with its own groups, merged in input
+// order at the end, so the output is the same for any number of threads.
+//
+// Durations are kept in log-linear histograms (latencyhist.h), so
+// percentiles are within 1/16 of exact. Times in the output are microseconds.
+//
+// Compile with g++ -O2 spanquery.cc -o spanquery -pthread
+//
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+
+#include "basetypes.h"
+#include "json_ticks.h"
+#include "latencyhist.h"
+#include "spanscan.h"
+
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+static const int kDefaultTop = 20;
+static const int kMaxNameLen = 256;
+
+enum GroupBy {kByAll, kByCpu, kByPid, kByRpc, kByEvent, kByName, kByBase};
+enum SortBy {kSortSum, kSortCount, kSortMax, kSortP50, kSortP90, kSortP99};
+
+// Inclusive range of values
+typedef struct {
+  int64 lo;
+  int64 hi;
+} ValueRange;
+
+typedef vector<ValueRange> ValueList;	// Empty matches everything
+
+typedef struct {
+  int64 start_ns;
+  int64 stop_ns;
+  ValueList cpu;
+  ValueList pid;
+  ValueList rpc;
+  ValueList event;
+  ValueList ipc;
+  const char* name_pattern;	// NULL matches everything
+  int64 mindur_ns;
+  int64 maxdur_ns;
+} Query;
+
+typedef struct {
+  int64 numkey;		// cpu/pid/rpc/event
+  string strkey;	// name or base name
+  string example;	// First name seen, for numeric keys
+  LatHist hist;
+} Group;
+
+// One thread's share of the input and everything it found
+typedef struct {
+  const char* begin;
+  const char* limit;
+  int64 scanned;
+  int64 matched;
+  int64 out_of_order;
+  unordered_map<int64, int> numgroups;	// Key => subscript in groups
+  unordered_map<string, int> strgroups;
+  vector<Group*> groups;
+  string listing;			// Matching lines, for -list
+} Shard;
+
+// Globals
+static Query query;
+static GroupBy group_by = kByAll;
+static bool dolist = false;
+static int64 ns_per_unit = 1000000000;
+
+void Usage() {
+  fprintf(stderr, "Usage: spanquery [-start <sec>] [-stop <sec>] [-cpu <list>] [-pid <list>] "
+                  "[-rpc <list>] [-event <list>] [-ipc <list>]\n"
+                  "                 [-name <pattern>] [-mindur <usec>] [-maxdur <usec>]\n"
+                  "                 [-by cpu|pid|rpc|event|name|base] "
+                  "[-sort sum|count|max|p50|p90|p99] [-top <n>] [-list]\n"
+                  "                 [-t <threads>] [-noskip] [foo.json]\n");
+  exit(0);
+}
+
+// 12,0x800:0x9ff,-1 into ranges
+void ParseValueList(const char* s, ValueList* list) {
+  while (*s != '\0') {
+    char* end;
+    ValueRange range;
+    range.lo = strtoll(s, &end, 0);
+    if (end == s) {Usage();}
+    range.hi = range.lo;
+    s = end;
+    if (*s == ':') {
+      ++s;
+      range.hi = strtoll(s, &end, 0);
+      if (end == s) {Usage();}
+      s = end;
+    }
+    list->push_back(range);
+    if (*s == ',') {++s;} else if (*s != '\0') {Usage();}
+  }
+}
+
+inline bool InList(int64 value, const ValueList& list) {
+  if (list.empty()) {return true;}
+  for (int i = 0; i < (int)list.size(); ++i) {
+    if ((list[i].lo <= value) && (value <= list[i].hi)) {return true;}
+  }
+  return false;
+}
+
+// The name up to the last period, as spantoprof does for row names
+inline int BaseLen(const char* name, int namelen) {
+  for (int i = namelen - 1; 0 < i; --i) {
+    if (name[i] == '.') {return i;}
+  }
+  return namelen;
+}
+
+bool Matches(const ScanSpan& span, char* namebuf) {
+  if ((span.start_ns < query.start_ns) || (query.stop_ns <= span.start_ns)) {return false;}
+  if ((span.duration_ns < query.mindur_ns) || (query.maxdur_ns < span.duration_ns)) {return false;}
+  if (!InList(span.cpu, query.cpu)) {return false;}
+  if (!InList(span.pid, query.pid)) {return false;}
+  if (!InList(span.rpcid, query.rpc)) {return false;}
+  if (!InList(span.eventnum, query.event)) {return false;}
+  if (!InList(span.ipc, query.ipc)) {return false;}
+  if (query.name_pattern != NULL) {
+    if (fnmatch(query.name_pattern, namebuf, 0) != 0) {return false;}
+  }
+  return true;
+}
+
+Group* NewGroup(Shard* shard) {
+  Group* group = new Group;
+  group->numkey = 0;
+  InitLatHist(&group->hist);
+  shard->groups.push_back(group);
+  return group;
+}
+
+Group* FindGroup(const ScanSpan& span, Shard* shard) {
+  if ((group_by == kByName) || (group_by == kByBase)) {
+    int len = (group_by == kByBase) ? BaseLen(span.name, span.namelen) : span.namelen;
+    string key(span.name, len);
+    unordered_map<string, int>::const_iterator it = shard->strgroups.find(key);
+    if (it != shard->strgroups.end()) {return shard->groups[it->second];}
+    shard->strgroups[key] = shard->groups.size();
+    Group* group = NewGroup(shard);
+    group->strkey = key;
+    return group;
+  }
+
+  int64 key = 0;
+  switch (group_by) {
+  case kByCpu:   key = span.cpu; break;
+  case kByPid:   key = span.pid; break;
+  case kByRpc:   key = span.rpcid; break;
+  case kByEvent: key = span.eventnum; break;
+  default:       break;
+  }
+  unordered_map<int64, int>::const_iterator it = shard->numgroups.find(key);
+  if (it != shard->numgroups.end()) {return shard->groups[it->second];}
+  shard->numgroups[key] = shard->groups.size();
+  Group* group = NewGroup(shard);
+  group->numkey = key;
+  group->example = string(span.name, span.namelen);
+  return group;
+}
+
+void ScanShard(Shard* shard) {
+  shard->scanned = 0;
+  shard->matched = 0;
+  shard->out_of_order = 0;
+  int64 prior_ns = -1;
+  char namebuf[kMaxNameLen];
+  const char* p = shard->begin;
+  while (p < shard->limit) {
+    const char* eol = ScanLineEnd(p, shard->limit);
+    const char* next = ScanNextLine(p, shard->limit);
+    ScanSpan span;
+    if (!ScanSpanLine(p, eol, ns_per_unit, &span) || (kScanEndNs <= span.start_ns)) {
+      p = next;
+      continue;
+    }
+    ++shard->scanned;
+    if (span.start_ns < prior_ns) {++shard->out_of_order;}
+    prior_ns = span.start_ns;
+
+    if (query.name_pattern != NULL) {
+      int len = (span.namelen < kMaxNameLen - 1) ? span.namelen : kMaxNameLen - 1;
+      memcpy(namebuf, span.name, len);
+      namebuf[len] = '\0';
+    }
+    if (Matches(span, namebuf)) {
+      ++shard->matched;
+      if (dolist) {
+        shard->listing.append(p, next - p);
+      } else {
+        AddToLatHist(span.duration_ns, span.start_ns, span.pid, &FindGroup(span, shard)->hist);
+      }
+    }
+    p = next;
+  }
+}
+
+// Add a later shard's groups into total, in the order they first appeared
+void MergeShard(const Shard& part, Shard* total) {
+  total->scanned += part.scanned;
+  total->matched += part.matched;
+  total->out_of_order += part.out_of_order;
+  for (int i = 0; i < (int)part.groups.size(); ++i) {
+    const Group* partgroup = part.groups[i];
+    int subscr = -1;
+    if ((group_by == kByName) || (group_by == kByBase)) {
+      unordered_map<string, int>::const_iterator it = total->strgroups.find(partgroup->strkey);
+      if (it != total->strgroups.end()) {subscr = it->second;}
+      else {total->strgroups[partgroup->strkey] = total->groups.size();}
+    } else {
+      unordered_map<int64, int>::const_iterator it = total->numgroups.find(partgroup->numkey);
+      if (it != total->numgroups.end()) {subscr = it->second;}
+      else {total->numgroups[partgroup->numkey] = total->groups.size();}
+    }
+    if (subscr < 0) {
+      Group* group = NewGroup(total);
+      group->numkey = partgroup->numkey;
+      group->strkey = partgroup->strkey;
+      group->example = partgroup->example;
+      subscr = total->groups.size() - 1;
+    }
+    MergeLatHist(partgroup->hist, &total->groups[subscr]->hist);
+  }
+}
+
+static SortBy sort_by = kSortSum;
+
+int64 SortValue(const Group* group) {
+  const LatHist& hist = group->hist;
+  switch (sort_by) {
+  case kSortSum:   return hist.sum_ns;
+  case kSortCount: return hist.count;
+  case kSortMax:   return hist.max_ns;
+  case kSortP50:   return LatPercentile(hist, 0.50);
+  case kSortP90:   return LatPercentile(hist, 0.90);
+  case kSortP99:   return LatPercentile(hist, 0.99);
+  }
+  return 0;
+}
+
+// Descending by the sort metric, ties by first appearance
+bool GroupGreater(const Group* a, const Group* b) {
+  return SortValue(a) > SortValue(b);
+}
+
+string GroupLabel(const Group* group) {
+  char temp[64];
+  switch (group_by) {
+  case kByAll:
+    return string("all");
+  case kByName:
+  case kByBase:
+    return group->strkey;
+  case kByEvent:
+    sprintf(temp, "%lld (0x%03llx) ", group->numkey, group->numkey);
+    return string(temp) + group->example;
+  default:
+    sprintf(temp, "%lld", group->numkey);
+    return string(temp);
+  }
+}
+
+double NsToUsec(int64 ns) {return ns / 1000.0;}
+
+void PrintGroups(FILE* f, vector<Group*>* groups, int top) {
+  std::stable_sort(groups->begin(), groups->end(), GroupGreater);
+  fprintf(f, "%12s %14s %12s %12s %12s %12s %12s  %s\n",
+          "count", "sum_us", "mean_us", "p50_us", "p90_us", "p99_us", "max_us", "group");
+  for (int i = 0; i < (int)groups->size(); ++i) {
+    if ((0 < top) && (top <= i)) {break;}
+    const LatHist& hist = (*groups)[i]->hist;
+    fprintf(f, "%12lld %14.3f %12.3f %12.3f %12.3f %12.3f %12.3f  %s\n",
+            hist.count, NsToUsec(hist.sum_ns), NsToUsec(hist.sum_ns) / hist.count,
+            NsToUsec(LatPercentile(hist, 0.50)), NsToUsec(LatPercentile(hist, 0.90)),
+            NsToUsec(LatPercentile(hist, 0.99)), NsToUsec(hist.max_ns),
+            GroupLabel((*groups)[i]).c_str());
+  }
+  if ((0 < top) && (top < (int)groups->size())) {
+    fprintf(f, "... %d more groups\n", (int)groups->size() - top);
+  }
+}
+
+int64 SecToNs(const char* s) {
+  return (int64)(atof(s) * 1000000000.0 + 0.5);
+}
+
+int main(int argc, const char** argv) {
+  const char* fname = NULL;
+  int thread_count = 1;
+  int top = kDefaultTop;
+  bool noskip = false;
+  query.start_ns = -kScanNever;
+  query.stop_ns = kScanNever;
+  query.name_pattern = NULL;
+  query.mindur_ns = 0;
+  query.maxdur_ns = kScanNever;
+
+  for (int i = 1; i < argc; ++i) {
+    bool has_arg = (i < (argc - 1));
+    if ((strcmp(argv[i], "-start") == 0) && has_arg) {query.start_ns = SecToNs(argv[++i]);}
+    else if ((strcmp(argv[i], "-stop") == 0) && has_arg) {query.stop_ns = SecToNs(argv[++i]);}
+    else if ((strcmp(argv[i], "-cpu") == 0) && has_arg) {ParseValueList(argv[++i], &query.cpu);}
+    else if ((strcmp(argv[i], "-pid") == 0) && has_arg) {ParseValueList(argv[++i], &query.pid);}
+    else if ((strcmp(argv[i], "-rpc") == 0) && has_arg) {ParseValueList(argv[++i], &query.rpc);}
+    else if ((strcmp(argv[i], "-event") == 0) && has_arg) {ParseValueList(argv[++i], &query.event);}
+    else if ((strcmp(argv[i], "-ipc") == 0) && has_arg) {ParseValueList(argv[++i], &query.ipc);}
+    else if ((strcmp(argv[i], "-name") == 0) && has_arg) {query.name_pattern = argv[++i];}
+    else if ((strcmp(argv[i], "-mindur") == 0) && has_arg) {query.mindur_ns = SecToNs(argv[++i]) / 1000000;}
+    else if ((strcmp(argv[i], "-maxdur") == 0) && has_arg) {query.maxdur_ns = SecToNs(argv[++i]) / 1000000;}
+    else if ((strcmp(argv[i], "-by") == 0) && has_arg) {
+      ++i;
+      if (strcmp(argv[i], "cpu") == 0) {group_by = kByCpu;}
+      else if (strcmp(argv[i], "pid") == 0) {group_by = kByPid;}
+      else if (strcmp(argv[i], "rpc") == 0) {group_by = kByRpc;}
+      else if (strcmp(argv[i], "event") == 0) {group_by = kByEvent;}
+      else if (strcmp(argv[i], "name") == 0) {group_by = kByName;}
+      else if (strcmp(argv[i], "base") == 0) {group_by = kByBase;}
+      else {Usage();}
+    }
+    else if ((strcmp(argv[i], "-sort") == 0) && has_arg) {
+      ++i;
+      if (strcmp(argv[i], "sum") == 0) {sort_by = kSortSum;}
+      else if (strcmp(argv[i], "count") == 0) {sort_by = kSortCount;}
+      else if (strcmp(argv[i], "max") == 0) {sort_by = kSortMax;}
+      else if (strcmp(argv[i], "p50") == 0) {sort_by = kSortP50;}
+      else if (strcmp(argv[i], "p90") == 0) {sort_by = kSortP90;}
+      else if (strcmp(argv[i], "p99") == 0) {sort_by = kSortP99;}
+      else {Usage();}
+    }
+    else if ((strcmp(argv[i], "-top") == 0) && has_arg) {top = atoi(argv[++i]);}
+    else if (strcmp(argv[i], "-list") == 0) {dolist = true;}
+    else if ((strcmp(argv[i], "-t") == 0) && has_arg) {thread_count = atoi(argv[++i]);}
+    else if (strcmp(argv[i], "-noskip") == 0) {noskip = true;}
+    else if (argv[i][0] != '-') {fname = argv[i];}
+    else {Usage();}
+  }
+  if (thread_count < 1) {Usage();}
+
+  FILE* f = stdin;
+  if (fname != NULL) {
+    f = fopen(fname, "rb");
+    if (f == NULL) {
+      fprintf(stderr, "%s did not open\n", fname);
+      exit(0);
+    }
+  }
+  size_t input_len = 0;
+  const char* input = MapSpanInput(f, &input_len);
+  const char* input_limit = input + input_len;
+
+  int64 ticks_per_sec = 0;
+  const char* first_span = ScanHeader(input, input_limit, &ticks_per_sec);
+  ns_per_unit = ScanNsPerUnit(ticks_per_sec);
+
+  // Just the lines that can start in [start, stop)
+  const char* begin = first_span;
+  const char* limit = input_limit;
+  if (!noskip) {
+    if (query.start_ns != -kScanNever) {
+      begin = FirstSpanAtOrAfter(first_span, input_limit, query.start_ns, ns_per_unit);
+    }
+    if (query.stop_ns != kScanNever) {
+      limit = FirstSpanAtOrAfter(begin, input_limit, query.stop_ns, ns_per_unit);
+    }
+  }
+
+  // Split at line boundaries and scan the pieces in parallel
+  vector<Shard*> shards;
+  vector<std::thread*> threads;
+  const char* shard_begin = begin;
+  for (int i = 0; i < thread_count; ++i) {
+    const char* shard_limit = begin + ((limit - begin) * (i + 1)) / thread_count;
+    while ((shard_limit < limit) && (shard_limit[-1] != '\n')) {++shard_limit;}
+    if (shard_limit < shard_begin) {shard_limit = shard_begin;}
+    Shard* shard = new Shard;
+    shard->begin = shard_begin;
+    shard->limit = shard_limit;
+    shards.push_back(shard);
+    shard_begin = shard_limit;
+  }
+  for (int i = 0; i < thread_count; ++i) {
+    threads.push_back(new std::thread(ScanShard, shards[i]));
+  }
+  Shard total;
+  total.scanned = 0;
+  total.matched = 0;
+  total.out_of_order = 0;
+  for (int i = 0; i < thread_count; ++i) {
+    threads[i]->join();
+    delete threads[i];
+  }
+  // A span that starts before the end of the previous shard is out of order too
+  for (int i = 1; i < thread_count; ++i) {
+    if ((shards[i - 1]->begin < shards[i - 1]->limit) && (shards[i]->begin < shards[i]->limit)) {
+      const char* last = shards[i]->begin - 1;
+      while ((shards[i - 1]->begin < last) && (last[-1] != '\n')) {--last;}
+      int64 last_ns = ScanStartNs(last, shards[i]->begin, ns_per_unit);
+      int64 first_ns = ScanStartNs(shards[i]->begin, shards[i]->limit, ns_per_unit);
+      if ((first_ns < last_ns) && (last_ns < kScanEndNs)) {++total.out_of_order;}
+    }
+  }
+
+  if (dolist) {
+    fwrite(input, 1, first_span - input, stdout);	// Header, through "events" : [
+    for (int i = 0; i < thread_count; ++i) {
+      fwrite(shards[i]->listing.data(), 1, shards[i]->listing.size(), stdout);
+      MergeShard(*shards[i], &total);
+      delete shards[i];
+    }
+    PrintFinalJson(stdout, ticks_per_sec);
+  } else {
+    for (int i = 0; i < thread_count; ++i) {
+      MergeShard(*shards[i], &total);
+      for (int k = 0; k < (int)shards[i]->groups.size(); ++k) {delete shards[i]->groups[k];}
+      delete shards[i];
+    }
+    PrintGroups(stdout, &total.groups, top);
+  }
+
+  fprintf(stderr, "spanquery: %lld spans scanned, %lld matched, %d groups, "
+          "%lld of %lld bytes read\n",
+          total.scanned, total.matched, (int)total.groups.size(),
+          (int64)(limit - begin), (int64)(input_limit - first_span));
+  bool cut = (query.start_ns != -kScanNever) || (query.stop_ns != kScanNever);
+  if ((0 < total.out_of_order) && cut && !noskip) {
+    fprintf(stderr, "spanquery: input is not sorted by time (%lld spans out of order); "
+            "use -noskip with -start/-stop\n", total.out_of_order);
+  }
+  if (f != stdin) {fclose(f);}
+  return 0;
+}
@@ -0,0 +1,202 @@
+// spanscan.h
+//
+// Fast scanning of JSON span files held in memory, for programs that look at
+// every span of big traces or jump to a time range.
+//
+// The whole input is mapped if it is a file, else read into memory. Span
+// lines are parsed in place, with times converted exactly to integer
+// nanoseconds, whether they came in as seconds (12.34569799) or integer ticks
+// (see json_ticks.h). The name is left in the input, not copied.
+//
+// Span files from the usual pipeline are sorted by start time, since the
+// start time is right-justified in a fixed width and the file is text-sorted.
+// FirstSpanAtOrAfter uses that to binary-search for the first span that
+// starts at or after a given time, so a time range can be cut out of a file
+// of any size without reading the rest of it.
+//
+
+#ifndef __SPANSCAN_H__
+#define __SPANSCAN_H__
+
+#include <stdio.h>
+#include <stdlib.h>     // strtoll
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+#include "basetypes.h"
+#include "json_ticks.h"
+
+static const int64 kScanEndNs = 999000000000LL;	// End marker [999.0, ...
+static const int64 kScanNever = 0x7FFFFFFFFFFFFFFFLL;
+
+// One span, parsed in place
+typedef struct {
+  int64 start_ns;
+  int64 duration_ns;
+  int cpu;
+  int pid;
+  int rpcid;
+  int eventnum;
+  int arg;
+  int retval;
+  int ipc;
+  const char* name;	// Just after the opening quote, not NUL terminated
+  int namelen;
+} ScanSpan;
+
+// The whole input, mapped if it is a file, else read
+inline const char* MapSpanInput(FILE* f, size_t* len) {
+  struct stat st;
+  if ((fstat(fileno(f), &st) == 0) && S_ISREG(st.st_mode) && (0 < st.st_size)) {
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (p != MAP_FAILED) {
+      *len = st.st_size;
+      return reinterpret_cast<const char*>(p);
+    }
+  }
+  std::vector<char>* all = new std::vector<char>;	// Lives until exit
+  char temp[65536];
+  size_t n;
+  while ((n = fread(temp, 1, sizeof(temp), f)) > 0) {all->insert(all->end(), temp, temp + n);}
+  *len = all->size();
+  return all->empty() ? "" : &(*all)[0];
+}
+
+// Start of the line after the one at p, or limit
+inline const char* ScanNextLine(const char* p, const char* limit) {
+  const char* nl = reinterpret_cast<const char*>(memchr(p, '\n', limit - p));
+  return (nl == NULL) ? limit : nl + 1;
+}
+
+// End of the line at p, before any cr lf, or limit
+inline const char* ScanLineEnd(const char* p, const char* limit) {
+  const char* nl = reinterpret_cast<const char*>(memchr(p, '\n', limit - p));
+  if (nl == NULL) {nl = limit;}
+  if ((p < nl) && (nl[-1] == '\r')) {--nl;}
+  return nl;
+}
+
+// Decimal seconds or integer ticks to nanoseconds, exactly.
+// ns_per_unit is 1000000000 for seconds, 10 for 10ns ticks
+inline int64 ScanNs(const char* s, char** end, int64 ns_per_unit) {
+  const char* p = s;
+  while (*p == ' ') {++p;}
+  bool negative = (*p == '-');
+  if (negative) {++p;}
+  int64 whole = 0;
+  int ndigits = 0;
+  while (('0' <= *p) && (*p <= '9')) {whole = whole * 10 + (*p++ - '0'); ++ndigits;}
+  int64 ns = whole * ns_per_unit;
+  if (*p == '.') {
+    ++p;
+    int64 scale = 100000000;	// Of the first fraction digit, in ns
+    while (('0' <= *p) && (*p <= '9')) {
+      ns += (*p++ - '0') * scale;
+      scale /= 10;
+      ++ndigits;
+    }
+  }
+  *end = const_cast<char*>((ndigits == 0) ? s : p);
+  return negative ? -ns : ns;
+}
+
+// strtol base 10, with a fast path for up to nine digits
+inline int ScanInt(const char* s, char** end) {
+  const char* p = s;
+  while (*p == ' ') {++p;}
+  bool negative = (*p == '-');
+  if (negative) {++p;}
+  int value = 0;
+  int ndigits = 0;
+  while (('0' <= *p) && (*p <= '9')) {value = value * 10 + (*p++ - '0'); ++ndigits;}
+  if ((ndigits == 0) || (9 < ndigits)) {return strtol(s, end, 10);}
+  *end = const_cast<char*>(p);
+  return negative ? -value : value;
+}
+
+// Parse the span line from s to eol. Returns false if it is not a span
+//   [ 22.39359781, 0.00000283, 0, 1910, 0, 2048, 3, 256, 3, "read"],
+inline bool ScanSpanLine(const char* s, const char* eol, int64 ns_per_unit, ScanSpan* span) {
+  if ((s >= eol) || (*s != '[')) {return false;}
+  ++s;
+  char* end;
+  span->start_ns = ScanNs(s, &end, ns_per_unit);
+  if ((end == s) || (*end != ',')) {return false;}
+  s = end + 1;
+  span->duration_ns = ScanNs(s, &end, ns_per_unit);
+  if (end == s) {return false;}
+  s = end;
+
+  int* fields[7] = {&span->cpu, &span->pid, &span->rpcid, &span->eventnum,
+                    &span->arg, &span->retval, &span->ipc};
+  for (int i = 0; i < 7; ++i) {
+    if (*s++ != ',') {return false;}
+    *fields[i] = ScanInt(s, &end);
+    if (end == s) {return false;}
+    s = end;
+  }
+
+  // Name is from the first quote to the last one on the line
+  const char* quote1 = reinterpret_cast<const char*>(memchr(s, '"', eol - s));
+  if (quote1 == NULL) {return false;}
+  const char* quote2 = eol - 1;
+  while ((quote1 < quote2) && (*quote2 != '"')) {--quote2;}
+  if (quote2 == quote1) {return false;}
+  span->name = quote1 + 1;
+  span->namelen = quote2 - quote1 - 1;
+  return true;
+}
+
+// Skip the lines before the first span, picking up ticksPerSec if there.
+// Returns the start of the first span line, or limit
+inline const char* ScanHeader(const char* begin, const char* limit, int64* ticks_per_sec) {
+  *ticks_per_sec = 0;
+  const char* p = begin;
+  while ((p < limit) && (*p != '[')) {
+    const char* eol = ScanLineEnd(p, limit);
+    char buffer[256];
+    int len = eol - p;
+    if (len > (int)sizeof(buffer) - 1) {len = sizeof(buffer) - 1;}
+    memcpy(buffer, p, len);
+    buffer[len] = '\0';
+    if (ParseTicksPerSec(buffer) != 0) {*ticks_per_sec = ParseTicksPerSec(buffer);}
+    p = ScanNextLine(p, limit);
+  }
+  return p;
+}
+
+inline int64 ScanNsPerUnit(int64 ticks_per_sec) {
+  return (ticks_per_sec == 0) ? 1000000000LL : 1000000000LL / ticks_per_sec;
+}
+
+// Start time of the span line at p, or kScanNever if it is not a span
+inline int64 ScanStartNs(const char* p, const char* limit, int64 ns_per_unit) {
+  ScanSpan span;
+  if (!ScanSpanLine(p, ScanLineEnd(p, limit), ns_per_unit, &span)) {return kScanNever;}
+  return span.start_ns;
+}
+
+// First line at or after begin whose span starts at or after ns, in a file
+// sorted by start time. begin must be the start of a line. Lines that are not
+// spans, such as the closing ]}, count as later than any span
+inline const char* FirstSpanAtOrAfter(const char* begin, const char* limit,
+                                      int64 ns, int64 ns_per_unit) {
+  const char* lo = begin;
+  const char* hi = limit;
+  while (lo < hi) {
+    const char* mid = lo + (hi - lo) / 2;
+    const char* line = mid;
+    while ((lo < line) && (line[-1] != '\n')) {--line;}
+    if (ScanStartNs(line, limit, ns_per_unit) < ns) {
+      lo = ScanNextLine(line, limit);
+    } else {
+      hi = line;
+    }
+  }
+  return lo;
+}
+
+#endif	// __SPANSCAN_H__
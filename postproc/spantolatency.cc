@@ -0,0 +1,376 @@
+// Little program to report latency distributions from a JSON span file:
+// one log-linear histogram per syscall, trap, and interrupt number, and one
+// per RPC method, all in a single streaming pass
+//
+// Filter from stdin to stdout
+// Optional command-line parameters --
+//   -json <fname>   also write the histograms as JSON to fname
+//
+//   cat foo.json |spantolatency -json foo_lat.json >foo_lat.txt
+//
+// Output to stdout is a text table, one line per histogram, in microseconds
+//   kind    event  name            count      p50      p90      p99    p99.9      max  worst at
+//   syscall   0800 read            60325     1.25    12.50   ...                        12.3456789 pid 1002
+//
+// Percentiles are the top of their histogram bucket, at most 1/16 above the
+// exact value (see latencyhist.h). Max and the worst instances are exact.
+//
+// Latency of a syscall, trap, or interrupt is from the start of its first span
+// to the end of its last. A call that blocks or is interrupted shows up as
+// several spans for its PID, with other kernel work or other PIDs in between;
+// these are stitched back together, per PID, until the PID is next seen in
+// user mode. A nested trap or interrupt is its own instance, ending when the
+// PID resumes the call it interrupted.
+//
+// Latency of an RPC is from its first KUTRACE_RPCIDREQ until the last thread
+// working on it stops, after some thread has sent its KUTRACE_RPCIDRESP (see
+// rpctrack.h). RPCs that never see a response, such as those cut off at the
+// end of the trace or traces that only mark requests, are counted but not put
+// in histograms. The method name comes from the span name, method.rpcid, which
+// eventtospan3 builds from the trace's methodnames.
+//
+// Compile with g++ -O2 spantolatency.cc -o spantolatency
+//
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <math.h>	// llround
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+#include "basetypes.h"
+#include "json_ticks.h"
+#include "kutrace_lib.h"
+#include "latencyhist.h"
+#include "rpctrack.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+// Kinds of histogram, in output order
+static const int kSyscall = 0;
+static const int kTrap = 1;
+static const int kIrq = 2;
+static const int kRpc = 3;
+static const char* const kKindName[4] = {"syscall", "trap", "irq", "rpc"};
+
+static const int kSchedSyscall = 0x1FF;	// -sched- is the last syscall number
+static const int kMaxNesting = 16;
+
+typedef struct {
+  double start_ts;	// Incoming units, seconds or ticks
+  double duration;
+  int64 start_ns;
+  int64 duration_ns;
+  int cpu;
+  int pid;
+  int rpcid;
+  int eventnum;
+  int arg;
+  int retval;
+  int ipc;
+  char name[64];	// Without quotes
+} OneSpan;
+
+// One histogram and what it is for
+typedef struct {
+  int kind;
+  int eventnum;		// -1 for RPCs
+  string name;
+  LatHist hist;
+} Latency;
+
+// One syscall/trap/irq that has started for a PID but not finished
+typedef struct {
+  int eventnum;
+  int64 start_ns;
+  int64 end_ns;		// End of its latest span
+} OpenCall;
+
+typedef map<int, Latency*> EventLatency;	// By eventnum
+typedef map<string, Latency*> RpcLatency;	// By method name
+typedef map<int, vector<OpenCall> > PidCalls;	// By PID, innermost last
+
+// Globals
+static EventLatency eventlatency;
+static RpcLatency rpclatency;
+static PidCalls pidcalls;
+static RpcTracker rpctracker;
+static map<int, string> eventnames;		// First span name seen per eventnum
+static int64 ticks_per_sec = 0;	// Incoming ticksPerSec, if any. 0 means times in seconds
+
+// Nanoseconds per incoming time unit, either seconds or ticks
+double NsPerUnit() {
+  return (ticks_per_sec == 0) ? 1000000000.0 : 1000000000.0 / ticks_per_sec;
+}
+
+double NsToUsec(int64 ns) {return ns / 1000.0;}
+
+// Kind of histogram for eventnum, or -1 if none
+int EventKind(int eventnum) {
+  if ((KUTRACE_TRAP <= eventnum) && (eventnum < KUTRACE_IRQ)) {return kTrap;}
+  if ((KUTRACE_IRQ <= eventnum) && (eventnum < KUTRACE_TRAPRET)) {return kIrq;}
+  if ((KUTRACE_SYSCALL64 <= eventnum) && (eventnum < KUTRACE_SYSRET64) &&
+      (eventnum != (KUTRACE_SYSCALL64 | kSchedSyscall))) {return kSyscall;}
+  if ((KUTRACE_SYSCALL32 <= eventnum) && (eventnum < KUTRACE_SYSRET32) &&
+      (eventnum != (KUTRACE_SYSCALL32 | kSchedSyscall))) {return kSyscall;}
+  return -1;
+}
+
+bool IsUserExec(int eventnum) {
+  return ((eventnum & 0xF0000) == 0x10000);
+}
+
+Latency* NewLatency(int kind, int eventnum, const string& name) {
+  Latency* latency = new Latency;
+  latency->kind = kind;
+  latency->eventnum = eventnum;
+  latency->name = name;
+  InitLatHist(&latency->hist);
+  return latency;
+}
+
+void RecordCall(int pid, const OpenCall& call) {
+  Latency* latency = eventlatency[call.eventnum];
+  if (latency == NULL) {
+    latency = NewLatency(EventKind(call.eventnum), call.eventnum, eventnames[call.eventnum]);
+    eventlatency[call.eventnum] = latency;
+  }
+  AddToLatHist(call.end_ns - call.start_ns, call.start_ns, pid, &latency->hist);
+}
+
+// Called by the RPC tracker as each RPC finishes
+void RecordRpc(const RpcInstance& rpc, void*) {
+  Latency* latency = rpclatency[rpc.method];
+  if (latency == NULL) {
+    latency = NewLatency(kRpc, -1, rpc.method);
+    rpclatency[rpc.method] = latency;
+  }
+  AddToLatHist(rpc.end_ns - rpc.start_ns, rpc.start_ns, rpc.start_pid, &latency->hist);
+}
+
+// Finish calls for pid from the top of its stack down to, not including, depth
+void CloseCalls(int pid, int depth, vector<OpenCall>* calls) {
+  while (depth < (int)calls->size()) {
+    RecordCall(pid, calls->back());
+    calls->pop_back();
+  }
+}
+
+// Syscall, trap, or interrupt span for pid
+void DoCallSpan(const OneSpan& span) {
+  OpenCall call;
+  call.eventnum = span.eventnum;
+  call.start_ns = span.start_ns;
+  call.end_ns = span.start_ns + span.duration_ns;
+  if (span.pid <= 0) {
+    // Idle or unknown PID; nothing to stitch to
+    RecordCall(span.pid, call);
+    return;
+  }
+
+  vector<OpenCall>* calls = &pidcalls[span.pid];
+  for (int i = calls->size() - 1; 0 <= i; --i) {
+    if ((*calls)[i].eventnum == span.eventnum) {
+      // Continuing an open call; anything nested inside it is done
+      CloseCalls(span.pid, i + 1, calls);
+      calls->back().end_ns = call.end_ns;
+      return;
+    }
+  }
+  if (kMaxNesting <= (int)calls->size()) {
+    // Lost track somewhere. Start over
+    CloseCalls(span.pid, 0, calls);
+  }
+  calls->push_back(call);
+}
+
+void DoSpan(const OneSpan& span) {
+  if (span.duration_ns < 0) {return;}
+  if (IsRpcWorkEvent(span.eventnum)) {
+    RpcWorkEvent(span.pid, span.eventnum, span.arg, span.start_ns, span.name, &rpctracker);
+    return;
+  }
+  if (IsUserExec(span.eventnum)) {
+    // Back in user mode: every call for this PID is done
+    PidCalls::iterator it = pidcalls.find(span.pid);
+    if (it != pidcalls.end()) {CloseCalls(span.pid, 0, &it->second);}
+    return;
+  }
+  if (EventKind(span.eventnum) < 0) {return;}
+  if (eventnames.find(span.eventnum) == eventnames.end()) {
+    eventnames[span.eventnum] = string(span.name);
+  }
+  DoCallSpan(span);
+}
+
+// End of input: finish everything still open
+void FinishAll() {
+  for (PidCalls::iterator it = pidcalls.begin(); it != pidcalls.end(); ++it) {
+    CloseCalls(it->first, 0, &it->second);
+  }
+  FinishRpcTracker(&rpctracker);
+}
+
+// All the histograms, in output order
+void AllLatencies(vector<const Latency*>* all) {
+  for (int kind = kSyscall; kind < kRpc; ++kind) {
+    for (EventLatency::const_iterator it = eventlatency.begin(); it != eventlatency.end(); ++it) {
+      if (it->second->kind == kind) {all->push_back(it->second);}
+    }
+  }
+  for (RpcLatency::const_iterator it = rpclatency.begin(); it != rpclatency.end(); ++it) {
+    all->push_back(it->second);
+  }
+}
+
+static const double kQuantile[4] = {0.50, 0.90, 0.99, 0.999};
+
+void WriteText(FILE* f, const vector<const Latency*>& all) {
+  fprintf(f, "%-7s %5s %-20s %9s %10s %10s %10s %10s %10s  %s\n",
+          "kind", "event", "name", "count", "p50", "p90", "p99", "p99.9", "max", "worst at");
+  for (int i = 0; i < (int)all.size(); ++i) {
+    const Latency* latency = all[i];
+    const LatHist& hist = latency->hist;
+    char event[16];
+    if (latency->eventnum < 0) {
+      strcpy(event, "-");
+    } else {
+      sprintf(event, "%04x", latency->eventnum);
+    }
+    fprintf(f, "%-7s %5s %-20s %9lld", kKindName[latency->kind], event,
+            latency->name.c_str(), hist.count);
+    for (int q = 0; q < 4; ++q) {
+      fprintf(f, " %10.2f", NsToUsec(LatPercentile(hist, kQuantile[q])));
+    }
+    fprintf(f, " %10.2f  %12.8f pid %d\n", NsToUsec(hist.max_ns),
+            hist.worst[0].start_ns / 1000000000.0, hist.worst[0].pid);
+  }
+  fprintf(f, "(times in microseconds; worst at is start time in seconds)\n");
+}
+
+void WriteJson(FILE* f, const vector<const Latency*>& all) {
+  fprintf(f, "{\"units\" : \"usec\",\n");
+  fprintf(f, "\"unansweredRpcs\" : %d,\n", rpctracker.unanswered);
+  fprintf(f, "\"latency\" : [\n");
+  for (int i = 0; i < (int)all.size(); ++i) {
+    const Latency* latency = all[i];
+    const LatHist& hist = latency->hist;
+    fprintf(f, "{\"kind\" : \"%s\", \"event\" : %d, \"name\" : \"%s\", \"count\" : %lld, ",
+            kKindName[latency->kind], latency->eventnum, latency->name.c_str(), hist.count);
+    fprintf(f, "\"mean\" : %.3f, \"p50\" : %.3f, \"p90\" : %.3f, \"p99\" : %.3f, \"p999\" : %.3f, \"max\" : %.3f,\n",
+            NsToUsec(hist.sum_ns) / hist.count,
+            NsToUsec(LatPercentile(hist, kQuantile[0])),
+            NsToUsec(LatPercentile(hist, kQuantile[1])),
+            NsToUsec(LatPercentile(hist, kQuantile[2])),
+            NsToUsec(LatPercentile(hist, kQuantile[3])),
+            NsToUsec(hist.max_ns));
+    // [start sec, latency usec, pid]
+    fprintf(f, " \"worst\" : [");
+    for (int w = 0; w < hist.worst_count; ++w) {
+      fprintf(f, "%s[%.8f, %.3f, %d]", (w == 0) ? "" : ", ",
+              hist.worst[w].start_ns / 1000000000.0, NsToUsec(hist.worst[w].value_ns),
+              hist.worst[w].pid);
+    }
+    // Non-empty buckets as [lo usec, count]
+    fprintf(f, "],\n \"buckets\" : [");
+    bool first = true;
+    for (int b = 0; b < kHistBuckets; ++b) {
+      if (hist.bucket[b] == 0) {continue;}
+      fprintf(f, "%s[%.3f, %lld]", first ? "" : ", ", NsToUsec(LatBucketLo(b)), hist.bucket[b]);
+      first = false;
+    }
+    fprintf(f, "]}%s\n", (i < (int)all.size() - 1) ? "," : "");
+  }
+  fprintf(f, "]}\n");
+}
+
+// Copy the name between quotes, which may contain spaces
+void CopyName(const char* s, char* name, int maxsize) {
+  const char* quote1 = strchr(s, '"');
+  const char* quote2 = (quote1 == NULL) ? NULL : strrchr(quote1 + 1, '"');
+  int len = (quote2 == NULL) ? 0 : quote2 - quote1 - 1;
+  if (maxsize - 1 < len) {len = maxsize - 1;}
+  if (0 < len) {memcpy(name, quote1 + 1, len);}
+  name[len] = '\0';
+}
+
+static const int kMaxBufferSize = 256;
+
+// Read next line, stripping any crlf. Return false if no more.
+bool ReadLine(FILE* f, char* buffer, int maxsize) {
+  char* s = fgets(buffer, maxsize, f);
+  if (s == NULL) {return false;}
+  int len = strlen(s);
+  // Strip any crlf or cr or lf
+  if (s[len - 1] == '\n') {s[--len] = '\0';}
+  if (s[len - 1] == '\r') {s[--len] = '\0';}
+  return true;
+}
+
+void Usage() {
+  fprintf(stderr, "Usage: spantolatency [-json <fname>]\n");
+  exit(0);
+}
+
+//
+// Filter from stdin to stdout
+//
+int main (int argc, const char** argv) {
+  const char* json_fname = NULL;
+  for (int i = 1; i < argc; ++i) {
+    if ((strcmp(argv[i], "-json") == 0) && (i < (argc - 1))) {
+      json_fname = argv[++i];
+    } else {
+      Usage();
+    }
+  }
+
+  // expecting:
+  //    ts           dur        cpu pid  rpc event arg retval  ipc name
+  //  [ 22.39359781, 0.00000283, 0, 1910, 0, 2048, 3, 256, 3, "read"],
+
+  InitRpcTracker(RecordRpc, NULL, &rpctracker);
+  int span_count = 0;
+  char buffer[kMaxBufferSize];
+  while (ReadLine(stdin, buffer, kMaxBufferSize)) {
+    OneSpan onespan;
+    int name_pos = 0;
+    int n = sscanf(buffer, "[%lf, %lf, %d, %d, %d, %d, %d, %d, %d, %n",
+                   &onespan.start_ts, &onespan.duration,
+                   &onespan.cpu, &onespan.pid, &onespan.rpcid,
+                   &onespan.eventnum, &onespan.arg, &onespan.retval, &onespan.ipc, &name_pos);
+    if (n < 9) {
+      if (ParseTicksPerSec(buffer) != 0) {ticks_per_sec = ParseTicksPerSec(buffer);}
+      continue;
+    }
+    if (SpanSec(onespan.start_ts, ticks_per_sec) >= 999.0) {break;}	// End marker
+
+    onespan.start_ns = llround(onespan.start_ts * NsPerUnit());
+    onespan.duration_ns = llround(onespan.duration * NsPerUnit());
+    CopyName(buffer + name_pos, onespan.name, sizeof(onespan.name));
+    DoSpan(onespan);
+    ++span_count;
+  }
+  FinishAll();
+
+  vector<const Latency*> all;
+  AllLatencies(&all);
+  WriteText(stdout, all);
+  if (json_fname != NULL) {
+    FILE* f = fopen(json_fname, "w");
+    if (f == NULL) {
+      fprintf(stderr, "%s did not open\n", json_fname);
+      exit(0);
+    }
+    WriteJson(f, all);
+    fclose(f);
+  }
+
+  fprintf(stderr, "spantolatency: %d spans, %d histograms, %d RPCs without a response\n",
+          span_count, (int)all.size(), rpctracker.unanswered);
+  return 0;
+}
@@ -0,0 +1,368 @@
+// Little program to report lock contention from a JSON span file: per lock,
+// how often it was acquired and contended, how long threads waited for it and
+// held it, which threads were involved, and the worst waits
+//
+// Filter from stdin to stdout
+// Optional command-line parameters --
+//   -n <count>   show details for this many locks, default 10
+//
+//   cat foo.json |spantolock >foo_lock.txt
+//
+// The traced lock library logs a failed try (KUTRACE_LOCKNOACQUIRE), the
+// acquire after it (KUTRACE_LOCKACQUIRE), and the release (KUTRACE_LOCKWAKEUP),
+// each with the lock's hash as arg. eventtospan3 keeps these point events and
+// adds a ~name span for each wait of at least 250ns from try to acquire
+// (KUTRACE_LOCK_TRY), and an =name span for each hold of at least 250ns from
+// acquire to release (KUTRACE_LOCK_HELD). Counts and hold times here come
+// from the point events, so short holds are timed too. Wait times come from
+// the ~name spans, so waits under 250ns are counted as contended but not
+// timed. Only acquires after a failed try are logged, so only those holds
+// are seen.
+//
+// Output to stdout is a table of locks by total wait time, then details for
+// the top few, times in microseconds:
+//   lock           hash     acquires contended  wait_total  wait_p50  wait_p99  wait_max  hold_p50  hold_p99  hold_max threads
+//   mylock0        00001234     1203       402     8123.45     12.10     95.20    130.55     60.10     99.80    120.00       8
+//
+//   mylock0 00001234
+//     pid 1001    proc1             waits     52   1023.30us  holds    160   9811.00us
+//     ...
+//     worst 12.34956947 pid 1007    proc7   waited    130.55us  held by 1001 proc1
+//
+// Compile with g++ -O2 spantolock.cc -o spantolock
+//
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <math.h>	// llround
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+#include "basetypes.h"
+#include "json_ticks.h"
+#include "kutrace_lib.h"
+#include "latencyhist.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+static const int kDefaultTopN = 10;
+static const int64 kStillHeld = 0x7fffffffffffffffLL;
+
+typedef struct {
+  double start_ts;	// Incoming units, seconds or ticks
+  double duration;
+  int64 start_ns;
+  int64 duration_ns;
+  int cpu;
+  int pid;
+  int rpcid;
+  int eventnum;
+  int arg;
+  int retval;
+  int ipc;
+  char name[64];	// Without quotes
+} OneSpan;
+
+// One thread's use of one lock
+typedef struct {
+  int waits;
+  int64 wait_ns;
+  int holds;
+  int64 hold_ns;
+} LockUser;
+
+// One wait, for the worst list
+typedef struct {
+  int64 start_ns;
+  int64 wait_ns;
+  int pid;
+  int holder_pid;	// -1 if unknown
+} Episode;
+
+typedef struct {
+  string name;
+  int lockhash;
+  int acquires;
+  int contended;
+  LatHist wait;
+  LatHist hold;
+  map<int, LockUser> users;	// By PID
+  map<int, bool> trying;	// PID => failed try not yet followed by an acquire
+  map<int, int64> acquired_ns;	// PID => logged acquire not yet released
+  int64 held_end_ns;		// Latest logged hold, to find who held the lock;
+  int held_pid;			//   kStillHeld until its release
+  int worst_count;
+  Episode worst[kMaxWorst];	// Descending by wait_ns
+} Lock;
+
+// Globals
+static map<int, Lock*> locks;			// By lock hash
+static map<int, string> threadname;		// By PID
+static int64 ticks_per_sec = 0;	// Incoming ticksPerSec, if any. 0 means times in seconds
+
+// Nanoseconds per incoming time unit, either seconds or ticks
+double NsPerUnit() {
+  return (ticks_per_sec == 0) ? 1000000000.0 : 1000000000.0 / ticks_per_sec;
+}
+
+double NsToUsec(int64 ns) {return ns / 1000.0;}
+
+bool IsUserExec(int eventnum) {
+  return ((eventnum & 0xF0000) == 0x10000);
+}
+
+bool IsLockEvent(int eventnum) {
+  return (KUTRACE_LOCKNOACQUIRE <= eventnum) && (eventnum <= KUTRACE_LOCKWAKEUP);
+}
+
+bool IsLockSpan(int eventnum) {
+  return (eventnum == KUTRACE_LOCK_TRY) || (eventnum == KUTRACE_LOCK_HELD);
+}
+
+Lock* LockOf(int lockhash) {
+  Lock* lock = locks[lockhash];
+  if (lock == NULL) {
+    lock = new Lock;
+    lock->lockhash = lockhash;
+    lock->acquires = 0;
+    lock->contended = 0;
+    InitLatHist(&lock->wait);
+    InitLatHist(&lock->hold);
+    lock->held_end_ns = 0;
+    lock->held_pid = -1;
+    lock->worst_count = 0;
+    locks[lockhash] = lock;
+  }
+  return lock;
+}
+
+// Lock name without the try_/acq_/rel_ or ~/= eventtospan3 put in front
+void SetLockName(const char* name, Lock* lock) {
+  if (!lock->name.empty()) {return;}
+  if ((name[0] == '~') || (name[0] == '=')) {
+    lock->name = string(name + 1);
+  } else if ((strlen(name) > 4) && (name[3] == '_')) {
+    lock->name = string(name + 4);
+  }
+}
+
+// Insert into the worst list; ties keep the earlier episode first
+void AddEpisode(const Episode& episode, Lock* lock) {
+  if ((lock->worst_count == kMaxWorst) &&
+      (episode.wait_ns <= lock->worst[kMaxWorst - 1].wait_ns)) {return;}
+  int i = (lock->worst_count < kMaxWorst) ? lock->worst_count++ : kMaxWorst - 1;
+  while ((0 < i) && (lock->worst[i - 1].wait_ns < episode.wait_ns)) {
+    lock->worst[i] = lock->worst[i - 1];
+    --i;
+  }
+  lock->worst[i] = episode;
+}
+
+// Try/acquire/release point event. A hold runs from a logged acquire to the
+// same thread's release
+void DoLockEvent(const OneSpan& span) {
+  Lock* lock = LockOf(span.arg);
+  SetLockName(span.name, lock);
+  if (span.eventnum == KUTRACE_LOCKNOACQUIRE) {
+    lock->trying[span.pid] = true;
+  } else if (span.eventnum == KUTRACE_LOCKACQUIRE) {
+    ++lock->acquires;
+    if (lock->trying[span.pid]) {++lock->contended;}
+    lock->trying[span.pid] = false;
+    lock->acquired_ns[span.pid] = span.start_ns;
+    lock->held_end_ns = kStillHeld;
+    lock->held_pid = span.pid;
+  } else if (span.eventnum == KUTRACE_LOCKWAKEUP) {
+    map<int, int64>::iterator it = lock->acquired_ns.find(span.pid);
+    if (it == lock->acquired_ns.end()) {return;}
+    int64 hold_ns = span.start_ns - it->second;
+    LockUser* user = &lock->users[span.pid];
+    AddToLatHist(hold_ns, it->second, span.pid, &lock->hold);
+    ++user->holds;
+    user->hold_ns += hold_ns;
+    if (lock->held_pid == span.pid) {lock->held_end_ns = span.start_ns;}
+    lock->acquired_ns.erase(it);
+  }
+}
+
+// ~name wait span. =name hold spans are left out; holds come from the point
+// events, including the ones too short for a span
+void DoLockSpan(const OneSpan& span) {
+  Lock* lock = LockOf(span.arg);
+  SetLockName(span.name, lock);
+  if (span.eventnum == KUTRACE_LOCK_HELD) {return;}
+  LockUser* user = &lock->users[span.pid];
+
+  AddToLatHist(span.duration_ns, span.start_ns, span.pid, &lock->wait);
+  ++user->waits;
+  user->wait_ns += span.duration_ns;
+  Episode episode;
+  episode.start_ns = span.start_ns;
+  episode.wait_ns = span.duration_ns;
+  episode.pid = span.pid;
+  // Spans are sorted by start, so the latest logged acquire came at or before
+  // this wait. If that hold is still going, its thread is what we waited for
+  bool held = (lock->held_pid >= 0) && (lock->held_pid != span.pid) &&
+              (span.start_ns < lock->held_end_ns);
+  episode.holder_pid = held ? lock->held_pid : -1;
+  AddEpisode(episode, lock);
+}
+
+void DoSpan(const OneSpan& span) {
+  if (span.duration_ns < 0) {return;}
+  if (IsLockEvent(span.eventnum)) {
+    DoLockEvent(span);
+  } else if (IsLockSpan(span.eventnum)) {
+    DoLockSpan(span);
+  } else if (IsUserExec(span.eventnum) && (0 < span.pid) && (span.name[0] != '-')) {
+    // Thread name is the user-mode span name without its .pid
+    string name = string(span.name);
+    size_t dot = name.rfind('.');
+    if ((dot != string::npos) && (0 < dot)) {name.resize(dot);}
+    threadname[span.pid] = name;
+  }
+}
+
+// Locks traced without a name show as ?
+const char* LockName(const Lock* lock) {
+  return lock->name.empty() ? "?" : lock->name.c_str();
+}
+
+string ThreadName(int pid) {
+  map<int, string>::const_iterator it = threadname.find(pid);
+  return (it == threadname.end()) ? string("") : it->second;
+}
+
+// Most total wait first
+bool ByWait(const Lock* a, const Lock* b) {
+  if (a->wait.sum_ns != b->wait.sum_ns) {return a->wait.sum_ns > b->wait.sum_ns;}
+  return a->lockhash < b->lockhash;
+}
+
+void WriteTable(FILE* f, const vector<const Lock*>& order) {
+  fprintf(f, "%-16s %8s %8s %9s %11s %9s %9s %9s %9s %9s %9s %7s\n",
+          "lock", "hash", "acquires", "contended", "wait_total", "wait_p50", "wait_p99",
+          "wait_max", "hold_p50", "hold_p99", "hold_max", "threads");
+  for (int i = 0; i < (int)order.size(); ++i) {
+    const Lock* lock = order[i];
+    fprintf(f, "%-16s %08x %8d %9d %11.2f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %7d\n",
+            LockName(lock), lock->lockhash, lock->acquires, lock->contended,
+            NsToUsec(lock->wait.sum_ns),
+            NsToUsec(LatPercentile(lock->wait, 0.50)),
+            NsToUsec(LatPercentile(lock->wait, 0.99)),
+            NsToUsec(lock->wait.max_ns),
+            NsToUsec(LatPercentile(lock->hold, 0.50)),
+            NsToUsec(LatPercentile(lock->hold, 0.99)),
+            NsToUsec(lock->hold.max_ns),
+            (int)lock->users.size());
+  }
+  fprintf(f, "(times in microseconds)\n");
+}
+
+void WriteDetail(FILE* f, const Lock* lock) {
+  fprintf(f, "\n%s %08x\n", LockName(lock), lock->lockhash);
+  for (map<int, LockUser>::const_iterator it = lock->users.begin();
+       it != lock->users.end(); ++it) {
+    const LockUser& user = it->second;
+    fprintf(f, "  pid %-7d %-16s waits %6d %11.2fus  holds %6d %11.2fus\n",
+            it->first, ThreadName(it->first).c_str(),
+            user.waits, NsToUsec(user.wait_ns), user.holds, NsToUsec(user.hold_ns));
+  }
+  for (int w = 0; w < lock->worst_count; ++w) {
+    const Episode& episode = lock->worst[w];
+    fprintf(f, "  worst %12.8f pid %-7d %-16s waited %11.2fus", episode.start_ns / 1000000000.0,
+            episode.pid, ThreadName(episode.pid).c_str(), NsToUsec(episode.wait_ns));
+    if (episode.holder_pid < 0) {
+      fprintf(f, "  held by ?\n");
+    } else {
+      fprintf(f, "  held by %d %s\n", episode.holder_pid, ThreadName(episode.holder_pid).c_str());
+    }
+  }
+}
+
+// Copy the name between quotes, which may contain spaces
+void CopyName(const char* s, char* name, int maxsize) {
+  const char* quote1 = strchr(s, '"');
+  const char* quote2 = (quote1 == NULL) ? NULL : strrchr(quote1 + 1, '"');
+  int len = (quote2 == NULL) ? 0 : quote2 - quote1 - 1;
+  if (maxsize - 1 < len) {len = maxsize - 1;}
+  if (0 < len) {memcpy(name, quote1 + 1, len);}
+  name[len] = '\0';
+}
+
+static const int kMaxBufferSize = 256;
+
+// Read next line, stripping any crlf. Return false if no more.
+bool ReadLine(FILE* f, char* buffer, int maxsize) {
+  char* s = fgets(buffer, maxsize, f);
+  if (s == NULL) {return false;}
+  int len = strlen(s);
+  // Strip any crlf or cr or lf
+  if (s[len - 1] == '\n') {s[--len] = '\0';}
+  if (s[len - 1] == '\r') {s[--len] = '\0';}
+  return true;
+}
+
+void Usage() {
+  fprintf(stderr, "Usage: spantolock [-n <count>]\n");
+  exit(0);
+}
+
+//
+// Filter from stdin to stdout
+//
+int main (int argc, const char** argv) {
+  int top_n = kDefaultTopN;
+  for (int i = 1; i < argc; ++i) {
+    if ((strcmp(argv[i], "-n") == 0) && (i < (argc - 1))) {
+      top_n = atoi(argv[++i]);
+      if (top_n < 0) {Usage();}
+    } else {
+      Usage();
+    }
+  }
+
+  // expecting:
+  //    ts           dur        cpu pid  rpc event arg retval  ipc name
+  //  [ 22.39359781, 0.00000283, 0, 1910, 0, 2048, 3, 256, 3, "read"],
+
+  int span_count = 0;
+  char buffer[kMaxBufferSize];
+  while (ReadLine(stdin, buffer, kMaxBufferSize)) {
+    OneSpan onespan;
+    int name_pos = 0;
+    int n = sscanf(buffer, "[%lf, %lf, %d, %d, %d, %d, %d, %d, %d, %n",
+                   &onespan.start_ts, &onespan.duration,
+                   &onespan.cpu, &onespan.pid, &onespan.rpcid,
+                   &onespan.eventnum, &onespan.arg, &onespan.retval, &onespan.ipc, &name_pos);
+    if (n < 9) {
+      if (ParseTicksPerSec(buffer) != 0) {ticks_per_sec = ParseTicksPerSec(buffer);}
+      continue;
+    }
+    if (SpanSec(onespan.start_ts, ticks_per_sec) >= 999.0) {break;}	// End marker
+
+    onespan.start_ns = llround(onespan.start_ts * NsPerUnit());
+    onespan.duration_ns = llround(onespan.duration * NsPerUnit());
+    CopyName(buffer + name_pos, onespan.name, sizeof(onespan.name));
+    DoSpan(onespan);
+    ++span_count;
+  }
+
+  vector<const Lock*> order;
+  for (map<int, Lock*>::const_iterator it = locks.begin(); it != locks.end(); ++it) {
+    order.push_back(it->second);
+  }
+  std::sort(order.begin(), order.end(), ByWait);
+  WriteTable(stdout, order);
+  for (int i = 0; (i < (int)order.size()) && (i < top_n); ++i) {
+    WriteDetail(stdout, order[i]);
+  }
+
+  fprintf(stderr, "spantolock: %d spans, %d locks\n", span_count, (int)locks.size());
+  return 0;
+}
@@ -0,0 +1,327 @@
+// Little program to add a level-of-detail pyramid of coarsened spans to a
+// sorted JSON span file, so show_cpu.html can draw a zoomed-out view quickly
+//
+// Filter from stdin to stdout
+// Optional command-line parameters --
+//   granularities in microseconds, default 100 1000 10000
+//
+//   cat foo.json |spantotrim 0 |spantolod |makeself show_cpu.html >foo.html
+//
+// Output is the input unchanged through the end of the events array, then
+//   "lod" : [
+//   {"usec" : 0, "indexBase" : 12.345, "indexSec" : 0.0001, "index" : [0, 0, 17, ...], "long" : [12]},
+//   {"usec" : 100, "indexBase" : 12.345, "indexSec" : 0.0001, "index" : [0, 0, 3, ...], "long" : [], "events" : [
+//   [ 12.34567890, 0.00012340, 0, 1910, 0, 67446, 0, 0, 0, "gnome-terminal-.1910"],
+//   ...
+//   [999.0, 0.0, 0, 0, 0, 0, 0, 0, 0, ""]]},
+//   ...
+//   ]}
+//
+// Each coarser level combines the full-resolution spans to its granularity
+// using the spantospan rules in spanmerge.h, and is sorted by start time.
+// Level usec=0 has no events of its own; it indexes the full events array.
+// index[k] is the first event in its array that starts at or after
+// indexBase + k * indexSec seconds. long lists, in array order, the events
+// that last longer than one window, indexSec. Any other event that overlaps
+// time t thus starts no earlier than the window before the one holding t,
+// so a viewer can skip directly to the events for any time range and add
+// just the long events from before that; one long span does not pin the
+// index for the rest of the trace.
+// The times in index fields are always seconds; span times are in whatever
+// units came in, seconds or integer ticks (see json_ticks.h).
+//
+// Anything after the events array, such as exported extra and savedview, is
+// kept after the lod array.
+//
+// makeself embeds each coarser level's events apart from the rest of the
+// JSON, so that show_cpu.html parses a level only when a zoom first needs it.
+//
+// Compile with g++ -O2 spantolod.cc -o spantolod
+//
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+#include "basetypes.h"
+#include "json_ticks.h"
+#include "spanmerge.h"
+
+#include "kupostproc.h"
+
+namespace spantolod {
+
+// Input and output streams. stdin/stdout except when run inside kupostproc
+static FILE* infile = NULL;
+static FILE* outfile = NULL;
+
+using std::string;
+using std::vector;
+
+typedef vector<OneSpan> SpanList;
+
+// One level of the pyramid
+typedef struct {
+  int usec;
+  SpanMerger* merger;
+  SpanList spans;
+} Level;
+
+static const int kIndexWindows = 1024;
+static const int kMaxLevels = 8;
+
+static int64 ticks_per_sec = 0;   // Incoming ticksPerSec, if any. 0 means times in seconds
+
+// Nanoseconds per incoming time unit, either seconds or ticks
+double NsPerUnit() {
+  return (ticks_per_sec == 0) ? 1000000000.0 : 1000000000.0 / ticks_per_sec;
+}
+
+void PrintSpan(FILE* f, const OneSpan& onespan) {
+    // Name has trailing punctuation, including ],
+    PrintSpanTimes(f, ticks_per_sec,
+                   onespan.start_ts_ns / NsPerUnit(),
+                   onespan.duration_ns / NsPerUnit());
+    fprintf(f, "%d, %d, %d, %d, %d, %d, %d, %s\n",
+            onespan.cpu, onespan.pid,
+            onespan.rpcid, onespan.event,
+            onespan.arg, onespan.retval,
+            onespan.ipc, onespan.name);
+}
+
+// Save one combined span in its level
+void EmitToLevel(const OneSpan& onespan, void* emit_arg) {
+  SpanList* spans = reinterpret_cast<SpanList*>(emit_arg);
+  spans->push_back(onespan);
+}
+
+bool SpanLess(const OneSpan& a, const OneSpan& b) {
+  return a.start_ts_ns < b.start_ts_ns;
+}
+
+// Write the window index for events whose start times and durations, in array
+// order, are start_sec and dur_sec. Entry k is the first event that starts at
+// or after the start of window k. Events longer than a window are listed too.
+// Base and window are written with full precision so a viewer computes exactly
+// the same window start times
+void WriteIndex(FILE* f, int usec, double base_sec, double window_sec,
+                const vector<double>& start_sec, const vector<double>& dur_sec) {
+  fprintf(f, "{\"usec\" : %d, \"indexBase\" : %.17g, \"indexSec\" : %.17g, \"index\" : [",
+          usec, base_sec, window_sec);
+  int k = 0;
+  for (int i = 0; i < (int)start_sec.size(); ++i) {
+    while ((k <= kIndexWindows) && ((base_sec + k * window_sec) <= start_sec[i])) {
+      fprintf(f, "%s%d", (k == 0) ? "" : ", ", i);
+      ++k;
+    }
+  }
+  while (k <= kIndexWindows) {
+    fprintf(f, "%s%d", (k == 0) ? "" : ", ", (int)start_sec.size());
+    ++k;
+  }
+  fprintf(f, "], \"long\" : [");
+  int nlong = 0;
+  for (int i = 0; i < (int)dur_sec.size(); ++i) {
+    if (window_sec < dur_sec[i]) {fprintf(f, "%s%d", (nlong++ == 0) ? "" : ", ", i);}
+  }
+  fprintf(f, "]");
+}
+
+// Copy the quoted name and trailing ], from the end of a span line. Names may
+// contain spaces. An overlong name is shortened so the line is still valid JSON
+void CopyName(const char* s, char* name, int maxsize) {
+  int len = strlen(s);
+  if (len < maxsize) {
+    memcpy(name, s, len + 1);
+  } else {
+    memcpy(name, s, maxsize - 4);
+    memcpy(name + maxsize - 4, "\"],", 4);
+  }
+}
+
+static const int kMaxBufferSize = 256;
+
+// Read next line, stripping any crlf. Return false if no more.
+bool ReadLine(FILE* f, char* buffer, int maxsize) {
+  char* s = fgets(buffer, maxsize, f);
+  if (s == NULL) {return false;}
+  int len = strlen(s);
+  // Strip any crlf or cr or lf
+  if (s[len - 1] == '\n') {s[--len] = '\0';}
+  if (s[len - 1] == '\r') {s[--len] = '\0';}
+  return true;
+}
+
+void Usage() {
+  fprintf(stderr, "Usage: spantolod [granularity_usec ...]\n");
+  exit(0);
+}
+
+//
+// Filter from stdin to stdout
+//
+int SpanToLod(int argc, const char** argv, FILE* in, FILE* out) {
+  infile = in;
+  outfile = out;
+
+  Level levels[kMaxLevels];
+  int level_count = 0;
+  for (int i = 1; i < argc; ++i) {
+    if ((level_count >= kMaxLevels) || (atoi(argv[i]) <= 0)) {Usage();}
+    levels[level_count++].usec = atoi(argv[i]);
+  }
+  if (level_count == 0) {
+    // Finer levels cost more file size than they save in drawing, since
+    // at those zoom levels the index already skips most of the full events
+    static const int kDefaultUsec[3] = {100, 1000, 10000};
+    for (int i = 0; i < 3; ++i) {levels[level_count++].usec = kDefaultUsec[i];}
+  }
+  for (int i = 0; i < level_count; ++i) {
+    levels[i].merger = new SpanMerger;
+    InitSpanMerger(levels[i].usec * 1000LL, EmitToLevel, &levels[i].spans, levels[i].merger);
+  }
+
+  // Full-resolution span start times and durations, for its index
+  vector<double> full_start_sec;
+  vector<double> full_dur_sec;
+  double lo_sec = 0.0;
+  double hi_sec = 0.0;
+  double prior_sec = 0.0;
+
+  // expecting:
+  //    ts           dur        cpu pid  rpc event arg retval  ipc name
+  //  [ 22.39359781, 0.00000283, 0, 1910, 0, 67446, 0, 256, 3, "gnome-terminal-.1910"],
+
+  int linenum = 0;
+  bool saw_end = false;
+  char buffer[kMaxBufferSize];
+  while (ReadLine(infile, buffer, kMaxBufferSize)) {
+    ++linenum;
+    OneSpan onespan;
+    int name_pos = 0;
+    int n = sscanf(buffer, "[%lf, %lf, %d, %d, %d, %d, %d, %d, %d, %n",
+                   &onespan.start_ts, &onespan.duration,
+                   &onespan.cpu, &onespan.pid, &onespan.rpcid,
+                   &onespan.event, &onespan.arg, &onespan.retval, &onespan.ipc, &name_pos);
+
+    if (n < 9) {
+      // Copy unchanged anything not a span
+      fprintf(outfile, "%s\n", buffer);
+      if (ParseTicksPerSec(buffer) != 0) {ticks_per_sec = ParseTicksPerSec(buffer);}
+      continue;
+    }
+
+    // Stop at the 999.0 end marker; the rest is copied after the lod array
+    double start_sec = SpanSec(onespan.start_ts, ticks_per_sec);
+    if (start_sec >= 999.0) {
+      saw_end = true;
+      break;
+    }
+
+    // The window index depends on spans arriving in start-time order
+    if (start_sec < prior_sec) {
+      fprintf(stderr, "spantolod: input not sorted at line %d\n", linenum);
+      fprintf(stderr, "  '%s'\n", buffer);
+      exit(0);
+    }
+    prior_sec = start_sec;
+    CopyName(buffer + name_pos, onespan.name, sizeof(onespan.name));
+
+    // Full resolution goes straight through
+    fprintf(outfile, "%s\n", buffer);
+    double dur_sec = SpanSec(onespan.duration, ticks_per_sec);
+    if (full_start_sec.empty()) {lo_sec = start_sec;}
+    if (hi_sec < start_sec + dur_sec) {hi_sec = start_sec + dur_sec;}
+    full_start_sec.push_back(start_sec);
+    full_dur_sec.push_back(dur_sec);
+
+    // Coarser levels follow spantospan
+    if (!KeepIntact(onespan) && DeleteMe(onespan, ticks_per_sec)) {continue;}
+    if (kMaxCpus <= onespan.cpu){
+      fprintf(stderr, "Bad CPU number at '%s'\n", buffer);
+      exit(0);
+    }
+
+    // Make all times nsec
+    onespan.start_ts_ns = onespan.start_ts * NsPerUnit();
+    onespan.duration_ns = onespan.duration * NsPerUnit();
+
+    for (int i = 0; i < level_count; ++i) {
+      if (KeepIntact(onespan)) {
+        levels[i].spans.push_back(onespan);
+      } else {
+        ProcessSpan(levels[i].merger, onespan);
+      }
+    }
+  }
+
+  if (!saw_end) {
+    fprintf(stderr, "spantolod: missing 999.0 end marker\n");
+    exit(0);
+  }
+
+  // Everything after the end marker, normally just ]}
+  string tail;
+  while (ReadLine(infile, buffer, kMaxBufferSize)) {
+    tail += buffer;
+    tail += "\n";
+  }
+  if (tail.empty() || (tail[0] != ']')) {
+    fprintf(stderr, "spantolod: expected ] after 999.0 end marker\n");
+    exit(0);
+  }
+
+  // Close the events array
+  PrintEndMarker(outfile, ticks_per_sec);
+  fprintf(outfile, "\n],\n");
+
+  double window_sec = (hi_sec - lo_sec) / kIndexWindows;
+  if (window_sec <= 0.0) {window_sec = 1.0;}
+
+  fprintf(outfile, "\"lod\" : [\n");
+  WriteIndex(outfile, 0, lo_sec, window_sec, full_start_sec, full_dur_sec);
+  fprintf(outfile, "},\n");
+
+  int output_events = 0;
+  for (int i = 0; i < level_count; ++i) {
+    Level* level = &levels[i];
+    FlushAllSpans(level->merger);
+    std::stable_sort(level->spans.begin(), level->spans.end(), SpanLess);
+
+    vector<double> start_sec;
+    vector<double> dur_sec;
+    for (int j = 0; j < (int)level->spans.size(); ++j) {
+      const OneSpan& span = level->spans[j];
+      start_sec.push_back(span.start_ts_ns / 1000000000.0);
+      dur_sec.push_back(span.duration_ns / 1000000000.0);
+    }
+    WriteIndex(outfile, level->usec, lo_sec, window_sec, start_sec, dur_sec);
+    fprintf(outfile, ", \"events\" : [\n");
+    for (int j = 0; j < (int)level->spans.size(); ++j) {
+      PrintSpan(outfile, level->spans[j]);
+    }
+    PrintEndMarker(outfile, ticks_per_sec);
+    fprintf(outfile, "]}%s\n", (i < level_count - 1) ? "," : "");
+    output_events += level->spans.size();
+    fprintf(stderr, "spantolod: %d usec, %d events\n", level->usec, (int)level->spans.size());
+    delete level->merger;
+  }
+
+  // Close the lod array, then whatever followed the events array
+  fprintf(outfile, "]%s", tail.c_str() + 1);
+
+  fprintf(stderr, "spantolod: %d full-resolution events, %d in coarser levels\n",
+          (int)full_start_sec.size(), output_events);
+  return 0;
+}
+
+}  // namespace spantolod
+
+#ifndef KUPOSTPROC
+int main (int argc, const char** argv) {
+  return spantolod::SpanToLod(argc, argv, stdin, stdout);
+}
+#endif
@@ -0,0 +1,340 @@
+// Little program to find the slowest RPCs in a JSON span file and say where
+// their time went, compared to a typical request of the same method
+//
+// Filter from stdin to stdout
+// Optional command-line parameters --
+//   -n <count>        show this many slowest requests per method, default 5
+//   -method <name>    only this method
+//
+//   cat foo.json |spantoslowrpc -n 3 >foo_slow.txt
+//
+// Each RPC instance runs from its first KUTRACE_RPCIDREQ until the last thread
+// working on it stops, after some thread has sent its KUTRACE_RPCIDRESP; these
+// are the same instances spantolatency puts in its RPC histograms (see
+// rpctrack.h). While an instance is open, every span for its rpcid is charged
+// to it, by category:
+//   user              user-mode execution
+//   sys:<name>        syscall, including -sched-
+//   trap:<name>       trap, such as page_fault
+//   irq:<name>        interrupt
+//   wait:<name>       waiting, one category per wait letter (wait_cpu, wait_disk, ...)
+//   queue:<name>      queued on a work queue, from enqueue to dequeue
+//   lock:<name>       spinning or blocked trying to get a lock
+//   other             elapsed time not covered by any of the above
+// Lock and wait spans carry no rpcid; they go to the RPC their PID was working
+// on, so a preempted thread's wait_cpu counts against its RPC.
+//
+// For each method, the output shows the median request and the slowest few,
+// each with a table of categories by how much more time the slow request
+// spent there than the median one did:
+//
+//   getfoo: 1200 requests, median 52.10us  rpcid 1234 at 12.34567890
+//   #1 rpcid 77 at 13.45678901 pid 1002  elapsed 812.33us = 15.6x median
+//       category                     slow_us  median_us   delta_us
+//       wait:wait_disk                640.12       0.00    +640.12
+//       ...
+//
+// Several threads working on one RPC at once can make the categories add up
+// to more than its elapsed time; other is then zero.
+//
+// testdata/slowrpc_wait_cpu.json has three getfoo requests; the slowest is
+// preempted for 40us, which must show up as wait:wait_cpu +40.00, not other:
+//   spantoslowrpc -n 1 <testdata/slowrpc_wait_cpu.json
+//
+// Compile with g++ -O2 spantoslowrpc.cc -o spantoslowrpc
+//
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <math.h>	// llround
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+#include "basetypes.h"
+#include "json_ticks.h"
+#include "kutrace_lib.h"
+#include "rpctrack.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+static const int kDefaultTopN = 5;
+
+typedef struct {
+  double start_ts;	// Incoming units, seconds or ticks
+  double duration;
+  int64 start_ns;
+  int64 duration_ns;
+  int cpu;
+  int pid;
+  int rpcid;
+  int eventnum;
+  int arg;
+  int retval;
+  int ipc;
+  char name[64];	// Without quotes
+} OneSpan;
+
+typedef map<int, int64> Breakdown;	// Category number => ns
+
+// One finished RPC instance
+typedef struct {
+  int64 start_ns;
+  int64 elapsed_ns;
+  int rpcid;
+  int start_pid;
+  Breakdown breakdown;
+} Request;
+
+typedef map<int, Breakdown> OpenBreakdowns;	// By RpcInstance serial
+typedef map<string, vector<Request> > MethodRequests;
+
+// Globals
+static RpcTracker rpctracker;
+static OpenBreakdowns openbreakdowns;
+static MethodRequests methodrequests;
+static vector<string> categoryname;		// By category number
+static map<string, int> categorynum;
+static int64 ticks_per_sec = 0;	// Incoming ticksPerSec, if any. 0 means times in seconds
+
+// Nanoseconds per incoming time unit, either seconds or ticks
+double NsPerUnit() {
+  return (ticks_per_sec == 0) ? 1000000000.0 : 1000000000.0 / ticks_per_sec;
+}
+
+double NsToUsec(int64 ns) {return ns / 1000.0;}
+
+int CategoryNum(const string& name) {
+  map<string, int>::const_iterator it = categorynum.find(name);
+  if (it != categorynum.end()) {return it->second;}
+  int num = categoryname.size();
+  categoryname.push_back(name);
+  categorynum[name] = num;
+  return num;
+}
+
+bool IsUserExec(int eventnum) {
+  return ((eventnum & 0xF0000) == 0x10000);
+}
+
+bool IsSyscall(int eventnum) {
+  return ((KUTRACE_SYSCALL64 <= eventnum) && (eventnum < KUTRACE_SYSRET64)) ||
+         ((KUTRACE_SYSCALL32 <= eventnum) && (eventnum < KUTRACE_SYSRET32));
+}
+
+// Category prefix for a span, or NULL if it is not charged to its RPC.
+// Point events, marks, PC samples, and lock-held lines overlay execution that
+// is already counted
+const char* CategoryPrefix(const OneSpan& span) {
+  if (span.eventnum == KUTRACE_ENQUEUE) {return "queue:";}
+  if ((KUTRACE_WAITA <= span.eventnum) && (span.eventnum <= KUTRACE_WAITZ)) {return "wait:";}
+  if (span.eventnum == KUTRACE_LOCK_TRY) {return "lock:";}
+  if (span.cpu < 0) {return NULL;}
+  if (IsUserExec(span.eventnum)) {return (0 < span.pid) ? "user" : NULL;}
+  if (IsSyscall(span.eventnum)) {return "sys:";}
+  if ((KUTRACE_TRAP <= span.eventnum) && (span.eventnum < KUTRACE_IRQ)) {return "trap:";}
+  if ((KUTRACE_IRQ <= span.eventnum) && (span.eventnum < KUTRACE_TRAPRET)) {return "irq:";}
+  return NULL;
+}
+
+// Called by the RPC tracker as each RPC finishes
+void RecordRpc(const RpcInstance& rpc, void*) {
+  Request request;
+  request.start_ns = rpc.start_ns;
+  request.elapsed_ns = rpc.end_ns - rpc.start_ns;
+  request.rpcid = rpc.rpcid;
+  request.start_pid = rpc.start_pid;
+  OpenBreakdowns::iterator it = openbreakdowns.find(rpc.serial);
+  if (it != openbreakdowns.end()) {
+    request.breakdown.swap(it->second);
+    openbreakdowns.erase(it);
+  }
+
+  int64 accounted = 0;
+  for (Breakdown::const_iterator it2 = request.breakdown.begin();
+       it2 != request.breakdown.end(); ++it2) {
+    accounted += it2->second;
+  }
+  int64 other = request.elapsed_ns - accounted;
+  if (0 < other) {request.breakdown[CategoryNum("other")] = other;}
+  methodrequests[rpc.method].push_back(request);
+}
+
+void DoSpan(const OneSpan& span) {
+  if (span.duration_ns < 0) {return;}
+  if (IsRpcWorkEvent(span.eventnum)) {
+    RpcWorkEvent(span.pid, span.eventnum, span.arg, span.start_ns, span.name, &rpctracker);
+    return;
+  }
+  const char* prefix = CategoryPrefix(span);
+  if (prefix == NULL) {return;}
+
+  // Lock spans have rpcid -1 and wait spans rpcid 0; use whatever their PID
+  // is working on
+  int rpcid = (span.rpcid <= 0) ? PidRpc(span.pid, rpctracker) : span.rpcid;
+  if (rpcid <= 0) {return;}
+  const RpcInstance* rpc = OpenRpc(rpcid, rpctracker);
+  if (rpc == NULL) {return;}
+
+  string category = string(prefix);
+  if (category != "user") {category += span.name;}
+  openbreakdowns[rpc->serial][CategoryNum(category)] += span.duration_ns;
+}
+
+bool ByElapsed(const Request& a, const Request& b) {
+  if (a.elapsed_ns != b.elapsed_ns) {return a.elapsed_ns < b.elapsed_ns;}
+  return a.start_ns < b.start_ns;
+}
+
+int64 CategoryNs(const Breakdown& breakdown, int category) {
+  Breakdown::const_iterator it = breakdown.find(category);
+  return (it == breakdown.end()) ? 0 : it->second;
+}
+
+typedef struct {
+  int64 delta_ns;
+  int category;
+} CategoryDelta;
+
+// Biggest increase first, then by name
+bool ByDelta(const CategoryDelta& a, const CategoryDelta& b) {
+  if (a.delta_ns != b.delta_ns) {return a.delta_ns > b.delta_ns;}
+  return categoryname[a.category] < categoryname[b.category];
+}
+
+// One slow request against the median one
+void WriteComparison(FILE* f, int rank, const Request& slow, const Request& median) {
+  double ratio = (median.elapsed_ns == 0) ? 0.0 :
+                 (double)slow.elapsed_ns / median.elapsed_ns;
+  fprintf(f, "#%d rpcid %d at %12.8f pid %d  elapsed %.2fus = %.1fx median\n",
+          rank, slow.rpcid, slow.start_ns / 1000000000.0, slow.start_pid,
+          NsToUsec(slow.elapsed_ns), ratio);
+
+  // Every category either request spent time in
+  map<int, bool> seen;
+  vector<CategoryDelta> deltas;
+  for (int pass = 0; pass < 2; ++pass) {
+    const Breakdown& breakdown = (pass == 0) ? slow.breakdown : median.breakdown;
+    for (Breakdown::const_iterator it = breakdown.begin(); it != breakdown.end(); ++it) {
+      if (seen[it->first]) {continue;}
+      seen[it->first] = true;
+      CategoryDelta temp;
+      temp.category = it->first;
+      temp.delta_ns = CategoryNs(slow.breakdown, it->first) -
+                      CategoryNs(median.breakdown, it->first);
+      deltas.push_back(temp);
+    }
+  }
+  std::sort(deltas.begin(), deltas.end(), ByDelta);
+
+  fprintf(f, "    %-28s %10s %10s %10s\n", "category", "slow_us", "median_us", "delta_us");
+  for (int i = 0; i < (int)deltas.size(); ++i) {
+    int category = deltas[i].category;
+    fprintf(f, "    %-28s %10.2f %10.2f %+10.2f\n", categoryname[category].c_str(),
+            NsToUsec(CategoryNs(slow.breakdown, category)),
+            NsToUsec(CategoryNs(median.breakdown, category)),
+            NsToUsec(deltas[i].delta_ns));
+  }
+}
+
+void WriteMethod(FILE* f, const string& method, vector<Request>* requests, int top_n) {
+  std::sort(requests->begin(), requests->end(), ByElapsed);
+  int n = requests->size();
+  const Request& median = (*requests)[(n - 1) / 2];
+  fprintf(f, "%s: %d requests, median %.2fus  rpcid %d at %12.8f\n",
+          method.c_str(), n, NsToUsec(median.elapsed_ns),
+          median.rpcid, median.start_ns / 1000000000.0);
+  for (int rank = 1; (rank <= top_n) && (rank <= n); ++rank) {
+    WriteComparison(f, rank, (*requests)[n - rank], median);
+  }
+  fprintf(f, "\n");
+}
+
+// Copy the name between quotes, which may contain spaces
+void CopyName(const char* s, char* name, int maxsize) {
+  const char* quote1 = strchr(s, '"');
+  const char* quote2 = (quote1 == NULL) ? NULL : strrchr(quote1 + 1, '"');
+  int len = (quote2 == NULL) ? 0 : quote2 - quote1 - 1;
+  if (maxsize - 1 < len) {len = maxsize - 1;}
+  if (0 < len) {memcpy(name, quote1 + 1, len);}
+  name[len] = '\0';
+}
+
+static const int kMaxBufferSize = 256;
+
+// Read next line, stripping any crlf. Return false if no more.
+bool ReadLine(FILE* f, char* buffer, int maxsize) {
+  char* s = fgets(buffer, maxsize, f);
+  if (s == NULL) {return false;}
+  int len = strlen(s);
+  // Strip any crlf or cr or lf
+  if (s[len - 1] == '\n') {s[--len] = '\0';}
+  if (s[len - 1] == '\r') {s[--len] = '\0';}
+  return true;
+}
+
+void Usage() {
+  fprintf(stderr, "Usage: spantoslowrpc [-n <count>] [-method <name>]\n");
+  exit(0);
+}
+
+//
+// Filter from stdin to stdout
+//
+int main (int argc, const char** argv) {
+  int top_n = kDefaultTopN;
+  const char* only_method = NULL;
+  for (int i = 1; i < argc; ++i) {
+    if ((strcmp(argv[i], "-n") == 0) && (i < (argc - 1))) {
+      top_n = atoi(argv[++i]);
+      if (top_n < 1) {Usage();}
+    } else if ((strcmp(argv[i], "-method") == 0) && (i < (argc - 1))) {
+      only_method = argv[++i];
+    } else {
+      Usage();
+    }
+  }
+
+  // expecting:
+  //    ts           dur        cpu pid  rpc event arg retval  ipc name
+  //  [ 22.39359781, 0.00000283, 0, 1910, 0, 2048, 3, 256, 3, "read"],
+
+  InitRpcTracker(RecordRpc, NULL, &rpctracker);
+  int span_count = 0;
+  char buffer[kMaxBufferSize];
+  while (ReadLine(stdin, buffer, kMaxBufferSize)) {
+    OneSpan onespan;
+    int name_pos = 0;
+    int n = sscanf(buffer, "[%lf, %lf, %d, %d, %d, %d, %d, %d, %d, %n",
+                   &onespan.start_ts, &onespan.duration,
+                   &onespan.cpu, &onespan.pid, &onespan.rpcid,
+                   &onespan.eventnum, &onespan.arg, &onespan.retval, &onespan.ipc, &name_pos);
+    if (n < 9) {
+      if (ParseTicksPerSec(buffer) != 0) {ticks_per_sec = ParseTicksPerSec(buffer);}
+      continue;
+    }
+    if (SpanSec(onespan.start_ts, ticks_per_sec) >= 999.0) {break;}	// End marker
+
+    onespan.start_ns = llround(onespan.start_ts * NsPerUnit());
+    onespan.duration_ns = llround(onespan.duration * NsPerUnit());
+    CopyName(buffer + name_pos, onespan.name, sizeof(onespan.name));
+    DoSpan(onespan);
+    ++span_count;
+  }
+  FinishRpcTracker(&rpctracker);
+
+  int request_count = 0;
+  for (MethodRequests::iterator it = methodrequests.begin(); it != methodrequests.end(); ++it) {
+    request_count += it->second.size();
+    if ((only_method != NULL) && (it->first != only_method)) {continue;}
+    WriteMethod(stdout, it->first, &it->second, top_n);
+  }
+
+  fprintf(stderr, "spantoslowrpc: %d spans, %d RPCs in %d methods, %d RPCs without a response\n",
+          span_count, request_count, (int)methodrequests.size(), rpctracker.unanswered);
+  return 0;
+}
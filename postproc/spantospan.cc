@@ -4,6 +4,10 @@
 // Filter from stdin to stdout
 // One command-line parameter -- 
 //   granularity in microseconds. zero means 1:1 passthrough
+// or a comma-separated list of granularities, plus -o <prefix>, to make each
+// of them in one pass over the input, writing <prefix>_<usec>us.json
+//
+//   cat foo.json |spantospan 10,100,1000 -o foo
 //
 // compile with g++ -O2 spantospan.cc -o spantospan
 //
@@ -13,22 +17,11 @@
 // dick sites 2017.11.18
 //  add instructions per cycle IPC support
 // dsites 2022.07.07 Total rewrite
+// 2026.10.16 Accept integer-tick JSON spans, see json_ticks.h
+// 2026.10.17 Several granularities in one pass, one SpanMerger each
 //
 
-/***
- Design notes:
- We want the granular output to contain nearly the same total amount of time per 
- timeline as the originaly.
- We want long timespans to land in nearly the same position as originally.
- We drop a lot of decoration items but keep mark_a/b/c.
- We accumulate spans by event number, releasing an output span whenever
- the total exceeds the granularity.
- Large spans land within +/- granularity of their original
-
- Items that total less than granularity at the end are dropped. We compensate
- by initializing each deferred span's duration to half the granularity.
- Each combined span is represented by its first-arrived item.
- ***/
+// The merging itself is in spanmerge.h, shared with spantolod
 
 #include <map>
 #include <string>
@@ -37,205 +30,67 @@
 #include <stdlib.h>     // exit
 #include <string.h>
 #include "basetypes.h"
+#include "json_ticks.h"
+#include "spanmerge.h"
 
 #define UserPidNum       0x200
 
 using std::string;
 using std::map;
 
-typedef struct {
-  double start_ts;	// Seconds
-  double duration;	// Seconds
-  int64 start_ts_ns;
-  int64 duration_ns;
-  int cpu;
-  int pid;
-  int rpcid;
-  int event;
-  int arg;
-  int retval;
-  int ipc;
-  char name[64];
-} OneSpan;
-
-// Short spans accumulate by summing duration
-typedef map<int, OneSpan> SpanMap;
+static const int kMaxLevels = 16;
 
+// One output granularity
 typedef struct {
-  int64 next_ts_ns;
-  int64 total_deferred_ns;
-  SpanMap spanmap;
-} CPUstate;
-
-static const int kMaxCpus = 80;
-
+  int64 granularity_ns;
+  FILE* f;
+  string fname;
+  int output_events;
+  SpanMerger* merger;
+} Level;
 
 // Globals
-int64 granularity_ns;
-int output_events = 0;
-bool output_buffer_full[kMaxCpus];
-OneSpan buffered_span[kMaxCpus];
+Level levels[kMaxLevels];
+int level_count = 0;
+int64 ticks_per_sec = 0;	// Incoming ticksPerSec, if any. 0 means times in seconds
+
+// Nanoseconds per incoming time unit, either seconds or ticks
+double NsPerUnit() {
+  return (ticks_per_sec == 0) ? 1000000000.0 : 1000000000.0 / ticks_per_sec;
+}
 
 void PrintSpan(FILE* f, const OneSpan& onespan) {
     // Name has trailing punctuation, including ],
-    fprintf(f, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, %s\n",
-            onespan.start_ts_ns / 1000000000.0, 
-            onespan.duration_ns / 1000000000.0,
+    PrintSpanTimes(f, ticks_per_sec,
+                   onespan.start_ts_ns / NsPerUnit(), 
+                   onespan.duration_ns / NsPerUnit());
+    fprintf(f, "%d, %d, %d, %d, %d, %d, %d, %s\n",
             onespan.cpu, onespan.pid, 
             onespan.rpcid, onespan.event, 
             onespan.arg, onespan.retval, 
             onespan.ipc, onespan.name);
 }
 
-// Accumulate a span in per-CPU state, incrementing the deferred not-yet-output times
-void AddSpan(const OneSpan& onespan, CPUstate* cpustate) {
-  int event = onespan.event;
-  SpanMap::iterator it = cpustate->spanmap.find(event);
-  if (it == cpustate->spanmap.end()) {
-    // Make a new event entry
-    OneSpan temp;
-    temp = onespan;					// Copy all the fields
-    temp.duration_ns = 0;				// Updated below
-    cpustate->spanmap[event] = temp;
-    it = cpustate->spanmap.find(event);
-//fprintf(stderr, "New "); PrintSpan(stderr, onespan);
-  }
-  OneSpan* addedspan = &it->second;
-  if (addedspan->duration_ns == 0) {
-    *addedspan = onespan;				// Reinit pid, etc.
-  } else {
-    addedspan->duration_ns += onespan.duration_ns;	// Just add to existing duration
-  }
-  cpustate->total_deferred_ns += onespan.duration_ns;
-}
-
-OneSpan* FindLargestDeferred(SpanMap& spanmap) {
-  int max_deferred = 0;
-  OneSpan* retval = NULL;
-  for (SpanMap::iterator it = spanmap.begin(); it != spanmap.end(); ++it) {
-    if (max_deferred < it->second.duration_ns) {
-      max_deferred = it->second.duration_ns;
-      retval = &it->second;
-    }
-  }
-  return retval;  
+// Write one combined span to its level's output
+void EmitSpan(const OneSpan& onespan, void* emit_arg) {
+  Level* level = reinterpret_cast<Level*>(emit_arg);
+  PrintSpan(level->f, onespan);
+  ++level->output_events;
 }
 
-// Run a one-span buffer so we can combine identical-event spans
-// This can be called with newspan=NULL to flush the last buffered entry
-void OutputSpan(int cpu, int64 next_ts_ns, const OneSpan* newspan) {
-  // Possibly combine with previously buffered span per CPU
-  if ((newspan != NULL) && 
-      output_buffer_full[cpu] &&
-      (newspan->event == buffered_span[cpu].event)) {
-    buffered_span[cpu].duration_ns += newspan->duration_ns;
-    return;
-  }
-  // Flush any buffered span
-  if (output_buffer_full[cpu]) {
-    PrintSpan(stdout, buffered_span[cpu]);
-    ++output_events;
-    output_buffer_full[cpu] = false;
-  }
-  // Save as new buffered span
-  if (newspan != NULL) {
-    buffered_span[cpu] = *newspan;			// Copy all the fields
-    buffered_span[cpu].start_ts_ns = next_ts_ns;
-    output_buffer_full[cpu] = true;
+// Copy a line unchanged to every level, or just the passthrough ones
+void CopyLine(const char* buffer, bool passthrough_only, bool is_span) {
+  for (int i = 0; i < level_count; ++i) {
+    if (passthrough_only && (levels[i].granularity_ns != 0)) {continue;}
+    fprintf(levels[i].f, "%s\n", buffer);
+    if (is_span && (levels[i].granularity_ns == 0)) {++levels[i].output_events;}
   }
 }
 
-void DumpDeferred(FILE* f, CPUstate* cpustate) {
-  fprintf(f, "DumpDefered %5lld\n", cpustate->total_deferred_ns);
-  for (SpanMap::iterator it = cpustate->spanmap.begin(); it != cpustate->spanmap.end(); ++it) {
-    if (0 < it->second.duration_ns) {
-      fprintf(f, "  %5lld %s\n", it->second.duration_ns, it->second.name);
-    }
-  }
-}
-
-OneSpan* GetCurrent(int event,  CPUstate* cpustate) {
-  SpanMap::iterator it = cpustate->spanmap.find(event);
-  if (it == cpustate->spanmap.end()) {
-    // No such event
-    return NULL;
-  }
-  return &it->second;
-}
-
-// Flush the deferred event that matches onespan.event
-void FlushCurrent(const OneSpan& onespan, CPUstate* cpustate) {
-  OneSpan* curspan = GetCurrent(onespan.event, cpustate);
-  if (curspan == NULL) {return;}
-  int64 duration_ns = curspan->duration_ns;
-  if (duration_ns == 0) {return;}
-  int cpu = curspan->cpu;
-  OutputSpan(cpu, cpustate->next_ts_ns, curspan);
-//fprintf(stderr, "  ->  "); PrintSpan(stderr, *curspan);
-//fprintf(stderr, "\n");
-  curspan->duration_ns = 0;
-  cpustate->next_ts_ns += duration_ns;
-  cpustate->total_deferred_ns -= duration_ns;
-}
-
-// Output deferred spans by decreasing size
-void FlushDeferred(CPUstate* cpustate) {
-    //DumpDeferred(stderr, &cpustate[cpu]);
-    while (cpustate->total_deferred_ns >= granularity_ns) {
-      OneSpan* deferspan = FindLargestDeferred(cpustate->spanmap);
-      if (deferspan == NULL) {break;}
-      int64 duration_ns = deferspan->duration_ns;
-      OutputSpan(deferspan->cpu, cpustate->next_ts_ns, deferspan);
-      //fprintf(stderr, "  =>  "); PrintSpan(stderr, *deferspan);
-      deferspan->duration_ns = 0;
-      cpustate->next_ts_ns += duration_ns;
-      cpustate->total_deferred_ns -= duration_ns;
-    }
-    //fprintf(stderr, " = %lld\n", cpustate[cpu]->total_deferred_ns);
-}
-
-// Defer this span by adding its duration to accumulated time by event number,
-// and also to total deferred time per CPU number.
-// If total deferred for this CPU then exceeds granularity, flush the largest
-// deferred spans.  
-void ProcessSpan(const OneSpan& onespan, CPUstate* cpustate) {
-  int cpu = onespan.cpu;
-  // Initialize start timestamp at first entry per CPU
-  if (cpustate[cpu].next_ts_ns < 0) {
-    cpustate[cpu].next_ts_ns = onespan.start_ts_ns;
-  } 
-////fprintf(stderr, "%5lld in", cpustate[cpu].total_deferred_ns); PrintSpan(stderr, onespan);
-
-  // If this is a big span,  catch up deferred spans until we are within 
-  // granularity of the new span's original start_ts, and then output this span.
-  // If  not big, defer this span and return.
-  // Big means that this span's duration plus any same-event deferred 
-  // duration is >= granularity.
-//fprintf(stderr, "calling getcurrent\n");
-  OneSpan* curspan = GetCurrent(onespan.event, &cpustate[cpu]);
-  int64 dur_ns = onespan.duration_ns;
-  if (curspan != NULL) {
-    dur_ns += curspan->duration_ns;
-  }
-  bool bigspan = (dur_ns >= granularity_ns);
-//fprintf(stderr, "bigspan %d\n", bigspan);  
-  if (bigspan) {
-    FlushDeferred(&cpustate[cpu]);
-    AddSpan(onespan, &cpustate[cpu]);
-    FlushCurrent(onespan, &cpustate[cpu]);
-    return;
-  }
-
-  // Else just accumulate this span in deferred per-CPU state, possibly merging 
-  // with previous small instances
-  AddSpan(onespan, &cpustate[cpu]);
-}
-
 // Add dummy entry that sorts last, then close the events array and top-level json
 // Version 3 with IPC
 void FinalJson(FILE* f) {
-  fprintf(f, "[999.0, 0.0, 0, 0, 0, 0, 0, 0, 0, \"\"]\n");	// no comma
-  fprintf(f, "]}\n");
+  PrintFinalJson(f, ticks_per_sec);
 }
 
 
@@ -252,25 +107,13 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
   return true;
 }
 
-bool KeepIntact(const OneSpan& onespan) {
-  // Keep mark_a for landmarks 
-  if (onespan.event == 0x020A) {return true;}
-  return false;
-}
-
-bool DeleteMe(const OneSpan& onespan) {
-  if (onespan.cpu < 0) {return true;}
-  if (onespan.event < 0x400) {return true;}
-  if (onespan.duration < 0.000000011) {return true;}
-  return false;
-}
-
 
 // Input is a json file of spans
-// start time and duration for each span are in seconds
+// start time and duration for each span are in seconds, or integer ticks
 // Output is a smaller json file of fewer spans with lower-resolution times
 void Usage() {
   fprintf(stderr, "Usage: spantospan resolution_usec [start_sec [stop_sec]]\n");
+  fprintf(stderr, "       spantospan resolution_usec,resolution_usec,... -o prefix\n");
   exit(0);
 }
 
@@ -278,36 +121,59 @@ void Usage() {
 // Filter from stdin to stdout
 //
 int main (int argc, const char** argv) {
-  CPUstate cpustate[kMaxCpus];
   // Internally, we keep everything as integer nanoseconds to avoid roundoff 
   // error and to give clean truncation
-  int64 output_granularity_ns;
+  const char* prefix = NULL;
 
   if (argc < 2) {Usage();}
-  granularity_ns = 1000 * atoi(argv[1]);
-
-  // Initialize each CPU deferral
-  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
-    cpustate[cpu].next_ts_ns = -1;
-    cpustate[cpu].total_deferred_ns = granularity_ns / 2;
-    cpustate[cpu].spanmap.clear();
-    output_buffer_full[cpu] = false;
+  for (int i = 2; i < argc; ++i) {
+    if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) {prefix = argv[++i];}
+  }
+
+  const char* p = argv[1];
+  while (*p != '\0') {
+    if (level_count >= kMaxLevels) {Usage();}
+    Level* level = &levels[level_count++];
+    level->granularity_ns = 1000 * atoi(p);
+    level->output_events = 0;
+    level->f = stdout;
+    level->fname = "stdout";
+    if (prefix != NULL) {
+      char temp[32];
+      sprintf(temp, "_%dus.json", atoi(p));
+      level->fname = string(prefix) + temp;
+      level->f = fopen(level->fname.c_str(), "w");
+      if (level->f == NULL) {
+        fprintf(stderr, "%s did not open\n", level->fname.c_str());
+        exit(0);
+      }
+    }
+    level->merger = new SpanMerger;
+    InitSpanMerger(level->granularity_ns, EmitSpan, level, level->merger);
+    const char* comma = strchr(p, ',');
+    if (comma == NULL) {break;}
+    p = comma + 1;
+  }
+  // Several granularities cannot share stdout
+  if ((level_count > 1) && (prefix == NULL)) {Usage();}
+
+  bool any_passthrough = false;
+  bool any_merged = false;
+  for (int i = 0; i < level_count; ++i) {
+    if (levels[i].granularity_ns == 0) {any_passthrough = true;} else {any_merged = true;}
   }
 
   // expecting:
   //    ts           dur        cpu pid  rpc event arg retval  ipc name 
   //  [ 22.39359781, 0.00000283, 0, 1910, 0, 67446, 0, 256, 3, "gnome-terminal-.1910"],
 
+  // Once past the end marker, only zero-granularity passthrough levels want more
+  bool spans_done = false;
   char buffer[kMaxBufferSize];
   while (ReadLine(stdin, buffer, kMaxBufferSize)) {
 //fprintf(stderr, "%s\n", buffer);
-   // Zero granularity means 1:1 passthrough
-    if (granularity_ns == 0) {
-      fprintf(stdout, "%s\n", buffer);
-      // Leading "[" below picks off just span JSON entries
-      if (buffer[0] == '[') {
-        ++output_events;
-      }
+    if (spans_done) {
+      CopyLine(buffer, true, buffer[0] == '[');
       continue;
     }
 
@@ -323,57 +189,74 @@ int main (int argc, const char** argv) {
     
     if (n < 9) {
       // Copy unchanged anything not a span
-      fprintf(stdout, "%s\n", buffer);
+      CopyLine(buffer, false, buffer[0] == '[');
+      if (ParseTicksPerSec(buffer) != 0) {ticks_per_sec = ParseTicksPerSec(buffer);}
       continue;
     }
 
+    // Zero granularity means 1:1 passthrough
+    CopyLine(buffer, true, true);
+
     // Always strip 999.0 end marker and exit this loop
-    if (onespan.start_ts >= 999.0) {
-      break;
+    if (SpanSec(onespan.start_ts, ticks_per_sec) >= 999.0) {
+      if (!any_passthrough) {break;}
+      spans_done = true;
+      continue;
     }
 
     // Keep a few things, such as mark_a marker
     if (KeepIntact(onespan)) {
-      fprintf(stdout, "%s\n", buffer);
-      ++output_events;
+      for (int i = 0; i < level_count; ++i) {
+        if (levels[i].granularity_ns == 0) {continue;}
+        fprintf(levels[i].f, "%s\n", buffer);
+        ++levels[i].output_events;
+      }
       continue;
     }
 
     // Delete all but events that span actual CPU time
-    if (DeleteMe(onespan)) {
+    if (DeleteMe(onespan, ticks_per_sec)) {
       continue;
     }
 
+    if (!any_merged) {continue;}
+
     if (kMaxCpus <= onespan.cpu){
       fprintf(stderr, "Bad CPU number at '%s'\n", buffer);
-      fprintf(stdout, "Bad CPU number at '%s'\n", buffer);
+      for (int i = 0; i < level_count; ++i) {
+        fprintf(levels[i].f, "Bad CPU number at '%s'\n", buffer);
+      }
       exit(0);
     }
 
     // Make all times nsec
-    onespan.start_ts_ns = onespan.start_ts * 1000000000.0;
-    onespan.duration_ns = onespan.duration * 1000000000.0;
+    onespan.start_ts_ns = onespan.start_ts * NsPerUnit();
+    onespan.duration_ns = onespan.duration * NsPerUnit();
 
-    // Defer and then possibly output this event
-    ProcessSpan(onespan, &cpustate[0]);    
-  }
-
-  // Flush any remaining deferred spans per CPU
-  //fprintf(stderr, "flush all\n");
-  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
-    // Possibly many deferred events
-    FlushDeferred(&cpustate[cpu]);
-    // And push out last buffered item
-    OutputSpan(cpu, cpustate[cpu].next_ts_ns, NULL);
+    // Defer and then possibly output this event, at each granularity
+    for (int i = 0; i < level_count; ++i) {
+      if (levels[i].granularity_ns == 0) {continue;}
+      ProcessSpan(levels[i].merger, onespan);
+    }
   }
 
-  // Add marker and closing at the end
-  // Zero granularity means 1:1 passthrough
-  if (granularity_ns != 0) {
-    FinalJson(stdout);
+  for (int i = 0; i < level_count; ++i) {
+    Level* level = &levels[i];
+    // Zero granularity means 1:1 passthrough
+    if (level->granularity_ns != 0) {
+      // Flush any remaining deferred spans per CPU
+      FlushAllSpans(level->merger);
+      // Add marker and closing at the end
+      FinalJson(level->f);
+    }
+    if (level->f != stdout) {
+      fclose(level->f);
+      fprintf(stderr, "spantospan: %d events in %s\n", level->output_events, level->fname.c_str());
+    } else {
+      fprintf(stderr, "spantospan: %d events\n", level->output_events);
+    }
+    delete level->merger;
   }
 
-  fprintf(stderr, "spantospan: %d events\n", output_events);
-
   return 0;
 }
@@ -3,6 +3,7 @@
 // Filter from stdin to stdout
 // One or two command-line parameters -- 
 //   stat_second [stop_second]
+// or a mark label, plus optionally the input file name in place of stdin
 //
 // dick sites 2016.11.07
 // dick sites 2017.08.16
@@ -11,6 +12,12 @@
 //  Add trim by mark_abc label
 // dick sites 2017.11.18
 //  add optional instructions per cycle IPC support
+// 2026.10.16 Accept integer-tick JSON spans, see json_ticks.h
+// 2026.10.17 Input that is a file, not a pipe, is mapped and the time range
+//  found by binary search, since the usual pipeline sorts spans by start time.
+//  Label trims use a sidecar index of mark positions, foo.json.marks, built
+//  on first use. Either way the cost is proportional to the output size.
+//  Pipe unsorted input in, cat foo.json |spantotrim ..., to scan it all.
 //
 //
 // Compile with g++ -O2 spantotrim.cc from_base40.cc -o spantotrim
@@ -18,15 +25,28 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>     // exit
 #include <string.h>
+#include <sys/stat.h>
 #include "basetypes.h"
 #include "from_base40.h"
+#include "json_ticks.h"
+#include "spanscan.h"
+
+#include "kupostproc.h"
+
+namespace spantotrim {
+
+// Input and output streams. stdin/stdout except when run inside kupostproc
+static FILE* infile = NULL;
+static FILE* outfile = NULL;
 
 using std::string;
 using std::map;
+using std::vector;
 
 typedef struct {
   double start_ts;	// Seconds
@@ -43,13 +63,19 @@ typedef struct {
   char name[64];
 } OneSpan;
 
+// One mark_abc span, for trimming by label
+typedef struct {
+  int64 offset;		// Of its line in the input
+  char label[8];
+} OneMark;
+
 static int incoming_version = 0;  // Incoming version number, if any, from ## VERSION: 2
 static int incoming_flags = 0;    // Incoming flags, if any, from ## FLAGS: 128
+static int64 ticks_per_sec = 0;   // Incoming ticksPerSec, if any. 0 means times in seconds
 
 // Add dummy entry that sorts last, then close the events array and top-level json
 void FinalJson(FILE* f) {
-  fprintf(f, "[999.0, 0.0, 0, 0, 0, 0, 0, 0, 0, \"\"]\n");	// no comma
-  fprintf(f, "]}\n");
+  PrintFinalJson(f, ticks_per_sec);
 }
 
 // Return true if the event is mark_a mark_b mark_c
@@ -72,14 +98,135 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
 // start time and duration for each span are in seconds
 // Output is a smaller json file of fewer spans with lower-resolution times
 void Usage() {
-  fprintf(stderr, "Usage: spantotrim label | start_sec [stop_sec]\n");
+  fprintf(stderr, "Usage: spantotrim label | start_sec [stop_sec]  [foo.json]\n");
   exit(0);
 }
 
+// Copy lines from begin to limit, stripping any crlf. Returns the number of spans
+int CopyLines(const char* begin, const char* limit) {
+  int spans = 0;
+  const char* p = begin;
+  while (p < limit) {
+    const char* eol = ScanLineEnd(p, limit);
+    fwrite(p, 1, eol - p, outfile);
+    fputc('\n', outfile);
+    if (*p == '[') {++spans;}
+    p = ScanNextLine(p, limit);
+  }
+  return spans;
+}
+
+// Find all the mark_abc spans between begin and limit
+void BuildMarkIndex(const char* base, const char* begin, const char* limit,
+                    int64 ns_per_unit, vector<OneMark>* marks) {
+  const char* p = begin;
+  while (p < limit) {
+    ScanSpan span;
+    if (ScanSpanLine(p, ScanLineEnd(p, limit), ns_per_unit, &span) &&
+        is_mark_abc(span.eventnum)) {
+      OneMark mark;
+      mark.offset = p - base;
+      Base40ToChar(span.arg, mark.label);
+      marks->push_back(mark);
+    }
+    p = ScanNextLine(p, limit);
+  }
+}
+
+// The sidecar index starts with the size and modify time of the input it was
+// built from, so a changed input is noticed, then has one line per mark:
+//   offset label
+bool ReadMarkIndex(const char* fname, const struct stat& st, vector<OneMark>* marks) {
+  FILE* f = fopen(fname, "r");
+  if (f == NULL) {return false;}
+  char buffer[kMaxBufferSize];
+  long long int size, mtime;
+  bool ok = ReadLine(f, buffer, kMaxBufferSize) &&
+            (sscanf(buffer, "# spantotrim marks %lld %lld", &size, &mtime) == 2) &&
+            (size == (long long int)st.st_size) && (mtime == (long long int)st.st_mtime);
+  while (ok && ReadLine(f, buffer, kMaxBufferSize)) {
+    OneMark mark;
+    long long int offset;
+    memset(mark.label, 0, sizeof(mark.label));
+    if (sscanf(buffer, "%lld %7s", &offset, mark.label) < 1) {ok = false; break;}
+    if ((offset < 0) || (st.st_size <= offset)) {ok = false; break;}
+    mark.offset = offset;
+    marks->push_back(mark);
+  }
+  fclose(f);
+  if (!ok) {marks->clear();}
+  return ok;
+}
+
+// Best effort; without it the next label trim just rebuilds the index
+void WriteMarkIndex(const char* fname, const struct stat& st, const vector<OneMark>& marks) {
+  FILE* f = fopen(fname, "w");
+  if (f == NULL) {return;}
+  fprintf(f, "# spantotrim marks %lld %lld\n",
+          (long long int)st.st_size, (long long int)st.st_mtime);
+  for (int i = 0; i < (int)marks.size(); ++i) {
+    fprintf(f, "%lld %s\n", marks[i].offset, marks[i].label);
+  }
+  fclose(f);
+}
+
+// Trim a mapped input. Spans are sorted by start time, so the time range is
+// found by binary search. For a label, the mark index gives the line ranges
+// from each Mark_abc label through the next Mark_abc /label, inclusive
+int TrimMapped(const char* fname, double start_sec, double stop_sec,
+               bool by_label, const char* label, const char* notlabel) {
+  struct stat st;
+  fstat(fileno(infile), &st);
+  size_t input_len = 0;
+  const char* input = MapSpanInput(infile, &input_len);
+  const char* input_limit = input + input_len;
+  const char* first_span = ScanHeader(input, input_limit, &ticks_per_sec);
+  int64 ns_per_unit = ScanNsPerUnit(ticks_per_sec);
+  const char* spans_limit = FirstSpanAtOrAfter(first_span, input_limit, kScanEndNs, ns_per_unit);
+
+  int output_events = 0;
+  CopyLines(input, first_span);
+  if (!by_label) {
+    int64 start_ns = (int64)(start_sec * 1000000000.0 + 0.5);
+    int64 stop_ns = (int64)(stop_sec * 1000000000.0 + 0.5);
+    const char* begin = FirstSpanAtOrAfter(first_span, spans_limit, start_ns, ns_per_unit);
+    const char* limit = FirstSpanAtOrAfter(begin, spans_limit, stop_ns, ns_per_unit);
+    output_events = CopyLines(begin, limit);
+  } else {
+    vector<OneMark> marks;
+    string index_fname;
+    if (fname != NULL) {index_fname = string(fname) + ".marks";}
+    if ((fname == NULL) || !ReadMarkIndex(index_fname.c_str(), st, &marks)) {
+      BuildMarkIndex(input, first_span, spans_limit, ns_per_unit, &marks);
+      if (fname != NULL) {WriteMarkIndex(index_fname.c_str(), st, marks);}
+    }
+
+    const char* begin = NULL;
+    for (int i = 0; i < (int)marks.size(); ++i) {
+      const char* line = input + marks[i].offset;
+      if ((begin == NULL) && (strcmp(label, marks[i].label) == 0)) {begin = line;}
+      if ((begin != NULL) && (strcmp(notlabel, marks[i].label) == 0)) {
+        output_events += CopyLines(begin, ScanNextLine(line, input_limit));
+        begin = NULL;
+      }
+    }
+    if (begin != NULL) {output_events += CopyLines(begin, spans_limit);}
+  }
+
+  // Add marker and closing at the end
+  FinalJson(outfile);
+  fprintf(stderr, "spantotrim: %d events\n", output_events);
+  return 0;
+}
+
 //
 // Filter from stdin to stdout
 //
-int main (int argc, const char** argv) {
+int SpanToTrim(int argc, const char** argv, FILE* in, FILE* out) {
+  infile = in;
+  outfile = out;
+  const char* fname = NULL;
+
   double start_sec = 0.0;
   double stop_sec = 999.0;
   char label[8];
@@ -89,6 +236,20 @@ int main (int argc, const char** argv) {
   bool next_inside_label_span = true;
 
   if (argc < 2) {Usage();}
+
+  // Optional input file name last
+  if (argc >= 3) {
+    char* end;
+    strtod(argv[argc - 1], &end);
+    if ((*end != '\0') || (('9' < argv[1][0]) && (argc == 3))) {
+      fname = argv[--argc];
+      infile = fopen(fname, "rb");
+      if (infile == NULL) {
+        fprintf(stderr, "%s did not open\n", fname);
+        exit(0);
+      }
+    }
+  }
   
   if ('9' < argv[1][0]) {
     // Does not start with a digit. Assume it is a label and
@@ -97,8 +258,9 @@ int main (int argc, const char** argv) {
     // inclusive
     int len = strlen(argv[1]);
     if (len > 6 ) {len = 6;}
-    memcpy(label, argv[1], len + 1);
-    memcpy(notlabel + 1, label, len);
+    memcpy(label, argv[1], len);
+    label[len] = '\0';
+    memcpy(notlabel + 1, label, len + 1);
     notlabel[0] = '/';
     notlabel[7] = '\0';
     inside_label_span = false;
@@ -114,13 +276,20 @@ int main (int argc, const char** argv) {
     if (n != 1) {Usage();}
   }
 
+  struct stat st;
+  if ((fstat(fileno(infile), &st) == 0) && S_ISREG(st.st_mode)) {
+    int retval = TrimMapped(fname, start_sec, stop_sec, !inside_label_span, label, notlabel);
+    if (fname != NULL) {fclose(infile);}
+    return retval;
+  }
+
   // expecting:
   //    ts           dur       cpu  pid  rpc event arg ret  name--------------------> 
   //  [ 22.39359781, 0.00000283, 0, 1910, 0, 67446, 0, 256, "gnome-terminal-.1910"],
 
   int output_events = 0;
   char buffer[kMaxBufferSize];
-  while (ReadLine(stdin, buffer, kMaxBufferSize)) {
+  while (ReadLine(infile, buffer, kMaxBufferSize)) {
     char buffer2[256];
     buffer2[0] = '\0';
     OneSpan onespan;
@@ -132,12 +301,14 @@ int main (int argc, const char** argv) {
     
     if (n < 9) {
       // Copy unchanged anything not a span
-      fprintf(stdout, "%s\n", buffer);
+      fprintf(outfile, "%s\n", buffer);
+      if (ParseTicksPerSec(buffer) != 0) {ticks_per_sec = ParseTicksPerSec(buffer);}
       continue;
     }
-    if (onespan.start_ts >= 999.0) {break;}	// Always strip 999.0 end marker and stop
-    if (onespan.start_ts < start_sec) {continue;}
-    if (onespan.start_ts >= stop_sec) {continue;}
+    double span_sec = SpanSec(onespan.start_ts, ticks_per_sec);
+    if (span_sec >= 999.0) {break;}	// Always strip 999.0 end marker and stop
+    if (span_sec < start_sec) {continue;}
+    if (span_sec >= stop_sec) {continue;}
 
     // Keep an eye out for mark_abc
     if (is_mark_abc(onespan.event)) {
@@ -152,8 +323,8 @@ int main (int argc, const char** argv) {
     if (!inside_label_span) {continue;}	
 
     // Name has trailing punctuation, including ],
-    fprintf(stdout, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, %s\n",
-            onespan.start_ts, onespan.duration,
+    PrintSpanTimes(outfile, ticks_per_sec, onespan.start_ts, onespan.duration);
+    fprintf(outfile, "%d, %d, %d, %d, %d, %d, %d, %s\n",
             onespan.cpu, onespan.pid, onespan.rpcid, onespan.event, 
             onespan.arg, onespan.retval, onespan.ipc, onespan.name);
     ++output_events;
@@ -162,8 +333,16 @@ int main (int argc, const char** argv) {
   }
 
   // Add marker and closing at the end
-  FinalJson(stdout);
+  FinalJson(outfile);
   fprintf(stderr, "spantotrim: %d events\n", output_events);
 
   return 0;
 }
+
+}  // namespace spantotrim
+
+#ifndef KUPOSTPROC
+int main (int argc, const char** argv) {
+  return spantotrim::SpanToTrim(argc, argv, stdin, stdout);
+}
+#endif
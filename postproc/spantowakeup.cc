@@ -0,0 +1,437 @@
+// Little program to report scheduling delays and wakeup chains from a JSON
+// span file, to find convoys in thread pools
+//
+// Filter from stdin to stdout
+// Optional command-line parameters --
+//   start_sec [stop_sec]   only report what happens in this time window
+//   -n <count>             show this many chains, default 10
+//
+//   cat foo.json |spantowakeup 12.5 12.6 >foo_wakeup.txt
+//
+// eventtospan3 draws a -wakeup- arc from each make-runnable event to where the
+// woken thread next runs, and wait_* spans for why a thread was not running.
+// This program reads those back:
+//
+// Per thread, the runnable-to-running delay is the length of its wakeup arcs,
+// from being made runnable to running on some CPU. Blocked time is the sum of
+// its wait spans, by wait letter. wait_cpu is left out, as that is runnable
+// time, not blocked time.
+//
+// Each wakeup is done by some thread, or by an interrupt that happens to
+// borrow a thread's CPU. A wakeup done by a thread is linked to the wakeup that
+// last made that thread run, and so on back, up to kMaxChain links, until an
+// interrupt, the idle thread, or the start of the trace. The runnable delays
+// along such a chain are time the whole chain of work spent waiting for CPUs;
+// when a pool of threads hands work along, this is the convoy. The chains with
+// the most runnable delay are shown, each link once.
+//
+// Output to stdout is two tables, times in microseconds:
+//   pid    name               wakeups   run_p50   run_p99   run_max  runnable  blocked by reason
+//   1003   proc3                  412      2.10     48.00     95.30   3120.55  wait_disk 801.20  wait_lock 55.00
+//
+//   Chain 1: 3 wakeups, 245.00us runnable, 1310.20us from first wakeup to last run
+//     12.34567890 irq local_timer cpu 0      -> 1003 proc3    runnable   5.20
+//     12.34570000 1003 proc3 futex cpu 1     -> 1001 proc1    runnable 200.00
+//     ...
+//
+// Compile with g++ -O2 spantowakeup.cc -o spantowakeup
+//
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <math.h>	// llround
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+#include "basetypes.h"
+#include "json_ticks.h"
+#include "kutrace_lib.h"
+#include "latencyhist.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+static const int kArcNum = -3;		// Wakeup arc, as made by eventtospan3
+static const int kMaxChain = 8;
+static const int kDefaultTopN = 10;
+static const int kMaxReasons = 4;	// Wait letters shown per thread
+
+typedef struct {
+  double start_ts;	// Incoming units, seconds or ticks
+  double duration;
+  int64 start_ns;
+  int64 duration_ns;
+  int cpu;
+  int pid;
+  int rpcid;
+  int eventnum;
+  int arg;
+  int retval;
+  int ipc;
+  char name[64];	// Without quotes
+} OneSpan;
+
+// What a CPU is doing, from its latest execution span
+typedef struct {
+  int eventnum;
+  int pid;
+  int name;		// Interned
+} CpuNow;
+
+// One wakeup arc
+typedef struct {
+  int64 wake_ns;
+  int64 run_ns;
+  int waker_cpu;
+  int waker_pid;	// CPU's current PID, even for an interrupt
+  int target_pid;
+  int context;		// Interned name of what the waker CPU was doing
+  int parent;		// Wakeup that last made waker_pid run, -1 if none
+  bool from_irq;
+  bool reported;
+} Wakeup;
+
+typedef struct {
+  LatHist runnable;
+  int64 runnable_ns;
+  int64 blocked_ns[26];	// By wait letter
+} ThreadStats;
+
+// Globals
+static vector<Wakeup> wakeups;
+static map<int, int> lastwakeup;		// PID => wakeup that last made it run
+static map<int, CpuNow> cpunow;		// By CPU
+static map<int, ThreadStats*> threadstats;	// By PID
+static map<int, string> threadname;		// By PID
+static vector<string> names;			// Interned
+static map<string, int> namenum;
+static string waitname[26];			// By wait letter
+static int64 ticks_per_sec = 0;	// Incoming ticksPerSec, if any. 0 means times in seconds
+static int64 window_start_ns = 0;
+static int64 window_stop_ns = 0x7FFFFFFFFFFFFFFFLL;
+
+// Nanoseconds per incoming time unit, either seconds or ticks
+double NsPerUnit() {
+  return (ticks_per_sec == 0) ? 1000000000.0 : 1000000000.0 / ticks_per_sec;
+}
+
+double NsToUsec(int64 ns) {return ns / 1000.0;}
+double NsToSec(int64 ns) {return ns / 1000000000.0;}
+
+bool InWindow(int64 ns) {
+  return (window_start_ns <= ns) && (ns < window_stop_ns);
+}
+
+int NameNum(const char* name) {
+  map<string, int>::const_iterator it = namenum.find(name);
+  if (it != namenum.end()) {return it->second;}
+  int num = names.size();
+  names.push_back(string(name));
+  namenum[string(name)] = num;
+  return num;
+}
+
+bool IsUserExec(int eventnum) {
+  return ((eventnum & 0xF0000) == 0x10000);
+}
+
+// Syscall, trap, interrupt, or user-mode execution: what a CPU is doing.
+// Point events and PC samples overlay these
+bool IsExecution(int eventnum) {
+  return IsUserExec(eventnum) ||
+         ((KUTRACE_TRAP <= eventnum) && (eventnum < KUTRACE_TRAPRET)) ||
+         ((KUTRACE_SYSCALL64 <= eventnum) && (eventnum < KUTRACE_SYSRET64)) ||
+         ((KUTRACE_SYSCALL32 <= eventnum) && (eventnum < KUTRACE_SYSRET32));
+}
+
+bool IsIrq(int eventnum) {
+  return (KUTRACE_IRQ <= eventnum) && (eventnum < KUTRACE_TRAPRET);
+}
+
+ThreadStats* StatsOf(int pid) {
+  ThreadStats* stats = threadstats[pid];
+  if (stats == NULL) {
+    stats = new ThreadStats;
+    InitLatHist(&stats->runnable);
+    stats->runnable_ns = 0;
+    memset(stats->blocked_ns, 0, sizeof(stats->blocked_ns));
+    threadstats[pid] = stats;
+  }
+  return stats;
+}
+
+// Wakeup arc: pid on cpu made retval runnable; it ran duration later
+void DoArc(const OneSpan& span) {
+  Wakeup wakeup;
+  wakeup.wake_ns = span.start_ns;
+  wakeup.run_ns = span.start_ns + span.duration_ns;
+  wakeup.waker_cpu = span.cpu;
+  wakeup.waker_pid = span.pid;
+  wakeup.target_pid = span.retval;
+  wakeup.context = -1;
+  wakeup.parent = -1;
+  wakeup.from_irq = false;
+  wakeup.reported = false;
+
+  map<int, CpuNow>::const_iterator it = cpunow.find(span.cpu);
+  if (it != cpunow.end()) {
+    wakeup.context = it->second.name;
+    wakeup.from_irq = IsIrq(it->second.eventnum);
+  }
+  // An interrupt or the idle thread starts a chain; a thread continues one
+  if (!wakeup.from_irq && (0 < wakeup.waker_pid)) {
+    map<int, int>::const_iterator it2 = lastwakeup.find(wakeup.waker_pid);
+    if ((it2 != lastwakeup.end()) && (wakeups[it2->second].run_ns <= wakeup.wake_ns)) {
+      wakeup.parent = it2->second;
+    }
+  }
+  lastwakeup[wakeup.target_pid] = wakeups.size();
+  wakeups.push_back(wakeup);
+
+  if (InWindow(wakeup.wake_ns) && (0 < wakeup.target_pid)) {
+    ThreadStats* stats = StatsOf(wakeup.target_pid);
+    AddToLatHist(span.duration_ns, span.start_ns, wakeup.target_pid, &stats->runnable);
+    stats->runnable_ns += span.duration_ns;
+  }
+}
+
+void DoSpan(const OneSpan& span) {
+  if (span.duration_ns < 0) {return;}
+  if (span.eventnum == kArcNum) {
+    DoArc(span);
+    return;
+  }
+  if ((KUTRACE_WAITA <= span.eventnum) && (span.eventnum <= KUTRACE_WAITZ)) {
+    int letter = span.eventnum - KUTRACE_WAITA;
+    if (waitname[letter].empty()) {waitname[letter] = string(span.name);}
+    if ((letter != 'c' - 'a') && (0 < span.pid) && InWindow(span.start_ns)) {
+      StatsOf(span.pid)->blocked_ns[letter] += span.duration_ns;
+    }
+    return;
+  }
+  if ((span.cpu < 0) || !IsExecution(span.eventnum)) {return;}
+
+  CpuNow* now = &cpunow[span.cpu];
+  now->eventnum = span.eventnum;
+  now->pid = span.pid;
+  now->name = NameNum(span.name);
+  if (IsUserExec(span.eventnum) && (0 < span.pid) && (span.name[0] != '-')) {
+    // Thread name is the user-mode span name without its .pid
+    string name = string(span.name);
+    size_t dot = name.rfind('.');
+    if ((dot != string::npos) && (0 < dot)) {name.resize(dot);}
+    threadname[span.pid] = name;
+  }
+}
+
+string ThreadName(int pid) {
+  map<int, string>::const_iterator it = threadname.find(pid);
+  return (it == threadname.end()) ? string("") : it->second;
+}
+
+typedef struct {
+  int64 ns;
+  int key;
+} Ranked;
+
+bool ByNsDescending(const Ranked& a, const Ranked& b) {
+  if (a.ns != b.ns) {return a.ns > b.ns;}
+  return a.key < b.key;
+}
+
+void WriteThreads(FILE* f) {
+  vector<Ranked> order;
+  for (map<int, ThreadStats*>::const_iterator it = threadstats.begin();
+       it != threadstats.end(); ++it) {
+    Ranked temp;
+    temp.ns = it->second->runnable_ns;
+    temp.key = it->first;
+    order.push_back(temp);
+  }
+  std::sort(order.begin(), order.end(), ByNsDescending);
+
+  fprintf(f, "%-7s %-16s %8s %9s %9s %9s %10s  %s\n", "pid", "name", "wakeups",
+          "run_p50", "run_p99", "run_max", "runnable", "blocked by reason");
+  for (int i = 0; i < (int)order.size(); ++i) {
+    int pid = order[i].key;
+    const ThreadStats* stats = threadstats[pid];
+    fprintf(f, "%-7d %-16s %8lld %9.2f %9.2f %9.2f %10.2f ", pid, ThreadName(pid).c_str(),
+            stats->runnable.count,
+            NsToUsec(LatPercentile(stats->runnable, 0.50)),
+            NsToUsec(LatPercentile(stats->runnable, 0.99)),
+            NsToUsec(stats->runnable.max_ns), NsToUsec(stats->runnable_ns));
+    vector<Ranked> reasons;
+    for (int letter = 0; letter < 26; ++letter) {
+      if (stats->blocked_ns[letter] == 0) {continue;}
+      Ranked temp;
+      temp.ns = stats->blocked_ns[letter];
+      temp.key = letter;
+      reasons.push_back(temp);
+    }
+    std::sort(reasons.begin(), reasons.end(), ByNsDescending);
+    for (int r = 0; (r < (int)reasons.size()) && (r < kMaxReasons); ++r) {
+      fprintf(f, " %s %.2f", waitname[reasons[r].key].c_str(), NsToUsec(reasons[r].ns));
+    }
+    fprintf(f, "\n");
+  }
+  fprintf(f, "(times in microseconds)\n\n");
+}
+
+// Up to kMaxChain wakeups ending at w, earliest first
+void ChainOf(int w, vector<int>* chain) {
+  chain->clear();
+  for (int i = w; (0 <= i) && ((int)chain->size() < kMaxChain); i = wakeups[i].parent) {
+    chain->push_back(i);
+  }
+  std::reverse(chain->begin(), chain->end());
+}
+
+int64 ChainRunnableNs(const vector<int>& chain) {
+  int64 sum = 0;
+  for (int i = 0; i < (int)chain.size(); ++i) {
+    sum += wakeups[chain[i]].run_ns - wakeups[chain[i]].wake_ns;
+  }
+  return sum;
+}
+
+void WriteWaker(FILE* f, const Wakeup& wakeup) {
+  char waker[96];
+  const char* context = (wakeup.context < 0) ? "?" : names[wakeup.context].c_str();
+  if (wakeup.from_irq) {
+    snprintf(waker, sizeof(waker), "irq %s", context);
+  } else if (wakeup.waker_pid <= 0) {
+    snprintf(waker, sizeof(waker), "idle %s", context);
+  } else {
+    snprintf(waker, sizeof(waker), "%d %s %s", wakeup.waker_pid,
+             ThreadName(wakeup.waker_pid).c_str(), context);
+  }
+  fprintf(f, "  %12.8f %-32s cpu %-3d -> %-7d %-16s runnable %9.2f\n",
+          NsToSec(wakeup.wake_ns), waker, wakeup.waker_cpu, wakeup.target_pid,
+          ThreadName(wakeup.target_pid).c_str(), NsToUsec(wakeup.run_ns - wakeup.wake_ns));
+}
+
+// The chains ending in the window with the most runnable delay, no wakeup
+// shown twice
+void WriteChains(FILE* f, int top_n) {
+  vector<Ranked> order;
+  vector<int> chain;
+  for (int w = 0; w < (int)wakeups.size(); ++w) {
+    if (!InWindow(wakeups[w].wake_ns)) {continue;}
+    ChainOf(w, &chain);
+    Ranked temp;
+    temp.ns = ChainRunnableNs(chain);
+    temp.key = w;
+    order.push_back(temp);
+  }
+  std::sort(order.begin(), order.end(), ByNsDescending);
+
+  int shown = 0;
+  for (int i = 0; (i < (int)order.size()) && (shown < top_n); ++i) {
+    ChainOf(order[i].key, &chain);
+    bool overlaps = false;
+    for (int k = 0; k < (int)chain.size(); ++k) {
+      if (wakeups[chain[k]].reported) {overlaps = true;}
+    }
+    if (overlaps) {continue;}
+
+    ++shown;
+    const Wakeup& first = wakeups[chain.front()];
+    const Wakeup& last = wakeups[chain.back()];
+    fprintf(f, "Chain %d: %d wakeups, %.2fus runnable, %.2fus from first wakeup to last run\n",
+            shown, (int)chain.size(), NsToUsec(order[i].ns),
+            NsToUsec(last.run_ns - first.wake_ns));
+    for (int k = 0; k < (int)chain.size(); ++k) {
+      wakeups[chain[k]].reported = true;
+      WriteWaker(f, wakeups[chain[k]]);
+    }
+  }
+}
+
+// Copy the name between quotes, which may contain spaces
+void CopyName(const char* s, char* name, int maxsize) {
+  const char* quote1 = strchr(s, '"');
+  const char* quote2 = (quote1 == NULL) ? NULL : strrchr(quote1 + 1, '"');
+  int len = (quote2 == NULL) ? 0 : quote2 - quote1 - 1;
+  if (maxsize - 1 < len) {len = maxsize - 1;}
+  if (0 < len) {memcpy(name, quote1 + 1, len);}
+  name[len] = '\0';
+}
+
+static const int kMaxBufferSize = 256;
+
+// Read next line, stripping any crlf. Return false if no more.
+bool ReadLine(FILE* f, char* buffer, int maxsize) {
+  char* s = fgets(buffer, maxsize, f);
+  if (s == NULL) {return false;}
+  int len = strlen(s);
+  // Strip any crlf or cr or lf
+  if (s[len - 1] == '\n') {s[--len] = '\0';}
+  if (s[len - 1] == '\r') {s[--len] = '\0';}
+  return true;
+}
+
+void Usage() {
+  fprintf(stderr, "Usage: spantowakeup [-n <count>] [start_sec [stop_sec]]\n");
+  exit(0);
+}
+
+//
+// Filter from stdin to stdout
+//
+int main (int argc, const char** argv) {
+  int top_n = kDefaultTopN;
+  int positional = 0;
+  for (int i = 1; i < argc; ++i) {
+    double sec;
+    if ((strcmp(argv[i], "-n") == 0) && (i < (argc - 1))) {
+      top_n = atoi(argv[++i]);
+      if (top_n < 1) {Usage();}
+    } else if ((positional < 2) && (sscanf(argv[i], "%lf", &sec) == 1)) {
+      if (positional == 0) {
+        window_start_ns = llround(sec * 1000000000.0);
+      } else {
+        window_stop_ns = llround(sec * 1000000000.0);
+      }
+      ++positional;
+    } else {
+      Usage();
+    }
+  }
+
+  // expecting:
+  //    ts           dur        cpu pid  rpc event arg retval  ipc name
+  //  [ 22.39359781, 0.00000283, 0, 1910, 0, 2048, 3, 256, 3, "read"],
+
+  int span_count = 0;
+  char buffer[kMaxBufferSize];
+  while (ReadLine(stdin, buffer, kMaxBufferSize)) {
+    OneSpan onespan;
+    int name_pos = 0;
+    int n = sscanf(buffer, "[%lf, %lf, %d, %d, %d, %d, %d, %d, %d, %n",
+                   &onespan.start_ts, &onespan.duration,
+                   &onespan.cpu, &onespan.pid, &onespan.rpcid,
+                   &onespan.eventnum, &onespan.arg, &onespan.retval, &onespan.ipc, &name_pos);
+    if (n < 9) {
+      if (ParseTicksPerSec(buffer) != 0) {ticks_per_sec = ParseTicksPerSec(buffer);}
+      continue;
+    }
+    if (SpanSec(onespan.start_ts, ticks_per_sec) >= 999.0) {break;}	// End marker
+
+    onespan.start_ns = llround(onespan.start_ts * NsPerUnit());
+    onespan.duration_ns = llround(onespan.duration * NsPerUnit());
+    CopyName(buffer + name_pos, onespan.name, sizeof(onespan.name));
+    DoSpan(onespan);
+    ++span_count;
+  }
+
+  WriteThreads(stdout);
+  WriteChains(stdout, top_n);
+
+  fprintf(stderr, "spantowakeup: %d spans, %d wakeups, %d threads\n",
+          span_count, (int)wakeups.size(), (int)threadstats.size());
+  return 0;
+}
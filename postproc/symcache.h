@@ -0,0 +1,212 @@
+// symcache.h
+//
+// Persistent on-disk symbol cache shared across samptoname_k and samptoname_u
+// runs, so re-symbolizing traces that use the same binaries or the same kernel
+// is mostly lookups.
+//
+// The cache is a directory of files, one per symbol source, named by content:
+//   u<build-id hex>.sym          user binary, by its ELF build-id
+//   u<fnv64 hex>.sym             user binary without a build-id, by file hash
+//   k<fnv64 hex>.sym             kernel, by hash of the allsyms file
+// Each file maps an address within that source to a routine name. With KASLR
+// the kernel addresses change every boot, so kernel entries only hit for
+// traces taken in the same boot.
+//
+// File layout, native little-endian, written once then mmapped read-only
+//   char magic[8]                "KUSYMC1\n"
+//   uint64 count
+//   SymCacheEntry entries[count] sorted by key
+//   char names[]                 NUL-terminated strings
+//
+// A program opens the file for each source as it first needs it, looks keys up
+// by binary search, and at the end writes back the old entries merged with the
+// new ones, via a temporary file and rename so that a concurrent reader sees
+// either the old or the new file, never a partial one.
+//
+
+#ifndef __SYMCACHE_H__
+#define __SYMCACHE_H__
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "basetypes.h"
+
+static const char kSymCacheMagic[8] = {'K', 'U', 'S', 'Y', 'M', 'C', '1', '\n'};
+static const uint64 kFnvOffset = 0xcbf29ce484222325LL;
+static const uint64 kFnvPrime = 0x00000100000001b3LL;
+
+typedef struct {
+  uint64 key;           // Address within the binary or kernel
+  uint64 name_offset;   // Offset of name within names[]
+} SymCacheEntry;
+
+typedef struct {
+  std::string fname;
+  const char* base;     // mmapped file, or NULL if there was none
+  size_t len;
+  uint64 count;
+  const SymCacheEntry* entries;
+  const char* names;
+  std::map<uint64, std::string> added;  // New entries from this run
+} SymCache;
+
+inline bool SymCacheEntryLess(const SymCacheEntry& a, const SymCacheEntry& b) {
+  return a.key < b.key;
+}
+
+// FNV-1a hash, continuing from hash
+inline uint64 SymCacheHash(uint64 hash, const char* p, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (uint8)p[i];
+    hash *= kFnvPrime;
+  }
+  return hash;
+}
+
+// Hash of a whole file's contents, as 16 hex digits. Empty string if it did not open
+inline std::string SymCacheHashFile(const char* fname) {
+  FILE* f = fopen(fname, "rb");
+  if (f == NULL) {return std::string();}
+  uint64 hash = kFnvOffset;
+  char buffer[65536];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    hash = SymCacheHash(hash, buffer, n);
+  }
+  fclose(f);
+  char hex[24];
+  sprintf(hex, "%016llx", hash);
+  return std::string(hex);
+}
+
+// Map the cache file for name in dir, if any. A missing or malformed file
+// just makes an empty cache, which is written fresh at the end
+inline void OpenSymCache(const char* dir, const std::string& name, SymCache* cache) {
+  cache->fname = std::string(dir) + "/" + name + ".sym";
+  cache->base = NULL;
+  cache->len = 0;
+  cache->count = 0;
+  cache->entries = NULL;
+  cache->names = NULL;
+  cache->added.clear();
+
+  int fd = open(cache->fname.c_str(), O_RDONLY);
+  if (fd < 0) {return;}
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || (st.st_size < 16)) {close(fd); return;}
+  void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {return;}
+
+  const char* base = reinterpret_cast<const char*>(p);
+  size_t len = st.st_size;
+  uint64 count = 0;
+  memcpy(&count, base + 8, sizeof(uint64));
+  bool ok = (memcmp(base, kSymCacheMagic, 8) == 0);
+  if (ok && ((len - 16) / sizeof(SymCacheEntry) < count)) {ok = false;}
+  // Names must end in NUL so that every in-bounds name_offset is a C string
+  if (ok && (0 < count) && (base[len - 1] != '\0')) {ok = false;}
+  if (!ok) {
+    fprintf(stderr, "symcache: ignoring malformed %s\n", cache->fname.c_str());
+    munmap(p, len);
+    return;
+  }
+  cache->base = base;
+  cache->len = len;
+  cache->count = count;
+  cache->entries = reinterpret_cast<const SymCacheEntry*>(base + 16);
+  cache->names = base + 16 + count * sizeof(SymCacheEntry);
+}
+
+// Look up key, first in the file then in this run's additions
+inline bool SymCacheLookup(const SymCache& cache, uint64 key, std::string* name) {
+  SymCacheEntry temp;
+  temp.key = key;
+  const SymCacheEntry* end = cache.entries + cache.count;
+  const SymCacheEntry* it = std::lower_bound(cache.entries, end, temp, SymCacheEntryLess);
+  if ((it != end) && (it->key == key)) {
+    size_t names_len = cache.len - (cache.names - cache.base);
+    if (it->name_offset < names_len) {
+      *name = std::string(cache.names + it->name_offset);
+      return true;
+    }
+  }
+  std::map<uint64, std::string>::const_iterator it2 = cache.added.find(key);
+  if (it2 == cache.added.end()) {return false;}
+  *name = it2->second;
+  return true;
+}
+
+inline void SymCacheAdd(SymCache* cache, uint64 key, const std::string& name) {
+  cache->added[key] = name;
+}
+
+// Write back the merged entries if there are new ones, then unmap
+inline void CloseSymCache(SymCache* cache) {
+  if (!cache->added.empty()) {
+    // Merge the two sorted lists; the file wins on a duplicate key
+    std::map<uint64, std::string> merged = cache->added;
+    for (uint64 i = 0; i < cache->count; ++i) {
+      std::string name;
+      SymCacheLookup(*cache, cache->entries[i].key, &name);
+      merged[cache->entries[i].key] = name;
+    }
+
+    char suffix[32];
+    sprintf(suffix, ".tmp%d", getpid());
+    std::string tempname = cache->fname + suffix;
+    FILE* f = fopen(tempname.c_str(), "wb");
+    if (f == NULL) {
+      fprintf(stderr, "symcache: %s did not open\n", tempname.c_str());
+    } else {
+      uint64 count = merged.size();
+      fwrite(kSymCacheMagic, 1, 8, f);
+      fwrite(&count, sizeof(uint64), 1, f);
+      uint64 name_offset = 0;
+      for (std::map<uint64, std::string>::const_iterator it = merged.begin();
+           it != merged.end(); ++it) {
+        SymCacheEntry entry;
+        entry.key = it->first;
+        entry.name_offset = name_offset;
+        fwrite(&entry, sizeof(SymCacheEntry), 1, f);
+        name_offset += it->second.size() + 1;
+      }
+      for (std::map<uint64, std::string>::const_iterator it = merged.begin();
+           it != merged.end(); ++it) {
+        fwrite(it->second.c_str(), 1, it->second.size() + 1, f);
+      }
+      bool ok = (ferror(f) == 0);
+      ok &= (fclose(f) == 0);
+      if (!ok || (rename(tempname.c_str(), cache->fname.c_str()) != 0)) {
+        fprintf(stderr, "symcache: could not write %s\n", cache->fname.c_str());
+        unlink(tempname.c_str());
+      }
+    }
+  }
+
+  if (cache->base != NULL) {munmap(const_cast<char*>(cache->base), cache->len);}
+  cache->base = NULL;
+  cache->count = 0;
+  cache->added.clear();
+}
+
+// Make the cache directory if it is not there already
+inline bool MakeSymCacheDir(const char* dir) {
+  if ((mkdir(dir, 0755) != 0) && (errno != EEXIST)) {
+    fprintf(stderr, "symcache: could not make directory %s\n", dir);
+    return false;
+  }
+  return true;
+}
+
+#endif	// __SYMCACHE_H__
@@ -0,0 +1,410 @@
+// Little program to help pick the kernel trace buffer size, tracemb
+//
+// Usage: tracesize <foo.trace | foo.csv> [-mb <list>] [-ipc] [-v] [-check <foo.csv>]
+//   -mb <list>  candidate buffer sizes in MB, comma separated,
+//               default 2,5,10,20,50,100,200
+//   -ipc        buffer also holds IPC bytes (automatic for a .trace with IPC)
+//   -v          also show the time window kept for each CPU
+//   -check <foo.csv>  check that the blocks replayed from foo.csv agree with
+//               those of foo.trace, to within one block per CPU per second
+//
+//   tracesize foo.trace -mb 4,8,16
+//   checktrace foo.trace -series foo.csv; tracesize foo.csv
+//   tracesize foo.trace -check foo.csv
+//
+// The kernel module splits its tracemb buffer into 64KB blocks. Each CPU
+// fills one block at a time; when a block is full, the CPU takes the next
+// free block, working down from the top of the buffer. With IPC, the lower
+// 1/8 of the buffer holds IPC bytes. When the buffer is full, tracing stops,
+// or in wraparound mode the next block is block 1 again, so block 0 with the
+// trace start is kept and the oldest of the rest are overwritten.
+// When tracing stops, do_flush zeros the unused tail of each CPU's current
+// block; that space is dumped but holds no events.
+//
+// This program replays the block allocations of a recorded trace, in time
+// order, against buffers of each candidate size, as if the incident of
+// interest were at the end of the recording:
+//   no wrap   how long until the buffer fills and tracing stops
+//   wrap      how much of the end of the recording is kept, for all CPUs
+//             together (the CPU whose oldest kept block is latest limits
+//             this) and per CPU
+// plus the do_flush waste as a fraction of each buffer size. A buffer larger
+// than the recording never fills within it; its fill time is estimated from
+// the average block rate.
+//
+// A checktrace -series CSV file works in place of the trace. Its blocks per
+// CPU per second are fractions, each block's share of the seconds it covers.
+// Each CPU's running total is carried from second to second, and a block
+// starts where the total before it reaches a whole number, filling evenly
+// within each second. The partial first and last seconds are sized from the
+// neighboring second's rate. The CSV counts a partly-filled block as a whole
+// one, so the flush waste is taken as half a block per CPU.
+//
+// Compile with g++ -O2 tracesize.cc -o tracesize
+//
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <math.h>	// ceil
+#include <stdio.h>
+#include <stdlib.h>     // exit
+#include <string.h>
+
+#include "basetypes.h"
+#include "rawblock.h"
+
+using std::map;
+using std::vector;
+
+static const int kBlockKB = 64;
+static const int kMaxCpus = 256;
+static const char* kDefaultSizes = "2,5,10,20,50,100,200";
+static const double kSeriesSlop = 0.02;	// Blocks, for the CSV's rounding
+
+// One recorded block, by when its CPU took it
+typedef struct {
+  int64 usec;		// Time of day
+  int cpu;
+  int serial;		// Order in the input, to keep sorting stable
+} OneBlock;
+
+typedef struct {
+  vector<OneBlock> blocks;	// [0] is the very first block
+  int64 stop_usec;		// End of the recording
+  int ncpus;			// Highest CPU number + 1
+  bool has_ipc;
+  double flush_waste_kb;	// Unused tails of the last block of each CPU
+  bool waste_measured;		// Else estimated
+} Recording;
+
+static bool verbose = false;
+
+void Usage() {
+  fprintf(stderr, "Usage: tracesize <foo.trace | foo.csv> [-mb <list>] [-ipc] [-v] [-check <foo.csv>]\n");
+  exit(0);
+}
+
+bool BlockLess(const OneBlock& a, const OneBlock& b) {
+  if (a.usec != b.usec) {return a.usec < b.usec;}
+  return a.serial < b.serial;
+}
+
+bool EndsWith(const char* s, const char* suffix) {
+  size_t len = strlen(s);
+  size_t suffix_len = strlen(suffix);
+  return (suffix_len <= len) && (strcmp(s + len - suffix_len, suffix) == 0);
+}
+
+// Blocks from a raw trace. The unused tail of each CPU's last block is the
+// run of zero words at its end
+void ReadTrace(FILE* f, Recording* rec) {
+  RawReader reader;
+  RawBlock block;
+  int64 last_usec[kMaxCpus];
+  int tail_words[kMaxCpus];
+  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
+    last_usec[cpu] = -1;
+    tail_words[cpu] = 0;
+  }
+
+  InitRawReader(f, &reader);
+  while (NextRawBlock(&reader, &block)) {
+    if (block.blocknum == 0) {
+      rec->has_ipc |= RawHasIpc(block.flags);
+      rec->stop_usec = block.words[5];	// Stop time of day
+    }
+    OneBlock temp;
+    temp.usec = block.gtod;
+    temp.cpu = block.cpu;
+    temp.serial = block.blocknum;
+    rec->blocks.push_back(temp);
+    if (rec->ncpus <= block.cpu) {rec->ncpus = block.cpu + 1;}
+
+    if (last_usec[block.cpu] <= temp.usec) {
+      last_usec[block.cpu] = temp.usec;
+      int k = kTraceBufSize;
+      while ((block.first_entry < k) && (block.words[k - 1] == 0)) {--k;}
+      tail_words[block.cpu] = kTraceBufSize - k;
+    }
+  }
+  CloseRawReader(&reader);
+
+  rec->flush_waste_kb = 0.0;
+  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {rec->flush_waste_kb += tail_words[cpu] * 8 / 1024.0;}
+  rec->waste_measured = true;
+}
+
+// Blocks that cpu used in second, or 0 if the CSV has no such row
+double SeriesRate(const map<int64, double>& rows, int64 second, int cpu) {
+  map<int64, double>::const_iterator it = rows.find((second << 8) | cpu);
+  return (it == rows.end()) ? 0.0 : it->second;
+}
+
+// Blocks from checktrace -series: second,cpu,blocks,...
+// The recording starts part way into its first second and stops part way
+// into its last; each CPU's blocks there are taken to fill at the rate of
+// its neighboring second, at the end of the first second and the start of
+// the last
+void ReadSeries(FILE* f, Recording* rec) {
+  char buffer[256];
+  map<int64, double> rows;	// Key is (second << 8) | cpu, in time order
+  while (fgets(buffer, sizeof(buffer), f) != NULL) {
+    int64 second;
+    int cpu;
+    double blocks;
+    if (sscanf(buffer, "%lld,%d,%lf", &second, &cpu, &blocks) != 3) {continue;}  // Header
+    if ((cpu < 0) || (kMaxCpus <= cpu) || (blocks <= 0.0)) {continue;}
+    rows[(second << 8) | cpu] += blocks;
+  }
+  if (rows.empty()) {return;}
+  int64 first_second = rows.begin()->first >> 8;
+  int64 last_second = rows.rbegin()->first >> 8;
+
+  int serial = 0;
+  bool seen[kMaxCpus];
+  double filled[kMaxCpus];	// Running total of blocks, block n starts at n
+  memset(seen, 0, sizeof(seen));
+  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {filled[cpu] = 0.0;}
+  for (map<int64, double>::const_iterator it = rows.begin(); it != rows.end(); ++it) {
+    int64 second = it->first >> 8;
+    int cpu = it->first & 0xFF;
+    double blocks = it->second;
+
+    // Part of this second the blocks fill, in usec
+    int64 start_usec = second * 1000000;
+    int64 len_usec = 1000000;
+    double rate = 0.0;
+    if (second == first_second) {rate = SeriesRate(rows, second + 1, cpu);}
+    if (second == last_second) {rate = SeriesRate(rows, second - 1, cpu);}
+    if (blocks < rate) {
+      len_usec = (int64)((blocks / rate) * 1000000);
+      if (second == first_second) {start_usec += 1000000 - len_usec;}
+    }
+
+    // The CSV has two decimals; allow for their rounding near whole numbers
+    double lo = filled[cpu];
+    double hi = lo + blocks;
+    filled[cpu] = hi;
+    for (int64 n = (int64)ceil(lo - kSeriesSlop); n < hi - kSeriesSlop; ++n) {
+      double frac = (n <= lo) ? 0.0 : (n - lo) / blocks;
+      OneBlock temp;
+      temp.usec = start_usec + (int64)(frac * len_usec);
+      temp.cpu = cpu;
+      temp.serial = serial++;
+      rec->blocks.push_back(temp);
+    }
+    if (rec->ncpus <= cpu) {rec->ncpus = cpu + 1;}
+    if (rec->stop_usec < start_usec + len_usec) {rec->stop_usec = start_usec + len_usec;}
+    seen[cpu] = true;
+  }
+
+  int cpus_seen = 0;
+  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {if (seen[cpu]) {++cpus_seen;}}
+  rec->flush_waste_kb = cpus_seen * kBlockKB / 2.0;
+  rec->waste_measured = false;
+}
+
+// Blocks per CPU per second, key is (second << 8) | cpu
+void CountBlocks(const Recording& rec, map<int64, int>* counts) {
+  for (int i = 0; i < (int)rec.blocks.size(); ++i) {
+    const OneBlock& block = rec.blocks[i];
+    ++(*counts)[((block.usec / 1000000) << 8) | block.cpu];
+  }
+}
+
+// Compare each CPU's running block count at the end of every second, trace
+// against series. Returns the number of seconds that are off by more than one
+int CheckSeries(const Recording& trace, const Recording& csv, const char* csv_fname) {
+  map<int64, int> trace_counts;
+  map<int64, int> csv_counts;
+  CountBlocks(trace, &trace_counts);
+  CountBlocks(csv, &csv_counts);
+  map<int64, int> seconds;	// All seconds in either, in order
+  for (map<int64, int>::const_iterator it = trace_counts.begin(); it != trace_counts.end(); ++it) {
+    seconds[it->first >> 8] = 1;
+  }
+  for (map<int64, int>::const_iterator it = csv_counts.begin(); it != csv_counts.end(); ++it) {
+    seconds[it->first >> 8] = 1;
+  }
+
+  int trace_total[kMaxCpus];
+  int csv_total[kMaxCpus];
+  memset(trace_total, 0, sizeof(trace_total));
+  memset(csv_total, 0, sizeof(csv_total));
+  int problems = 0;
+  for (map<int64, int>::const_iterator it = seconds.begin(); it != seconds.end(); ++it) {
+    for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
+      int64 key = (it->first << 8) | cpu;
+      if (trace_counts.find(key) != trace_counts.end()) {trace_total[cpu] += trace_counts[key];}
+      if (csv_counts.find(key) != csv_counts.end()) {csv_total[cpu] += csv_counts[key];}
+      if (abs(trace_total[cpu] - csv_total[cpu]) <= 1) {continue;}
+      fprintf(stdout, "second %lld cpu %d: %d blocks in the trace so far, %d in %s\n",
+              it->first, cpu, trace_total[cpu], csv_total[cpu], csv_fname);
+      ++problems;
+    }
+  }
+  fprintf(stdout, "%s %s the trace, %d blocks against %d\n", csv_fname,
+          (problems == 0) ? "agrees with" : "DISAGREES with",
+          (int)csv.blocks.size(), (int)trace.blocks.size());
+  return problems;
+}
+
+// Blocks that fit in a tracemb buffer
+int BufferBlocks(int mb, bool has_ipc) {
+  int blocks = (mb * 1024) / kBlockKB;
+  if (has_ipc) {blocks -= blocks / 8;}	// Lower 1/8 is IPC bytes
+  return blocks;
+}
+
+// Simulate one buffer size against the recording, blocks in time order.
+// Returns false if the buffer would hold the whole recording
+bool OneSize(int mb, const Recording& rec) {
+  const vector<OneBlock>& blocks = rec.blocks;
+  int nblocks = blocks.size();
+  int capacity = BufferBlocks(mb, rec.has_ipc);
+  int64 start_usec = blocks[0].usec;
+  double recorded_sec = (rec.stop_usec - start_usec) / 1000000.0;
+  double waste_pct = (rec.flush_waste_kb * 100.0) / (mb * 1024.0);
+
+  if (nblocks <= capacity) {
+    // Never fills within the recording
+    double est_sec = (recorded_sec * capacity) / nblocks;
+    fprintf(stdout, "%6d %7d  %8.2f*  %8.2f  %8.2f  %6.1f%%\n",
+            mb, capacity, est_sec, recorded_sec, recorded_sec, waste_pct);
+    return false;
+  }
+
+  // No wrap: tracing stops when block capacity+1 is wanted
+  double fill_sec = (blocks[capacity].usec - start_usec) / 1000000.0;
+
+  // Wrap: block 0 plus the latest capacity-1 blocks are kept
+  int64 oldest_kept[kMaxCpus];
+  for (int cpu = 0; cpu < rec.ncpus; ++cpu) {oldest_kept[cpu] = -1;}
+  for (int i = nblocks - 1; nblocks - capacity < i; --i) {
+    oldest_kept[blocks[i].cpu] = blocks[i].usec;
+  }
+
+  bool used[kMaxCpus];
+  memset(used, 0, sizeof(used));
+  for (int i = 0; i < nblocks; ++i) {used[blocks[i].cpu] = true;}
+
+  double min_sec = recorded_sec;
+  double max_sec = 0.0;
+  for (int cpu = 0; cpu < rec.ncpus; ++cpu) {
+    if (!used[cpu]) {continue;}
+    double sec = (oldest_kept[cpu] < 0) ? 0.0 : (rec.stop_usec - oldest_kept[cpu]) / 1000000.0;
+    if (sec < min_sec) {min_sec = sec;}
+    if (max_sec < sec) {max_sec = sec;}
+  }
+
+  fprintf(stdout, "%6d %7d  %8.2f   %8.2f  %8.2f  %6.1f%%\n",
+          mb, capacity, fill_sec, min_sec, max_sec, waste_pct);
+
+  if (verbose) {
+    for (int cpu = 0; cpu < rec.ncpus; ++cpu) {
+      if (!used[cpu]) {continue;}
+      if (oldest_kept[cpu] < 0) {
+        fprintf(stdout, "         cpu %3d  nothing kept but block 0\n", cpu);
+      } else {
+        fprintf(stdout, "         cpu %3d  %8.2f sec kept\n",
+                cpu, (rec.stop_usec - oldest_kept[cpu]) / 1000000.0);
+      }
+    }
+  }
+  return true;
+}
+
+int main(int argc, const char** argv) {
+  const char* fname = NULL;
+  const char* check_fname = NULL;
+  const char* sizes = kDefaultSizes;
+  bool force_ipc = false;
+  for (int i = 1; i < argc; ++i) {
+    if ((strcmp(argv[i], "-mb") == 0) && (i < (argc - 1))) {
+      sizes = argv[++i];
+    } else if (strcmp(argv[i], "-ipc") == 0) {
+      force_ipc = true;
+    } else if (strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else if ((strcmp(argv[i], "-check") == 0) && (i < (argc - 1))) {
+      check_fname = argv[++i];
+    } else if (argv[i][0] != '-') {
+      fname = argv[i];
+    } else {
+      Usage();
+    }
+  }
+  if (fname == NULL) {Usage();}
+  if ((check_fname != NULL) && (EndsWith(fname, ".csv") || !EndsWith(check_fname, ".csv"))) {Usage();}
+
+  FILE* f = fopen(fname, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "%s did not open\n", fname);
+    exit(0);
+  }
+
+  Recording rec;
+  rec.stop_usec = 0;
+  rec.ncpus = 0;
+  rec.has_ipc = force_ipc;
+  if (EndsWith(fname, ".csv")) {
+    ReadSeries(f, &rec);
+  } else {
+    ReadTrace(f, &rec);
+  }
+  fclose(f);
+
+  if (check_fname != NULL) {
+    FILE* csv_f = fopen(check_fname, "rb");
+    if (csv_f == NULL) {
+      fprintf(stderr, "%s did not open\n", check_fname);
+      exit(0);
+    }
+    Recording csv_rec;
+    csv_rec.stop_usec = 0;
+    csv_rec.ncpus = 0;
+    csv_rec.has_ipc = rec.has_ipc;
+    ReadSeries(csv_f, &csv_rec);
+    fclose(csv_f);
+    return (CheckSeries(rec, csv_rec, check_fname) == 0) ? 0 : 1;
+  }
+
+  if (rec.blocks.size() < 2) {
+    fprintf(stderr, "tracesize: %s has too few blocks\n", fname);
+    exit(0);
+  }
+
+  // Block 0 stays first; the rest in the order CPUs took them
+  std::sort(rec.blocks.begin() + 1, rec.blocks.end(), BlockLess);
+  double recorded_sec = (rec.stop_usec - rec.blocks[0].usec) / 1000000.0;
+  if (recorded_sec <= 0.0) {
+    fprintf(stderr, "tracesize: %s has no usable stop time\n", fname);
+    exit(0);
+  }
+
+  double total_mb = (rec.blocks.size() * kBlockKB) / 1024.0;
+  fprintf(stdout, "%s: %d CPUs, %d blocks of 64KB%s over %.2f seconds, %.2f MB/sec\n",
+          fname, rec.ncpus, (int)rec.blocks.size(), rec.has_ipc ? " plus IPC" : "",
+          recorded_sec, total_mb / recorded_sec);
+  fprintf(stdout, "do_flush leaves %.0fKB of partly-filled blocks unused (%s)\n\n",
+          rec.flush_waste_kb, rec.waste_measured ? "measured" : "estimated");
+
+  fprintf(stdout, "                 no wrap   -- wrap, kept --\n");
+  fprintf(stdout, "    MB  blocks  full sec   all CPUs  best CPU   flush waste\n");
+  bool any_estimated = false;
+  const char* p = sizes;
+  while (*p != '\0') {
+    int mb = atoi(p);
+    if ((0 < mb) && !OneSize(mb, rec)) {any_estimated = true;}
+    const char* comma = strchr(p, ',');
+    if (comma == NULL) {break;}
+    p = comma + 1;
+  }
+  if (any_estimated) {
+    fprintf(stdout, "* Holds the whole recording; full time estimated from the average rate\n");
+  }
+
+  return 0;
+}
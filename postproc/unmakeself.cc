@@ -8,17 +8,25 @@
 //     The contained JSON file written to stdout
 //     If you want, then pipe through sed 's/], /],\n/g'
 //
+// Also accepts the compressed form from makeself -z, var myStringZ holding
+// base64 of zlib-compressed JSON. That JSON is inflated to stdout with its
+// original newlines.
+//
+// Compile with g++ -O2 unmakeself.cc -lz -o unmakeself
+//
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>		// exit
 #include <string.h>
+#include <zlib.h>
 
 static const char* const_text_1 = "<script>";
 static const char* const_text_2 = "</script>";
 
 static const char* const_text_3 = "var myString = '";
 static const char* const_text_4 = "';";
+static const char* const_text_3z = "var myStringZ = '";
 
 static const char* const_text_5 = "data = JSON.parse(myString); newdata2_resize(data);";
 static const char* const_text_6 = "";
@@ -29,6 +37,54 @@ void usage() {
   exit(0);
 }
 
+// Decode base64 src of length len into dst, in place is OK. Returns the number
+// of bytes written, or -1 on a bad character
+int64_t Base64Decode(const char* src, int64_t len, unsigned char* dst) {
+  unsigned char* d = dst;
+  uint32_t w = 0;
+  int nbits = 0;
+  for (int64_t i = 0; i < len; ++i) {
+    char c = src[i];
+    int v;
+    if ('A' <= c && c <= 'Z') {v = c - 'A';}
+    else if ('a' <= c && c <= 'z') {v = c - 'a' + 26;}
+    else if ('0' <= c && c <= '9') {v = c - '0' + 52;}
+    else if (c == '+') {v = 62;}
+    else if (c == '/') {v = 63;}
+    else if (c == '=') {break;}
+    else {return -1;}
+    w = (w << 6) | v;
+    nbits += 6;
+    if (nbits >= 8) {
+      nbits -= 8;
+      *d++ = (w >> nbits) & 0xFF;
+    }
+  }
+  return d - dst;
+}
+
+// Inflate zlib-format z_buf to f. Returns false if the data is bad
+bool InflateToFile(const unsigned char* z_buf, int64_t z_len, FILE* f) {
+  static const int kChunkSize = 1 << 20;
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit(&strm) != Z_OK) {return false;}
+  unsigned char* out_buf = new unsigned char[kChunkSize];
+  strm.next_in = (Bytef*)z_buf;
+  strm.avail_in = z_len;
+  int status = Z_OK;
+  while (status == Z_OK) {
+    strm.next_out = out_buf;
+    strm.avail_out = kChunkSize;
+    status = inflate(&strm, Z_NO_FLUSH);
+    if (status != Z_OK && status != Z_STREAM_END) {break;}
+    fwrite(out_buf, 1, kChunkSize - strm.avail_out, f);
+  }
+  inflateEnd(&strm);
+  delete[] out_buf;
+  return (status == Z_STREAM_END);
+}
+
 int main (int argc, const char** argv) {
   FILE* finhtml;
   if (argc < 2) {
@@ -91,7 +147,20 @@ int main (int argc, const char** argv) {
 
   // Length of json inhtml piece
   int len3 = quote2 - quote1;
-  fwrite(quote1, 1, len3, stdout);
+
+  // Compressed form from makeself -z
+  int len3z = strlen(const_text_3z);
+  bool compressed = ((quote1 - self1_end) >= len3z) &&
+                    (memcmp(quote1 - len3z, const_text_3z, len3z) == 0);
+  if (compressed) {
+    int64_t z_len = Base64Decode(quote1, len3, (unsigned char*)quote1);
+    if ((z_len < 0) || !InflateToFile((unsigned char*)quote1, z_len, stdout)) {
+      fprintf(stderr, "Bad compressed myStringZ\n");
+      return 0;
+    }
+  } else {
+    fwrite(quote1, 1, len3, stdout);
+  }
 
   free(inhtml_buf);
   return 0;